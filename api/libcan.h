@@ -48,7 +48,13 @@ typedef enum {
     CAN_EVENT_TX_MBOX2_ABORT,
     CAN_EVENT_SLEEP,
     CAN_EVENT_WAKUP_FROM_RX_MSG,
-    CAN_EVENT_ERROR
+    CAN_EVENT_ERROR,
+    CAN_EVENT_INIT_COMPLETE,   /* can_initialize_async() done or failed */
+    CAN_EVENT_START_COMPLETE,  /* can_start_async() done or failed */
+    CAN_EVENT_STOP_COMPLETE,   /* can_stop_async() done or failed */
+    CAN_EVENT_TX_MBOX0_EXPIRED,/* aborted on deadline expiry */
+    CAN_EVENT_TX_MBOX1_EXPIRED,
+    CAN_EVENT_TX_MBOX2_EXPIRED
 } can_event_t;
 
 typedef enum {
@@ -81,6 +87,7 @@ typedef uint32_t can_error_t;
 #define  CAN_ERROR_ERR_LEC_BR                (0x1 << 14)
 #define  CAN_ERROR_ERR_LEC_BD                (0x1 << 15)
 #define  CAN_ERROR_ERR_LEC_CRC               (0x1 << 16)
+#define  CAN_ERROR_INAK_TIMEOUT              (0x1 << 17)
 
 mbed_error_t can_event(can_event_t event, can_port_t port, can_error_t errcode);
 
@@ -91,7 +98,8 @@ mbed_error_t can_event(can_event_t event, can_port_t port, can_error_t errcode);
 typedef enum {
     CAN_MBOX_0 = 0,
     CAN_MBOX_1,
-    CAN_MBOX_2
+    CAN_MBOX_2,
+    CAN_MBOX_QUEUED  /* frame stored in the software Tx queue (txqueued mode) */
 } can_mbox_t;
 
 /* can receive FIFO id */
@@ -119,7 +127,11 @@ typedef enum {
     CAN_STATE_READY,
     CAN_STATE_STARTED,
     CAN_STATE_STOPPED,
-    CAN_STATE_RESET
+    CAN_STATE_RESET,
+    /* asynchronous transitions, pending on the MSR:INAK handshake */
+    CAN_STATE_INITIALIZING,
+    CAN_STATE_STARTING,
+    CAN_STATE_STOPPING
 } can_state_t;
 
 /* a CAN msg uses one id format between standard or extended, depending on IDE
@@ -142,12 +154,75 @@ typedef enum {
 /* bit rates specific to vehicles */
   CAN_SPEED_512KHZ,
 #endif
-#if CONFIG_CAN_TARGET_AUTOMATON
+#if CONFIG_CAN_TARGET_AUTOMATONS
 /* bit rates specific to industrial automaton */
-  CAN_SPEED_384KHZ
+  CAN_SPEED_384KHZ,
 #endif
+  CAN_SPEED_CUSTOM  /* bit rate and sample point given in the context */
 } can_bit_r_t;
 
+/*
+ * Bit timing, in time quanta: a bit is made of the synchronization segment
+ * (1 quantum), TS1 and TS2, the sample point being at the end of TS1. The
+ * quantum is BRP APB1 clock periods. See RM0090, chap 32.7.7 (Bit timing).
+ */
+typedef struct {
+    uint16_t brp;          /* prescaler, 1 to 1024 */
+    uint8_t  ts1;          /* time segment 1, 1 to 16 quanta */
+    uint8_t  ts2;          /* time segment 2, 1 to 8 quanta */
+    uint8_t  sjw;          /* resynchronization jump width, 1 to 4 quanta */
+    uint16_t sample_point; /* achieved sample point, per mille */
+    uint32_t bitrate;      /* achieved bit rate, in bit/s */
+    int32_t  error_ppm;    /* achieved bit rate error, in ppm */
+} can_bit_timing_t;
+
+/* sample point used when none is given (CiA 301 recommendation) */
+#define CAN_SAMPLE_POINT_DEFAULT 875
+
+/* bit rate error above which can_initialize() refuses the timing */
+#define CAN_BIT_TIMING_MAX_ERROR_PPM 5000
+
+/*
+ * Compile time bit timing, for fixed configurations with an exact solution:
+ * the number of quanta per bit is the highest one, from 25 down to 8, giving
+ * an integer prescaler and room for the sample point in TS1 and TS2. When
+ * there is none, CAN_BIT_TIMING_INIT() divides by zero, which makes the
+ * build fail. For instance:
+ *
+ * static const can_bit_timing_t bt =
+ *     CAN_BIT_TIMING_INIT(CONFIG_CORE_FREQUENCY / CONFIG_APB1_DIVISOR, 500000, 875);
+ */
+#define CAN_BT_MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define CAN_BT_MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define CAN_BT_FITS(clk, rate, sp, ntq) \
+    (((clk) % ((rate) * (ntq))) == 0 && ((clk) / ((rate) * (ntq))) <= 1024 && \
+     ((ntq) * (sp) + 500) / 1000 <= 17 && \
+     (ntq) - ((ntq) * (sp) + 500) / 1000 <= 8)
+#define CAN_BIT_TIMING_NTQ(clk, rate, sp) \
+    (CAN_BT_FITS(clk, rate, sp, 25) ? 25 : CAN_BT_FITS(clk, rate, sp, 24) ? 24 : \
+     CAN_BT_FITS(clk, rate, sp, 23) ? 23 : CAN_BT_FITS(clk, rate, sp, 22) ? 22 : \
+     CAN_BT_FITS(clk, rate, sp, 21) ? 21 : CAN_BT_FITS(clk, rate, sp, 20) ? 20 : \
+     CAN_BT_FITS(clk, rate, sp, 19) ? 19 : CAN_BT_FITS(clk, rate, sp, 18) ? 18 : \
+     CAN_BT_FITS(clk, rate, sp, 17) ? 17 : CAN_BT_FITS(clk, rate, sp, 16) ? 16 : \
+     CAN_BT_FITS(clk, rate, sp, 15) ? 15 : CAN_BT_FITS(clk, rate, sp, 14) ? 14 : \
+     CAN_BT_FITS(clk, rate, sp, 13) ? 13 : CAN_BT_FITS(clk, rate, sp, 12) ? 12 : \
+     CAN_BT_FITS(clk, rate, sp, 11) ? 11 : CAN_BT_FITS(clk, rate, sp, 10) ? 10 : \
+     CAN_BT_FITS(clk, rate, sp,  9) ?  9 : CAN_BT_FITS(clk, rate, sp,  8) ?  8 : 0)
+/* TS1 of a ntq quanta bit, sample point sp per mille, TS2 being 1 to 8 */
+#define CAN_BT_TS1(ntq, sp) \
+    CAN_BT_MIN(16, CAN_BT_MAX((ntq) - 9, \
+        CAN_BT_MAX(1, ((ntq) * (sp) + 500) / 1000 - 1)))
+#define CAN_BIT_TIMING_INIT_NTQ(clk, rate, sp, ntq) { \
+    .brp          = (clk) / ((rate) * (ntq)), \
+    .ts1          = CAN_BT_TS1(ntq, sp), \
+    .ts2          = (ntq) - 1 - CAN_BT_TS1(ntq, sp), \
+    .sjw          = CAN_BT_MIN(4, (ntq) - 1 - CAN_BT_TS1(ntq, sp)), \
+    .sample_point = (1000 * (1 + CAN_BT_TS1(ntq, sp))) / (ntq), \
+    .bitrate      = (rate), \
+    .error_ppm    = 0 }
+#define CAN_BIT_TIMING_INIT(clk, rate, sp) \
+    CAN_BIT_TIMING_INIT_NTQ(clk, rate, sp, CAN_BIT_TIMING_NTQ(clk, rate, sp))
+
 /* can message header */
 typedef struct {
     u_can_msg_id_t     id;    /*< CAN identifier */
@@ -156,7 +231,10 @@ typedef struct {
     uint8_t            DLC;   /*< Data length */
     uint8_t            FMI;   /*< Filter match (index of filters that have matched (Rx case) */
     bool               TGT;   /*< transmit global time ? (Tx case) */
-    uint8_t            gt;    /*< global time, set by sender */
+    uint16_t           gt;    /*< time stamp (time triggered mode), in bit times */
+#if CONFIG_USR_DRV_CAN_TIMESTAMP
+    uint64_t           timestamp; /*< gt extended to 64 bits (Rx case) */
+#endif
 } can_header_t;
 
 /*
@@ -187,6 +265,168 @@ typedef union {
     can_data_fields_t data_fields;
 } can_data_t;
 
+/* a complete CAN frame (header and content) */
+typedef struct {
+    can_header_t header;
+    can_data_t   data;
+} can_frame_t;
+
+/*
+ * Packed CAN frame, using the very layout of the bxCAN mailboxes, so that a
+ * frame is moved from or to a mailbox with four 32 bits accesses:
+ * - id   : identifier word (TIxR/RIxR: STID[31:21], EXID[20:3], IDE, RTR)
+ * - dlct : data length, filter match index (Rx) or TGT (Tx), time stamp
+ *          (TDTxR/RDTxR)
+ * - datal: data bytes 0 to 3 (TDLxR/RDLxR)
+ * - datah: data bytes 4 to 7 (TDHxR/RDHxR)
+ */
+typedef struct {
+    uint32_t id;
+    uint32_t dlct;
+    uint32_t datal;
+    uint32_t datah;
+} can_packed_frame_t;
+
+/*
+ * Rx filters are described by the upper layer as a list of filter elements,
+ * each of them being an exact identifier or an identifier/mask pair, for
+ * standard or extended identifiers. The driver compiles this list into the
+ * smallest set of hardware filter banks, choosing for each bank the most
+ * compact scale (16 or 32 bits) and mode (list or mask).
+ */
+typedef enum {
+    CAN_FILTER_ID,    /* exact identifier (data frames only) */
+    CAN_FILTER_MASK   /* identifier/mask pair, mask bits at 1 must match */
+} can_filter_type_t;
+
+#if CONFIG_USR_DRV_CAN_RX_BALANCE
+/*
+ * Rx FIFO assignment hints, used when the context spreads its filters over
+ * both Rx FIFOs (rxbalanced field). High priority elements get Rx FIFO1 for
+ * themselves, so that bulk traffic cannot overrun it. Otherwise, elements
+ * are balanced over both FIFOs on their expected frame rate, elements of
+ * unknown rate counting for the mean of the known ones.
+ */
+typedef enum {
+    CAN_FILTER_PRIO_BULK = 0,
+    CAN_FILTER_PRIO_HIGH
+} can_filter_prio_t;
+#endif
+
+typedef struct {
+    can_filter_type_t  type;
+    can_id_extention_t IDE;   /*< standard (11 bits) or extended (29 bits) identifier */
+    uint32_t           id;    /*< identifier */
+    uint32_t           mask;  /*< identifier mask (CAN_FILTER_MASK only) */
+#if CONFIG_USR_DRV_CAN_RX_BALANCE
+    uint16_t           rate;  /*< expected frames per second (0: unknown) */
+    can_filter_prio_t  prio;  /*< priority class */
+#endif
+} can_filter_t;
+
+/* maximum number of filter numbers (FMI values) per Rx FIFO: 28 banks of four
+ * 16 bits identifiers */
+#define CAN_FILTER_NUMBERS_MAX 112
+
+#if CONFIG_USR_DRV_CAN_SW_FILTER
+/*
+ * Software Rx filter, used behind the hardware filter banks when the filters
+ * list does not fit in them. Standard identifiers are checked in a 2048 bits
+ * bitmap, extended identifiers in an open addressing hash set (holding
+ * id + 1, 0 being a free slot), then against a short list of
+ * identifier/mask pairs.
+ */
+typedef struct {
+    bool     active;     /* hardware filters are a superset of the list */
+    bool     ext_all;    /* extended identifiers overflow: accept them all */
+    uint8_t  ext_masks_num;
+    uint32_t std_bitmap[2048 / 32];
+    uint32_t ext_set[CONFIG_USR_DRV_CAN_SW_FILTER_EXT_SLOTS];
+    struct {
+        uint32_t id;
+        uint32_t mask;
+    } ext_masks[CONFIG_USR_DRV_CAN_SW_FILTER_EXT_MASKS];
+} can_sw_filter_t;
+#endif
+
+#if CONFIG_USR_DRV_CAN_RX_RING
+/*
+ * Single producer (ISR), single consumer (user task) Rx ring. head is only
+ * written by the ISR, tail only by the user task. Both are free running
+ * indexes, the depth being a power of two.
+ */
+typedef struct {
+    can_packed_frame_t slots[CONFIG_USR_DRV_CAN_RX_RING_DEPTH];
+    volatile uint32_t  head;
+    volatile uint32_t  tail;
+    volatile bool      stalled;   /* ring full, FIFO interrupts left masked */
+#if CONFIG_USR_DRV_CAN_RX_COALESCE
+    uint32_t           batch;     /* frames stored since the last report */
+    uint64_t           first;     /* first of them storage time, in us */
+#endif
+} can_rx_ring_t;
+#endif
+
+#if CONFIG_USR_DRV_CAN_TX_QUEUE
+/*
+ * Tx queue, sorted by decreasing arbitration priority key (the lowest key
+ * wins the arbitration): the next frame to send is always the last one. The
+ * queue is filled by the user task and emptied by the Tx ISR.
+ * While the user task holds the lock, the ISR only sets the pending flag
+ * and the user task refills the mailboxes itself when releasing the lock.
+ */
+typedef struct {
+    can_packed_frame_t slots[CONFIG_USR_DRV_CAN_TX_QUEUE_DEPTH];
+    uint32_t           count;
+    volatile bool      locked;
+    volatile bool      pending;
+#if CONFIG_USR_DRV_CAN_TX_PREEMPT
+    volatile uint8_t   preempt[3];  /* preemption state of each mailbox */
+#endif
+} can_tx_queue_t;
+#endif
+
+#if CONFIG_USR_DRV_CAN_STATS
+/*
+ * Runtime statistics of a context. Counters are free running 32 bits values,
+ * each one being incremented by a single execution thread (ISR or user task).
+ * tec and rec are not counters: they are read from the ESR register when the
+ * snapshot is taken and must stay the last fields.
+ */
+typedef struct {
+    /* interrupts executed, per line */
+    uint32_t irq_tx;
+    uint32_t irq_rx[2];
+    uint32_t irq_sce;
+    /* reception, per Rx FIFO */
+    uint32_t rx_frames[2];       /* frames read from the hardware FIFO */
+    uint32_t rx_rejected[2];     /* of which rejected by the software filter */
+    uint32_t rx_full[2];         /* FIFO full events */
+    uint32_t rx_overruns[2];     /* FIFO overrun events (frame lost) */
+    uint32_t rx_ring_full[2];    /* Rx ring full, frames left in the FIFO */
+    uint32_t rx_level[2][4];     /* FIFO occupancy: histogram of the
+                                    number of pending frames (FMP) at each Rx
+                                    interrupt, or read in polling mode */
+    /* transmission, per Tx mailbox */
+    uint32_t tx_requests[3];     /* frames written to the mailbox */
+    uint32_t tx_frames[3];       /* transmissions completed (IT mode) */
+    uint32_t tx_aborts[3];       /* transmissions aborted (IT mode) */
+    uint32_t tx_arb_lost[3];     /* of which on arbitration lost */
+    uint32_t tx_expired[3];      /* of which on deadline expiry */
+    uint32_t tx_preempted[3];    /* aborts requested for a more prioritary
+                                    queued frame */
+    uint32_t tx_errors[3];       /* of which on transmission error */
+    /* bus errors (IT mode) */
+    uint32_t lec[8];             /* histogram, indexed by ESR:LEC */
+    uint32_t err_warning;        /* error interrupts with EWGF set */
+    uint32_t err_passive;        /* error interrupts with EPVF set */
+    uint32_t bus_off;            /* error interrupts with BOFF set */
+    /* error counters, read at snapshot time */
+    uint32_t tec;                /* ESR:TEC, transmit error counter */
+    uint32_t rec;                /* ESR:REC, receive error counter */
+} can_stats_t;
+#endif
+
 /******************************************************************************/
 
 /*
@@ -197,7 +437,8 @@ typedef union {
  *   context uptodate
  *
  * The driver permits to handle multiple CAN devices using multiple contexts
- * at the same time, as there is no globals.
+ * at the same time. The only global is a private table of declared contexts,
+ * indexed by port, used by the ISR to find back its context.
  */
 typedef struct {
     /* about infos set at declare time by uper layer **/
@@ -211,10 +452,88 @@ typedef struct {
     bool          rxfifolocked;    /* set Rx Fifo locked against overrun */
     bool          txfifoprio;      /* set Tx Fifo in chronological order */
     can_bit_r_t   bit_rate;        /* physical CAN bus bit rate */
+    uint32_t      bitrate;         /* CAN_SPEED_CUSTOM bit rate, in bit/s */
+    uint16_t      sample_point;    /* per mille, 0 for CAN_SAMPLE_POINT_DEFAULT */
+    const can_bit_timing_t *timing;/* precomputed timing (CAN_BIT_TIMING_INIT),
+                                      overrides the three fields above */
+    const can_filter_t *filters;   /* Rx filters list, NULL to accept all frames */
+    uint8_t       filters_num;     /* number of elements in filters */
+#if CONFIG_USR_DRV_CAN_SW_FILTER
+    bool          swfilter;        /* software filter for unfit filters */
+#endif
+#if CONFIG_USR_DRV_CAN_RX_BALANCE
+    bool          rxbalanced;      /* filters spread over both Rx FIFOs */
+#endif
+#if CONFIG_USR_DRV_CAN_RX_RING
+    bool          rxbuffered;      /* ISR drains Rx FIFOs into rx_ring (IT mode) */
+#endif
+#if CONFIG_USR_DRV_CAN_RX_COALESCE
+    uint8_t       rx_coalesce_frames; /* report rx_ring frames once this
+                                      number is buffered (0: no threshold) */
+    uint32_t      rx_coalesce_us;  /* or once the oldest one is buffered since
+                                      this delay, in us (0: no delay) */
+#endif
+#if CONFIG_USR_DRV_CAN_RX_DIRECT
+    bool          rxdirect;        /* ISR hands frames to can_rx_frame() (IT mode) */
+#endif
+#if CONFIG_USR_DRV_CAN_TX_QUEUE
+    bool          txqueued;        /* can_xmit() goes through tx_queue (IT mode) */
+#endif
+#if CONFIG_USR_DRV_CAN_TX_PREEMPT
+    bool          txpreempt;       /* urgent queued frames preempt the least
+                                      prioritary mailbox (txqueued mode) */
+#endif
+#if CONFIG_USR_DRV_CAN_CAPTURE
+    bool          capture;         /* ISR records the frames in the capture
+                                      ring (IT mode) */
+#endif
     /* about info set at declare and init time by the driver */
     device_t      can_dev;         /*< CAN associated kernel structure */
     can_state_t   state;           /*< current state */
     int           can_dev_handle;  /* device handle returned by kernel */
+    can_bit_timing_t bit_timing;   /* bit timing set at initialization */
+    can_state_t   transition_prev; /* state before the pending transition */
+    bool          transition_notify; /* report its completion to can_event() */
+    uint32_t      transition_timeout;/* pending transition timeout, in us */
+    uint64_t      transition_start;  /* pending transition request time, in us */
+    uint8_t       filters_unfit;   /* number of filters, at the end of the
+                                      filters list, that did not fit in the
+                                      hardware filter banks */
+#if CONFIG_USR_DRV_CAN_RX_BALANCE
+    uint32_t      filters_fifo1[8]; /* Rx FIFO of each element of the
+                                      filters list, one bit each (set for
+                                      FIFO1) */
+#endif
+#if CONFIG_USR_DRV_CAN_DISPATCH
+    uint8_t       fmi_map[2][CAN_FILTER_NUMBERS_MAX]; /* filters list index
+                                      of each FMI value, per Rx FIFO */
+#endif
+#if CONFIG_USR_DRV_CAN_SW_FILTER
+    can_sw_filter_t sw_filter;     /* software second stage Rx filter */
+#endif
+#if CONFIG_USR_DRV_CAN_RX_RING
+    can_rx_ring_t rx_ring[2];      /* software Rx rings, one per Rx FIFO */
+#endif
+#if CONFIG_USR_DRV_CAN_TX_QUEUE
+    can_tx_queue_t tx_queue;       /* software Tx queue, sorted by priority */
+#endif
+#if CONFIG_USR_DRV_CAN_TX_DEADLINE
+    uint64_t      tx_deadline[3];  /* expiry time of each Tx mailbox frame,
+                                      in us (0: no deadline) */
+    volatile bool tx_expiring[3];  /* mailbox aborted on expiry, until the
+                                      ISR reports it */
+#endif
+#if CONFIG_USR_DRV_CAN_TIMESTAMP
+    uint64_t      ts_start;        /* time stamps origin (can_start()), in us */
+    uint16_t      ts_phase;        /* time stamp counter value at ts_start */
+    volatile bool ts_synced;       /* ts_phase taken from the first stamp */
+    uint64_t      tx_time[3];      /* extended time stamp of the last frame
+                                      sent by each Tx mailbox (set by the ISR) */
+#endif
+#if CONFIG_USR_DRV_CAN_STATS
+    can_stats_t   stats;           /* running counters */
+    can_stats_t   stats_base;      /* counters values at the last reset */
+#endif
 } can_context_t;
 
 /* declare device */
@@ -223,18 +542,61 @@ mbed_error_t can_declare(__inout can_context_t *ctx);
 /* init device */
 mbed_error_t can_initialize(__inout can_context_t *ctx);
 
+/* compute the bit timing of the given bit rate and sample point (per mille)
+ * from the clk APB1 clock frequency */
+mbed_error_t can_bit_timing_solve(const __in  uint32_t          clk,
+                                  const __in  uint32_t          bitrate,
+                                  const __in  uint16_t          sample_point,
+                                        __out can_bit_timing_t *timing);
+
+/* request the initialization, completed by can_transition_poll() */
+mbed_error_t can_initialize_async(__inout can_context_t *ctx,
+                                  const __in uint32_t    timeout_us);
+
+/* init device, failing if the controller does not enter the initialization
+ * mode within timeout_us */
+mbed_error_t can_initialize_timeout(__inout can_context_t *ctx,
+                                    const __in uint32_t    timeout_us);
+
+/* make the pending asynchronous transition progress. Returns
+ * MBED_ERROR_BUSY while it is pending, MBED_ERROR_INITFAIL on timeout */
+mbed_error_t can_transition_poll(__inout can_context_t *ctx);
+
 /* release device */
 mbed_error_t can_release(__inout can_context_t *ctx);
 
-/* set filters (can be done outside initialization) */
+/* set filters from the ctx filters list (can be done outside initialization) */
 mbed_error_t can_set_filters(__in can_context_t *ctx);
 
+#if CONFIG_USR_DRV_CAN_RX_BALANCE
+/* Rx FIFO of the given element of the filters list, once set. Elements left
+ * out are MBED_ERROR_NOTFOUND, unless handled by the software filter, in
+ * FIFO0 */
+mbed_error_t can_filter_fifo(const __in  can_context_t *ctx,
+                             const __in  uint8_t        index,
+                                   __out can_fifo_t    *fifo);
+#endif
+
 /* start the CAN (required after initialization or filters setting) */
 mbed_error_t can_start(__inout can_context_t *ctx);
 
 /* Stop the CAN */
 mbed_error_t can_stop(__inout can_context_t *ctx);
 
+/* same as can_start() and can_stop(), completed by can_transition_poll() */
+mbed_error_t can_start_async(__inout can_context_t *ctx,
+                             const __in uint32_t    timeout_us);
+
+mbed_error_t can_stop_async(__inout can_context_t *ctx,
+                            const __in uint32_t    timeout_us);
+
+/* same as can_start() and can_stop(), with the given timeout */
+mbed_error_t can_start_timeout(__inout can_context_t *ctx,
+                               const __in uint32_t    timeout_us);
+
+mbed_error_t can_stop_timeout(__inout can_context_t *ctx,
+                              const __in uint32_t    timeout_us);
+
 /* send data into one of the CAN Tx FIFO */
 mbed_error_t can_xmit(const __in  can_context_t *ctx,
                             __in  can_header_t  *header,
@@ -245,16 +607,232 @@ mbed_error_t can_is_txmsg_pending(const __in  can_context_t *ctx,
                                         __in  can_mbox_t mbox,
                                         __out bool *status);
 
+/* same as can_xmit(), using a packed frame */
+mbed_error_t can_xmit_packed(const __in  can_context_t      *ctx,
+                             const __in  can_packed_frame_t *frame,
+                                   __out can_mbox_t         *mbox);
+
+/* send up to n packed frames in a single pass on the Tx mailboxes. The
+ * number of frames accepted is set in *accepted, and the mailbox of each of
+ * them in mboxes[] (may be NULL). Returns MBED_ERROR_BUSY if none is */
+mbed_error_t can_xmit_burst(const __in  can_context_t      *ctx,
+                            const __in  can_packed_frame_t  frames[],
+                            const __in  uint32_t            n,
+                                  __out uint32_t           *accepted,
+                                  __out can_mbox_t          mboxes[]);
+
+#if CONFIG_USR_DRV_CAN_TX_DEADLINE
+/* same as can_xmit_packed(), the frame being aborted if still pending
+ * lifetime_us after this call (0: no deadline). Not available in txqueued
+ * mode */
+mbed_error_t can_xmit_deadline(const __in  can_context_t      *ctx,
+                               const __in  can_packed_frame_t *frame,
+                               const __in  uint32_t            lifetime_us,
+                                     __out can_mbox_t         *mbox);
+
+/* abort the Tx mailboxes whose frame deadline has passed. Also done by
+ * the xmit functions when no mailbox is empty */
+mbed_error_t can_tx_expire(const __in can_context_t *ctx);
+#endif
+
+#if CONFIG_USR_DRV_CAN_TIMESTAMP
+/* 64 bits time stamp of a received packed frame, in bit times. To be called
+ * less than 32768 bit times after the frame reception */
+mbed_error_t can_timestamp(const __in  can_context_t      *ctx,
+                           const __in  can_packed_frame_t *frame,
+                                 __out uint64_t           *timestamp);
+
+/* 64 bits time stamp of the last frame sent by the given mailbox, in bit
+ * times. To be called from can_event() on CAN_EVENT_TX_MBOXx_COMPLETE */
+mbed_error_t can_tx_timestamp(const __in  can_context_t *ctx,
+                              const __in  can_mbox_t     mbox,
+                                    __out uint64_t      *timestamp);
+#endif
+
 /* get back data from one of the CAN Rx FIFO */
 mbed_error_t can_receive(const __in  can_context_t *ctx,
                          const __in  can_fifo_t     fifo,
                                __out can_header_t  *header,
                                __out can_data_t    *data);
 
-#ifdef _LIBCAN_
-volatile uint32_t nb_CAN_IRQ_Handler = 0;
-#else
-extern volatile uint32_t nb_CAN_IRQ_Handler;
+/* same as can_receive(), using a packed frame */
+mbed_error_t can_receive_packed(const __in  can_context_t      *ctx,
+                                const __in  can_fifo_t          fifo,
+                                      __out can_packed_frame_t *frame);
+
+/* conversion between the header/data and the packed frame formats */
+void can_frame_pack(const __in  can_header_t       *header,
+                    const __in  can_data_t         *data,
+                          __out can_packed_frame_t *frame);
+
+void can_frame_unpack(const __in  can_packed_frame_t *frame,
+                            __out can_header_t       *header,
+                            __out can_data_t         *data);
+
+/* read-only access to the next received frame of the given FIFO: the slot of
+ * the software ring, or a copy of the hardware FIFO output mailbox. The frame
+ * stays in the FIFO, or the ring, until can_receive_commit() releases it */
+mbed_error_t can_receive_peek(const __in  can_context_t       *ctx,
+                              const __in  can_fifo_t           fifo,
+                                    __out const can_packed_frame_t **frame);
+
+mbed_error_t can_receive_commit(const __in  can_context_t *ctx,
+                                const __in  can_fifo_t     fifo);
+
+/* get back up to max frames from one of the CAN Rx FIFO in a single call */
+mbed_error_t can_receive_burst(const __in  can_context_t *ctx,
+                               const __in  can_fifo_t     fifo,
+                                     __out can_frame_t    frames[],
+                               const __in  uint32_t       max,
+                                     __out uint32_t      *count);
+
+#if CONFIG_USR_DRV_CAN_DISPATCH
+/*******************************************************************************
+ *   CAN Rx dispatch
+ *
+ * Like can_event(), the Rx handlers are resolved at link time: the
+ * application defines, for each port it uses, a const table of handlers,
+ * stored in flash, with one entry per element of the context filters list
+ * (same order), plus a last default entry for the frames that match no
+ * single element (accept-all filter, software filtered frames). NULL
+ * entries are skipped.
+ *
+ * const can_rx_handler_t can1_rx_dispatch[] = { h_engine, h_brake, h_default };
+ ******************************************************************************/
+typedef void (*can_rx_handler_t)(can_port_t port,
+                                 const can_packed_frame_t *frame);
+
+extern const can_rx_handler_t can1_rx_dispatch[] __attribute__((weak));
+extern const can_rx_handler_t can2_rx_dispatch[] __attribute__((weak));
+
+/* receive up to max frames from one of the CAN Rx FIFO and route each of them
+ * to its handler */
+mbed_error_t can_receive_dispatch(const __in  can_context_t *ctx,
+                                  const __in  can_fifo_t     fifo,
+                                  const __in  uint32_t       max,
+                                        __out uint32_t      *count);
+#endif
+
+#if CONFIG_USR_DRV_CAN_RX_DIRECT
+/*******************************************************************************
+ *   CAN Rx direct delivery
+ *
+ * In direct mode (rxdirect field), each received frame is handed by the ISR
+ * to can_rx_frame(), resolved at link time as can_event(), instead of being
+ * reported by a CAN_EVENT_RX_FIFOx_MSG_PENDING event and read back with
+ * can_receive(). It is executed in the ISR context and must be kept short.
+ * Declaring a context in direct mode fails if it is not defined.
+ ******************************************************************************/
+void can_rx_frame(can_port_t                port,
+                  can_fifo_t                fifo,
+                  const can_packed_frame_t *frame) __attribute__((weak));
+#endif
+
+#if CONFIG_USR_DRV_CAN_PROFILE
+/*******************************************************************************
+ *   CAN profiling
+ *
+ * Probes are timestamped at entry and exit of the driver hot paths with
+ * can_profile_clock(). The driver provides a weak definition of it, reading
+ * the core cycle counter through sys_get_systick(PREC_CYCLE). A task having
+ * a cheaper clock source (or the host build) defines its own, resolved at
+ * link time as can_event().
+ ******************************************************************************/
+typedef enum {
+    CAN_PROBE_IRQ = 0,      /* can_IRQHandler() execution */
+    CAN_PROBE_XMIT,         /* can_xmit_packed(), called by can_xmit(),
+                               can_xmit_burst() and can_xmit_deadline() */
+    CAN_PROBE_RECEIVE,      /* can_receive_packed(), called by can_receive() */
+    CAN_PROBE_RX_LATENCY,   /* from the ISR reporting pending frames to
+                               their first reception by the user task */
+    CAN_PROBE_INAK_WAIT,    /* initialization mode enter/exit handshakes,
+                               from request to completion or timeout */
+    CAN_PROBE_NUM
+} can_probe_t;
+
+/* log2 histogram: bucket i counts durations of [2^i, 2^(i+1)[ ticks, the
+ * last one all the longer durations */
+#define CAN_PROFILE_BUCKETS 16
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;           /* mean is sum / count */
+    uint32_t histogram[CAN_PROFILE_BUCKETS];
+} can_profile_t;
+
+uint32_t can_profile_clock(void);
+
+/* get the measures of the given probe, for all ports */
+mbed_error_t can_profile_get(const __in  can_probe_t    probe,
+                                   __out can_profile_t *profile);
+
+/* reset the measures of all probes */
+void can_profile_reset(void);
+#endif
+
+#if CONFIG_USR_DRV_CAN_CAPTURE
+/*******************************************************************************
+ *   CAN capture
+ *
+ * For the contexts in capture mode (capture field), the ISR records each
+ * frame it reads from a Rx FIFO, in buffered and direct modes, and each frame
+ * sent, in a RAM ring shared by both ports. The ISR never waits for the
+ * reader: the oldest records are overwritten, and counted as lost by
+ * can_capture_read(). Frames read from the FIFOs by the user task (polling
+ * and plain IT modes) are not recorded.
+ *
+ * Records are stamped with can_capture_clock(), read once per interrupt.
+ * The driver provides a weak definition of it, giving the system tick in us.
+ * As can_profile_clock(), a task can provide a cheaper clock source.
+ ******************************************************************************/
+#define CAN_CAPTURE_TX       0x1  /* frame sent, otherwise received */
+#define CAN_CAPTURE_FIFO1    0x2  /* received in Rx FIFO 1 */
+#define CAN_CAPTURE_REJECTED 0x4  /* rejected by the software filter */
+
+typedef struct {
+    uint64_t stamp;         /* can_capture_clock(), in us */
+    uint32_t id;            /* identifier, IDE and RTR, as the RIxR register */
+    uint8_t  dlc;
+    uint8_t  port;
+    uint8_t  flags;         /* CAN_CAPTURE_* */
+    uint8_t  index;         /* filter match index (received), mailbox (sent) */
+    uint32_t datal;         /* as the RDLxR and RDHxR registers */
+    uint32_t datah;
+} can_capture_record_t;
+
+/* longest can_capture_format() line, final NUL included */
+#define CAN_CAPTURE_LINE_MAX 64
+
+uint64_t can_capture_clock(void);
+
+/* read up to max records, oldest first, lost being the number of records
+ * overwritten before being read since the previous call */
+mbed_error_t can_capture_read(__out can_capture_record_t *records,
+                              const __in uint32_t        max,
+                              __out uint32_t             *count,
+                              __out uint32_t             *lost);
+
+/* drop the records not read yet */
+void can_capture_reset(void);
+
+/* format a record as a Linux candump -L log line, port N being canN-1:
+ * "(seconds.us) can0 123#11223344\n". Returns the line length, NUL
+ * excluded, or 0 if it does not fit in size */
+uint32_t can_capture_format(const __in  can_capture_record_t *record,
+                                  __out char                 *buf,
+                            const __in  uint32_t              size);
+#endif
+
+#if CONFIG_USR_DRV_CAN_STATS
+/* get the statistics counted since the last reset, with the current error
+ * counters */
+mbed_error_t can_stats_snapshot(const __in  can_context_t *ctx,
+                                      __out can_stats_t   *stats);
+
+/* reset the statistics of the context */
+mbed_error_t can_stats_reset(__inout can_context_t *ctx);
 #endif
 
 #endif /*!LIBCAN_H_*/
@@ -0,0 +1,209 @@
+/*
+ * CANopen (CiA 301) slave core over the CAN driver, for the industrial
+ * automation target: NMT slave, SYNC driven and event driven PDOs through
+ * mappings compiled at initialization, and an SDO server supporting the
+ * expedited, segmented and block transfers.
+*/
+
+#ifndef LIBCAN_CANOPEN_H_
+#define LIBCAN_CANOPEN_H_
+
+#include "autoconf.h"
+#include "api/libcan.h"
+
+#if CONFIG_USR_DRV_CAN_CANOPEN
+
+/* predefined connection set function codes */
+#define CAN_CO_COB_NMT       0x000
+#define CAN_CO_COB_SYNC      0x080
+#define CAN_CO_COB_SDO_TX    0x580  /* + node id, server to client */
+#define CAN_CO_COB_SDO_RX    0x600  /* + node id, client to server */
+#define CAN_CO_COB_HEARTBEAT 0x700  /* + node id, boot-up message */
+
+/* PDO transmission types */
+#define CAN_CO_PDO_ACYCLIC   0      /* sent at the SYNC following can_co_tpdo_send() */
+#define CAN_CO_PDO_SYNC_MAX  240    /* 1-240: sent every n SYNC */
+#define CAN_CO_PDO_EVENT     254    /* sent by can_co_tpdo_send() */
+
+/* mapping entry: index, subindex and length in bits */
+#define CAN_CO_MAP(index, sub, bits) \
+    (((uint32_t)(index) << 16) | ((uint32_t)(sub) << 8) | (uint32_t)(bits))
+
+/* SDO block transfers: at most 127 segments per block */
+#define CAN_CO_SDO_BLKSIZE_MAX 127
+/* SDO transfers timeout when the node sdo_timeout_ms field is 0 */
+#define CAN_CO_SDO_TIMEOUT   1000
+
+/* SDO abort codes */
+#define CAN_CO_SDO_ABORT_TOGGLE    0x05030000  /* toggle bit not alternated */
+#define CAN_CO_SDO_ABORT_TIMEOUT   0x05040000
+#define CAN_CO_SDO_ABORT_COMMAND   0x05040001  /* invalid command specifier */
+#define CAN_CO_SDO_ABORT_BLKSIZE   0x05040002  /* invalid block size */
+#define CAN_CO_SDO_ABORT_SEQNO     0x05040003  /* invalid sequence number */
+#define CAN_CO_SDO_ABORT_CRC       0x05040004
+#define CAN_CO_SDO_ABORT_WRITEONLY 0x06010001
+#define CAN_CO_SDO_ABORT_READONLY  0x06010002
+#define CAN_CO_SDO_ABORT_NO_OBJECT 0x06020000
+#define CAN_CO_SDO_ABORT_LENGTH    0x06070010  /* data type length mismatch */
+
+/*******************************************************************************
+ *   CANopen event
+ *
+ * As can_event(), can_co_event() is resolved at link time, and optional. It
+ * is called from can_co_rx_frame() and can_co_poll(), in the user task
+ * context.
+ ******************************************************************************/
+typedef enum {
+    CAN_CO_EVENT_NMT = 0,        /* NMT state changed, arg is the new state */
+    CAN_CO_EVENT_RPDO,           /* RPDO mapped objects written, arg is the
+                                    RPDO number */
+    CAN_CO_EVENT_SDO_WRITTEN,    /* object written by the SDO server, arg is
+                                    index << 8 | subindex */
+    CAN_CO_EVENT_SDO_ABORT       /* SDO transfer aborted, arg is the abort code */
+} can_co_event_t;
+
+typedef enum {
+    CAN_CO_NMT_INITIALIZING = 0x00,
+    CAN_CO_NMT_STOPPED = 0x04,
+    CAN_CO_NMT_OPERATIONAL = 0x05,
+    CAN_CO_NMT_PRE_OPERATIONAL = 0x7f
+} can_co_nmt_state_t;
+
+/*
+ * Object dictionary entry. The dictionary is a const table defined by the
+ * application, sorted by index and subindex. Values are stored in the CPU
+ * byte order, little endian as on the CAN bus.
+ */
+#define CAN_CO_ACCESS_READ  0x1
+#define CAN_CO_ACCESS_WRITE 0x2
+#define CAN_CO_ACCESS_RW    (CAN_CO_ACCESS_READ | CAN_CO_ACCESS_WRITE)
+
+typedef struct {
+    uint16_t index;
+    uint8_t  subindex;
+    uint8_t  access;             /* CAN_CO_ACCESS_* flags */
+    uint32_t size;               /* in bytes */
+    void    *data;
+} can_co_od_entry_t;
+
+/* PDO communication and mapping parameters */
+typedef struct {
+    uint16_t        cob_id;      /* 11 bits identifier */
+    uint8_t         type;        /* transmission type */
+    uint8_t         num;         /* number of mapping entries */
+    const uint32_t *mapping;     /* CAN_CO_MAP() entries. In RPDOs, indexes
+                                    below 0x1000 are dummy entries */
+} can_co_pdo_t;
+
+/*
+ * Compiled PDO: the mapping is turned at initialization into a list of byte
+ * copies between the object dictionary and the frame data, contiguous
+ * objects being merged, so that packing or unpacking a PDO does no lookup
+ * and no bit interpretation.
+ */
+typedef struct {
+    uint8_t *obj;                /* object data */
+    uint8_t  off;                /* offset in the frame data */
+    uint8_t  len;                /* bytes to copy */
+} can_co_pdo_copy_t;
+
+typedef struct {
+    const can_co_pdo_t *pdo;
+    can_header_t        header;  /* TPDO frame header */
+    uint8_t             ncopies;
+    uint8_t             dlc;     /* mapped length, in bytes */
+    uint8_t             sync_count;
+    bool                armed;   /* acyclic TPDO requested, or synchronous
+                                    RPDO received, for the next SYNC */
+    can_data_t          data;    /* synchronous RPDO data, until the SYNC */
+    can_co_pdo_copy_t   copies[8];
+} can_co_pdo_map_t;
+
+typedef enum {
+    CAN_CO_SDO_IDLE = 0,
+    CAN_CO_SDO_DOWN_SEGMENT,     /* segmented download */
+    CAN_CO_SDO_UP_SEGMENT,       /* segmented upload */
+    CAN_CO_SDO_DOWN_BLOCK,       /* block download, receiving segments */
+    CAN_CO_SDO_DOWN_BLOCK_END,   /* block download, waiting for the end */
+    CAN_CO_SDO_UP_BLOCK_START,   /* block upload, waiting for the start */
+    CAN_CO_SDO_UP_BLOCK,         /* block upload, sending segments */
+    CAN_CO_SDO_UP_BLOCK_ACK,     /* block upload, waiting for the ack */
+    CAN_CO_SDO_UP_BLOCK_END      /* block upload, waiting for the end */
+} can_co_sdo_state_t;
+
+/*
+ * A CANopen node on a started CAN context. As the CAN context, it is
+ * separated in two parts:
+ * - one set by the upper layer before can_co_init()
+ * - the other one set by the driver, during the node lifecycle
+ */
+typedef struct {
+    /* about infos set at init time by the upper layer */
+    const can_context_t     *ctx;       /*< started CAN context used by the node */
+    uint8_t                  node_id;   /*< 1 to 127 */
+    const can_co_od_entry_t *od;        /*< object dictionary, sorted */
+    uint16_t                 od_num;
+    const can_co_pdo_t      *tpdo;      /*< transmit PDOs */
+    uint8_t                  tpdo_num;
+    const can_co_pdo_t      *rpdo;      /*< receive PDOs */
+    uint8_t                  rpdo_num;
+    uint8_t                  block_size; /* block download segments per
+                                           block (0: 127) */
+    uint16_t                 sdo_timeout_ms; /* 0 for CAN_CO_SDO_TIMEOUT */
+    /* about info set at init time and during the node life by the driver */
+    can_co_nmt_state_t       nmt;
+    can_co_pdo_map_t         tpdo_map[CONFIG_USR_DRV_CAN_CANOPEN_PDO_MAX];
+    can_co_pdo_map_t         rpdo_map[CONFIG_USR_DRV_CAN_CANOPEN_PDO_MAX];
+    uint32_t                 tpdo_pending; /* TPDOs to send, one bit each */
+    can_co_sdo_state_t       sdo_state;
+    const can_co_od_entry_t *sdo_entry; /* object being transferred */
+    uint32_t                 sdo_size;  /* bytes to transfer */
+    uint32_t                 sdo_off;   /* bytes transferred */
+    uint32_t                 sdo_block_off; /* offset of the current block */
+    uint8_t                  sdo_toggle;
+    uint8_t                  sdo_seqno; /* segments of the current block */
+    uint8_t                  sdo_blksize;
+    bool                     sdo_crc;   /* CRC negotiated (block transfers) */
+    uint64_t                 sdo_deadline; /* in us */
+    can_mbox_t               sdo_mbox;  /* mailbox of the last segment */
+    bool                     sdo_inflight;
+    bool                     sdo_resp_pending; /* sdo_resp to send again */
+    can_packed_frame_t       sdo_resp;
+} can_co_node_t;
+
+void can_co_event(can_co_node_t  *node,
+                  can_co_event_t  event,
+                  uint32_t        arg) __attribute__((weak));
+
+/*******************************************************************************
+ *   CANopen API
+ *
+ * As the ISO-TP links, the node does not read the CAN context: the task
+ * hands each received frame to can_co_rx_frame() and calls can_co_poll()
+ * periodically. SDO block upload segments are pipelined in all the Tx
+ * mailboxes when the context is in chronological Tx order (txfifoprio).
+ ******************************************************************************/
+
+/* compile the PDO mappings, enter pre-operational and send the boot-up
+ * message */
+mbed_error_t can_co_init(__inout can_co_node_t *node);
+
+/* send an event driven TPDO now, or arm an acyclic one for the next SYNC */
+mbed_error_t can_co_tpdo_send(__inout can_co_node_t *node,
+                              const __in uint8_t     num);
+
+/* process a received frame, MBED_ERROR_NOTFOUND if not for this node */
+mbed_error_t can_co_rx_frame(__inout can_co_node_t      *node,
+                             const __in can_packed_frame_t *frame);
+
+/* send the pending frames and check the SDO timeout */
+mbed_error_t can_co_poll(__inout can_co_node_t *node);
+
+/* object dictionary lookup, NULL if not found */
+const can_co_od_entry_t *can_co_od_find(const can_co_node_t *node,
+                                        uint16_t             index,
+                                        uint8_t              subindex);
+
+#endif
+
+#endif /* LIBCAN_CANOPEN_H_ */
@@ -0,0 +1,154 @@
+/*
+ * ISO-TP (ISO 15765-2) transport protocol over the CAN driver: messages of up
+ * to 4 GB are segmented in single, first and consecutive frames, the receiver
+ * pacing the sender with flow control frames (block size and STmin).
+*/
+
+#ifndef LIBCAN_ISOTP_H_
+#define LIBCAN_ISOTP_H_
+
+#include "autoconf.h"
+#include "api/libcan.h"
+
+#if CONFIG_USR_DRV_CAN_ISOTP
+
+/*******************************************************************************
+ *   ISO-TP event
+ *
+ * As can_event(), can_isotp_event() is resolved at link time. It is called
+ * from can_isotp_rx_frame() and can_isotp_poll(), in the user task context,
+ * when a message has been sent or received, or when a transfer failed. It is
+ * optional: can_isotp_send() returning MBED_ERROR_BUSY and can_isotp_receive()
+ * can be polled instead.
+ ******************************************************************************/
+
+typedef enum {
+    CAN_ISOTP_EVENT_TX_DONE = 0, /* all the frames of the message are handed
+                                    to the driver */
+    CAN_ISOTP_EVENT_RX_DONE,     /* a message is available in rx_buf */
+    CAN_ISOTP_EVENT_TX_ERROR,    /* message transmission aborted */
+    CAN_ISOTP_EVENT_RX_ERROR     /* message reception aborted */
+} can_isotp_event_t;
+
+typedef enum {
+    CAN_ISOTP_ERROR_NONE = 0,
+    CAN_ISOTP_ERROR_TIMEOUT_BS,  /* no flow control frame in time (N_Bs) */
+    CAN_ISOTP_ERROR_TIMEOUT_CR,  /* no consecutive frame in time (N_Cr) */
+    CAN_ISOTP_ERROR_WRONG_SN,    /* consecutive frame out of sequence */
+    CAN_ISOTP_ERROR_OVERFLOW,    /* message larger than the receiver buffer */
+    CAN_ISOTP_ERROR_UNEXP_PDU,   /* new message during a reception */
+    CAN_ISOTP_ERROR_WFT_OVRN,    /* too many flow control WAIT frames */
+    CAN_ISOTP_ERROR_INVALID_FS   /* unknown flow control status */
+} can_isotp_error_t;
+
+/* maximum number of consecutive flow control WAIT frames accepted */
+#define CAN_ISOTP_WFT_MAX          16
+
+/* N_Bs and N_Cr timeouts when the link timeout_ms field is 0 */
+#define CAN_ISOTP_TIMEOUT_DEFAULT  1000
+
+/* padding byte of the frames shorter than 8 bytes (padding field) */
+#define CAN_ISOTP_PADDING_BYTE     0xCC
+
+typedef enum {
+    CAN_ISOTP_IDLE = 0,
+    CAN_ISOTP_TX_FIRST,          /* single or first frame to send */
+    CAN_ISOTP_TX_WAIT_FC,        /* waiting for a flow control frame */
+    CAN_ISOTP_TX_SENDING,        /* sending consecutive frames */
+    CAN_ISOTP_RX_RECEIVING       /* receiving consecutive frames */
+} can_isotp_state_t;
+
+/*
+ * An ISO-TP link is a pair of identifiers (one per direction) on a started
+ * CAN context, with one message in transmission and one in reception at a
+ * time. As the CAN context, it is separated in two parts:
+ * - one set by the upper layer before can_isotp_init()
+ * - the other one set by the driver, during the link lifecycle
+ *
+ * The data given to can_isotp_send() is not copied and must be kept until
+ * CAN_ISOTP_EVENT_TX_DONE. Received messages are written into rx_buf.
+ */
+typedef struct {
+    /* about infos set at init time by the upper layer */
+    const can_context_t *ctx;      /*< started CAN context used by the link */
+    can_id_extention_t IDE;        /*< identifiers format */
+    uint32_t      tx_id;           /*< identifier of the sent frames */
+    uint32_t      rx_id;           /*< identifier of the received frames */
+    uint8_t       block_size;      /* consecutive frames between two of our
+                                      flow control frames (0: no limit) */
+    uint8_t       st_min;          /* minimum gap between the consecutive
+                                      frames we receive (ISO coding) */
+    bool          padding;         /* pad the sent frames to 8 bytes */
+    uint16_t      timeout_ms;      /* N_Bs and N_Cr timeouts, in ms (0 for
+                                      CAN_ISOTP_TIMEOUT_DEFAULT) */
+    uint8_t      *rx_buf;          /* reception buffer */
+    uint32_t      rx_size;         /* its size, in bytes */
+    /* about info set at init time and during transfers by the driver */
+    uint32_t      tx_pid;          /* tx_id, as a packed frame identifier word */
+    uint32_t      rx_pid;          /* rx_id, as a packed frame identifier word */
+    can_isotp_state_t tx_state;
+    const uint8_t *tx_data;        /* message being sent */
+    uint32_t      tx_len;
+    uint32_t      tx_off;          /* bytes already handed to the driver */
+    uint8_t       tx_sn;           /* next consecutive frame sequence number */
+    uint8_t       tx_bs;           /* block size of the last flow control */
+    uint8_t       tx_bs_left;      /* consecutive frames left in the block */
+    uint8_t       tx_wft;          /* WAIT flow control frames received */
+    uint32_t      tx_st_us;        /* STmin of the last flow control, in us */
+    uint64_t      tx_next;         /* earliest next consecutive frame, in us */
+    uint64_t      tx_deadline;     /* flow control timeout, in us */
+    can_mbox_t    tx_mbox;         /* mailbox of the last consecutive frame */
+    bool          tx_inflight;     /* tx_mbox may still be pending */
+    can_isotp_state_t rx_state;
+    uint32_t      rx_len;          /* message being received */
+    uint32_t      rx_off;          /* bytes already received */
+    uint8_t       rx_sn;           /* expected consecutive frame sequence number */
+    uint8_t       rx_bs_left;      /* consecutive frames left in the block */
+    uint64_t      rx_deadline;     /* consecutive frame timeout, in us */
+    bool          rx_done;         /* rx_buf holds a complete message */
+    bool          rx_fc_pending;   /* flow control frame to send again */
+    uint8_t       rx_fc_status;    /* its flow status */
+} can_isotp_link_t;
+
+void can_isotp_event(can_isotp_link_t        *link,
+                     can_isotp_event_t        event,
+                     can_isotp_error_t        error) __attribute__((weak));
+
+/*******************************************************************************
+ *   ISO-TP API
+ *
+ * The link does not own the CAN context reception: the task reads the frames
+ * (can_receive_packed(), can_receive_peek()...) and hands each of them to
+ * can_isotp_rx_frame(), which returns MBED_ERROR_NOTFOUND for frames of other
+ * identifiers. can_isotp_poll() must be called periodically, to send the
+ * consecutive frames as the mailboxes free up and to check the timeouts.
+ *
+ * Consecutive frames are sent in bursts filling all the Tx mailboxes when
+ * the sender STmin is 0 and the context is in chronological Tx order
+ * (txfifoprio field). Otherwise, as the controller sends the frames of a same
+ * identifier in the mailbox number order, a single one is pending at a time.
+ ******************************************************************************/
+
+/* check the link configuration and reset its state */
+mbed_error_t can_isotp_init(__inout can_isotp_link_t *link);
+
+/* start the transmission of a message of len bytes, not copied */
+mbed_error_t can_isotp_send(__inout can_isotp_link_t *link,
+                            const __in uint8_t       *data,
+                            const __in uint32_t       len);
+
+/* process a received frame, MBED_ERROR_NOTFOUND if not for this link */
+mbed_error_t can_isotp_rx_frame(__inout can_isotp_link_t   *link,
+                                const __in can_packed_frame_t *frame);
+
+/* send the pending frames and check the timeouts */
+mbed_error_t can_isotp_poll(__inout can_isotp_link_t *link);
+
+/* length of the message received in rx_buf, MBED_ERROR_NOTREADY if none.
+ * The message is released for the next one */
+mbed_error_t can_isotp_receive(__inout can_isotp_link_t *link,
+                                     __out uint32_t     *len);
+
+#endif
+
+#endif /* LIBCAN_ISOTP_H_ */
@@ -0,0 +1,227 @@
+/*
+ * SAE J1939 over the CAN driver, for the vehicles target: 29 bits identifiers
+ * encoding (priority, PGN, destination and source addresses), transport
+ * protocol for the messages of 9 to 1785 bytes (broadcast BAM and RTS/CTS
+ * connection mode) and address claim (J1939-81).
+*/
+
+#ifndef LIBCAN_J1939_H_
+#define LIBCAN_J1939_H_
+
+#include "autoconf.h"
+#include "api/libcan.h"
+
+#if CONFIG_USR_DRV_CAN_J1939
+
+/* addresses */
+#define CAN_J1939_ADDR_GLOBAL     0xFF
+#define CAN_J1939_ADDR_NULL       0xFE  /* no address claimed */
+#define CAN_J1939_ADDR_ARBITRARY  128   /* first address of the arbitrary
+                                           address capable nodes range */
+#define CAN_J1939_ADDR_ARBITRARY_LAST 247
+
+/* parameter group numbers used by the stack */
+#define CAN_J1939_PGN_REQUEST     0xEA00
+#define CAN_J1939_PGN_TP_DT       0xEB00
+#define CAN_J1939_PGN_TP_CM       0xEC00
+#define CAN_J1939_PGN_ADDR_CLAIM  0xEE00
+
+#define CAN_J1939_PRIO_DEFAULT    6
+#define CAN_J1939_PRIO_TP         7     /* TP.CM and TP.DT frames */
+
+/* transport protocol: 255 packets of 7 bytes */
+#define CAN_J1939_TP_MAX          1785
+
+/* J1939-21 timeouts, in ms */
+#define CAN_J1939_T1              750   /* receiver, between two TP.DT */
+#define CAN_J1939_T2              1250  /* receiver, after a CTS */
+#define CAN_J1939_T3              1250  /* sender, after the last TP.DT of a
+                                           window, waiting for CTS/EOMA */
+#define CAN_J1939_T4              1050  /* sender, after a hold CTS */
+#define CAN_J1939_BAM_GAP         50    /* between two broadcast TP.DT */
+/* J1939-81 address claim delay, in ms */
+#define CAN_J1939_CLAIM_DELAY     250
+
+/* NAME arbitrary address capable bit */
+#define CAN_J1939_NAME_AAC        (1ULL << 63)
+
+/*******************************************************************************
+ *   J1939 events
+ *
+ * As can_event(), can_j1939_rx() and can_j1939_event() are resolved at link
+ * time. Both are optional, and called from can_j1939_rx_frame() and
+ * can_j1939_poll(), in the user task context.
+ ******************************************************************************/
+
+typedef enum {
+    CAN_J1939_EVENT_TX_DONE = 0,  /* transport protocol message sent (and
+                                     acknowledged, connection mode) */
+    CAN_J1939_EVENT_TX_ABORT,     /* transport protocol transmission aborted */
+    CAN_J1939_EVENT_RX_ABORT,     /* transport protocol reception aborted */
+    CAN_J1939_EVENT_ADDR_CLAIMED, /* the node address is claimed */
+    CAN_J1939_EVENT_ADDR_LOST     /* no address could be claimed */
+} can_j1939_event_t;
+
+/* connection abort reasons (J1939-21) */
+typedef enum {
+    CAN_J1939_ABORT_NONE = 0,
+    CAN_J1939_ABORT_BUSY = 1,         /* already in a session */
+    CAN_J1939_ABORT_RESOURCES = 2,    /* no session available */
+    CAN_J1939_ABORT_TIMEOUT = 3,
+    CAN_J1939_ABORT_CTS_IN_DT = 4,    /* CTS received during a data window */
+    CAN_J1939_ABORT_RETRANSMIT = 5,
+    CAN_J1939_ABORT_UNEXPECTED_DT = 6,
+    CAN_J1939_ABORT_BAD_SEQUENCE = 7,
+    CAN_J1939_ABORT_DUP_SEQUENCE = 8,
+    CAN_J1939_ABORT_SIZE = 9          /* announced size not supported */
+} can_j1939_abort_t;
+
+/* received message, single frame or reassembled */
+typedef struct {
+    uint32_t       pgn;
+    uint8_t        priority;
+    uint8_t        sa;            /* source address */
+    uint8_t        da;            /* destination address (or global) */
+    uint16_t       len;
+    const uint8_t *data;          /* only valid during the call */
+} can_j1939_msg_t;
+
+typedef enum {
+    CAN_J1939_CLAIM_NONE = 0,
+    CAN_J1939_CLAIM_PENDING,      /* address claimed, contention delay running */
+    CAN_J1939_CLAIM_DONE,
+    CAN_J1939_CLAIM_LOST          /* cannot claim an address */
+} can_j1939_claim_t;
+
+typedef enum {
+    CAN_J1939_SESSION_FREE = 0,
+    CAN_J1939_SESSION_BAM,
+    CAN_J1939_SESSION_CMDT
+} can_j1939_session_type_t;
+
+/* transport protocol reception session, for one source address */
+typedef struct {
+    can_j1939_session_type_t type;
+    uint8_t       sa;
+    uint32_t      pgn;
+    uint16_t      len;
+    uint8_t       packets;        /* total number of TP.DT */
+    uint16_t      next;           /* next expected sequence number */
+    uint8_t       window_end;     /* last sequence number of the current CTS */
+    uint8_t       window_max;     /* sender maximum packets per CTS */
+    uint64_t      deadline;       /* in us */
+    uint8_t       buf[CAN_J1939_TP_MAX];
+} can_j1939_session_t;
+
+typedef enum {
+    CAN_J1939_TX_IDLE = 0,
+    CAN_J1939_TX_BAM,             /* sending broadcast TP.DT */
+    CAN_J1939_TX_WAIT_CTS,        /* RTS or data window sent */
+    CAN_J1939_TX_DT               /* sending a data window */
+} can_j1939_tx_state_t;
+
+/* control frames waiting for a free Tx mailbox */
+#define CAN_J1939_CM_QUEUE (CONFIG_USR_DRV_CAN_J1939_SESSIONS + 2)
+
+/*
+ * A J1939 node (controller application) on a started CAN context. As the CAN
+ * context, it is separated in two parts:
+ * - one set by the upper layer before can_j1939_init()
+ * - the other one set by the driver, during the node lifecycle
+ *
+ * A node sends one transport protocol message at a time, the data given to
+ * can_j1939_send() being kept until CAN_J1939_EVENT_TX_DONE, and reassembles
+ * up to CONFIG_USR_DRV_CAN_J1939_SESSIONS messages concurrently, from
+ * distinct sources.
+ */
+typedef struct {
+    /* about infos set at init time by the upper layer */
+    const can_context_t *ctx;     /*< started CAN context used by the node */
+    uint64_t      name;           /*< 64 bits NAME (J1939-81) */
+    uint8_t       address;        /*< preferred source address */
+    uint8_t       cts_packets;    /* packets granted per CTS (0: all) */
+    uint32_t      bam_gap_us;     /* gap between two broadcast TP.DT (0 for
+                                     CAN_J1939_BAM_GAP ms) */
+    /* about info set at init time and during transfers by the driver */
+    uint8_t       sa;             /* claimed address, or CAN_J1939_ADDR_NULL */
+    can_j1939_claim_t claim;
+    uint64_t      claim_deadline; /* end of the contention delay, in us */
+    uint32_t      addr_used[8];   /* addresses claimed by other nodes */
+    can_j1939_tx_state_t tx_state;
+    const uint8_t *tx_data;       /* message being sent */
+    uint16_t      tx_len;
+    uint32_t      tx_pgn;
+    uint8_t       tx_da;
+    uint8_t       tx_packets;
+    uint16_t      tx_next;        /* next TP.DT sequence number */
+    uint8_t       tx_window_end;  /* last sequence number of the window */
+    uint64_t      tx_time;        /* earliest next broadcast TP.DT, in us */
+    uint64_t      tx_deadline;    /* CTS or EOMA timeout, in us */
+    can_mbox_t    tx_mbox;        /* mailbox of the last TP.DT */
+    bool          tx_inflight;    /* tx_mbox may still be pending */
+    can_packed_frame_t cm_queue[CAN_J1939_CM_QUEUE];
+    uint8_t       cm_count;
+    can_mbox_t    cm_mbox;        /* mailbox of the last control frame sent */
+    can_j1939_session_t sessions[CONFIG_USR_DRV_CAN_J1939_SESSIONS];
+} can_j1939_node_t;
+
+void can_j1939_rx(can_j1939_node_t      *node,
+                  const can_j1939_msg_t *msg) __attribute__((weak));
+
+void can_j1939_event(can_j1939_node_t  *node,
+                     can_j1939_event_t  event,
+                     uint32_t           pgn,
+                     can_j1939_abort_t  reason) __attribute__((weak));
+
+/*******************************************************************************
+ *   J1939 API
+ *
+ * As ISO-TP links, nodes do not read the CAN context themselves: the task
+ * hands each received frame to can_j1939_rx_frame() of each node, frames not
+ * addressed to the node being refused with MBED_ERROR_NOTFOUND, and calls
+ * can_j1939_poll() periodically to send the pending frames and check the
+ * timeouts. TP.DT frames of a connection are pipelined in all the Tx
+ * mailboxes when the context is in chronological Tx order (txfifoprio).
+ ******************************************************************************/
+
+/* 29 bits identifier of a parameter group, for can_header_t. The destination
+ * address is only used by PDU1 PGNs (PF below 240) */
+uint32_t can_j1939_id(uint8_t  priority,
+                      uint32_t pgn,
+                      uint8_t  da,
+                      uint8_t  sa);
+
+/* split a 29 bits identifier. PDU2 PGNs get the global destination */
+void can_j1939_id_parse(uint32_t  id,
+                        uint8_t  *priority,
+                        uint32_t *pgn,
+                        uint8_t  *da,
+                        uint8_t  *sa);
+
+/* check the node configuration and reset its state */
+mbed_error_t can_j1939_init(__inout can_j1939_node_t *node);
+
+/* claim the preferred address, CAN_J1939_EVENT_ADDR_CLAIMED being reported
+ * CAN_J1939_CLAIM_DELAY ms later without contention */
+mbed_error_t can_j1939_claim(__inout can_j1939_node_t *node);
+
+/* send a parameter group. Up to 8 bytes in a single frame, otherwise
+ * through the transport protocol: broadcast (BAM) to the global address,
+ * connection mode (RTS/CTS) to a specific one. Data is not copied */
+mbed_error_t can_j1939_send(__inout can_j1939_node_t *node,
+                            const __in uint8_t        priority,
+                            const __in uint32_t       pgn,
+                            const __in uint8_t        da,
+                            const __in uint8_t       *data,
+                            const __in uint16_t       len);
+
+/* process a received frame, MBED_ERROR_NOTFOUND if not for this node */
+mbed_error_t can_j1939_rx_frame(__inout can_j1939_node_t   *node,
+                                const __in can_packed_frame_t *frame);
+
+/* send the pending frames and check the timeouts */
+mbed_error_t can_j1939_poll(__inout can_j1939_node_t *node);
+
+#endif
+
+#endif /* LIBCAN_J1939_H_ */
@@ -11,7 +11,1033 @@
 #include "generated/can2.h"
 #include "autoconf.h"
 
-#define MAX_BUSY_WAITING_CYCLES 2147483647 /* = 2^31 */
+#if CONFIG_USR_DRV_CAN_RX_RING
+# if (CONFIG_USR_DRV_CAN_RX_RING_DEPTH & (CONFIG_USR_DRV_CAN_RX_RING_DEPTH - 1)) != 0
+#  error "CONFIG_USR_DRV_CAN_RX_RING_DEPTH must be a power of two"
+# endif
+# define CAN_RX_RING_MASK (CONFIG_USR_DRV_CAN_RX_RING_DEPTH - 1)
+#endif
+
+/*
+ * Compiler barrier, ordering the ring slot accesses against the head/tail
+ * publication. The ISR and the main thread execute on the same core, so no
+ * hardware barrier is required.
+ */
+#define can_barrier() __asm__ volatile ("" ::: "memory")
+
+/*
+ * Declared contexts, indexed by port - 1. The IRQ handler only gets the IRQ
+ * number and the posthook values from the kernel and uses this table to find
+ * back the context it works on.
+ */
+static can_context_t *can_ctx_table[2] = { NULL, NULL };
+
+static inline can_context_t *can_get_context(can_port_t port)
+{
+    if (port != CAN_PORT_1 && port != CAN_PORT_2) {
+        return NULL;
+    }
+    return can_ctx_table[port - 1];
+}
+
+/*
+ * Statistics counters update. The functions of the user API take a const
+ * context, the counters being the only fields they update.
+ */
+#if CONFIG_USR_DRV_CAN_STATS
+# define can_stats_inc(ctx, field) (((can_context_t*)(ctx))->stats.field++)
+#else
+# define can_stats_inc(ctx, field) do { } while (0)
+#endif
+
+#if CONFIG_USR_DRV_CAN_PROFILE
+/*******************************************************************************
+ *          PROFILING PROBES
+ *
+ * Each probe is only recorded by a single execution thread: the IRQ probe by
+ * the ISR, the others by the user task.
+ ******************************************************************************/
+
+static can_profile_t can_profile_table[CAN_PROBE_NUM];
+
+/* ISR timestamp of the oldest pending frames not received yet, per port and
+ * Rx FIFO, 0 when there is none */
+static volatile uint32_t can_profile_rx_stamp[2][2];
+
+__attribute__((weak)) uint32_t can_profile_clock(void)
+{
+    uint64_t cycles = 0;
+
+    sys_get_systick(&cycles, PREC_CYCLE);
+    return (uint32_t)cycles;
+}
+
+static void can_profile_record(can_probe_t probe, uint32_t ticks)
+{
+    can_profile_t *p = &can_profile_table[probe];
+    uint32_t bucket = 0;
+
+    if (p->count == 0 || ticks < p->min) {
+        p->min = ticks;
+    }
+    if (ticks > p->max) {
+        p->max = ticks;
+    }
+    p->count++;
+    p->sum += ticks;
+    if (ticks != 0) {
+        bucket = 31 - __builtin_clz(ticks);
+        if (bucket >= CAN_PROFILE_BUCKETS) {
+            bucket = CAN_PROFILE_BUCKETS - 1;
+        }
+    }
+    p->histogram[bucket]++;
+}
+
+/* ISR side: pending frames are reported to the user task */
+static inline void can_profile_rx_pending(can_port_t port, can_fifo_t fifo)
+{
+    uint32_t now;
+
+    if (can_profile_rx_stamp[port - 1][fifo] == 0) {
+        now = can_profile_clock();
+        can_profile_rx_stamp[port - 1][fifo] = (now != 0) ? now : 1;
+    }
+}
+
+/* user task side: pending frames are received */
+static inline void can_profile_rx_received(can_port_t port, can_fifo_t fifo)
+{
+    uint32_t stamp = can_profile_rx_stamp[port - 1][fifo];
+
+    if (stamp != 0) {
+        can_profile_rx_stamp[port - 1][fifo] = 0;
+        can_profile_record(CAN_PROBE_RX_LATENCY, can_profile_clock() - stamp);
+    }
+}
+
+/* initialization mode transitions request time, per port */
+static uint32_t can_profile_inak_stamp[2];
+
+# define can_profile_inak_begin(port) \
+    (can_profile_inak_stamp[(port) - 1] = can_profile_clock())
+# define can_profile_inak_end(port) \
+    can_profile_record(CAN_PROBE_INAK_WAIT, \
+                       can_profile_clock() - can_profile_inak_stamp[(port) - 1])
+# define can_profile_begin(t)      uint32_t t = can_profile_clock()
+# define can_profile_end(probe, t) can_profile_record((probe), can_profile_clock() - (t))
+#else
+# define can_profile_begin(t)
+# define can_profile_end(probe, t)
+# define can_profile_rx_pending(port, fifo)
+# define can_profile_rx_received(port, fifo)
+# define can_profile_inak_begin(port)
+# define can_profile_inak_end(port)
+#endif
+
+/*******************************************************************************
+ *          PACKED FRAMES AND MAILBOXES ACCESS
+ *
+ * Frames are moved from and to the device mailboxes using the packed frame
+ * format, which has the very layout of a mailbox: each mailbox access is
+ * made of four 32 bits accesses instead of per-field read-modify-writes.
+ ******************************************************************************/
+
+/* packed frame identifier word: 29 bits extended identifier position */
+#define CAN_PACKED_EXID_Pos CAN_TIxR_EXID_Pos
+#define CAN_PACKED_EXID_Msk ((uint32_t)0x1fffffff << CAN_PACKED_EXID_Pos)
+
+void can_frame_pack(const __in  can_header_t       *header,
+                    const __in  can_data_t         *data,
+                          __out can_packed_frame_t *frame)
+{
+    if (header->IDE == CAN_ID_STD) {
+        frame->id = ((uint32_t)header->id.std << CAN_TIxR_STID_Pos) & CAN_TIxR_STID_Msk;
+    } else {
+        frame->id = ((header->id.ext << CAN_PACKED_EXID_Pos) & CAN_PACKED_EXID_Msk)
+                  | CAN_TIxR_IDE_Msk;
+    }
+    if (header->RTR) {
+        frame->id |= CAN_TIxR_RTR_Msk;
+    }
+    frame->dlct = ((uint32_t)header->DLC << CAN_TDTxR_DLC_Pos) & CAN_TDTxR_DLC_Msk;
+    if (header->TGT == true) {
+        frame->dlct |= CAN_TDTxR_TGT_Msk;
+    }
+    frame->datal = ((uint32_t)data->data_fields.data0 << CAN_TDLxR_DATA0_Pos)
+                 | ((uint32_t)data->data_fields.data1 << CAN_TDLxR_DATA1_Pos)
+                 | ((uint32_t)data->data_fields.data2 << CAN_TDLxR_DATA2_Pos)
+                 | ((uint32_t)data->data_fields.data3 << CAN_TDLxR_DATA3_Pos);
+    frame->datah = ((uint32_t)data->data_fields.data4 << CAN_TDHxR_DATA4_Pos)
+                 | ((uint32_t)data->data_fields.data5 << CAN_TDHxR_DATA5_Pos)
+                 | ((uint32_t)data->data_fields.data6 << CAN_TDHxR_DATA6_Pos)
+                 | ((uint32_t)data->data_fields.data7 << CAN_TDHxR_DATA7_Pos);
+}
+
+void can_frame_unpack(const __in  can_packed_frame_t *frame,
+                            __out can_header_t       *header,
+                            __out can_data_t         *data)
+{
+    header->IDE = (frame->id & CAN_RIxR_IDE_Msk) >> CAN_RIxR_IDE_Pos;
+    if (header->IDE == CAN_ID_STD) {
+        header->id.std = (uint16_t)((frame->id & CAN_RIxR_STID_Msk) >> CAN_RIxR_STID_Pos);
+    } else {
+        header->id.ext = (frame->id & CAN_PACKED_EXID_Msk) >> CAN_PACKED_EXID_Pos;
+    }
+    header->RTR = (frame->id & CAN_RIxR_RTR_Msk) >> CAN_RIxR_RTR_Pos;
+    header->DLC = (uint8_t)((frame->dlct & CAN_RDTxR_DLC_Msk) >> CAN_RDTxR_DLC_Pos);
+    header->FMI = (uint8_t)((frame->dlct & CAN_RDTxR_FMI_Msk) >> CAN_RDTxR_FMI_Pos);
+    header->TGT = false;
+    header->gt  = (uint16_t)((frame->dlct & CAN_RDTxR_TIME_Msk) >> CAN_RDTxR_TIME_Pos);
+
+    data->data_fields.data0 = (uint8_t)(frame->datal >> CAN_RDLxR_DATA0_Pos);
+    data->data_fields.data1 = (uint8_t)(frame->datal >> CAN_RDLxR_DATA1_Pos);
+    data->data_fields.data2 = (uint8_t)(frame->datal >> CAN_RDLxR_DATA2_Pos);
+    data->data_fields.data3 = (uint8_t)(frame->datal >> CAN_RDLxR_DATA3_Pos);
+    data->data_fields.data4 = (uint8_t)(frame->datah >> CAN_RDHxR_DATA4_Pos);
+    data->data_fields.data5 = (uint8_t)(frame->datah >> CAN_RDHxR_DATA5_Pos);
+    data->data_fields.data6 = (uint8_t)(frame->datah >> CAN_RDHxR_DATA6_Pos);
+    data->data_fields.data7 = (uint8_t)(frame->datah >> CAN_RDHxR_DATA7_Pos);
+}
+
+/* return the first empty mailbox of the given (non-null) TSR:TME field */
+static inline can_mbox_t can_tme_first(uint32_t tme)
+{
+    if (tme & 0x1) {
+        return CAN_MBOX_0;
+    } else if (tme & 0x2) {
+        return CAN_MBOX_1;
+    }
+    return CAN_MBOX_2;
+}
+
+/*
+ * Fill the given (empty) Tx mailbox with the frame and request its
+ * transmission. The identifier register is written last, as it holds the
+ * transmission request bit.
+ */
+static inline void can_mbox_write(const can_context_t      *ctx,
+                                  can_mbox_t                mbox,
+                                  const can_packed_frame_t *frame)
+{
+    volatile can_mbox_regs_t *regs = r_CANx_TxMBOX(ctx->id, mbox);
+
+    regs->DTxR = frame->dlct & (CAN_TDTxR_DLC_Msk | CAN_TDTxR_TGT_Msk);
+    regs->DLxR = frame->datal;
+    regs->DHxR = frame->datah;
+    regs->IxR  = frame->id | CAN_TIxR_TXRQ_Msk;
+    can_stats_inc(ctx, tx_requests[mbox]);
+#if CONFIG_USR_DRV_CAN_TX_DEADLINE
+    /* set back by can_xmit_deadline() if the frame has one. An expiry of
+     * the previous frame not reported yet is not the one of this frame */
+    ((can_context_t*)ctx)->tx_deadline[mbox] = 0;
+    ((can_context_t*)ctx)->tx_expiring[mbox] = false;
+#endif
+}
+
+/* Read back the frame of a Tx mailbox, which is kept by an abort or
+ * a transmission */
+static inline void can_mbox_read(const can_context_t *ctx,
+                                 can_mbox_t           mbox,
+                                 can_packed_frame_t  *frame)
+{
+    volatile can_mbox_regs_t *regs = r_CANx_TxMBOX(ctx->id, mbox);
+
+    frame->id    = regs->IxR & ~CAN_TIxR_TXRQ_Msk;
+    frame->dlct  = regs->DTxR;
+    frame->datal = regs->DLxR;
+    frame->datah = regs->DHxR;
+}
+
+/*
+ * Read the output mailbox of the given Rx FIFO, then release it. The FIFO
+ * must not be empty. FULLx and FOVRx are rc_w1 bits, a plain write of
+ * RFOMx leaves them untouched for the overrun detection.
+ */
+static inline void can_fifo_read(const can_context_t *ctx,
+                                 can_fifo_t           fifo,
+                                 volatile uint32_t   *can_rfxr,
+                                 can_packed_frame_t  *frame)
+{
+    volatile can_mbox_regs_t *regs = r_CANx_RxMBOX(ctx->id, fifo);
+
+    frame->id    = regs->IxR;
+    frame->dlct  = regs->DTxR;
+    frame->datal = regs->DLxR;
+    frame->datah = regs->DHxR;
+    write_reg_value(can_rfxr, CAN_RFxR_RFOMx_Msk);
+    can_stats_inc(ctx, rx_frames[fifo]);
+}
+
+/* reenable the interrupts of the given Rx FIFO, once a frame is read */
+static inline void can_fifo_irq_restore(const can_context_t *ctx,
+                                        can_fifo_t           fifo)
+{
+    if (fifo == CAN_FIFO_0) {
+       set_reg_bits(r_CANx_IER(ctx->id), CAN_IER_FMPIE0_Msk
+                                       | CAN_IER_FFIE0_Msk
+                                       | CAN_IER_FOVIE0_Msk);
+    } else {
+       set_reg_bits(r_CANx_IER(ctx->id), CAN_IER_FMPIE1_Msk
+                                       | CAN_IER_FFIE1_Msk
+                                       | CAN_IER_FOVIE1_Msk);
+    }
+}
+
+/*
+ * Count the FIFO full and overrun events of the given RFxR value, and
+ * acknowledge them. A FOVRx bit left set would raise the Rx interrupt again
+ * as soon as FOVIEx is reenabled.
+ */
+static inline void can_fifo_ack(const can_context_t *ctx,
+                                can_fifo_t           fifo,
+                                uint32_t             rfr)
+{
+    uint32_t flags = rfr & (CAN_RFxR_FULLx_Msk | CAN_RFxR_FOVRx_Msk);
+
+    can_stats_inc(ctx, rx_level[fifo][(rfr & CAN_RFxR_FMPx_Msk) >> CAN_RFxR_FMPx_Pos]);
+    if (flags == 0) {
+        return;
+    }
+    if ((flags & CAN_RFxR_FULLx_Msk) != 0) {
+        can_stats_inc(ctx, rx_full[fifo]);
+    }
+    if ((flags & CAN_RFxR_FOVRx_Msk) != 0) {
+        can_stats_inc(ctx, rx_overruns[fifo]);
+    }
+    write_reg_value((fifo == CAN_FIFO_0) ? r_CANx_RF0R(ctx->id)
+                                         : r_CANx_RF1R(ctx->id), flags);
+}
+
+#if CONFIG_USR_DRV_CAN_CAPTURE
+/*******************************************************************************
+ *          CAPTURE RING
+ *
+ * The ring is only written by the ISR, for both ports, and read by the user
+ * task, which never holds the writer back: a record is published by the head
+ * increment, and the reader drops the records overwritten while it copied
+ * them. A record costs four word copies, the clock being read once per
+ * interrupt.
+ ******************************************************************************/
+# if (CONFIG_USR_DRV_CAN_CAPTURE_DEPTH & (CONFIG_USR_DRV_CAN_CAPTURE_DEPTH - 1)) != 0
+#  error "CONFIG_USR_DRV_CAN_CAPTURE_DEPTH must be a power of two"
+# endif
+# define CAN_CAPTURE_MASK (CONFIG_USR_DRV_CAN_CAPTURE_DEPTH - 1)
+
+static struct {
+    can_capture_record_t slots[CONFIG_USR_DRV_CAN_CAPTURE_DEPTH];
+    volatile uint32_t    head;  /* records written, by the ISR */
+    uint32_t             tail;  /* records read, by the user task */
+    uint64_t             now;   /* clock of the current interrupt, 0 until
+                                   the first record */
+} can_capture;
+
+__attribute__((weak)) uint64_t can_capture_clock(void)
+{
+    uint64_t us = 0;
+
+    sys_get_systick(&us, PREC_MICRO);
+    return us;
+}
+
+/* ISR side: record a frame read from a Rx FIFO, or sent by a Tx mailbox */
+static inline void can_capture_frame(const can_context_t      *ctx,
+                                     const can_packed_frame_t *frame,
+                                     uint8_t                   flags,
+                                     uint8_t                   index)
+{
+    uint32_t head = can_capture.head;
+    can_capture_record_t *rec = &can_capture.slots[head & CAN_CAPTURE_MASK];
+
+    if (can_capture.now == 0) {
+        can_capture.now = can_capture_clock();
+    }
+    rec->stamp = can_capture.now;
+    rec->id    = frame->id & ~CAN_TIxR_TXRQ_Msk;
+    rec->dlc   = (uint8_t)((frame->dlct & CAN_RDTxR_DLC_Msk) >> CAN_RDTxR_DLC_Pos);
+    rec->port  = ctx->id;
+    rec->flags = flags;
+    rec->index = index;
+    rec->datal = frame->datal;
+    rec->datah = frame->datah;
+    can_barrier();
+    can_capture.head = head + 1;
+}
+
+/* ISR side: record a frame read from a Rx FIFO */
+static inline void can_capture_rx(const can_context_t      *ctx,
+                                  can_fifo_t                fifo,
+                                  const can_packed_frame_t *frame,
+                                  uint8_t                   flags)
+{
+    if (ctx->capture) {
+        can_capture_frame(ctx, frame,
+                          ((fifo == CAN_FIFO_1) ? CAN_CAPTURE_FIFO1 : 0) | flags,
+                          (uint8_t)((frame->dlct & CAN_RDTxR_FMI_Msk) >> CAN_RDTxR_FMI_Pos));
+    }
+}
+
+/* ISR side: record the frames sent, before the mailboxes are refilled */
+static void can_tx_capture(const can_context_t *ctx, uint32_t tsr)
+{
+    can_packed_frame_t frame;
+
+    for (uint8_t mbox = CAN_MBOX_0; mbox <= CAN_MBOX_2; ++mbox) {
+        if ((tsr & ((CAN_TSR_RQCP0_Msk | CAN_TSR_TXOK0_Msk) << (8 * mbox))) ==
+            ((CAN_TSR_RQCP0_Msk | CAN_TSR_TXOK0_Msk) << (8 * mbox))) {
+            can_mbox_read(ctx, mbox, &frame);
+            can_capture_frame(ctx, &frame, CAN_CAPTURE_TX, mbox);
+        }
+    }
+}
+
+/* the clock is read again by the first record of the next interrupt */
+# define can_capture_irq_begin() (can_capture.now = 0)
+#else
+# define can_capture_irq_begin()
+# define can_capture_rx(ctx, fifo, frame, flags)
+#endif
+
+#if CONFIG_USR_DRV_CAN_SW_FILTER
+/*******************************************************************************
+ *          SOFTWARE RX FILTER
+ *
+ * When active, the hardware filter banks accept a superset of the filters
+ * list, and each received frame is checked in O(1) against the whole list
+ * before being queued or reported. Rejected frames are released directly.
+ ******************************************************************************/
+
+/* software filter extended identifiers hash set index */
+#if (CONFIG_USR_DRV_CAN_SW_FILTER_EXT_SLOTS & (CONFIG_USR_DRV_CAN_SW_FILTER_EXT_SLOTS - 1)) != 0
+# error "CONFIG_USR_DRV_CAN_SW_FILTER_EXT_SLOTS must be a power of two"
+#endif
+#define CAN_SW_FILTER_EXT_MASK (CONFIG_USR_DRV_CAN_SW_FILTER_EXT_SLOTS - 1)
+
+static inline uint32_t can_sw_filter_hash(uint32_t ext)
+{
+    uint32_t h = ext * 0x9e3779b1;
+
+    return (h ^ (h >> 16)) & CAN_SW_FILTER_EXT_MASK;
+}
+
+/* check the packed identifier word of a received frame */
+static inline bool can_sw_filter_accept(const can_context_t *ctx, uint32_t id)
+{
+    const can_sw_filter_t *swf = &ctx->sw_filter;
+    uint32_t key, h;
+
+    if (!swf->active) {
+        return true;
+    }
+    if ((id & CAN_RIxR_IDE_Msk) == 0) {
+        key = (id & CAN_RIxR_STID_Msk) >> CAN_RIxR_STID_Pos;
+        return ((swf->std_bitmap[key >> 5] >> (key & 0x1f)) & 0x1) != 0;
+    }
+    if (swf->ext_all) {
+        return true;
+    }
+    key = (id & CAN_PACKED_EXID_Msk) >> CAN_PACKED_EXID_Pos;
+    h = can_sw_filter_hash(key);
+    for (uint32_t i = 0; i < CONFIG_USR_DRV_CAN_SW_FILTER_EXT_SLOTS; ++i) {
+        if (swf->ext_set[h] == key + 1) {
+            return true;
+        }
+        if (swf->ext_set[h] == 0) {
+            break;
+        }
+        h = (h + 1) & CAN_SW_FILTER_EXT_MASK;
+    }
+    for (uint32_t i = 0; i < swf->ext_masks_num; ++i) {
+        if (((key ^ swf->ext_masks[i].id) & swf->ext_masks[i].mask) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Release the frames rejected by the software filter at the head of the
+ * given Rx FIFO. Returns true if an accepted frame is pending in the FIFO.
+ */
+static bool can_sw_filter_flush(const can_context_t *ctx, can_fifo_t fifo)
+{
+    volatile uint32_t *can_rfxr;
+    volatile can_mbox_regs_t *regs = r_CANx_RxMBOX(ctx->id, fifo);
+
+    can_rfxr = (fifo == CAN_FIFO_0) ? r_CANx_RF0R(ctx->id) : r_CANx_RF1R(ctx->id);
+    while ((*can_rfxr & CAN_RFxR_FMPx_Msk) != 0U) {
+        if (can_sw_filter_accept(ctx, regs->IxR)) {
+            return true;
+        }
+        write_reg_value(can_rfxr, CAN_RFxR_RFOMx_Msk);
+        can_stats_inc(ctx, rx_frames[fifo]);
+        can_stats_inc(ctx, rx_rejected[fifo]);
+    }
+    return false;
+}
+#endif
+
+#if CONFIG_USR_DRV_CAN_RX_RING
+/*******************************************************************************
+ *          RX RING
+ *
+ * In buffered mode, the ISR copies each pending mailbox of the Rx FIFO into
+ * the context ring and releases it immediately, so that the three hardware
+ * mailboxes are freed as soon as possible. The user task then decodes the
+ * frames from the ring, without accessing the device.
+ ******************************************************************************/
+
+/*
+ * ISR side: move every pending mailbox of the given FIFO into the ring.
+ * Returns false if the ring became full before the hardware FIFO was empty.
+ * In that case the remaining frames are kept in the hardware FIFO and the
+ * ring is marked as stalled, so that the user task reenables the FIFO
+ * interrupts once it has made room.
+ */
+static bool can_rx_ring_fill(can_context_t *ctx, can_fifo_t fifo)
+{
+    can_rx_ring_t *ring = &ctx->rx_ring[fifo];
+    volatile uint32_t *can_rfxr;
+    uint32_t head = ring->head;
+
+    can_rfxr = (fifo == CAN_FIFO_0) ? r_CANx_RF0R(ctx->id) : r_CANx_RF1R(ctx->id);
+
+    while ((*can_rfxr & CAN_RFxR_FMPx_Msk) != 0U) {
+        if ((head - ring->tail) >= CONFIG_USR_DRV_CAN_RX_RING_DEPTH) {
+            ring->stalled = true;
+            can_stats_inc(ctx, rx_ring_full[fifo]);
+            return false;
+        }
+        can_fifo_read(ctx, fifo, can_rfxr, &ring->slots[head & CAN_RX_RING_MASK]);
+#if CONFIG_USR_DRV_CAN_SW_FILTER
+        if (!can_sw_filter_accept(ctx, ring->slots[head & CAN_RX_RING_MASK].id)) {
+            /* rejected, the slot is reused */
+            can_stats_inc(ctx, rx_rejected[fifo]);
+            can_capture_rx(ctx, fifo, &ring->slots[head & CAN_RX_RING_MASK],
+                           CAN_CAPTURE_REJECTED);
+            continue;
+        }
+#endif
+        can_capture_rx(ctx, fifo, &ring->slots[head & CAN_RX_RING_MASK], 0);
+        head++;
+        can_barrier();
+        ring->head = head;
+    }
+    return true;
+}
+
+/*
+ * User task side: once some room has been made in a stalled ring, reenable
+ * the FIFO interrupts masked by the posthook so that the ISR drains the
+ * frames kept in the hardware FIFO.
+ */
+static inline void can_rx_ring_release(const can_context_t *ctx,
+                                       can_fifo_t           fifo,
+                                       can_rx_ring_t       *ring)
+{
+    if (ring->stalled) {
+        ring->stalled = false;
+        if (fifo == CAN_FIFO_0) {
+           set_reg_bits(r_CANx_IER(ctx->id), CAN_IER_FMPIE0_Msk
+                                           | CAN_IER_FFIE0_Msk
+                                           | CAN_IER_FOVIE0_Msk);
+        } else {
+           set_reg_bits(r_CANx_IER(ctx->id), CAN_IER_FMPIE1_Msk
+                                           | CAN_IER_FFIE1_Msk
+                                           | CAN_IER_FOVIE1_Msk);
+        }
+    }
+}
+
+#if CONFIG_USR_DRV_CAN_RX_COALESCE
+/*
+ * Coalescing: tell whether the frames stored in the ring since the last
+ * report must be reported now, stored being the number of frames the current
+ * interrupt moved to the ring. The delay is only checked on Rx interrupts.
+ */
+static bool can_rx_coalesce_due(can_context_t *ctx, can_fifo_t fifo, uint32_t stored)
+{
+    can_rx_ring_t *ring = &ctx->rx_ring[fifo];
+    uint64_t now = 0;
+
+    if (ctx->rx_coalesce_frames == 0 && ctx->rx_coalesce_us == 0) {
+        /* coalescing disabled */
+        return true;
+    }
+    if (ctx->rx_coalesce_us != 0) {
+        sys_get_systick(&now, PREC_MICRO);
+        if (ring->batch == 0) {
+            ring->first = now;
+        }
+    }
+    ring->batch += stored;
+    if (ctx->rx_coalesce_frames != 0 && ring->batch >= ctx->rx_coalesce_frames) {
+        return true;
+    }
+    return ctx->rx_coalesce_us != 0 && (now - ring->first) >= ctx->rx_coalesce_us;
+}
+#endif
+
+/*
+ * Handle a Rx interrupt in buffered mode. Overrun is still reported as an
+ * error, then all pending frames are moved to the ring.
+ */
+static void can_rx_ring_isr(can_context_t *ctx, can_fifo_t fifo, uint32_t rfr)
+{
+    can_error_t err = CAN_ERROR_NONE;
+    uint32_t ier_msk;
+#if CONFIG_USR_DRV_CAN_RX_COALESCE
+    /* FIFO full, overrun and ring full conditions bypass the coalescing */
+    bool urgent = (rfr & (CAN_RFxR_FULLx_Msk | CAN_RFxR_FOVRx_Msk)) != 0;
+    uint32_t head = ctx->rx_ring[fifo].head;
+#endif
+
+    if ((rfr & CAN_RFxR_FOVRx_Msk) != 0) {
+        err |= (fifo == CAN_FIFO_0) ? CAN_ERROR_RX_FIFO0_OVERRRUN
+                                    : CAN_ERROR_RX_FIFO1_OVERRRUN;
+        can_event(CAN_EVENT_ERROR, ctx->id, err);
+        err = CAN_ERROR_NONE;
+    }
+    if (can_rx_ring_fill(ctx, fifo)) {
+        /* hardware FIFO emptied, reallow all Rx FIFO interrupts */
+        ier_msk = (fifo == CAN_FIFO_0) ?
+            (CAN_IER_FMPIE0_Msk | CAN_IER_FFIE0_Msk | CAN_IER_FOVIE0_Msk) :
+            (CAN_IER_FMPIE1_Msk | CAN_IER_FFIE1_Msk | CAN_IER_FOVIE1_Msk);
+    } else {
+        /* ring full, we still allow IRQ to detect overrun */
+        ier_msk = (fifo == CAN_FIFO_0) ? CAN_IER_FOVIE0_Msk : CAN_IER_FOVIE1_Msk;
+#if CONFIG_USR_DRV_CAN_RX_COALESCE
+        urgent = true;
+#endif
+    }
+    set_reg_bits(r_CANx_IER(ctx->id), ier_msk);
+
+#if CONFIG_USR_DRV_CAN_RX_COALESCE
+    if (!can_rx_coalesce_due(ctx, fifo, ctx->rx_ring[fifo].head - head) && !urgent) {
+        return;
+    }
+    ctx->rx_ring[fifo].batch = 0;
+#endif
+    if (ctx->rx_ring[fifo].head != ctx->rx_ring[fifo].tail) {
+        can_profile_rx_pending(ctx->id, fifo);
+        can_event((fifo == CAN_FIFO_0) ? CAN_EVENT_RX_FIFO0_MSG_PENDING
+                                       : CAN_EVENT_RX_FIFO1_MSG_PENDING,
+                  ctx->id, err);
+    }
+}
+#endif
+
+#if CONFIG_USR_DRV_CAN_RX_DIRECT
+/*******************************************************************************
+ *          RX DIRECT DELIVERY
+ *
+ * In direct mode, the ISR reads each pending mailbox of the Rx FIFO, releases
+ * it and hands the frame to the application, from the ISR context. The FIFO
+ * interrupts, masked by the posthook, are reenabled as soon as the FIFO is
+ * empty: the user task neither reads the device nor reenables them.
+ ******************************************************************************/
+static void can_rx_direct_isr(can_context_t *ctx, can_fifo_t fifo, uint32_t rfr)
+{
+    volatile uint32_t *can_rfxr;
+    can_packed_frame_t frame;
+
+    if ((rfr & CAN_RFxR_FOVRx_Msk) != 0) {
+        can_event(CAN_EVENT_ERROR, ctx->id,
+                  (fifo == CAN_FIFO_0) ? CAN_ERROR_RX_FIFO0_OVERRRUN
+                                       : CAN_ERROR_RX_FIFO1_OVERRRUN);
+    }
+    can_rfxr = (fifo == CAN_FIFO_0) ? r_CANx_RF0R(ctx->id) : r_CANx_RF1R(ctx->id);
+    while ((*can_rfxr & CAN_RFxR_FMPx_Msk) != 0U) {
+        can_fifo_read(ctx, fifo, can_rfxr, &frame);
+#if CONFIG_USR_DRV_CAN_SW_FILTER
+        if (!can_sw_filter_accept(ctx, frame.id)) {
+            can_stats_inc(ctx, rx_rejected[fifo]);
+            can_capture_rx(ctx, fifo, &frame, CAN_CAPTURE_REJECTED);
+            continue;
+        }
+#endif
+        can_capture_rx(ctx, fifo, &frame, 0);
+        can_rx_frame(ctx->id, fifo, &frame);
+    }
+    set_reg_bits(r_CANx_IER(ctx->id),
+                 (fifo == CAN_FIFO_0) ?
+                 (CAN_IER_FMPIE0_Msk | CAN_IER_FFIE0_Msk | CAN_IER_FOVIE0_Msk) :
+                 (CAN_IER_FMPIE1_Msk | CAN_IER_FFIE1_Msk | CAN_IER_FOVIE1_Msk));
+}
+#endif
+
+#if CONFIG_USR_DRV_CAN_TX_QUEUE
+/*******************************************************************************
+ *          TX QUEUE
+ *
+ * In queued mode, can_xmit() inserts the frames in a queue sorted by
+ * arbitration priority, and each Tx interrupt (mailbox freed) moves the most
+ * prioritary frames of the queue to the empty mailboxes.
+ ******************************************************************************/
+
+/*
+ * Arbitration key of a packed frame: the identifier aligned on 29 bits,
+ * followed by the IDE bit, as a standard frame wins against an extended frame
+ * with the same base identifier. In the packed identifier word, this is
+ * simply STID:EXID:IDE. The lowest key wins the arbitration.
+ */
+static inline uint32_t can_tx_key(const can_packed_frame_t *frame)
+{
+    return frame->id >> CAN_TIxR_IDE_Pos;
+}
+
+/*
+ * Insert a frame in the queue, keeping it sorted. The queue must not be full.
+ * A new frame is put after the queued frames with the same key, so that they
+ * are sent in chronological order, and a frame put back in the queue before
+ * them.
+ */
+static void can_tx_queue_insert(can_tx_queue_t           *queue,
+                                const can_packed_frame_t *frame,
+                                bool                      requeued)
+{
+    uint32_t key = can_tx_key(frame);
+    uint32_t i = queue->count;
+
+    /* move up the frames to send first */
+    while (i > 0 && (can_tx_key(&queue->slots[i - 1]) < key ||
+                     (!requeued && can_tx_key(&queue->slots[i - 1]) == key))) {
+        queue->slots[i] = queue->slots[i - 1];
+        i--;
+    }
+    queue->slots[i] = *frame;
+    queue->count++;
+}
+
+#if CONFIG_USR_DRV_CAN_TX_PREEMPT
+/*
+ * Preemption state of a Tx mailbox. A single preemption is in progress at a
+ * time: the refill requests the abort of the least prioritary mailbox, the
+ * ISR tells whether the abort was done or the frame sent in the meantime,
+ * then the next refill puts the aborted frame back in the queue.
+ */
+#define CAN_TX_PREEMPT_NONE      0
+#define CAN_TX_PREEMPT_REQUESTED 1  /* ABRQx set by the refill */
+#define CAN_TX_PREEMPT_ABORTED   2  /* frame to put back in the queue */
+
+/*
+ * All mailboxes being pending, abort the least prioritary one if the next
+ * queued frame wins against it.
+ */
+static void can_tx_preempt(can_context_t *ctx)
+{
+    can_tx_queue_t *queue = &ctx->tx_queue;
+    uint32_t key, lowest_key = 0;
+    uint8_t lowest = CAN_MBOX_0;
+
+    for (uint8_t mbox = CAN_MBOX_0; mbox <= CAN_MBOX_2; ++mbox) {
+        if (queue->preempt[mbox] != CAN_TX_PREEMPT_NONE) {
+            /* already in progress */
+            return;
+        }
+        key = r_CANx_TxMBOX(ctx->id, mbox)->IxR >> CAN_TIxR_IDE_Pos;
+        if (key >= lowest_key) {
+            lowest_key = key;
+            lowest = mbox;
+        }
+    }
+    if (can_tx_key(&queue->slots[queue->count - 1]) >= lowest_key) {
+        return;
+    }
+    queue->preempt[lowest] = CAN_TX_PREEMPT_REQUESTED;
+    can_stats_inc(ctx, tx_preempted[lowest]);
+    can_barrier();
+    /* RQCPx, TXOKx, ALSTx and TERRx are rc_w1: written as 0 here, they are
+     * left to the posthook */
+    write_reg_value(r_CANx_TSR(ctx->id), CAN_TSR_ABRQ0_Msk << (8 * lowest));
+}
+#endif
+
+/*
+ * Move as many frames as possible from the queue to the empty mailboxes.
+ * Called by the ISR, or by the user task while holding the queue lock.
+ */
+static void can_tx_queue_refill(can_context_t *ctx)
+{
+    can_tx_queue_t *queue = &ctx->tx_queue;
+    uint32_t tme;
+    can_mbox_t mbox;
+#if CONFIG_USR_DRV_CAN_TX_PREEMPT
+    can_packed_frame_t displaced;
+    bool requeue = false;
+
+    for (mbox = CAN_MBOX_0; mbox <= CAN_MBOX_2; ++mbox) {
+        if (queue->preempt[mbox] == CAN_TX_PREEMPT_ABORTED) {
+            /* read back before the mailbox is refilled */
+            can_mbox_read(ctx, mbox, &displaced);
+            queue->preempt[mbox] = CAN_TX_PREEMPT_NONE;
+            requeue = true;
+        }
+    }
+#endif
+
+    tme = get_reg_value(r_CANx_TSR(ctx->id), CAN_TSR_TME_Msk, CAN_TSR_TME_Pos);
+#if CONFIG_USR_DRV_CAN_TX_PREEMPT
+    /* an aborted mailbox is empty at once, but left alone until the ISR has
+     * told whether its frame was sent or is to be read back */
+    for (mbox = CAN_MBOX_0; mbox <= CAN_MBOX_2; ++mbox) {
+        if (queue->preempt[mbox] != CAN_TX_PREEMPT_NONE) {
+            tme &= ~(0x1UL << mbox);
+        }
+    }
+#endif
+    while (tme != 0 && queue->count > 0) {
+        mbox = can_tme_first(tme);
+        can_mbox_write(ctx, mbox, &queue->slots[queue->count - 1]);
+        queue->count--;
+        tme &= ~(0x1UL << mbox);
+    }
+#if CONFIG_USR_DRV_CAN_TX_PREEMPT
+    if (requeue) {
+        /* the mailbox it leaves has been refilled from the queue, if not
+         * empty, so there is room for it */
+        can_tx_queue_insert(queue, &displaced, true);
+    }
+    if (ctx->txpreempt && tme == 0 && queue->count > 0) {
+        can_tx_preempt(ctx);
+    }
+#endif
+}
+
+/*
+ * ISR side: refill the mailboxes, or defer to the user task if locked.
+ * Returns the RQCPx bits of the mailboxes aborted by a preemption, which are
+ * not reported to the application.
+ */
+static uint32_t can_tx_queue_isr(can_context_t *ctx, uint32_t tsr)
+{
+    uint32_t displaced = 0;
+
+#if CONFIG_USR_DRV_CAN_TX_PREEMPT
+    for (uint8_t mbox = CAN_MBOX_0; mbox <= CAN_MBOX_2; ++mbox) {
+        if ((tsr & (CAN_TSR_RQCP0_Msk << (8 * mbox))) == 0 ||
+            ctx->tx_queue.preempt[mbox] != CAN_TX_PREEMPT_REQUESTED) {
+            continue;
+        }
+        if ((tsr & (CAN_TSR_TXOK0_Msk << (8 * mbox))) != 0) {
+            /* sent before the abort request */
+            ctx->tx_queue.preempt[mbox] = CAN_TX_PREEMPT_NONE;
+        } else {
+            ctx->tx_queue.preempt[mbox] = CAN_TX_PREEMPT_ABORTED;
+            displaced |= CAN_TSR_RQCP0_Msk << (8 * mbox);
+        }
+    }
+#else
+    (void)tsr;
+#endif
+    if (ctx->tx_queue.locked) {
+        ctx->tx_queue.pending = true;
+        return displaced;
+    }
+    can_tx_queue_refill(ctx);
+    return displaced;
+}
+
+/*
+ * User task side: insert a frame in the queue, keeping it sorted, then
+ * refill the empty mailboxes. Frames with the same key are kept in
+ * chronological order. *mbox is set to CAN_MBOX_QUEUED, as the mailbox is
+ * only selected at refill time.
+ */
+static mbed_error_t can_tx_queue_push(const can_context_t      *ctx,
+                                      const can_packed_frame_t *frame,
+                                      can_mbox_t               *mbox)
+{
+    /* the context is owned by the user task, only the queue is updated */
+    can_context_t *wctx = (can_context_t*)ctx;
+    can_tx_queue_t *queue = &wctx->tx_queue;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    queue->locked = true;
+    can_barrier();
+    if (queue->count == CONFIG_USR_DRV_CAN_TX_QUEUE_DEPTH) {
+        errcode = MBED_ERROR_BUSY;
+    } else {
+        can_tx_queue_insert(queue, frame, false);
+        *mbox = CAN_MBOX_QUEUED;
+    }
+    /* even with a full queue: the mailboxes may have been left empty by a
+     * Tx interrupt that could not refill them */
+    can_tx_queue_refill(wctx);
+    can_barrier();
+    queue->locked = false;
+    can_barrier();
+    while (queue->pending) {
+        /* a Tx interrupt occured while locked, possibly again during the
+         * previous refill: its RQCPx are already cleared by the posthook,
+         * nothing else would replay it */
+        queue->pending = false;
+        queue->locked = true;
+        can_barrier();
+        can_tx_queue_refill(wctx);
+        can_barrier();
+        queue->locked = false;
+        can_barrier();
+    }
+    return errcode;
+}
+#endif
+
+#if CONFIG_USR_DRV_CAN_TX_DEADLINE
+/*******************************************************************************
+ *          TX DEADLINES
+ *
+ * Each Tx mailbox may hold a frame with an expiry time. Expired frames still
+ * pending are aborted with ABRQx, which is immediate if the frame is not
+ * being transmitted, and reported by the Tx ISR as expired.
+ ******************************************************************************/
+
+/*
+ * Empty mailboxes that can be written. In interrupt mode, a mailbox aborted
+ * on expiry is left alone until the ISR has reported it, as a new request
+ * would clear its RQCPx first.
+ */
+static inline uint32_t can_tx_deadline_free(const can_context_t *ctx, uint32_t tme)
+{
+    if (ctx->access == CAN_ACCESS_IT) {
+        for (uint8_t mbox = CAN_MBOX_0; mbox <= CAN_MBOX_2; ++mbox) {
+            if (ctx->tx_expiring[mbox]) {
+                tme &= ~(0x1UL << mbox);
+            }
+        }
+    }
+    return tme;
+}
+
+/*
+ * User task side: request the abort of the pending mailboxes whose deadline
+ * has passed. Returns the mailboxes empty flags (TSR:TME) once the aborts of
+ * the pending, but not transmitting, mailboxes are done.
+ */
+static uint32_t can_tx_deadline_check(const can_context_t *ctx)
+{
+    /* the context is owned by the user task, only the deadlines are updated */
+    can_context_t *wctx = (can_context_t*)ctx;
+    uint32_t tme;
+    uint32_t abrq = 0;
+    uint64_t now = 0;
+
+    tme = get_reg_value(r_CANx_TSR(ctx->id), CAN_TSR_TME_Msk, CAN_TSR_TME_Pos);
+    for (uint8_t mbox = CAN_MBOX_0; mbox <= CAN_MBOX_2; ++mbox) {
+        if ((tme & (0x1UL << mbox)) != 0 || wctx->tx_deadline[mbox] == 0) {
+            /* empty, or without deadline */
+            continue;
+        }
+        if (now == 0) {
+            sys_get_systick(&now, PREC_MICRO);
+        }
+        if (now < wctx->tx_deadline[mbox]) {
+            continue;
+        }
+        wctx->tx_deadline[mbox] = 0;
+        wctx->tx_expiring[mbox] = true;
+        abrq |= CAN_TSR_ABRQ0_Msk << (8 * mbox);
+    }
+    if (abrq != 0) {
+        can_barrier();
+        /* RQCPx, TXOKx, ALSTx and TERRx are rc_w1: written as 0 here, they
+         * are left to the posthook */
+        write_reg_value(r_CANx_TSR(ctx->id), abrq);
+        tme = get_reg_value(r_CANx_TSR(ctx->id), CAN_TSR_TME_Msk, CAN_TSR_TME_Pos);
+    }
+    return can_tx_deadline_free(ctx, tme);
+}
+
+/*
+ * ISR side: tell whether the completed mailbox was aborted on expiry. A frame
+ * sent before the abort request took effect is not an expired one.
+ */
+static inline bool can_tx_expired(can_context_t *ctx, can_mbox_t mbox, uint32_t tsr)
+{
+    bool expired = ctx->tx_expiring[mbox] &&
+                   (tsr & (CAN_TSR_TXOK0_Msk << (8 * mbox))) == 0;
+
+    ctx->tx_expiring[mbox] = false;
+    if (expired) {
+        can_stats_inc(ctx, tx_expired[mbox]);
+    }
+    return expired;
+}
+#else
+# define can_tx_expired(ctx, mbox, tsr) false
+#endif
+
+#if CONFIG_USR_DRV_CAN_TIMESTAMP
+/*******************************************************************************
+ *          TIME STAMPS
+ *
+ * In time triggered mode, the controller captures a 16 bits counter,
+ * incremented each bit time, at the start of each received or sent frame. It
+ * wraps every 65536 bit times (65 ms at 1 Mbit/s), and is extended here to a
+ * 64 bits count, the number of wraps being deduced from the system tick.
+ ******************************************************************************/
+
+/*
+ * The estimate of the counter is the time elapsed since can_start(), in bit
+ * times, plus the counter phase, which is taken from the first stamp. The
+ * extended stamp is the nearest value to this estimate having the given low
+ * 16 bits: a stamp must then be extended less than 32768 bit times after its
+ * capture. The estimate does not depend on any previous stamp, so that both
+ * the ISR and the user task can extend stamps, in any order.
+ */
+static uint64_t can_time_extend(const can_context_t *ctx, uint16_t stamp)
+{
+    /* the context is owned by the user task, only the phase is updated */
+    can_context_t *wctx = (can_context_t*)ctx;
+    uint64_t now = 0;
+    uint64_t elapsed, estimate;
+    int32_t delta;
+
+    sys_get_systick(&now, PREC_MICRO);
+    /* bit times since the start, seconds and microseconds apart so that the
+     * product does not overflow after a few months */
+    elapsed = now - ctx->ts_start;
+    estimate = (elapsed / 1000000) * ctx->bit_timing.bitrate +
+               (elapsed % 1000000) * ctx->bit_timing.bitrate / 1000000;
+    if (!ctx->ts_synced) {
+        wctx->ts_phase = (uint16_t)(stamp - (uint16_t)estimate);
+        can_barrier();
+        wctx->ts_synced = true;
+    }
+    estimate += ctx->ts_phase;
+    delta = (int16_t)(stamp - (uint16_t)estimate);
+    if (delta < 0 && estimate < (uint64_t)(-delta)) {
+        /* before the origin: keep it positive */
+        delta += 0x10000;
+    }
+    return estimate + delta;
+}
+
+/* ISR side: save the stamps of the sent frames, before the mailboxes are
+ * refilled */
+static void can_tx_stamp(can_context_t *ctx, uint32_t tsr)
+{
+    for (uint8_t mbox = CAN_MBOX_0; mbox <= CAN_MBOX_2; ++mbox) {
+        if ((tsr & ((CAN_TSR_RQCP0_Msk | CAN_TSR_TXOK0_Msk) << (8 * mbox))) ==
+            ((CAN_TSR_RQCP0_Msk | CAN_TSR_TXOK0_Msk) << (8 * mbox))) {
+            ctx->tx_time[mbox] = can_time_extend(ctx,
+                (uint16_t)(r_CANx_TxMBOX(ctx->id, mbox)->DTxR >> CAN_TDTxR_TIME_Pos));
+        }
+    }
+}
+#endif
+
+/* extend the time stamp of a received frame header, if any */
+static inline void can_header_stamp(const can_context_t *ctx,
+                                    can_header_t        *header)
+{
+#if CONFIG_USR_DRV_CAN_TIMESTAMP
+    header->timestamp = ctx->timetrigger ? can_time_extend(ctx, header->gt) : 0;
+#else
+    (void)ctx;
+    (void)header;
+#endif
+}
 
 /*******************************************************************************
  *          IRQ HANDLER
@@ -26,16 +1052,19 @@ static void can_IRQHandler(uint8_t irq,
 {
     uint32_t msr = 0, esr = 0; /* status and control */
     uint32_t tsr = 0, rfr = 0; /* tx/rx */
+    bool expired;
 
     uint32_t err = CAN_ERROR_NONE;
 
     can_port_t canid;
+    can_context_t *ctx;
     /* IRQ numbers, seen from the core, start at 0x10 (after exceptions) */
     uint32_t interrupt = irq + 0x10;
+    can_profile_begin(t0);
+    can_capture_irq_begin();
 
     /* get back CAN state (depending on current IRQ) */
     msr = status;
-    nb_CAN_IRQ_Handler = nb_CAN_IRQ_Handler + 1;
     switch (interrupt) {
         case CAN1_TX_IRQ:
             tsr = data;
@@ -73,6 +1102,11 @@ static void can_IRQHandler(uint8_t irq,
             goto err;
             break;
     }
+    /* the context is registered before any interrupt is enabled */
+    ctx = can_get_context(canid);
+    if (ctx == NULL) {
+        goto err;
+    }
 
     /* now handling current interrupt */
     switch(interrupt) {
@@ -80,55 +1114,91 @@ static void can_IRQHandler(uint8_t irq,
               /********** handling transmit case ***************/
       case CAN1_TX_IRQ:
       case CAN2_TX_IRQ:
+        can_stats_inc(ctx, irq_tx);
+#if CONFIG_USR_DRV_CAN_TIMESTAMP
+        if (ctx->timetrigger) {
+            can_tx_stamp(ctx, tsr);
+        }
+#endif
+#if CONFIG_USR_DRV_CAN_CAPTURE
+        if (ctx->capture) {
+            can_tx_capture(ctx, tsr);
+        }
+#endif
+#if CONFIG_USR_DRV_CAN_TX_QUEUE
+        if (ctx->txqueued) {
+            /* mailboxes freed by this interrupt are refilled first, to keep
+             * the bus busy, then the events are reported */
+            tsr &= ~can_tx_queue_isr(ctx, tsr);
+        }
+#endif
         /* Tx Mbox 0 */
         if ((tsr & CAN_TSR_RQCP0_Msk) != 0) {
             /* Transmit (or abort) performed on Mbox0, cleared by PH */
+            expired = can_tx_expired(ctx, CAN_MBOX_0, tsr);
             if ((tsr & CAN_TSR_TXOK0_Msk) != 0) {
                 /* Transfer complete */
+                can_stats_inc(ctx, tx_frames[CAN_MBOX_0]);
                 can_event(CAN_EVENT_TX_MBOX0_COMPLETE, canid, err);
             } else {
                 /* Transfer aborted, get error */
+                can_stats_inc(ctx, tx_aborts[CAN_MBOX_0]);
                 if ((tsr & CAN_TSR_ALST0_Msk) != 0) {
                     err |= CAN_ERROR_TX_ARBITRATION_LOST_MB0;
+                    can_stats_inc(ctx, tx_arb_lost[CAN_MBOX_0]);
                 }
                 if ((tsr & CAN_TSR_TERR0_Msk) != 0) {
                     err |= CAN_ERROR_TX_TRANSMISSION_ERR_MB0;
+                    can_stats_inc(ctx, tx_errors[CAN_MBOX_0]);
                 }
-                can_event(CAN_EVENT_TX_MBOX0_ABORT, canid, err);
+                can_event(expired ? CAN_EVENT_TX_MBOX0_EXPIRED
+                                  : CAN_EVENT_TX_MBOX0_ABORT, canid, err);
             }
         }
         /* Tx Mbox 1 */
         if ((tsr & CAN_TSR_RQCP1_Msk) != 0) {
             /* Transmit (or abort) performed on Mbox1, cleared by PH */
+            expired = can_tx_expired(ctx, CAN_MBOX_1, tsr);
             if ((tsr & CAN_TSR_TXOK1_Msk) != 0) {
                 /* Transfer complete */
+                can_stats_inc(ctx, tx_frames[CAN_MBOX_1]);
                 can_event(CAN_EVENT_TX_MBOX1_COMPLETE, canid, err);
             } else {
                 /* Transfer aborted, get error */
+                can_stats_inc(ctx, tx_aborts[CAN_MBOX_1]);
                 if ((tsr & CAN_TSR_ALST1_Msk) != 0) {
                     err |= CAN_ERROR_TX_ARBITRATION_LOST_MB1;
+                    can_stats_inc(ctx, tx_arb_lost[CAN_MBOX_1]);
                 }
                 if ((tsr & CAN_TSR_TERR1_Msk) != 0) {
                     err |= CAN_ERROR_TX_TRANSMISSION_ERR_MB1;
+                    can_stats_inc(ctx, tx_errors[CAN_MBOX_1]);
                 }
-                can_event(CAN_EVENT_TX_MBOX1_ABORT, canid, err);
+                can_event(expired ? CAN_EVENT_TX_MBOX1_EXPIRED
+                                  : CAN_EVENT_TX_MBOX1_ABORT, canid, err);
             }
         }
         /* Tx Mbox 2 */
         if ((tsr & CAN_TSR_RQCP2_Msk) != 0) {
             /* Transmit (or abort) performed on Mbox2, cleared by PH */
+            expired = can_tx_expired(ctx, CAN_MBOX_2, tsr);
             if ((tsr & CAN_TSR_TXOK2_Msk) != 0) {
                 /* Transfer complete */
+                can_stats_inc(ctx, tx_frames[CAN_MBOX_2]);
                 can_event(CAN_EVENT_TX_MBOX2_COMPLETE, canid, err);
             } else {
                 /* Transfer aborted, get error */
+                can_stats_inc(ctx, tx_aborts[CAN_MBOX_2]);
                 if ((tsr & CAN_TSR_ALST2_Msk) != 0) {
                     err |= CAN_ERROR_TX_ARBITRATION_LOST_MB2;
+                    can_stats_inc(ctx, tx_arb_lost[CAN_MBOX_2]);
                 }
                 if ((tsr & CAN_TSR_TERR2_Msk) != 0) {
                     err |= CAN_ERROR_TX_TRANSMISSION_ERR_MB2;
+                    can_stats_inc(ctx, tx_errors[CAN_MBOX_2]);
                 }
-                can_event(CAN_EVENT_TX_MBOX2_ABORT, canid, err);
+                can_event(expired ? CAN_EVENT_TX_MBOX2_EXPIRED
+                                  : CAN_EVENT_TX_MBOX2_ABORT, canid, err);
             }
         }
         break; /* Transmit case */
@@ -136,6 +1206,20 @@ static void can_IRQHandler(uint8_t irq,
               /********** handling receive case ***************/
       case CAN1_RX0_IRQ:
       case CAN2_RX0_IRQ:
+        can_stats_inc(ctx, irq_rx[CAN_FIFO_0]);
+        can_fifo_ack(ctx, CAN_FIFO_0, rfr);
+#if CONFIG_USR_DRV_CAN_RX_DIRECT
+        if (ctx->rxdirect) {
+            can_rx_direct_isr(ctx, CAN_FIFO_0, rfr);
+            break;
+        }
+#endif
+#if CONFIG_USR_DRV_CAN_RX_RING
+        if (ctx->rxbuffered) {
+            can_rx_ring_isr(ctx, CAN_FIFO_0, rfr);
+            break;
+        }
+#endif
         /* Rx FIFO0 overrun */
         if ((rfr & CAN_RFxR_FOVRx_Msk) != 0) {
           err |= CAN_ERROR_RX_FIFO0_OVERRRUN;
@@ -150,6 +1234,14 @@ static void can_IRQHandler(uint8_t irq,
         } else
         /* Rx FIFO0 msg pending */
         if ((rfr & CAN_RFxR_FMPx_Msk) != 0) {
+#if CONFIG_USR_DRV_CAN_SW_FILTER
+          if (!can_sw_filter_flush(ctx, CAN_FIFO_0)) {
+              /* only rejected frames, wait for the next one */
+              set_reg_bits(r_CANx_IER(canid), CAN_IER_FMPIE0_Msk | CAN_IER_FFIE0_Msk | CAN_IER_FOVIE0_Msk);
+              break;
+          }
+#endif
+          can_profile_rx_pending(canid, CAN_FIFO_0);
           can_event(CAN_EVENT_RX_FIFO0_MSG_PENDING, canid, err);
           /* if the FIFO0 is not full, we reallow Full and overrun */
           set_reg_bits(r_CANx_IER(canid), CAN_IER_FFIE0_Msk | CAN_IER_FOVIE0_Msk);
@@ -158,6 +1250,20 @@ static void can_IRQHandler(uint8_t irq,
 
       case CAN1_RX1_IRQ:
       case CAN2_RX1_IRQ:
+        can_stats_inc(ctx, irq_rx[CAN_FIFO_1]);
+        can_fifo_ack(ctx, CAN_FIFO_1, rfr);
+#if CONFIG_USR_DRV_CAN_RX_DIRECT
+        if (ctx->rxdirect) {
+            can_rx_direct_isr(ctx, CAN_FIFO_1, rfr);
+            break;
+        }
+#endif
+#if CONFIG_USR_DRV_CAN_RX_RING
+        if (ctx->rxbuffered) {
+            can_rx_ring_isr(ctx, CAN_FIFO_1, rfr);
+            break;
+        }
+#endif
         /* Rx FIFO1 overrun */
         if ((rfr & CAN_RFxR_FOVRx_Msk) != 0) {
           err |= CAN_ERROR_RX_FIFO1_OVERRRUN;
@@ -172,6 +1278,14 @@ static void can_IRQHandler(uint8_t irq,
         } else
         /* Rx FIFO1 msg pending */
         if ((rfr & CAN_RFxR_FMPx_Msk) != 0) {
+#if CONFIG_USR_DRV_CAN_SW_FILTER
+          if (!can_sw_filter_flush(ctx, CAN_FIFO_1)) {
+              /* only rejected frames, wait for the next one */
+              set_reg_bits(r_CANx_IER(canid), CAN_IER_FMPIE1_Msk | CAN_IER_FFIE1_Msk | CAN_IER_FOVIE1_Msk);
+              break;
+          }
+#endif
+          can_profile_rx_pending(canid, CAN_FIFO_1);
           can_event(CAN_EVENT_RX_FIFO1_MSG_PENDING, canid, err);
           /* if the FIFO1 is not full, we reallow Full and overrun */
           set_reg_bits(r_CANx_IER(canid), CAN_IER_FFIE1_Msk | CAN_IER_FOVIE1_Msk);
@@ -179,308 +1293,1237 @@ static void can_IRQHandler(uint8_t irq,
         break; /* Receive case */
 
 
-              /********** handling status change **************/
-      case CAN1_SCE_IRQ:
-      case CAN2_SCE_IRQ:
-        /* Wakeup */
-        if ((msr & CAN_MSR_WKUI_Msk) != 0) {
-            /* MSR:WKUI already acknowledge by PH */
-            can_event(CAN_EVENT_WAKUP_FROM_RX_MSG, canid, err);
-        } else
-        /* Sleep */
-        if ((msr & CAN_MSR_SLAKI_Msk) != 0) {
-            /* MSR:SLAKI already acknowledged by PH */
-            can_event(CAN_EVENT_SLEEP, canid, err);
+              /********** handling status change **************/
+      case CAN1_SCE_IRQ:
+      case CAN2_SCE_IRQ:
+        can_stats_inc(ctx, irq_sce);
+        /* Wakeup */
+        if ((msr & CAN_MSR_WKUI_Msk) != 0) {
+            /* MSR:WKUI already acknowledge by PH */
+            can_event(CAN_EVENT_WAKUP_FROM_RX_MSG, canid, err);
+        } else
+        /* Sleep */
+        if ((msr & CAN_MSR_SLAKI_Msk) != 0) {
+            /* MSR:SLAKI already acknowledged by PH */
+            can_event(CAN_EVENT_SLEEP, canid, err);
+        }
+        /* Errors */
+        if ((msr & CAN_MSR_ERRI_Msk) != 0) {
+            /* MSR:ERRI already acknowledged by PH */
+
+            /* calculating error mask. ESR has already been acknowledged by PH */
+            if ((esr & CAN_ESR_EWGF_Msk) != 0) {
+              err |= CAN_ERROR_ERR_WARNING_LIMIT;
+              can_stats_inc(ctx, err_warning);
+            }
+            if ((esr & CAN_ESR_EPVF_Msk) != 0) {
+              err |= CAN_ERROR_ERR_PASSIVE_LIMIT;
+              can_stats_inc(ctx, err_passive);
+            }
+            if ((esr & CAN_ESR_BOFF_Msk) != 0) {
+              err |= CAN_ERROR_ERR_BUS_OFF;
+              can_stats_inc(ctx, bus_off);
+            }
+
+            uint32_t lec = ((esr & CAN_ESR_LEC_Msk) >> CAN_ESR_LEC_Pos);
+            can_stats_inc(ctx, lec[lec]);
+            if (lec != 0) {
+               switch (lec) {
+                  case 0x1:
+                     err |= CAN_ERROR_ERR_LEC_STUFF;
+                     break;
+                   case 0x2:
+                     err |= CAN_ERROR_ERR_LEC_FROM;
+                     break;
+                   case 0x3:
+                     err |= CAN_ERROR_ERR_LEC_ACK;
+                     break;
+                   case 0x4:
+                      err |= CAN_ERROR_ERR_LEC_BR;
+                      break;
+                   case 0x5:
+                       err |= CAN_ERROR_ERR_LEC_BD;
+                       break;
+                  case 0x6:
+                       err |= CAN_ERROR_ERR_LEC_CRC;
+                       break;
+                  default:
+                       break;
+               }
+            }
+            if (err != CAN_ERROR_NONE) {
+                can_event(CAN_EVENT_ERROR, canid, err);
+            }
+        } /* End if Errors */
+    } /* End switch (interrupt) */
+err:
+    can_profile_end(CAN_PROBE_IRQ, t0);
+    return;
+}
+
+/*******************************************************************************
+ *           DECLARE CAN DEVICE
+ ******************************************************************************/
+mbed_error_t can_declare(__inout can_context_t *ctx)
+{
+    mbed_error_t errcode = MBED_ERROR_INVSTATE;
+    e_syscall_ret sret;
+    uint8_t td_port, td_pin, rd_port, rd_pin;
+    uint8_t tx_irq, rx0_irq, rx1_irq, sce_irq;
+
+    /* sanitize */
+    if (ctx == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+    if (ctx->access != CAN_ACCESS_POLL && ctx->access != CAN_ACCESS_IT) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+    if (ctx->id != CAN_PORT_1 && ctx->id != CAN_PORT_2) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+    /* CAN2 is a slave of CAN1: it has no filter banks of its own and the
+     * filter registers are only mapped through the CAN1 device, which must
+     * then be declared first by the same task. See RM0090, chap 32.2 */
+    if (ctx->id == CAN_PORT_2 && can_ctx_table[CAN_PORT_1 - 1] == NULL) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto end;
+    }
+
+    /* init driver part of the context */
+    memset((void*)(&ctx->can_dev), 0x0, sizeof(device_t));
+    ctx->can_dev_handle = 0;
+    ctx->state = CAN_STATE_SLEEP; /* default at reset */
+#if CONFIG_USR_DRV_CAN_RX_RING
+    memset((void*)ctx->rx_ring, 0x0, sizeof(ctx->rx_ring));
+    if (ctx->access != CAN_ACCESS_IT) {
+        /* the ring is filled by the ISR only */
+        ctx->rxbuffered = false;
+    }
+#endif
+#if CONFIG_USR_DRV_CAN_RX_DIRECT
+    if (ctx->access != CAN_ACCESS_IT) {
+        /* frames are delivered by the ISR only */
+        ctx->rxdirect = false;
+    }
+    if (ctx->rxdirect && can_rx_frame == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+#endif
+#if CONFIG_USR_DRV_CAN_TX_QUEUE
+    memset((void*)&ctx->tx_queue, 0x0, sizeof(ctx->tx_queue));
+    if (ctx->access != CAN_ACCESS_IT) {
+        /* the queue is emptied by the ISR only */
+        ctx->txqueued = false;
+    }
+#endif
+#if CONFIG_USR_DRV_CAN_TX_PREEMPT
+    if (!ctx->txqueued || ctx->txfifoprio) {
+        /* displaced frames go back to the queue, and the mailboxes must
+         * be sent by identifier priority */
+        ctx->txpreempt = false;
+    }
+#endif
+#if CONFIG_USR_DRV_CAN_CAPTURE
+    if (ctx->access != CAN_ACCESS_IT) {
+        /* frames are recorded by the ISR only */
+        ctx->capture = false;
+    }
+#endif
+#if CONFIG_USR_DRV_CAN_TX_DEADLINE
+    memset((void*)ctx->tx_deadline, 0x0, sizeof(ctx->tx_deadline));
+    memset((void*)ctx->tx_expiring, 0x0, sizeof(ctx->tx_expiring));
+#endif
+#if CONFIG_USR_DRV_CAN_TIMESTAMP
+    memset((void*)ctx->tx_time, 0x0, sizeof(ctx->tx_time));
+#endif
+#if CONFIG_USR_DRV_CAN_STATS
+    memset((void*)&ctx->stats, 0x0, sizeof(ctx->stats));
+    memset((void*)&ctx->stats_base, 0x0, sizeof(ctx->stats_base));
+#endif
+
+    /* let's write CAN device for the kernel... */
+    memcpy(ctx->can_dev.name, "canx", 4);
+    /* both controllers only differ by their address, pins and IRQ lines,
+     * the rest of the device declaration is shared */
+    switch (ctx->id) {
+        case CAN_PORT_1:
+           ctx->can_dev.name[3] = '1';
+           ctx->can_dev.address = can1_dev_infos.address;
+           ctx->can_dev.size = can1_dev_infos.size;
+           td_port = can1_dev_infos.gpios[CAN1_TD].port;
+           td_pin  = can1_dev_infos.gpios[CAN1_TD].pin;
+           rd_port = can1_dev_infos.gpios[CAN1_RD].port;
+           rd_pin  = can1_dev_infos.gpios[CAN1_RD].pin;
+           tx_irq  = CAN1_TX_IRQ;
+           rx0_irq = CAN1_RX0_IRQ;
+           rx1_irq = CAN1_RX1_IRQ;
+           sce_irq = CAN1_SCE_IRQ;
+           break;
+        case CAN_PORT_2:
+           ctx->can_dev.name[3] = '2';
+           ctx->can_dev.address = can2_dev_infos.address;
+           ctx->can_dev.size = can2_dev_infos.size;
+           td_port = can2_dev_infos.gpios[CAN2_TD].port;
+           td_pin  = can2_dev_infos.gpios[CAN2_TD].pin;
+           rd_port = can2_dev_infos.gpios[CAN2_RD].port;
+           rd_pin  = can2_dev_infos.gpios[CAN2_RD].pin;
+           tx_irq  = CAN2_TX_IRQ;
+           rx0_irq = CAN2_RX0_IRQ;
+           rx1_irq = CAN2_RX1_IRQ;
+           sce_irq = CAN2_SCE_IRQ;
+           break;
+        default:
+           errcode = MBED_ERROR_INVPARAM;
+           goto end;
+           break;
+    }
+
+    ctx->can_dev.gpio_num = 2;
+    ctx->can_dev.gpios[0].kref.port = td_port;
+    ctx->can_dev.gpios[0].kref.pin = td_pin;
+    ctx->can_dev.gpios[0].mask =
+        GPIO_MASK_SET_MODE | GPIO_MASK_SET_TYPE | GPIO_MASK_SET_SPEED |
+        GPIO_MASK_SET_PUPD | GPIO_MASK_SET_AFR;
+    ctx->can_dev.gpios[0].mode = GPIO_PIN_ALTERNATE_MODE;
+    ctx->can_dev.gpios[0].speed = GPIO_PIN_VERY_HIGH_SPEED;
+    ctx->can_dev.gpios[0].type = GPIO_PIN_OTYPER_PP;
+    ctx->can_dev.gpios[0].pupd = GPIO_NOPULL;
+    ctx->can_dev.gpios[0].afr = GPIO_AF_AF9; /* AF for CAN1 & CAN2 */
+
+    ctx->can_dev.gpios[1].kref.port = rd_port;
+    ctx->can_dev.gpios[1].kref.pin = rd_pin;
+    ctx->can_dev.gpios[1].mask =
+        GPIO_MASK_SET_MODE | GPIO_MASK_SET_TYPE | GPIO_MASK_SET_SPEED |
+        GPIO_MASK_SET_PUPD | GPIO_MASK_SET_AFR;
+    ctx->can_dev.gpios[1].mode = GPIO_PIN_ALTERNATE_MODE;
+    ctx->can_dev.gpios[1].type = GPIO_PIN_OTYPER_PP;
+    ctx->can_dev.gpios[1].pupd = GPIO_NOPULL;
+    ctx->can_dev.gpios[1].speed = GPIO_PIN_VERY_HIGH_SPEED;
+    ctx->can_dev.gpios[1].afr = GPIO_AF_AF9; /* AF for CAN1 & CAN2 */
+
+    if (ctx->access == CAN_ACCESS_POLL) {
+        ctx->can_dev.irq_num = 0;
+    } else {
+        ctx->can_dev.irq_num = 4;
+       /* TX interrupt is the consequence of RQCPx bits being set,
+        * in register TSR.
+        * see ST RM00090, chap 32.8   (CAN Interrupts)    fig.  348
+        *                 chap 32.9.5 (CAN registers map) table 184 */
+        ctx->can_dev.irqs[0].irq = tx_irq;
+        ctx->can_dev.irqs[0].handler = can_IRQHandler;
+        ctx->can_dev.irqs[0].mode = IRQ_ISR_STANDARD;
+        ctx->can_dev.irqs[0].posthook.status = CAN_MSR;
+        ctx->can_dev.irqs[0].posthook.data   = CAN_TSR;
+
+        ctx->can_dev.irqs[0].posthook.action[0].instr = IRQ_PH_READ;
+        ctx->can_dev.irqs[0].posthook.action[0].read.offset = CAN_MSR;
+
+        ctx->can_dev.irqs[0].posthook.action[1].instr = IRQ_PH_READ;
+        ctx->can_dev.irqs[0].posthook.action[1].read.offset = CAN_TSR;
+         /* clear TSR: RQCP0 */
+        ctx->can_dev.irqs[0].posthook.action[2].instr = IRQ_PH_WRITE;
+        ctx->can_dev.irqs[0].posthook.action[2].write.offset = CAN_TSR;
+        ctx->can_dev.irqs[0].posthook.action[2].write.value  = 0;
+        ctx->can_dev.irqs[0].posthook.action[2].write.mask   = 0x1 << 0;
+        /* clear TSR: RQCP1 */
+        ctx->can_dev.irqs[0].posthook.action[3].instr = IRQ_PH_WRITE;
+        ctx->can_dev.irqs[0].posthook.action[3].write.offset = CAN_TSR;
+        ctx->can_dev.irqs[0].posthook.action[3].write.value  = 0;
+        ctx->can_dev.irqs[0].posthook.action[3].write.mask   = 0x1 << 8;
+        /* clear TSR: RQCP2 */
+        ctx->can_dev.irqs[0].posthook.action[4].instr = IRQ_PH_WRITE;
+        ctx->can_dev.irqs[0].posthook.action[4].write.offset = CAN_TSR;
+        ctx->can_dev.irqs[0].posthook.action[4].write.value  = 0;
+        ctx->can_dev.irqs[0].posthook.action[4].write.mask   = 0x1 << 16;
+
+
+       /* RX0 interrupt is the consequence of RF0R register bits being
+        * set, see STRM00090, chap 32.8   (CAN Interrupts)    fig. 348
+        *                     chap 32.9.5 (CAN registers map) table 184 */
+        ctx->can_dev.irqs[1].irq  = rx0_irq;
+        ctx->can_dev.irqs[1].handler = can_IRQHandler;
+        ctx->can_dev.irqs[1].mode = IRQ_ISR_STANDARD;
+        ctx->can_dev.irqs[1].posthook.status = CAN_MSR;
+        ctx->can_dev.irqs[1].posthook.data   = CAN_RF0R;
+
+        ctx->can_dev.irqs[1].posthook.action[0].instr = IRQ_PH_READ;
+        ctx->can_dev.irqs[1].posthook.action[0].read.offset = CAN_MSR;
+
+        ctx->can_dev.irqs[1].posthook.action[1].instr = IRQ_PH_READ;
+        ctx->can_dev.irqs[1].posthook.action[1].read.offset = CAN_RF0R;
+       /* We need to mask in the kernel the sources of the RX0 interrupt
+        * related to the mailboxes :
+        *   - we clear IER:FMPIE0 and it will be set again by the
+        *     user task when it calls receive.
+        *   - we clear IER:FFIE0 and it will be set again by the
+        *     user task when it empties the FIFO or if it wasn't FULL
+        *     by the local IRQ Handler
+        *   - same for overrun ! */
+        ctx->can_dev.irqs[1].posthook.action[2].instr = IRQ_PH_WRITE;
+        ctx->can_dev.irqs[1].posthook.action[2].write.offset = CAN_IER;
+        ctx->can_dev.irqs[1].posthook.action[2].write.value  = 0;
+        ctx->can_dev.irqs[1].posthook.action[2].write.mask   =
+          CAN_IER_FMPIE0_Msk | CAN_IER_FFIE0_Msk | CAN_IER_FOVIE0_Msk;
+
+        /* RX1 interrupt is the consequence of RF1R register bits being
+         * set, see STRM00090, chap 32.8   (CAN Interrupts)    fig. 348
+         *                     chap 32.9.5 (CAN registers map) table 184 */
+        ctx->can_dev.irqs[2].irq = rx1_irq;
+        ctx->can_dev.irqs[2].handler = can_IRQHandler;
+        ctx->can_dev.irqs[2].mode = IRQ_ISR_STANDARD;
+        ctx->can_dev.irqs[2].posthook.status = CAN_MSR;
+        ctx->can_dev.irqs[2].posthook.data   = CAN_RF1R;
+
+        ctx->can_dev.irqs[2].posthook.action[0].instr = IRQ_PH_READ;
+        ctx->can_dev.irqs[2].posthook.action[0].read.offset = CAN_MSR;
+
+        ctx->can_dev.irqs[2].posthook.action[1].instr = IRQ_PH_READ;
+        ctx->can_dev.irqs[2].posthook.action[1].read.offset = CAN_RF1R;
+        /* We mask in the kernel the sources of the RX1 interrupt */
+        ctx->can_dev.irqs[2].posthook.action[2].instr = IRQ_PH_WRITE;
+        ctx->can_dev.irqs[2].posthook.action[2].write.offset = CAN_IER;
+        ctx->can_dev.irqs[2].posthook.action[2].write.value  = 0;
+        ctx->can_dev.irqs[2].posthook.action[2].write.mask   =
+          CAN_IER_FMPIE1_Msk | CAN_IER_FFIE1_Msk | CAN_IER_FOVIE1_Msk;
+
+
+        /* The Status Change SCE interrupt is the consequence of MSR
+         * register bits being set, in association with the ESR register
+         * filters.
+         * see ST RM00090, chap 32.8 (CAN Interrupts) fig. 348 */
+        ctx->can_dev.irqs[3].irq = sce_irq; /* status change*/
+        ctx->can_dev.irqs[3].handler = can_IRQHandler;
+        ctx->can_dev.irqs[3].mode = IRQ_ISR_STANDARD;
+        ctx->can_dev.irqs[3].posthook.status = CAN_MSR;
+        ctx->can_dev.irqs[3].posthook.data   = CAN_ESR;
+
+        ctx->can_dev.irqs[3].posthook.action[0].instr = IRQ_PH_READ;
+        ctx->can_dev.irqs[3].posthook.action[0].read.offset = CAN_MSR;
+        ctx->can_dev.irqs[3].posthook.action[1].instr = IRQ_PH_READ;
+        ctx->can_dev.irqs[3].posthook.action[1].read.offset = CAN_ESR;
+        /* clear MSR:SLAKI, WKUI & ERRI (previous values saved in status
+         * variable */
+        ctx->can_dev.irqs[3].posthook.action[2].instr = IRQ_PH_WRITE;
+        ctx->can_dev.irqs[3].posthook.action[2].write.offset = CAN_MSR;
+        ctx->can_dev.irqs[3].posthook.action[2].write.value  = 0x00;
+        ctx->can_dev.irqs[3].posthook.action[2].write.mask   = //0x7 << 2;
+                         CAN_MSR_SLAKI_Msk | CAN_MSR_WKUI_Msk |
+                         CAN_MSR_ERRI_Msk;
+        /* Set ESR:LEC[0:2] to 0b111 to clear the error number */
+        ctx->can_dev.irqs[3].posthook.action[3].instr = IRQ_PH_WRITE;
+        ctx->can_dev.irqs[3].posthook.action[3].write.offset = CAN_ESR;
+        ctx->can_dev.irqs[3].posthook.action[3].write.value  = 0xFFFF;
+        ctx->can_dev.irqs[3].posthook.action[3].write.mask   =
+                         CAN_ESR_LEC_Msk;
+        /* Inhibate error interrupt while the error is still there */
+        ctx->can_dev.irqs[3].posthook.action[4].instr = IRQ_PH_WRITE;
+        ctx->can_dev.irqs[3].posthook.action[4].write.offset = CAN_IER;
+        ctx->can_dev.irqs[3].posthook.action[4].write.value  = 0;
+        ctx->can_dev.irqs[3].posthook.action[4].write.mask   =
+                         CAN_IER_ERRIE_Msk  // OK !
+                       | CAN_IER_LECIE_Msk  // NOK.
+                       | CAN_IER_BOFIE_Msk  // NOK.
+                       | CAN_IER_EPVIE_Msk  // NOK.
+                       | CAN_IER_EWGIE_Msk; // NOK.
+    }
+    /* ... and declare it */
+    sret = sys_init(INIT_DEVACCESS, &(ctx->can_dev), &(ctx->can_dev_handle));
+    switch (sret) {
+        case SYS_E_DENIED:
+            errcode = MBED_ERROR_DENIED;
+            goto end;
+            break;
+        case SYS_E_BUSY:
+            errcode = MBED_ERROR_BUSY;
+            goto end;
+            break;
+        case SYS_E_INVAL:
+            errcode = MBED_ERROR_INITFAIL;
+            goto end;
+            break;
+        default:
+            break;
+
+    }
+    can_ctx_table[ctx->id - 1] = ctx;
+    errcode = MBED_ERROR_NONE;
+end:
+   return errcode;
+}
+
+/*******************************************************************************
+ *          FILTERS COMPILER
+ *
+ * The filters list of the context is compiled into the filter banks of the
+ * controller. Each element kind has a preferred bank configuration:
+ * - extended identifier/mask: 32 bits mask (1 per bank)
+ * - extended identifier     : 32 bits list (2 per bank)
+ * - standard identifier/mask: 16 bits mask (2 per bank)
+ * - standard identifier     : 16 bits list (4 per bank)
+ * A standard identifier may also use the free slot of an odd 32 bits list
+ * bank or of an odd 16 bits mask bank, as an exact match.
+ * If the banks of the controller are not enough, the last elements of the
+ * list are left out, and reported in ctx->filters_unfit.
+ * Elements are all routed to Rx FIFO0, unless the context spreads them over
+ * both Rx FIFOs (rxbalanced): the elements of each FIFO are then compiled
+ * into their own banks, FFA1R being set per bank.
+ ******************************************************************************/
+
+/* number of elements of each kind in the n first filters of the list */
+typedef struct {
+    uint32_t ext_masks;
+    uint32_t ext_ids;
+    uint32_t std_masks;
+    uint32_t std_ids;
+} can_filters_count_t;
+
+/* filter banks content, as written to the registers */
+typedef struct {
+    uint32_t r1;
+    uint32_t r2;
+    bool     list;   /* list mode, or mask mode */
+    bool     scale32;/* single 32 bits scale, or dual 16 bits */
+    uint8_t  filter[4]; /* filters list index of each filter number of the
+                           bank, CAN_FILTER_DEFAULT if none */
+    uint8_t  fifo;   /* Rx FIFO assigned to the bank */
+} can_filter_bank_t;
+
+/* filter number matching no single element of the filters list */
+#define CAN_FILTER_DEFAULT 0xff
+
+static inline uint32_t can_filter_id32(const can_filter_t *f)
+{
+    if (f->IDE == CAN_ID_STD) {
+        return (f->id << CAN_RIxR_STID_Pos) & CAN_RIxR_STID_Msk;
+    }
+    return ((f->id << CAN_RIxR_EXID_Pos) & (CAN_RIxR_STID_Msk | CAN_RIxR_EXID_Msk))
+           | CAN_RIxR_IDE_Msk;
+}
+
+static inline uint32_t can_filter_id16(uint32_t std)
+{
+    return (std << CAN_FxR16_STID_Pos) & CAN_FxR16_STID_Msk;
+}
+
+/* element i of the filters list is routed to the given Rx FIFO. fifo1 is the
+ * Rx FIFO1 bitmap of the list, NULL if all elements are in FIFO0 */
+static inline bool can_filter_in(const uint32_t *fifo1, uint32_t i, can_fifo_t fifo)
+{
+    bool in_fifo1 = (fifo1 != NULL) && ((fifo1[i >> 5] >> (i & 0x1f)) & 0x1) != 0;
+
+    return in_fifo1 == (fifo == CAN_FIFO_1);
+}
+
+static void can_filters_count(const can_filter_t   *filters,
+                              uint32_t              n,
+                              const uint32_t       *fifo1,
+                              can_fifo_t            fifo,
+                              can_filters_count_t  *count)
+{
+    memset((void*)count, 0x0, sizeof(can_filters_count_t));
+    for (uint32_t i = 0; i < n; ++i) {
+        if (!can_filter_in(fifo1, i, fifo)) {
+            continue;
+        }
+        if (filters[i].IDE == CAN_ID_EXT) {
+            if (filters[i].type == CAN_FILTER_MASK) {
+                count->ext_masks++;
+            } else {
+                count->ext_ids++;
+            }
+        } else {
+            if (filters[i].type == CAN_FILTER_MASK) {
+                count->std_masks++;
+            } else {
+                count->std_ids++;
+            }
+        }
+    }
+}
+
+/* number of banks required by the given elements count */
+static uint32_t can_filters_banks(const can_filters_count_t *count)
+{
+    uint32_t banks;
+    uint32_t spare = 0;
+    uint32_t std_ids = count->std_ids;
+
+    banks = count->ext_masks
+          + (count->ext_ids + 1) / 2
+          + (count->std_masks + 1) / 2;
+    /* free slots in odd 32 bits list and 16 bits mask banks */
+    spare += count->ext_ids & 0x1;
+    spare += count->std_masks & 0x1;
+    std_ids = (std_ids > spare) ? std_ids - spare : 0;
+    banks += (std_ids + 3) / 4;
+    return banks;
+}
+
+static mbed_error_t can_filters_check(const can_filter_t *filters, uint32_t n)
+{
+    uint32_t max;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        if (filters[i].IDE == CAN_ID_STD) {
+            max = 0x7ff;
+        } else if (filters[i].IDE == CAN_ID_EXT) {
+            max = 0x1fffffff;
+        } else {
+            return MBED_ERROR_INVPARAM;
+        }
+        if (filters[i].type != CAN_FILTER_ID && filters[i].type != CAN_FILTER_MASK) {
+            return MBED_ERROR_INVPARAM;
+        }
+        if (filters[i].id > max || filters[i].mask > max) {
+            return MBED_ERROR_INVPARAM;
+        }
+    }
+    return MBED_ERROR_NONE;
+}
+
+#if CONFIG_USR_DRV_CAN_RX_BALANCE
+static inline uint32_t can_filter_rate(const can_filter_t *f, uint32_t unknown)
+{
+    return (f->rate != 0) ? f->rate : unknown;
+}
+
+/*
+ * Split the filters list between both Rx FIFOs, in the fifo1 bitmap. High
+ * priority elements get FIFO1 for themselves. Otherwise, elements are taken
+ * by decreasing expected rate, each one going to the FIFO with the lowest
+ * expected rate so far.
+ */
+static void can_filters_balance(const can_filter_t *filters,
+                                uint32_t            n,
+                                uint32_t           *fifo1)
+{
+    uint8_t order[256];
+    uint32_t load[2] = { 0, 0 };
+    uint32_t known = 0, sum = 0, unknown, rate;
+    bool high = false;
+    uint32_t i, j, fifo;
+
+    memset((void*)fifo1, 0x0, 8 * sizeof(uint32_t));
+    for (i = 0; i < n; ++i) {
+        high |= (filters[i].prio == CAN_FILTER_PRIO_HIGH);
+        if (filters[i].rate != 0) {
+            known++;
+            sum += filters[i].rate;
+        }
+    }
+    if (high) {
+        for (i = 0; i < n; ++i) {
+            if (filters[i].prio == CAN_FILTER_PRIO_HIGH) {
+                fifo1[i >> 5] |= (0x1UL << (i & 0x1f));
+            }
+        }
+        return;
+    }
+    /* elements of unknown rate count for the mean of the known ones */
+    unknown = (known != 0) ? sum / known : 1;
+    /* stable insertion sort, by decreasing rate */
+    for (i = 0; i < n; ++i) {
+        rate = can_filter_rate(&filters[i], unknown);
+        for (j = i; j > 0 && can_filter_rate(&filters[order[j - 1]], unknown) < rate; --j) {
+            order[j] = order[j - 1];
+        }
+        order[j] = (uint8_t)i;
+    }
+    for (i = 0; i < n; ++i) {
+        fifo = (load[1] < load[0]) ? 1 : 0;
+        load[fifo] += can_filter_rate(&filters[order[i]], unknown);
+        if (fifo == 1) {
+            fifo1[order[i] >> 5] |= (0x1UL << (order[i] & 0x1f));
+        }
+    }
+}
+#endif
+
+/* number of banks required by the n first filters of the list, for both
+ * Rx FIFOs */
+static uint32_t can_filters_need(const can_filter_t *filters,
+                                 uint32_t            n,
+                                 const uint32_t     *fifo1)
+{
+    can_filters_count_t count;
+    uint32_t nb;
+
+    can_filters_count(filters, n, fifo1, CAN_FIFO_0, &count);
+    nb = can_filters_banks(&count);
+    if (fifo1 != NULL) {
+        can_filters_count(filters, n, fifo1, CAN_FIFO_1, &count);
+        nb += can_filters_banks(&count);
+    }
+    return nb;
+}
+
+/*
+ * Fill the banks table from the n first filters of the list routed to the
+ * given Rx FIFO. banks must hold can_filters_banks() entries. Returns the
+ * number of banks used.
+ */
+static uint32_t can_filters_compile(const can_filter_t *filters,
+                                    uint32_t            n,
+                                    const uint32_t     *fifo1,
+                                    can_fifo_t          fifo,
+                                    can_filter_bank_t  *banks)
+{
+    can_filters_count_t count;
+    uint32_t b_extm, b_extl, b_stdm, b_stdl; /* first bank of each kind */
+    uint32_t i_extm = 0, i_extl = 0, i_stdm = 0, i_stdl = 0;
+    uint32_t nb;
+    uint32_t id32, id16, mask16;
+    can_filter_bank_t *bank;
+
+    can_filters_count(filters, n, fifo1, fifo, &count);
+    nb = can_filters_banks(&count);
+    b_extm = 0;
+    b_extl = b_extm + count.ext_masks;
+    b_stdm = b_extl + (count.ext_ids + 1) / 2;
+    b_stdl = b_stdm + (count.std_masks + 1) / 2;
+
+    for (uint32_t i = b_extm; i < nb; ++i) {
+        banks[i].list    = (i >= b_extl && i < b_stdm) || (i >= b_stdl);
+        banks[i].scale32 = (i < b_stdm);
+        banks[i].fifo    = (uint8_t)fifo;
+    }
+    /* standard identifiers are placed in a second pass, once the free
+     * slots of the other banks are known */
+    for (uint32_t i = 0; i < 2 * n; ++i) {
+        const can_filter_t *f = &filters[i % n];
+        bool std_id = (f->IDE == CAN_ID_STD && f->type == CAN_FILTER_ID);
+        uint8_t idx = (uint8_t)(i % n);
+
+        if (std_id != (i >= n) || !can_filter_in(fifo1, i % n, fifo)) {
+            continue;
+        }
+        if (f->IDE == CAN_ID_EXT && f->type == CAN_FILTER_MASK) {
+            /* one per 32 bits mask bank, IDE must match */
+            bank = &banks[b_extm + i_extm++];
+            memset((void*)bank->filter, idx, sizeof(bank->filter));
+            bank->r1 = can_filter_id32(f);
+            bank->r2 = ((f->mask << CAN_RIxR_EXID_Pos) & (CAN_RIxR_STID_Msk | CAN_RIxR_EXID_Msk))
+                       | CAN_RIxR_IDE_Msk;
+        } else if (f->IDE == CAN_ID_EXT) {
+            /* two per 32 bits list bank */
+            bank = &banks[b_extl + i_extl / 2];
+            if ((i_extl & 0x1) == 0) {
+                memset((void*)bank->filter, idx, sizeof(bank->filter));
+                bank->r1 = bank->r2 = can_filter_id32(f);
+            } else {
+                bank->filter[1] = idx;
+                bank->r2 = can_filter_id32(f);
+            }
+            i_extl++;
+        } else if (f->type == CAN_FILTER_MASK) {
+            /* two per 16 bits mask bank, IDE must match */
+            bank = &banks[b_stdm + i_stdm / 2];
+            id16 = can_filter_id16(f->id);
+            mask16 = can_filter_id16(f->mask) | CAN_FxR16_IDE_Msk;
+            if ((i_stdm & 0x1) == 0) {
+                memset((void*)bank->filter, idx, sizeof(bank->filter));
+                bank->r1 = bank->r2 = (mask16 << 16) | id16;
+            } else {
+                bank->filter[1] = idx;
+                bank->r2 = (mask16 << 16) | id16;
+            }
+            i_stdm++;
+        } else {
+            /* free slot of an odd 32 bits list bank first, then free slot
+             * of an odd 16 bits mask bank, then 4 per 16 bits list bank */
+            id32 = can_filter_id32(f);
+            id16 = can_filter_id16(f->id);
+            if ((count.ext_ids & 0x1) && i_extl == count.ext_ids) {
+                banks[b_extl + i_extl / 2].r2 = id32;
+                banks[b_extl + i_extl / 2].filter[1] = idx;
+                i_extl++;
+            } else if ((count.std_masks & 0x1) && i_stdm == count.std_masks) {
+                mask16 = CAN_FxR16_STID_Msk | CAN_FxR16_IDE_Msk | CAN_FxR16_RTR_Msk;
+                banks[b_stdm + i_stdm / 2].r2 = (mask16 << 16) | id16;
+                banks[b_stdm + i_stdm / 2].filter[1] = idx;
+                i_stdm++;
+            } else {
+                bank = &banks[b_stdl + i_stdl / 4];
+                switch (i_stdl & 0x3) {
+                    case 0:
+                        /* unused slots duplicate the first identifier */
+                        memset((void*)bank->filter, idx, sizeof(bank->filter));
+                        bank->r1 = bank->r2 = (id16 << 16) | id16;
+                        break;
+                    case 1:
+                        bank->r1 = (bank->r1 & 0xffff) | (id16 << 16);
+                        break;
+                    case 2:
+                        bank->r2 = (bank->r2 & 0xffff0000) | id16;
+                        break;
+                    default:
+                        bank->r2 = (bank->r2 & 0xffff) | (id16 << 16);
+                        break;
+                }
+                bank->filter[i_stdl & 0x3] = idx;
+                i_stdl++;
+            }
+        }
+    }
+    return nb;
+}
+
+#if CONFIG_USR_DRV_CAN_SW_FILTER
+/*
+ * Compute, for each identifier kind (standard, extended) of the given
+ * elements, a single 32 bits identifier/mask bank accepting all of them: the
+ * mask only keeps the bits on which all the elements agree. banks may be
+ * NULL to only get the number of banks.
+ */
+static uint32_t can_filters_superset(const can_filter_t *filters,
+                                     uint32_t            n,
+                                     can_filter_bank_t  *banks)
+{
+    bool found[2] = { false, false };
+    uint32_t id[2] = { 0, 0 };
+    uint32_t mask[2] = { 0, 0 };
+    uint32_t id_msk, fid, fmask;
+    uint32_t k, nb = 0;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        const can_filter_t *f = &filters[i];
+
+        if (f->IDE == CAN_ID_STD) {
+            k = 0;
+            id_msk = CAN_RIxR_STID_Msk;
+            fmask = (f->type == CAN_FILTER_MASK) ? (f->mask << CAN_RIxR_STID_Pos) & id_msk : id_msk;
+        } else {
+            k = 1;
+            id_msk = CAN_RIxR_STID_Msk | CAN_RIxR_EXID_Msk;
+            fmask = (f->type == CAN_FILTER_MASK) ? (f->mask << CAN_RIxR_EXID_Pos) & id_msk : id_msk;
+        }
+        fid = can_filter_id32(f) & id_msk;
+        if (!found[k]) {
+            found[k] = true;
+            id[k] = fid;
+            mask[k] = fmask;
+        } else {
+            mask[k] &= fmask & ~(id[k] ^ fid);
+        }
+    }
+    for (k = 0; k < 2; ++k) {
+        if (!found[k]) {
+            continue;
+        }
+        if (banks != NULL) {
+            banks[nb].r1 = (id[k] & mask[k]) | ((k == 1) ? CAN_RIxR_IDE_Msk : 0);
+            banks[nb].r2 = mask[k] | CAN_RIxR_IDE_Msk;
+            banks[nb].list = false;
+            banks[nb].scale32 = true;
+            banks[nb].fifo = CAN_FIFO_0;
+            memset((void*)banks[nb].filter, CAN_FILTER_DEFAULT, sizeof(banks[nb].filter));
+        }
+        nb++;
+    }
+    return nb;
+}
+
+/* set the software filter from the whole filters list */
+static void can_sw_filter_build(can_sw_filter_t    *swf,
+                                const can_filter_t *filters,
+                                uint32_t            n)
+{
+    uint32_t h, j;
+
+    memset((void*)swf, 0x0, sizeof(can_sw_filter_t));
+    for (uint32_t i = 0; i < n; ++i) {
+        const can_filter_t *f = &filters[i];
+
+        if (f->IDE == CAN_ID_STD) {
+            if (f->type == CAN_FILTER_ID) {
+                swf->std_bitmap[f->id >> 5] |= (0x1UL << (f->id & 0x1f));
+                continue;
+            }
+            for (uint32_t std = 0; std < 2048; ++std) {
+                if (((std ^ f->id) & f->mask) == 0) {
+                    swf->std_bitmap[std >> 5] |= (0x1UL << (std & 0x1f));
+                }
+            }
+        } else if (f->type == CAN_FILTER_ID) {
+            h = can_sw_filter_hash(f->id);
+            for (j = 0; j < CONFIG_USR_DRV_CAN_SW_FILTER_EXT_SLOTS; ++j) {
+                if (swf->ext_set[h] == 0 || swf->ext_set[h] == f->id + 1) {
+                    swf->ext_set[h] = f->id + 1;
+                    break;
+                }
+                h = (h + 1) & CAN_SW_FILTER_EXT_MASK;
+            }
+            if (j == CONFIG_USR_DRV_CAN_SW_FILTER_EXT_SLOTS) {
+                swf->ext_all = true;
+            }
+        } else if (swf->ext_masks_num < CONFIG_USR_DRV_CAN_SW_FILTER_EXT_MASKS) {
+            swf->ext_masks[swf->ext_masks_num].id = f->id & f->mask;
+            swf->ext_masks[swf->ext_masks_num].mask = f->mask;
+            swf->ext_masks_num++;
+        } else {
+            swf->ext_all = true;
+        }
+    }
+    swf->active = true;
+}
+#endif
+
+/* first and last + 1 filter banks of the given controller */
+static inline void can_filters_range(can_port_t port, uint32_t *first, uint32_t *last)
+{
+    uint32_t can2sb = get_reg(r_CAN_FMR, CAN_FMR_CAN2SB);
+
+    if (port == CAN_PORT_1) {
+        *first = 0;
+        *last = can2sb;
+    } else {
+        *first = can2sb;
+        *last = CAN_MAX_FILTERS;
+    }
+}
+
+#if CONFIG_USR_DRV_CAN_DISPATCH
+/*
+ * Count the filter numbers, per Rx FIFO, of the banks below the given one.
+ * Filter numbers are given per Rx FIFO, in banks order, whatever the bank
+ * activation state and the controller owning the bank, each bank holding
+ * 1 (32 bits mask), 2 (32 bits list, 16 bits mask) or 4 (16 bits list)
+ * filter numbers. See RM0090, chap 32.7.4 (Filter match index).
+ */
+static void can_filters_fmi_count(uint32_t last, uint32_t fmi[2])
+{
+    uint32_t fm1r = *r_CAN_FM1R;
+    uint32_t fs1r = *r_CAN_FS1R;
+    uint32_t ffa1r = *r_CAN_FFA1R;
+    uint32_t num;
+
+    fmi[0] = 0;
+    fmi[1] = 0;
+    for (uint32_t i = 0; i < last; ++i) {
+        num = ((fs1r >> i) & 0x1) ? 1 : 2;
+        if ((fm1r >> i) & 0x1) {
+            num *= 2;
+        }
+        fmi[(ffa1r >> i) & 0x1] += num;
+    }
+}
+
+/*
+ * Build the FMI to filters list index map of the context, from the banks
+ * just installed from the first one of the controller.
+ */
+static void can_filters_map(can_context_t           *ctx,
+                            uint32_t                 first,
+                            const can_filter_bank_t *banks,
+                            uint32_t                 nb)
+{
+    uint32_t fmi[2];
+    uint32_t fifo, num;
+
+    can_filters_fmi_count(first, fmi);
+    memset((void*)ctx->fmi_map, CAN_FILTER_DEFAULT, sizeof(ctx->fmi_map));
+    for (uint32_t i = 0; i < nb; ++i) {
+        fifo = banks[i].fifo;
+        num = banks[i].scale32 ? 1 : 2;
+        if (banks[i].list) {
+            num *= 2;
         }
-        /* Errors */
-        if ((msr & CAN_MSR_ERRI_Msk) != 0) {
-            /* MSR:ERRI already acknowledged by PH */
+        for (uint32_t j = 0; j < num && fmi[fifo] + j < CAN_FILTER_NUMBERS_MAX; ++j) {
+            ctx->fmi_map[fifo][fmi[fifo] + j] = banks[i].filter[j];
+        }
+        fmi[fifo] += num;
+    }
+}
 
-            /* calculating error mask. ESR has already been acknowledged by PH */
-            if ((esr & CAN_ESR_EWGF_Msk) != 0) {
-              err |= CAN_ERROR_ERR_WARNING_LIMIT;
-            }
-            if ((esr & CAN_ESR_EPVF_Msk) != 0) {
-              err |= CAN_ERROR_ERR_PASSIVE_LIMIT;
-            }
-            if ((esr & CAN_ESR_BOFF_Msk) != 0) {
-              err |= CAN_ERROR_ERR_BUS_OFF;
+/*
+ * The CAN2 filter numbers follow the ones of the CAN1 banks: when these
+ * change, move the CAN2 map from the filter numbers counted before to the
+ * ones counted now. All the 28 banks numbers fit in the map, nothing is lost.
+ */
+static void can_filters_remap(can_context_t *ctx, const uint32_t before[2])
+{
+    uint8_t map[CAN_FILTER_NUMBERS_MAX];
+    uint32_t after[2];
+    uint32_t first, last;
+
+    can_filters_range(ctx->id, &first, &last);
+    can_filters_fmi_count(first, after);
+    for (uint32_t fifo = 0; fifo < 2; ++fifo) {
+        if (after[fifo] == before[fifo]) {
+            continue;
+        }
+        memcpy(map, (void*)ctx->fmi_map[fifo], sizeof(map));
+        memset((void*)ctx->fmi_map[fifo], CAN_FILTER_DEFAULT, sizeof(map));
+        for (uint32_t k = before[fifo]; k < CAN_FILTER_NUMBERS_MAX; ++k) {
+            if (k - before[fifo] + after[fifo] < CAN_FILTER_NUMBERS_MAX) {
+                ctx->fmi_map[fifo][k - before[fifo] + after[fifo]] = map[k];
             }
+        }
+    }
+}
+#endif
+
+/*
+ * Compile and install the filters list of the context in the filter banks
+ * of the controller. With no list, a single accept-all filter is installed.
+ * Filter banks are shared by CAN1 and CAN2, and their registers are all in
+ * the CAN1 register block.
+ */
+static mbed_error_t can_filters_install(can_context_t *ctx)
+{
+    volatile can_filters_table_t *filter_table = r_CAN1_FxRy();
+    can_filter_bank_t banks[CAN_MAX_FILTERS];
+    const uint32_t *fifo1 = NULL;
+    uint32_t first, last, nb, n;
+    uint32_t bank_msk = 0;
+#if CONFIG_USR_DRV_CAN_DISPATCH
+    can_context_t *can2 = (ctx->id == CAN_PORT_1) ? can_ctx_table[CAN_PORT_2 - 1] : NULL;
+    uint32_t can2_fmi[2];
+#endif
+    mbed_error_t errcode = MBED_ERROR_NONE;
 
-            if ((esr & CAN_ESR_LEC_Msk) != 0) {
-               uint32_t lec = ((esr & CAN_ESR_LEC_Msk) >> CAN_ESR_LEC_Pos);
-               switch (lec) {
-                  case 0x0:
-                     err |= CAN_ERROR_ERR_LEC_STUFF;
-                     break;
-                   case 0x1:
-                     err |= CAN_ERROR_ERR_LEC_FROM;
-                     break;
-                   case 0x3:
-                     err |= CAN_ERROR_ERR_LEC_ACK;
-                     break;
-                   case 0x4:
-                      err |= CAN_ERROR_ERR_LEC_BR;
-                      break;
-                   case 0x5:
-                       err |= CAN_ERROR_ERR_LEC_BD;
-                       break;
-                  case 0x6:
-                       err |= CAN_ERROR_ERR_LEC_CRC;
-                       break;
-                  default:
-                       break;
-               }
+    n = (ctx->filters != NULL) ? ctx->filters_num : 0;
+    if (can_filters_check(ctx->filters, n) != MBED_ERROR_NONE) {
+        return MBED_ERROR_INVPARAM;
+    }
+    can_filters_range(ctx->id, &first, &last);
+#if CONFIG_USR_DRV_CAN_RX_BALANCE
+    if (ctx->rxbalanced) {
+        can_filters_balance(ctx->filters, n, ctx->filters_fifo1);
+        fifo1 = ctx->filters_fifo1;
+    }
+#endif
+
+    if (n == 0) {
+        /* accept all: 32 bits mask, bit mask at 0 = Don't care ! */
+        banks[0].r1 = 0;
+        banks[0].r2 = 0;
+        banks[0].list = false;
+        banks[0].scale32 = true;
+        banks[0].fifo = CAN_FIFO_0;
+        memset((void*)banks[0].filter, CAN_FILTER_DEFAULT, sizeof(banks[0].filter));
+        nb = 1;
+#if CONFIG_USR_DRV_CAN_RX_BALANCE
+        if (ctx->rxbalanced && (last - first) >= 2) {
+            /* split on the lowest bit of the (base) standard identifier,
+             * odd identifiers going to FIFO1 */
+            banks[0].r2 = 0x1UL << CAN_RIxR_STID_Pos;
+            banks[1] = banks[0];
+            banks[1].r1 = 0x1UL << CAN_RIxR_STID_Pos;
+            banks[1].fifo = CAN_FIFO_1;
+            nb = 2;
+        }
+#endif
+    } else {
+        /* leave out the last elements of the list until it fits. With the
+         * software filter, the left out elements are covered by superset
+         * banks */
+        for (;;) {
+            nb = can_filters_need(ctx->filters, n, fifo1);
+#if CONFIG_USR_DRV_CAN_SW_FILTER
+            if (ctx->swfilter && n < ctx->filters_num) {
+                nb += can_filters_superset(&ctx->filters[n], ctx->filters_num - n, NULL);
             }
-            if (err != CAN_ERROR_NONE) {
-                can_event(CAN_EVENT_ERROR, canid, err);
+#endif
+            if (nb <= (last - first) || n == 0) {
+                break;
             }
-        } /* End if Errors */
-    } /* End switch (interrupt) */
-err:
-    return;
+            n--;
+        }
+        nb = can_filters_compile(ctx->filters, n, fifo1, CAN_FIFO_0, banks);
+        if (fifo1 != NULL) {
+            nb += can_filters_compile(ctx->filters, n, fifo1, CAN_FIFO_1, &banks[nb]);
+        }
+    }
+    ctx->filters_unfit = (ctx->filters != NULL) ? ctx->filters_num - n : 0;
+#if CONFIG_USR_DRV_CAN_SW_FILTER
+    ctx->sw_filter.active = false;
+    if (ctx->swfilter && ctx->filters_unfit != 0) {
+        nb += can_filters_superset(&ctx->filters[n], ctx->filters_unfit, &banks[nb]);
+        if (nb <= (last - first)) {
+            can_sw_filter_build(&ctx->sw_filter, ctx->filters, ctx->filters_num);
+        }
+    } else
+#endif
+    if (ctx->filters_unfit != 0) {
+        errcode = MBED_ERROR_NOSTORAGE;
+    }
+    if (nb == 0 || nb > (last - first)) {
+        /* no room at all for this controller (no bank given by CAN2SB, or
+         * not even the superset banks fitting): its banks are all left
+         * inactive, nothing being received */
+        nb = 0;
+        ctx->filters_unfit = (ctx->filters != NULL) ? ctx->filters_num : 0;
+        errcode = MBED_ERROR_NOMEM;
+    }
+
+#if CONFIG_USR_DRV_CAN_DISPATCH
+    if (can2 != NULL) {
+        can_filters_fmi_count(last, can2_fmi);
+    }
+#endif
+    /* Enter filter initialization */
+    set_reg_bits(r_CAN_FMR, CAN_FMR_FINIT_Msk);
+
+    /* deactivate all the banks of the controller */
+    for (uint32_t i = first; i < last; ++i) {
+        bank_msk |= (0x1UL << i);
+    }
+    clear_reg_bits(r_CAN_FA1R, bank_msk);
+
+    for (uint32_t i = 0; i < nb; ++i) {
+        uint32_t bit = 0x1UL << (first + i);
+
+        if (banks[i].list) {
+            set_reg_bits(r_CAN_FM1R, bit);
+        } else {
+            clear_reg_bits(r_CAN_FM1R, bit);
+        }
+        if (banks[i].scale32) {
+            set_reg_bits(r_CAN_FS1R, bit);
+        } else {
+            clear_reg_bits(r_CAN_FS1R, bit);
+        }
+        if (banks[i].fifo == CAN_FIFO_1) {
+            set_reg_bits(r_CAN_FFA1R, bit);
+        } else {
+            clear_reg_bits(r_CAN_FFA1R, bit);
+        }
+        filter_table[first + i].FiR1 = banks[i].r1;
+        filter_table[first + i].fiR2 = banks[i].r2;
+        set_reg_bits(r_CAN_FA1R, bit);
+    }
+
+    /* Quit Filter initialization */
+    clear_reg_bits(r_CAN_FMR, CAN_FMR_FINIT_Msk);
+#if CONFIG_USR_DRV_CAN_DISPATCH
+    can_filters_map(ctx, first, banks, nb);
+    if (can2 != NULL) {
+        /* the CAN2 filter numbers have moved with the CAN1 banks */
+        can_filters_remap(can2, can2_fmi);
+    }
+#endif
+    return errcode;
 }
 
 /*******************************************************************************
- *           DECLARE CAN DEVICE
+ *          BIT TIMING SOLVER
+ *
+ * Search the prescaler and time segments giving the requested bit rate from
+ * the APB1 clock, then the split of the bit between TS1 and TS2 that is the
+ * closest to the requested sample point. See RM0090, chap 32.7.7.
  ******************************************************************************/
-mbed_error_t can_declare(__inout can_context_t *ctx)
+
+/* bxCAN bit timing limits, in time quanta */
+#define CAN_BT_BRP_MAX 1024
+#define CAN_BT_TS1_MAX 16
+#define CAN_BT_TS2_MAX 8
+#define CAN_BT_SJW_MAX 4
+#define CAN_BT_NTQ_MIN 4   /* SYNC + TS1 + TS2, 1 quantum each at least */
+#define CAN_BT_NTQ_MAX (1 + CAN_BT_TS1_MAX + CAN_BT_TS2_MAX)
+/* sample point error, per mille, considered as exact */
+#define CAN_BT_SP_TOLERANCE 20
+
+static inline uint32_t can_bt_absdiff(uint32_t a, uint32_t b)
 {
-    mbed_error_t errcode = MBED_ERROR_INVSTATE;
-    e_syscall_ret sret;
+    return (a > b) ? a - b : b - a;
+}
 
-    /* sanitize */
-    if (ctx == NULL) {
-        errcode = MBED_ERROR_INVPARAM;
-        goto end;
+mbed_error_t can_bit_timing_solve(const __in  uint32_t          clk,
+                                  const __in  uint32_t          bitrate,
+                                  const __in  uint16_t          sample_point,
+                                        __out can_bit_timing_t *timing)
+{
+    uint32_t best_err = 0xffffffff, best_sp_err = 0xffffffff;
+    uint32_t sp, brp, ts1, achieved, err, sp_err;
+
+    if (timing == NULL || bitrate == 0 || clk == 0) {
+        return MBED_ERROR_INVPARAM;
     }
-    if (ctx->access != CAN_ACCESS_POLL && ctx->access != CAN_ACCESS_IT) {
-        errcode = MBED_ERROR_INVPARAM;
-        goto end;
+    sp = (sample_point != 0) ? sample_point : CAN_SAMPLE_POINT_DEFAULT;
+    if (sp >= 1000) {
+        return MBED_ERROR_INVPARAM;
     }
-    /* by now, only master CAN 1 supported. TODO to complete */
-    if (ctx->id != CAN_PORT_1) {
-        errcode = MBED_ERROR_INVPARAM;
-        goto end;
+    /* more quanta per bit first: on equal rate error, the finest
+     * resynchronization with a sample point close enough is kept */
+    for (uint32_t ntq = CAN_BT_NTQ_MAX; ntq >= CAN_BT_NTQ_MIN; --ntq) {
+        /* nearest prescaler for this number of quanta */
+        brp = (clk + (bitrate * ntq) / 2) / (bitrate * ntq);
+        if (brp == 0 || brp > CAN_BT_BRP_MAX) {
+            continue;
+        }
+        achieved = clk / (brp * ntq);
+        err = can_bt_absdiff(achieved, bitrate);
+        /* TS1 closest to the sample point, TS2 in its range */
+        ts1 = (ntq * sp + 500) / 1000;
+        ts1 = (ts1 > 1) ? ts1 - 1 : 1;
+        if (ts1 > CAN_BT_TS1_MAX) {
+            ts1 = CAN_BT_TS1_MAX;
+        }
+        if (ntq - 1 - ts1 > CAN_BT_TS2_MAX) {
+            ts1 = ntq - 1 - CAN_BT_TS2_MAX;
+        }
+        if (ntq - 1 - ts1 == 0) {
+            ts1--;
+        }
+        sp_err = can_bt_absdiff((1000 * (1 + ts1)) / ntq, sp);
+        if (sp_err <= CAN_BT_SP_TOLERANCE) {
+            sp_err = 0;
+        }
+        if (err < best_err || (err == best_err && sp_err < best_sp_err)) {
+            best_err = err;
+            best_sp_err = sp_err;
+            timing->brp = (uint16_t)brp;
+            timing->ts1 = (uint8_t)ts1;
+            timing->ts2 = (uint8_t)(ntq - 1 - ts1);
+            timing->sjw = (timing->ts2 < CAN_BT_SJW_MAX) ? timing->ts2 : CAN_BT_SJW_MAX;
+            timing->sample_point = (uint16_t)((1000 * (1 + ts1)) / ntq);
+            timing->bitrate = achieved;
+            timing->error_ppm = (int32_t)(((int64_t)achieved - bitrate) * 1000000 / bitrate);
+        }
     }
+    if (best_err == 0xffffffff) {
+        /* bit rate out of the prescaler range */
+        return MBED_ERROR_INVPARAM;
+    }
+    return MBED_ERROR_NONE;
+}
 
-    /* init driver part of the context */
-    memset((void*)(&ctx->can_dev), 0x0, sizeof(device_t));
-    ctx->can_dev_handle = 0;
-    ctx->state = CAN_STATE_SLEEP; /* default at reset */
-
-    /* let's write CAN device for the kernel... */
-    strncpy(ctx->can_dev.name, "canx", 4);
-    switch (ctx->id) {
-        case CAN_PORT_1:
-           ctx->can_dev.address = can1_dev_infos.address;
-           ctx->can_dev.size = can1_dev_infos.size;
-	         ctx->can_dev.gpio_num = 2;
-	   ctx->can_dev.gpios[0].kref.port = can1_dev_infos.gpios[CAN1_TD].port;
-	   ctx->can_dev.gpios[0].kref.pin = can1_dev_infos.gpios[CAN1_TD].pin;
-	   ctx->can_dev.gpios[0].mask =
-		   GPIO_MASK_SET_MODE | GPIO_MASK_SET_TYPE | GPIO_MASK_SET_SPEED |
-		   GPIO_MASK_SET_PUPD | GPIO_MASK_SET_AFR;
-	   ctx->can_dev.gpios[0].mode = GPIO_PIN_ALTERNATE_MODE;
-	   ctx->can_dev.gpios[0].speed = GPIO_PIN_VERY_HIGH_SPEED;
-	   ctx->can_dev.gpios[0].type = GPIO_PIN_OTYPER_PP;
-	   ctx->can_dev.gpios[0].pupd = GPIO_NOPULL;
-	   ctx->can_dev.gpios[0].afr = GPIO_AF_AF9; /* AF for CAN1 & CAN2 */
-
-	   ctx->can_dev.gpios[1].kref.port = can1_dev_infos.gpios[CAN1_RD].port;
-	   ctx->can_dev.gpios[1].kref.pin = can1_dev_infos.gpios[CAN1_RD].pin;
-	   ctx->can_dev.gpios[1].mask =
-		   GPIO_MASK_SET_MODE | GPIO_MASK_SET_TYPE | GPIO_MASK_SET_SPEED |
-		   GPIO_MASK_SET_PUPD | GPIO_MASK_SET_AFR;
-	   ctx->can_dev.gpios[1].mode = GPIO_PIN_ALTERNATE_MODE;
-	   ctx->can_dev.gpios[1].type = GPIO_PIN_OTYPER_PP;
-	   ctx->can_dev.gpios[1].pupd = GPIO_NOPULL;
-	   ctx->can_dev.gpios[1].speed = GPIO_PIN_VERY_HIGH_SPEED;
-	   ctx->can_dev.gpios[1].afr = GPIO_AF_AF9; /* AF for CAN1 & CAN2 */
-
-           if (ctx->access == CAN_ACCESS_POLL) {
-               ctx->can_dev.irq_num = 0;
-           } else {
-               ctx->can_dev.irq_num = 4;
-              /* TX interrupt is the consequence of RQCPx bits being set,
-               * in register TSR.
-               * see ST RM00090, chap 32.8   (CAN Interrupts)    fig.  348
-               *                 chap 32.9.5 (CAN registers map) table 184 */
-               ctx->can_dev.irqs[0].irq = CAN1_TX_IRQ;
-               ctx->can_dev.irqs[0].handler = can_IRQHandler;
-               ctx->can_dev.irqs[0].mode = IRQ_ISR_STANDARD;
-               ctx->can_dev.irqs[0].posthook.status = CAN_MSR;
-               ctx->can_dev.irqs[0].posthook.data   = CAN_TSR;
-
-               ctx->can_dev.irqs[0].posthook.action[0].instr = IRQ_PH_READ;
-               ctx->can_dev.irqs[0].posthook.action[0].read.offset = CAN_MSR;
-
-               ctx->can_dev.irqs[0].posthook.action[1].instr = IRQ_PH_READ;
-               ctx->can_dev.irqs[0].posthook.action[1].read.offset = CAN_TSR;
-                /* clear TSR: RQCP0 */
-               ctx->can_dev.irqs[0].posthook.action[2].instr = IRQ_PH_WRITE;
-               ctx->can_dev.irqs[0].posthook.action[2].write.offset = CAN_TSR;
-               ctx->can_dev.irqs[0].posthook.action[2].write.value  = 0;
-               ctx->can_dev.irqs[0].posthook.action[2].write.mask   = 0x1 << 0;
-               /* clear TSR: RQCP1 */
-               ctx->can_dev.irqs[0].posthook.action[3].instr = IRQ_PH_WRITE;
-               ctx->can_dev.irqs[0].posthook.action[3].write.offset = CAN_TSR;
-               ctx->can_dev.irqs[0].posthook.action[3].write.value  = 0;
-               ctx->can_dev.irqs[0].posthook.action[3].write.mask   = 0x1 << 8;
-               /* clear TSR: RQCP2 */
-               ctx->can_dev.irqs[0].posthook.action[4].instr = IRQ_PH_WRITE;
-               ctx->can_dev.irqs[0].posthook.action[4].write.offset = CAN_TSR;
-               ctx->can_dev.irqs[0].posthook.action[4].write.value  = 0;
-               ctx->can_dev.irqs[0].posthook.action[4].write.mask   = 0x1 << 16;
-
-
-              /* RX0 interrupt is the consequence of RF0R register bits being
-               * set, see STRM00090, chap 32.8   (CAN Interrupts)    fig. 348
-               *                     chap 32.9.5 (CAN registers map) table 184 */
-               ctx->can_dev.irqs[1].irq  = CAN1_RX0_IRQ;
-               ctx->can_dev.irqs[1].handler = can_IRQHandler;
-               ctx->can_dev.irqs[1].mode = IRQ_ISR_STANDARD;
-               ctx->can_dev.irqs[1].posthook.status = CAN_MSR;
-               ctx->can_dev.irqs[1].posthook.data   = CAN_RF0R;
-
-               ctx->can_dev.irqs[1].posthook.action[0].instr = IRQ_PH_READ;
-               ctx->can_dev.irqs[1].posthook.action[0].read.offset = CAN_MSR;
-
-               ctx->can_dev.irqs[1].posthook.action[1].instr = IRQ_PH_READ;
-               ctx->can_dev.irqs[1].posthook.action[1].read.offset = CAN_RF0R;
-              /* We need to mask in the kernel the sources of the RX0 interrupt
-               * related to the mailboxes :
-               *   - we clear IER:FMPIE0 and it will be set again by the
-               *     user task when it calls receive.
-               *   - we clear IER:FFIE0 and it will be set again by the
-               *     user task when it empties the FIFO or if it wasn't FULL
-               *     by the local IRQ Handler
-               *   - same for overrun ! */
-               ctx->can_dev.irqs[1].posthook.action[2].instr = IRQ_PH_WRITE;
-               ctx->can_dev.irqs[1].posthook.action[2].write.offset = CAN_IER;
-               ctx->can_dev.irqs[1].posthook.action[2].write.value  = 0;
-               ctx->can_dev.irqs[1].posthook.action[2].write.mask   =
-                 CAN_IER_FMPIE0_Msk | CAN_IER_FFIE0_Msk | CAN_IER_FOVIE0_Msk;
-
-               /* RX1 interrupt is the consequence of RF1R register bits being
-                * set, see STRM00090, chap 32.8   (CAN Interrupts)    fig. 348
-                *                     chap 32.9.5 (CAN registers map) table 184 */
-               ctx->can_dev.irqs[2].irq = CAN1_RX1_IRQ;
-               ctx->can_dev.irqs[2].handler = can_IRQHandler;
-               ctx->can_dev.irqs[2].mode = IRQ_ISR_STANDARD;
-               ctx->can_dev.irqs[2].posthook.status = CAN_MSR;
-               ctx->can_dev.irqs[2].posthook.data   = CAN_RF1R;
-
-               ctx->can_dev.irqs[2].posthook.action[0].instr = IRQ_PH_READ;
-               ctx->can_dev.irqs[2].posthook.action[0].read.offset = CAN_MSR;
-
-               ctx->can_dev.irqs[2].posthook.action[1].instr = IRQ_PH_READ;
-               ctx->can_dev.irqs[2].posthook.action[1].read.offset = CAN_RF1R;
-               /* We mask in the kernel the sources of the RX1 interrupt */
-               ctx->can_dev.irqs[2].posthook.action[2].instr = IRQ_PH_WRITE;
-               ctx->can_dev.irqs[2].posthook.action[2].write.offset = CAN_IER;
-               ctx->can_dev.irqs[2].posthook.action[2].write.value  = 0;
-               ctx->can_dev.irqs[2].posthook.action[2].write.mask   =
-                 CAN_IER_FMPIE1_Msk | CAN_IER_FFIE1_Msk | CAN_IER_FOVIE1_Msk;
-
-
-               /* The Status Change SCE interrupt is the consequence of MSR
-                * register bits being set, in association with the ESR register
-                * filters.
-                * see ST RM00090, chap 32.8 (CAN Interrupts) fig. 348 */
-               ctx->can_dev.irqs[3].irq = CAN1_SCE_IRQ; /* status change*/
-               ctx->can_dev.irqs[3].handler = can_IRQHandler;
-               ctx->can_dev.irqs[3].mode = IRQ_ISR_STANDARD;
-               ctx->can_dev.irqs[3].posthook.status = CAN_MSR;
-               ctx->can_dev.irqs[3].posthook.data   = CAN_ESR;
-
-               ctx->can_dev.irqs[3].posthook.action[0].instr = IRQ_PH_READ;
-               ctx->can_dev.irqs[3].posthook.action[0].read.offset = CAN_MSR;
-               ctx->can_dev.irqs[3].posthook.action[1].instr = IRQ_PH_READ;
-               ctx->can_dev.irqs[3].posthook.action[1].read.offset = CAN_ESR;
-               /* clear MSR:SLAKI, WKUI & ERRI (previous values saved in status
-                * variable */
-               ctx->can_dev.irqs[3].posthook.action[2].instr = IRQ_PH_WRITE;
-               ctx->can_dev.irqs[3].posthook.action[2].write.offset = CAN_MSR;
-               ctx->can_dev.irqs[3].posthook.action[2].write.value  = 0x00;
-               ctx->can_dev.irqs[3].posthook.action[2].write.mask   = //0x7 << 2;
-                                CAN_MSR_SLAKI_Msk | CAN_MSR_WKUI_Msk |
-                                CAN_MSR_ERRI_Msk;
-               /* Set ESR:LEC[0:2] to 0b111 to clear the error number */
-               ctx->can_dev.irqs[3].posthook.action[3].instr = IRQ_PH_WRITE;
-               ctx->can_dev.irqs[3].posthook.action[3].write.offset = CAN_ESR;
-               ctx->can_dev.irqs[3].posthook.action[3].write.value  = 0xFFFF;
-               ctx->can_dev.irqs[3].posthook.action[3].write.mask   =
-                                CAN_ESR_LEC_Msk;
-               /* Inhibate error interrupt while the error is still there */
-               ctx->can_dev.irqs[3].posthook.action[4].instr = IRQ_PH_WRITE;
-               ctx->can_dev.irqs[3].posthook.action[4].write.offset = CAN_IER;
-               ctx->can_dev.irqs[3].posthook.action[4].write.value  = 0;
-               ctx->can_dev.irqs[3].posthook.action[4].write.mask   =
-                                CAN_IER_ERRIE_Msk  // OK !
-                              | CAN_IER_LECIE_Msk  // NOK.
-                              | CAN_IER_BOFIE_Msk  // NOK.
-                              | CAN_IER_EPVIE_Msk  // NOK.
-                              | CAN_IER_EWGIE_Msk; // NOK.
-           }
-           break;
-        case CAN_PORT_2:
-           /* TODO: to complete */
-           break;
-        default:
-           errcode = MBED_ERROR_INVPARAM;
-           goto end;
-           break;
+/* bit timing of the context, from its precomputed timing, bit rate preset or
+ * custom bit rate */
+static mbed_error_t can_bit_timing_get(const can_context_t *ctx,
+                                       can_bit_timing_t    *timing)
+{
+    static const uint32_t APB1_freq = CONFIG_CORE_FREQUENCY / CONFIG_APB1_DIVISOR;
+    uint32_t bitrate;
+    mbed_error_t errcode;
+
+    if (ctx->timing != NULL) {
+        *timing = *ctx->timing;
+        if (timing->brp == 0 || timing->brp > CAN_BT_BRP_MAX ||
+            timing->ts1 == 0 || timing->ts1 > CAN_BT_TS1_MAX ||
+            timing->ts2 == 0 || timing->ts2 > CAN_BT_TS2_MAX ||
+            timing->sjw == 0 || timing->sjw > CAN_BT_SJW_MAX) {
+            return MBED_ERROR_INVPARAM;
+        }
+        return MBED_ERROR_NONE;
     }
-    /* ... and declare it */
-    sret = sys_init(INIT_DEVACCESS, &(ctx->can_dev), &(ctx->can_dev_handle));
-    switch (sret) {
-        case SYS_E_DENIED:
-            errcode = MBED_ERROR_DENIED;
-            goto end;
+    switch (ctx->bit_rate) {
+        case CAN_SPEED_1MHZ:
+            bitrate = 1000000;
             break;
-        case SYS_E_BUSY:
-            errcode = MBED_ERROR_BUSY;
-            goto end;
+#if CONFIG_CAN_TARGET_VEHICLES
+        case CAN_SPEED_512KHZ:
+            bitrate = 512000;
             break;
-        case SYS_E_INVAL:
-            errcode = MBED_ERROR_INITFAIL;
-            goto end;
+#endif
+#if CONFIG_CAN_TARGET_AUTOMATONS
+        case CAN_SPEED_384KHZ:
+            bitrate = 384000;
             break;
-        default:
+#endif
+        case CAN_SPEED_CUSTOM:
+            bitrate = ctx->bitrate;
             break;
-
+        default:
+            return MBED_ERROR_INVPARAM;
     }
-    errcode = MBED_ERROR_NONE;
-end:
-   return errcode;
+    errcode = can_bit_timing_solve(APB1_freq, bitrate, ctx->sample_point, timing);
+    if (errcode != MBED_ERROR_NONE) {
+        return errcode;
+    }
+    if (timing->error_ppm > CAN_BIT_TIMING_MAX_ERROR_PPM ||
+        timing->error_ppm < -CAN_BIT_TIMING_MAX_ERROR_PPM) {
+        /* too far from the requested bit rate for this APB1 clock */
+        return MBED_ERROR_UNSUPORTED;
+    }
+    return MBED_ERROR_NONE;
 }
 
 /*******************************************************************************
- *          INITIALIZE CAN DEVICE
+ *          INITIALIZATION MODE TRANSITIONS
+ *
+ * Entering and leaving the initialization mode is requested with MCR:INRQ and
+ * acknowledged by the controller with MSR:INAK once the bus allows it: at the
+ * end of the current frame to enter it, after 11 recessive bits to leave it.
+ * No interrupt is raised on this acknowledgment. Each transition is then
+ * requested, the context being in one of the pending states, and
+ * can_transition_poll() makes it progress until it completes or times out.
+ * The blocking functions poll it themselves.
  ******************************************************************************/
-mbed_error_t can_initialize(__inout can_context_t *ctx)
+
+static inline bool can_state_pending(can_state_t state)
 {
-    volatile int check = 0;
-    uint32_t check_nb  = 0;
+    return state == CAN_STATE_INITIALIZING
+        || state == CAN_STATE_STARTING
+        || state == CAN_STATE_STOPPING;
+}
 
-    if (!ctx) {
-        return MBED_ERROR_INVPARAM;
+/* the INRQ request has been written, the transition is now pending */
+static void can_transition_request(can_context_t *ctx,
+                                   can_state_t    pending,
+                                   uint32_t       timeout_us,
+                                   bool           notify)
+{
+    uint64_t now = 0;
+
+    sys_get_systick(&now, PREC_MICRO);
+    ctx->transition_prev    = ctx->state;
+    ctx->transition_notify  = notify;
+    ctx->transition_timeout = timeout_us;
+    ctx->transition_start   = now;
+    can_profile_inak_begin(ctx->id);
+    ctx->state = pending;
+}
+
+/* on timeout, get back to the state preceding the transition request */
+static void can_transition_cancel(can_context_t *ctx)
+{
+    switch (ctx->state) {
+        case CAN_STATE_INITIALIZING:
+            clear_reg_bits(r_CANx_MCR(ctx->id), CAN_MCR_INRQ_Msk);
+            if (ctx->transition_prev == CAN_STATE_SLEEP) {
+                set_reg_bits(r_CANx_MCR(ctx->id), CAN_MCR_SLEEP_Msk);
+            }
+            break;
+        case CAN_STATE_STARTING:
+            /* stay in initialization mode, interrupts disabled */
+            write_reg_value(r_CANx_IER(ctx->id), 0);
+            set_reg_bits(r_CANx_MCR(ctx->id), CAN_MCR_INRQ_Msk);
+            break;
+        case CAN_STATE_STOPPING:
+            /* stay in normal mode */
+            clear_reg_bits(r_CANx_MCR(ctx->id), CAN_MCR_INRQ_Msk);
+            break;
+        default:
+            break;
     }
+    ctx->state = ctx->transition_prev;
+}
 
-    /* Awake (exit sleep mode) and request initialization, cf RM00090, 32.4.3 */
-    clear_reg_bits(r_CANx_MCR(ctx->id), CAN_MCR_SLEEP_Msk);
-    set_reg_bits  (r_CANx_MCR(ctx->id), CAN_MCR_INRQ_Msk);
+/* busy wait for the completion of the transition just requested */
+static mbed_error_t can_transition_wait(can_context_t *ctx)
+{
+    mbed_error_t errcode;
 
-    /* waiting for init mode acknowledgment, i.e. that the INAK bit be set */
-    check_nb = 0;
     do {
-        check = *r_CANx_MSR(ctx->id) & CAN_MSR_INAK_Msk;
-        check_nb++;
-    } while ((check == 0) && (check_nb < MAX_BUSY_WAITING_CYCLES));
-    if (check_nb == MAX_BUSY_WAITING_CYCLES) {
-        goto err;
-    }
+        errcode = can_transition_poll(ctx);
+    } while (errcode == MBED_ERROR_BUSY);
+    return errcode;
+}
+
+/*
+ * Configure the controller once in initialization mode, the only mode in
+ * which the MCR options and the BTR register can be written.
+ */
+static mbed_error_t can_initialize_finish(can_context_t *ctx)
+{
+    mbed_error_t errcode;
+
     ctx->state = CAN_STATE_INIT;
 
     if (ctx->timetrigger) {
@@ -516,11 +2559,11 @@ mbed_error_t can_initialize(__inout can_context_t *ctx)
     }
 
     if (ctx->rxfifolocked) {
-        /* Auto wake up mode */
-        clear_reg_bits(r_CANx_MCR(ctx->id), CAN_MCR_RFLM_Msk);
-    } else {
-        /* or not...  */
+        /* Rx FIFO locked: on overrun, the new frame is discarded */
         set_reg_bits(r_CANx_MCR(ctx->id), CAN_MCR_RFLM_Msk);
+    } else {
+        /* or not, the last frame being overwritten  */
+        clear_reg_bits(r_CANx_MCR(ctx->id), CAN_MCR_RFLM_Msk);
     }
 
     if (ctx->txfifoprio) {
@@ -557,71 +2600,156 @@ mbed_error_t can_initialize(__inout can_context_t *ctx)
             break;
     }
 
-   /** CAN Hardware Configuration
-    *
-    * Set TS1, TS2 and prescaler so as to get the proper values...
-    * See RM0090 6.1.3 page 152 and BTR register.
-    *
-    * The baud rate is the inverse of the Nominal Bit Time
-    *   1 / br = t_q + t_BS1 + t_BS2
-    * Bit Segment 1 : t_BS1 = (TS1 +1) * t_q
-    * Bit Segment 2 : t_BS2 = (TS2 +1) * t_q
-    *   1 / br = (TS1 + TS2 +3)*t_q
-    *
-    *  Time quantum : t_q = (BRP +1) * t_p_apb1_clk,
-    *  with BRP as Baud Rate Prescaler, that divides the APB1 clock frequency.
-    */
-    static const uint32_t APB1_freq = CONFIG_CORE_FREQUENCY / CONFIG_APB1_DIVISOR;
-    uint32_t brp, ts1, ts2, sjw;
+    /* set the bit timing, BTR fields holding the number of quanta - 1 */
+    set_reg(r_CANx_BTR(ctx->id), ctx->bit_timing.brp - 1, CAN_BTR_BRP);
+    set_reg(r_CANx_BTR(ctx->id), ctx->bit_timing.ts1 - 1, CAN_BTR_TS1);
+    set_reg(r_CANx_BTR(ctx->id), ctx->bit_timing.ts2 - 1, CAN_BTR_TS2);
+    set_reg(r_CANx_BTR(ctx->id), ctx->bit_timing.sjw - 1, CAN_BTR_SJW);
 
-    sjw = 1;  // synchronization jump width = SJW * t_q
+    /* Split the filter banks between CAN1 and CAN2. The split is a build
+     * time constant, so whichever controller is initialized first sets it,
+     * and the other one finds it already set without disturbing its banks */
+    if (get_reg(r_CAN_FMR, CAN_FMR_CAN2SB) != CONFIG_USR_DRV_CAN_CAN2SB) {
+        set_reg_bits(r_CAN_FMR, CAN_FMR_FINIT_Msk);
+        set_reg(r_CAN_FMR, CONFIG_USR_DRV_CAN_CAN2SB, CAN_FMR_CAN2SB);
+        /* Quit Filter initialization */
+        clear_reg_bits(r_CAN_FMR, CAN_FMR_FINIT_Msk);
+    }
+    /* Install the context filters, or everything on FIFO 0 if none. Filters
+     * that do not fit are reported in ctx->filters_unfit and are not an
+     * initialization failure, a controller left without any bank is */
+    errcode = can_filters_install(ctx);
+    if (errcode == MBED_ERROR_INVPARAM || errcode == MBED_ERROR_NOMEM) {
+        return errcode;
+    }
 
-    switch (ctx->bit_rate) {
-      case CAN_SPEED_1MHZ:
-        ts1 = 12;
-        ts2 =  6;
-        brp = APB1_freq / (1000000 * (ts1 + ts2 + 3)) -1;
-        break;
+    /* update current state */
+    ctx->state = CAN_STATE_READY;
+
+    /* end of initialization */
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t can_transition_poll(__inout can_context_t *ctx)
+{
+    uint32_t expected;
+    uint64_t now = 0;
+    can_event_t event;
+    can_error_t err = CAN_ERROR_NONE;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (ctx == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto end;
+    }
+    switch (ctx->state) {
+        case CAN_STATE_INITIALIZING:
+            expected = CAN_MSR_INAK_Msk;
+            event = CAN_EVENT_INIT_COMPLETE;
+            break;
+        case CAN_STATE_STARTING:
+            expected = 0;
+            event = CAN_EVENT_START_COMPLETE;
+            break;
+        case CAN_STATE_STOPPING:
+            expected = CAN_MSR_INAK_Msk;
+            event = CAN_EVENT_STOP_COMPLETE;
+            break;
+        default:
+            /* no pending transition */
+            goto end;
+            break;
+    }
+
+    if ((*r_CANx_MSR(ctx->id) & CAN_MSR_INAK_Msk) == expected) {
+        can_profile_inak_end(ctx->id);
+        switch (ctx->state) {
+            case CAN_STATE_INITIALIZING:
+                errcode = can_initialize_finish(ctx);
+                break;
+            case CAN_STATE_STARTING:
+                ctx->state = CAN_STATE_STARTED;
+                break;
+            default:
+                /* Exit from sleep mode */
+                clear_reg_bits(r_CANx_MCR(ctx->id), CAN_MCR_SLEEP_Msk);
+                ctx->state = CAN_STATE_READY;
+                break;
+        }
+    } else {
+        sys_get_systick(&now, PREC_MICRO);
+        if ((now - ctx->transition_start) < ctx->transition_timeout) {
+            errcode = MBED_ERROR_BUSY;
+            goto end;
+        }
+        /* missing transceiver, or bus stuck at dominant level */
+        can_profile_inak_end(ctx->id);
+        can_transition_cancel(ctx);
+        err = CAN_ERROR_INAK_TIMEOUT;
+        errcode = MBED_ERROR_INITFAIL;
+    }
+    if (ctx->transition_notify) {
+        can_event(event, ctx->id, err);
+    }
+end:
+    return errcode;
+}
+
+/*******************************************************************************
+ *          INITIALIZE CAN DEVICE
+ ******************************************************************************/
+static mbed_error_t can_initialize_request(can_context_t *ctx,
+                                           uint32_t       timeout_us,
+                                           bool           notify)
+{
+    mbed_error_t errcode;
 
-      default:
-        brp =  3;
-        ts1 = 14;
-        ts2 =  6;
+    if (!ctx) {
+        return MBED_ERROR_INVPARAM;
+    }
+    if (can_state_pending(ctx->state)) {
+        return MBED_ERROR_BUSY;
+    }
+    /* solve the bit timing and check the filters first, so that an invalid
+     * configuration leaves the controller untouched */
+    errcode = can_bit_timing_get(ctx, &ctx->bit_timing);
+    if (errcode != MBED_ERROR_NONE) {
+        return errcode;
     }
+    if (can_filters_check(ctx->filters,
+                          (ctx->filters != NULL) ? ctx->filters_num : 0) != MBED_ERROR_NONE) {
+        return MBED_ERROR_INVPARAM;
+    }
+
+    /* Awake (exit sleep mode) and request initialization, cf RM00090, 32.4.3 */
+    clear_reg_bits(r_CANx_MCR(ctx->id), CAN_MCR_SLEEP_Msk);
+    set_reg_bits  (r_CANx_MCR(ctx->id), CAN_MCR_INRQ_Msk);
+    can_transition_request(ctx, CAN_STATE_INITIALIZING, timeout_us, notify);
+    return MBED_ERROR_NONE;
+}
 
-     set_reg(r_CANx_BTR(ctx->id), brp, CAN_BTR_BRP);
-     set_reg(r_CANx_BTR(ctx->id), ts1, CAN_BTR_TS1);
-     set_reg(r_CANx_BTR(ctx->id), ts2, CAN_BTR_TS2);
-     set_reg(r_CANx_BTR(ctx->id), sjw, CAN_BTR_SJW);
+mbed_error_t can_initialize_async(__inout can_context_t *ctx,
+                                  const __in uint32_t    timeout_us)
+{
+    return can_initialize_request(ctx, timeout_us, true);
+}
 
+mbed_error_t can_initialize_timeout(__inout can_context_t *ctx,
+                                    const __in uint32_t    timeout_us)
+{
+    mbed_error_t errcode;
 
-    /* Enter filter initialization mode, only for the master : CAN1 */
-    if (ctx->id == 1) {
-        set_reg_bits(r_CAN_FMR, CAN_FMR_FINIT_Msk);
-        /* Half of the filters (14) for CAN1 and half for CAN2 (Reset value)*/
-        set_reg(r_CAN_FMR, 14, CAN_FMR_CAN2SB);
-        /* Simple filtering :
-         * - everything for CAN1, on FIFO 0.
-         * - nothing for CAN2.
-         */
-         *r_CAN_FM1R  = 0; // Two 32bits registers in mask mode for all.
-         *r_CAN_FS1R  = 1; // Filter #0 : a single 32-bits scale configuration.
-         *r_CAN_FFA1R = 0; // All filters are assigned to FIFO 0.
-         *r_CAN_FA1R  = 0; // No filter activated !
-         *r_CAN_F0R1  = 0; // Filter #0, bit mask at 0 = Don't care !
-         *r_CAN_F0R2  = 0; // idem for all other filters.
-         *r_CAN_FA1R  = 1; // Filter #0 is activated !
-         /* Quit Filter initialization */
-         clear_reg_bits(r_CAN_FMR, CAN_FMR_FINIT_Msk);
+    errcode = can_initialize_request(ctx, timeout_us, false);
+    if (errcode == MBED_ERROR_NONE) {
+        /* waiting for init mode acknowledgment, i.e. that the INAK bit be set */
+        errcode = can_transition_wait(ctx);
     }
+    return errcode;
+}
 
-    /* update current state */
-    ctx->state = CAN_STATE_READY;
-
-    /* end of initialization */
-    return MBED_ERROR_NONE;
-err:
-    return MBED_ERROR_UNKNOWN;
+mbed_error_t can_initialize(__inout can_context_t *ctx)
+{
+    return can_initialize_timeout(ctx, CONFIG_USR_DRV_CAN_INAK_TIMEOUT);
 }
 
 /*******************************************************************************
@@ -632,6 +2760,10 @@ mbed_error_t can_release(__inout can_context_t *ctx)
     if (ctx == NULL) {
         return MBED_ERROR_INVPARAM;
     }
+    /* CAN2 still relies on the CAN1 filter banks and clock */
+    if (ctx->id == CAN_PORT_1 && can_ctx_table[CAN_PORT_2 - 1] != NULL) {
+        return MBED_ERROR_BUSY;
+    }
     if (can_stop(ctx) != MBED_ERROR_NONE) {
         return MBED_ERROR_INVSTATE;
     }
@@ -642,53 +2774,84 @@ mbed_error_t can_release(__inout can_context_t *ctx)
     if (sys_cfg(CFG_DEV_RELEASE, (uint32_t)ctx->can_dev_handle) != SYS_E_DONE) {
         return MBED_ERROR_INVSTATE;
     }
+    can_ctx_table[ctx->id - 1] = NULL;
     return MBED_ERROR_NONE;
 }
 
 /*******************************************************************************
  *           SET FILTERS
  *
- * set filters (can be done outside initialization mode)
+ * set filters (can be done outside initialization mode). Filter banks are
+ * modified in filter initialization mode, which does not require the
+ * controller to be in initialization mode.
  ******************************************************************************/
 mbed_error_t can_set_filters(__in can_context_t *ctx)
 {
-    volatile can_filters_table_t * filter_table;
-    mbed_error_t err = MBED_ERROR_NONE;
-
-    if (ctx->id == 1) {
-        filter_table = r_CAN1_FxRy();
-    } else if (ctx->id == 2) {
-        filter_table = r_CAN2_FxRy();
-    } else {
-        err = MBED_ERROR_INVPARAM;
+    if (ctx == NULL) {
+        return MBED_ERROR_INVPARAM;
     }
+    if (ctx->id != CAN_PORT_1 && ctx->id != CAN_PORT_2) {
+        return MBED_ERROR_INVPARAM;
+    }
+    /* Returns MBED_ERROR_NOSTORAGE if some filters did not fit, these
+     * being reported in ctx->filters_unfit, MBED_ERROR_NOMEM if none did */
+    return can_filters_install(ctx);
+}
 
-    /* TODO Waiting for FACTx bits to be cleared */
-
-    /* Enter filter initialization */
-    set_reg_bits(r_CAN_FMR, CAN_FMR_FINIT_Msk);
-
-    /* Quit Filter initialization */
-    clear_reg_bits(r_CAN_FMR, CAN_FMR_FINIT_Msk);
+#if CONFIG_USR_DRV_CAN_RX_BALANCE
+mbed_error_t can_filter_fifo(const __in  can_context_t *ctx,
+                             const __in  uint8_t        index,
+                                   __out can_fifo_t    *fifo)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
 
-    /* TODO handle communication filters */
-    return err;
+    /* sanitize */
+    if (ctx == NULL || fifo == NULL || ctx->filters == NULL ||
+        index >= ctx->filters_num) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (index >= ctx->filters_num - ctx->filters_unfit) {
+#if CONFIG_USR_DRV_CAN_SW_FILTER
+        if (ctx->sw_filter.active) {
+            /* superset banks */
+            *fifo = CAN_FIFO_0;
+            goto err;
+        }
+#endif
+        errcode = MBED_ERROR_NOTFOUND;
+        goto err;
+    }
+    *fifo = (ctx->rxbalanced && can_filter_in(ctx->filters_fifo1, index, CAN_FIFO_1)) ?
+            CAN_FIFO_1 : CAN_FIFO_0;
+err:
+    return errcode;
 }
+#endif
 
 /*******************************************************************************
  *         START CAN CONTROLLER
  *
  * start the CAN (required after initialization or filters setting)
  ******************************************************************************/
-mbed_error_t can_start(__inout can_context_t *ctx)
+static mbed_error_t can_start_request(can_context_t *ctx,
+                                      uint32_t       timeout_us,
+                                      bool           notify)
 {
-    volatile int check = 0;
-    uint32_t check_nb  = 0;
-
+    if (ctx == NULL) {
+        return MBED_ERROR_INVPARAM;
+    }
     if (ctx->state != CAN_STATE_READY) {
-        return MBED_ERROR_INVSTATE;
+        return can_state_pending(ctx->state) ? MBED_ERROR_BUSY
+                                             : MBED_ERROR_INVSTATE;
     }
 
+#if CONFIG_USR_DRV_CAN_TIMESTAMP
+    /* origin of the extended time stamps */
+    sys_get_systick(&ctx->ts_start, PREC_MICRO);
+    ctx->ts_synced = false;
+#endif
+
     /* enable CAN interrupts if in IT mode */
     if (ctx->access == CAN_ACCESS_IT) {
         uint32_t ier_val = 0;
@@ -706,72 +2869,437 @@ mbed_error_t can_start(__inout can_context_t *ctx)
 
     /* Request Normal mode */
     clear_reg_bits(r_CANx_MCR(ctx->id), CAN_MCR_INRQ_Msk);
+    can_transition_request(ctx, CAN_STATE_STARTING, timeout_us, notify);
+    return MBED_ERROR_NONE;
+}
 
-    /* waiting for Normal mode acknowledgment, i.e. that INAK bit be cleared */
-    check_nb = 0;
-    do {
-        check = *r_CANx_MSR(ctx->id) & CAN_MSR_INAK_Msk;
-        check_nb++;
-    } while ((check != 0) && check_nb < MAX_BUSY_WAITING_CYCLES);
-    if (check_nb == MAX_BUSY_WAITING_CYCLES) {
-      return MBED_ERROR_UNKNOWN;
+mbed_error_t can_start_async(__inout can_context_t *ctx,
+                             const __in uint32_t    timeout_us)
+{
+    return can_start_request(ctx, timeout_us, true);
+}
+
+mbed_error_t can_start_timeout(__inout can_context_t *ctx,
+                               const __in uint32_t    timeout_us)
+{
+    mbed_error_t errcode;
+
+    errcode = can_start_request(ctx, timeout_us, false);
+    if (errcode == MBED_ERROR_NONE) {
+        /* waiting for Normal mode acknowledgment, i.e. that INAK bit be cleared */
+        errcode = can_transition_wait(ctx);
+    }
+    return errcode;
+}
+
+mbed_error_t can_start(__inout can_context_t *ctx)
+{
+    return can_start_timeout(ctx, CONFIG_USR_DRV_CAN_INAK_TIMEOUT);
+}
+
+/*******************************************************************************
+ *         STOP CAN CONTROLLER
+ ******************************************************************************/
+static mbed_error_t can_stop_request(can_context_t *ctx,
+                                     uint32_t       timeout_us,
+                                     bool           notify)
+{
+    if (ctx == NULL) {
+        return MBED_ERROR_INVPARAM;
+    }
+    if (ctx->state != CAN_STATE_STARTED) {
+        return can_state_pending(ctx->state) ? MBED_ERROR_BUSY
+                                             : MBED_ERROR_INVSTATE;
+    }
+    set_reg_bits(r_CANx_MCR(ctx->id), CAN_MCR_INRQ_Msk);
+    can_transition_request(ctx, CAN_STATE_STOPPING, timeout_us, notify);
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t can_stop_async(__inout can_context_t *ctx,
+                            const __in uint32_t    timeout_us)
+{
+    return can_stop_request(ctx, timeout_us, true);
+}
+
+mbed_error_t can_stop_timeout(__inout can_context_t *ctx,
+                              const __in uint32_t    timeout_us)
+{
+    mbed_error_t errcode;
+
+    errcode = can_stop_request(ctx, timeout_us, false);
+    if (errcode == MBED_ERROR_NONE) {
+        /* waiting for init mode acknowledgment */
+        errcode = can_transition_wait(ctx);
+    }
+    return errcode;
+}
+
+mbed_error_t can_stop(__inout can_context_t *ctx)
+{
+    return can_stop_timeout(ctx, CONFIG_USR_DRV_CAN_INAK_TIMEOUT);
+}
+
+/*******************************************************************************
+ *           EMIT CAN FRAME
+ *
+ * Send data into one of the CAN Tx MBox
+ *******************************************************************************/
+mbed_error_t can_xmit(const __in  can_context_t *ctx,
+                            __in  can_header_t  *header,
+                            __in  can_data_t    *data,
+                            __out can_mbox_t    *mbox)
+{
+    can_packed_frame_t frame;
+
+    /* sanitize */
+    if (!ctx || !data || !header || !mbox) {
+        return MBED_ERROR_INVPARAM;
+    }
+    if (header->IDE != CAN_ID_STD && header->IDE != CAN_ID_EXT) {
+        /* invalid header format */
+        return MBED_ERROR_INVPARAM;
+    }
+    can_frame_pack(header, data, &frame);
+    /* Clear RTR bit to ensure that a data frame is emitted */
+    frame.id &= ~CAN_TIxR_RTR_Msk;
+
+    return can_xmit_packed(ctx, &frame, mbox);
+}
+
+/*******************************************************************************
+ *           EMIT PACKED CAN FRAME
+ *
+ * Send a packed frame into one of the CAN Tx MBox, using word accesses only
+ *******************************************************************************/
+mbed_error_t can_xmit_packed(const __in  can_context_t      *ctx,
+                             const __in  can_packed_frame_t *frame,
+                                   __out can_mbox_t         *mbox)
+{
+    uint32_t tme;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    can_profile_begin(t0);
+
+    /* sanitize */
+    if (!ctx || !frame || !mbox) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (ctx->state != CAN_STATE_STARTED) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+#if CONFIG_USR_DRV_CAN_TX_QUEUE
+    if (ctx->txqueued) {
+        errcode = can_tx_queue_push(ctx, frame, mbox);
+        goto err;
+    }
+#endif
+    tme = get_reg_value(r_CANx_TSR(ctx->id), CAN_TSR_TME_Msk, CAN_TSR_TME_Pos);
+#if CONFIG_USR_DRV_CAN_TX_DEADLINE
+    tme = can_tx_deadline_free(ctx, tme);
+    if (tme == 0x0) {
+        /* make room by aborting the expired frames, if any */
+        tme = can_tx_deadline_check(ctx);
+    }
+#endif
+    if (tme == 0x0) {
+        /* no mailbox empty */
+        errcode = MBED_ERROR_BUSY;
+        goto err;
+    }
+    /* select first empty mbox */
+    *mbox = can_tme_first(tme);
+    can_mbox_write(ctx, *mbox, frame);
+err:
+    can_profile_end(CAN_PROBE_XMIT, t0);
+    return errcode;
+}
+
+/*******************************************************************************
+ *           EMIT PACKED CAN FRAMES BURST
+ *
+ * Send up to n packed frames, in the given order, reading the mailboxes state
+ * once and filling every empty mailbox. The number of frames accepted is
+ * returned in *accepted, the remaining ones are left to the caller.
+ *******************************************************************************/
+mbed_error_t can_xmit_burst(const __in  can_context_t      *ctx,
+                            const __in  can_packed_frame_t  frames[],
+                            const __in  uint32_t            n,
+                                  __out uint32_t           *accepted,
+                                  __out can_mbox_t          mboxes[])
+{
+    uint32_t tme;
+    uint32_t i = 0;
+    can_mbox_t mbox;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    can_profile_begin(t0);
+
+    /* sanitize */
+    if (!ctx || !frames || !accepted) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    *accepted = 0;
+    if (ctx->state != CAN_STATE_STARTED) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+#if CONFIG_USR_DRV_CAN_TX_QUEUE
+    if (ctx->txqueued) {
+        while (i < n && can_tx_queue_push(ctx, &frames[i], &mbox) == MBED_ERROR_NONE) {
+            if (mboxes) {
+                mboxes[i] = mbox;
+            }
+            i++;
+        }
+        goto end;
+    }
+#endif
+    tme = get_reg_value(r_CANx_TSR(ctx->id), CAN_TSR_TME_Msk, CAN_TSR_TME_Pos);
+#if CONFIG_USR_DRV_CAN_TX_DEADLINE
+    tme = can_tx_deadline_free(ctx, tme);
+    if ((uint32_t)__builtin_popcount(tme) < n) {
+        /* make room by aborting the expired frames, if any */
+        tme = can_tx_deadline_check(ctx);
+    }
+#endif
+    while (i < n && tme != 0) {
+        mbox = can_tme_first(tme);
+        can_mbox_write(ctx, mbox, &frames[i]);
+        tme &= ~(0x1UL << mbox);
+        if (mboxes) {
+            mboxes[i] = mbox;
+        }
+        i++;
+    }
+#if CONFIG_USR_DRV_CAN_TX_QUEUE
+end:
+#endif
+    *accepted = i;
+    if (i == 0 && n != 0) {
+        /* no mailbox empty (or queue full) */
+        errcode = MBED_ERROR_BUSY;
+    }
+err:
+    can_profile_end(CAN_PROBE_XMIT, t0);
+    return errcode;
+}
+
+#if CONFIG_USR_DRV_CAN_TX_DEADLINE
+/*******************************************************************************
+ *           EMIT PACKED CAN FRAME WITH DEADLINE
+ *
+ * Same as can_xmit_packed(), the frame being aborted by the driver if it is
+ * still pending once its lifetime is over, so that a stale frame does not
+ * hold a mailbox in front of newer data.
+ *******************************************************************************/
+mbed_error_t can_xmit_deadline(const __in  can_context_t      *ctx,
+                               const __in  can_packed_frame_t *frame,
+                               const __in  uint32_t            lifetime_us,
+                                     __out can_mbox_t         *mbox)
+{
+    uint32_t tme;
+    uint64_t now = 0;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    can_profile_begin(t0);
+
+    /* sanitize */
+    if (!ctx || !frame || !mbox) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (ctx->state != CAN_STATE_STARTED) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+#if CONFIG_USR_DRV_CAN_TX_QUEUE
+    if (ctx->txqueued) {
+        /* queued frames get their mailbox from the ISR */
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+#endif
+    tme = can_tx_deadline_free(ctx,
+            get_reg_value(r_CANx_TSR(ctx->id), CAN_TSR_TME_Msk, CAN_TSR_TME_Pos));
+    if (tme == 0x0) {
+        tme = can_tx_deadline_check(ctx);
+    }
+    if (tme == 0x0) {
+        /* no mailbox empty */
+        errcode = MBED_ERROR_BUSY;
+        goto err;
+    }
+    *mbox = can_tme_first(tme);
+    can_mbox_write(ctx, *mbox, frame);
+    if (lifetime_us != 0) {
+        sys_get_systick(&now, PREC_MICRO);
+        ((can_context_t*)ctx)->tx_deadline[*mbox] = now + lifetime_us;
+    }
+err:
+    can_profile_end(CAN_PROBE_XMIT, t0);
+    return errcode;
+}
+
+/*******************************************************************************
+ *           ABORT EXPIRED CAN FRAMES
+ *
+ * For periodic calls (e.g. at each control loop period), so that expired
+ * frames are aborted even when no new frame is sent.
+ *******************************************************************************/
+mbed_error_t can_tx_expire(const __in can_context_t *ctx)
+{
+    /* sanitize */
+    if (!ctx) {
+        return MBED_ERROR_INVPARAM;
+    }
+    if (ctx->state != CAN_STATE_STARTED) {
+        return MBED_ERROR_INVSTATE;
+    }
+    can_tx_deadline_check(ctx);
+    return MBED_ERROR_NONE;
+}
+#endif
+
+/*******************************************************************************
+ *          RECEIVE CAN FRAME
+ *
+ * Get back data from one of the CAN Rx FIFO
+ ******************************************************************************/
+mbed_error_t can_receive(const __in  can_context_t *ctx,
+                         const __in  can_fifo_t     fifo,
+                               __out can_header_t  *header,
+                               __out can_data_t    *data)
+{
+    can_packed_frame_t frame;
+    mbed_error_t errcode;
+
+    /* sanitize */
+    if (!data || !header) {
+        return MBED_ERROR_INVPARAM;
+    }
+    errcode = can_receive_packed(ctx, fifo, &frame);
+    if (errcode == MBED_ERROR_NONE) {
+        can_frame_unpack(&frame, header, data);
+        can_header_stamp(ctx, header);
+    }
+    return errcode;
+}
+
+/*******************************************************************************
+ *          RECEIVE PACKED CAN FRAME
+ *
+ * Get back a packed frame from one of the CAN Rx FIFO, using word accesses
+ * only
+ ******************************************************************************/
+mbed_error_t can_receive_packed(const __in  can_context_t      *ctx,
+                                const __in  can_fifo_t          fifo,
+                                      __out can_packed_frame_t *frame)
+{
+    volatile uint32_t *can_rfxr;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    can_profile_begin(t0);
+
+    /* sanitize */
+    if (!ctx || !frame) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (ctx->state != CAN_STATE_STARTED) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+#if CONFIG_USR_DRV_CAN_RX_DIRECT
+    if (ctx->rxdirect) {
+        /* frames are handed to can_rx_frame() by the ISR */
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+#endif
+    switch (fifo) {
+        case CAN_FIFO_0:
+            can_rfxr  = r_CANx_RF0R(ctx->id);
+            break;
+        case CAN_FIFO_1:
+            can_rfxr  = r_CANx_RF1R(ctx->id);
+            break;
+        default:
+            errcode = MBED_ERROR_INVPARAM;
+            goto err;
+            break;
     }
-
-    ctx->state = CAN_STATE_STARTED;
-    return MBED_ERROR_NONE;
-}
-
-/*******************************************************************************
- *         STOP CAN CONTROLLER
- ******************************************************************************/
-mbed_error_t can_stop(__inout can_context_t *ctx)
-{
-    volatile int check = 0;
-    uint32_t check_nb  = 0;
-
-    if (ctx == NULL) {
-        return MBED_ERROR_INVPARAM;
+#if CONFIG_USR_DRV_CAN_RX_RING
+    if (ctx->rxbuffered) {
+        /* the context is owned by the user task, only the consumer index
+         * is updated here */
+        can_rx_ring_t *ring = (can_rx_ring_t*)&ctx->rx_ring[fifo];
+        uint32_t tail = ring->tail;
+
+        if (tail == ring->head) {
+            errcode = MBED_ERROR_NOTREADY;
+            goto err;
+        }
+        can_barrier();
+        *frame = ring->slots[tail & CAN_RX_RING_MASK];
+        can_barrier();
+        ring->tail = tail + 1;
+        can_rx_ring_release(ctx, fifo, ring);
+        can_profile_rx_received(ctx->id, fifo);
+        goto err;
     }
-    if (ctx->state != CAN_STATE_STARTED) {
-        return MBED_ERROR_INVSTATE;
+#endif
+#if CONFIG_USR_DRV_CAN_SW_FILTER
+    /* release frames rejected by the software filter */
+    can_sw_filter_flush(ctx, fifo);
+#endif
+    if (ctx->access == CAN_ACCESS_POLL) {
+        /* no ISR to acknowledge the FIFO full and overrun events */
+        can_fifo_ack(ctx, fifo, *can_rfxr);
     }
-    set_reg_bits(r_CANx_MCR(ctx->id), CAN_MCR_INRQ_Msk);
-    /* waiting for init mode acknowledgment */
-    check_nb = 0;
-    do {
-        check = *r_CANx_MSR(ctx->id) & CAN_MSR_INAK_Msk;
-        check_nb++;
-    } while ((check == 0) && (check_nb < MAX_BUSY_WAITING_CYCLES));
-    if (check_nb == MAX_BUSY_WAITING_CYCLES) {
-      return MBED_ERROR_UNKNOWN;
+    /* is current fifo empty ? */
+    if ((*can_rfxr & CAN_RFxR_FMPx_Msk) == 0U) {
+        errcode = MBED_ERROR_NOTREADY;
+        goto err;
     }
 
-    /* Exit from sleep mode */
-    clear_reg_bits(r_CANx_MCR(ctx->id), CAN_MCR_SLEEP_Msk);
+    /* read the message from mailbox 0 of current FIFO and release it */
+    can_fifo_read(ctx, fifo, can_rfxr, frame);
+    can_profile_rx_received(ctx->id, fifo);
 
-    ctx->state = CAN_STATE_READY;
-    return MBED_ERROR_NONE;
+    /* restore interruptions on the FIFO to get another frame */
+    can_fifo_irq_restore(ctx, fifo);
+err:
+    can_profile_end(CAN_PROBE_RECEIVE, t0);
+    return errcode;
 }
 
 /*******************************************************************************
- *           EMIT CAN FRAME
+ *          PEEK AND COMMIT RECEIVED CAN FRAME
  *
- * Send data into one of the CAN Tx MBox
- *******************************************************************************/
-mbed_error_t can_xmit(const __in  can_context_t *ctx,
-                            __in  can_header_t  *header,
-                            __in  can_data_t    *data,
-                            __out can_mbox_t    *mbox)
+ * Give a read-only access to the next received frame, without releasing it:
+ * in buffered mode, the frame is the slot of the software ring, otherwise a
+ * copy of the output mailbox of the hardware FIFO, read with volatile loads
+ * as any register. The frame stays in place until can_receive_commit().
+ ******************************************************************************/
+
+/* copies of the hardware FIFOs output mailbox, per port and FIFO */
+static can_packed_frame_t can_peek_frames[2][2];
+
+mbed_error_t can_receive_peek(const __in  can_context_t       *ctx,
+                              const __in  can_fifo_t           fifo,
+                                    __out const can_packed_frame_t **frame)
 {
-    uint32_t tme;
-    volatile uint32_t *can_tdlxr;
-    volatile uint32_t *can_tdhxr;
-    volatile uint32_t *can_tixr;
-    volatile uint32_t *can_tdtxr;
+    volatile uint32_t *can_rfxr;
+    volatile can_mbox_regs_t *regs;
+    can_packed_frame_t *copy;
     mbed_error_t errcode = MBED_ERROR_NONE;
 
     /* sanitize */
-    if (!ctx || !data || !header || !mbox) {
+    if (!ctx || !frame) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (fifo != CAN_FIFO_0 && fifo != CAN_FIFO_1) {
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
@@ -779,96 +3307,128 @@ mbed_error_t can_xmit(const __in  can_context_t *ctx,
         errcode = MBED_ERROR_INVSTATE;
         goto err;
     }
-    tme = get_reg_value(r_CANx_TSR(ctx->id), CAN_TSR_TME_Msk, CAN_TSR_TME_Pos);
-    if (tme == 0x0) {
-        /* no mailbox empty */
-        errcode = MBED_ERROR_BUSY;
+#if CONFIG_USR_DRV_CAN_RX_DIRECT
+    if (ctx->rxdirect) {
+        /* frames are handed to can_rx_frame() by the ISR */
+        errcode = MBED_ERROR_INVSTATE;
         goto err;
     }
-    /* select first empty mbox */
-    if ((tme & 0x1)) {
-        *mbox = CAN_MBOX_0;
-        can_tdlxr = r_CANx_TDL0R(ctx->id);
-        can_tdhxr = r_CANx_TDH0R(ctx->id);
-        can_tixr  = r_CANx_TI0R (ctx->id);
-        can_tdtxr = r_CANx_TDT0R(ctx->id);
-    } else if (tme & 0x2) {
-        *mbox = CAN_MBOX_1;
-        can_tdlxr = r_CANx_TDL1R(ctx->id);
-        can_tdhxr = r_CANx_TDH1R(ctx->id);
-        can_tixr  = r_CANx_TI1R (ctx->id);
-        can_tdtxr = r_CANx_TDT1R(ctx->id);
-    } else if (tme & 0x4) {
-        *mbox = CAN_MBOX_2;
-        can_tdlxr = r_CANx_TDL2R(ctx->id);
-        can_tdhxr = r_CANx_TDH2R(ctx->id);
-        can_tixr  = r_CANx_TI2R (ctx->id);
-        can_tdtxr = r_CANx_TDT2R(ctx->id);
-    } else {
-        /* should not be executed with the tme == 0x0 check */
-        errcode = MBED_ERROR_UNKNOWN;
+#endif
+#if CONFIG_USR_DRV_CAN_RX_RING
+    if (ctx->rxbuffered) {
+        const can_rx_ring_t *ring = &ctx->rx_ring[fifo];
+        uint32_t tail = ring->tail;
+
+        if (tail == ring->head) {
+            errcode = MBED_ERROR_NOTREADY;
+            goto err;
+        }
+        can_barrier();
+        /* the ISR does not write this slot until the tail moves */
+        *frame = &ring->slots[tail & CAN_RX_RING_MASK];
+        goto err;
+    }
+#endif
+    can_rfxr = (fifo == CAN_FIFO_0) ? r_CANx_RF0R(ctx->id) : r_CANx_RF1R(ctx->id);
+#if CONFIG_USR_DRV_CAN_SW_FILTER
+    /* release frames rejected by the software filter */
+    can_sw_filter_flush(ctx, fifo);
+#endif
+    if (ctx->access == CAN_ACCESS_POLL) {
+        /* no ISR to acknowledge the FIFO full and overrun events */
+        can_fifo_ack(ctx, fifo, *can_rfxr);
+    }
+    if ((*can_rfxr & CAN_RFxR_FMPx_Msk) == 0U) {
+        errcode = MBED_ERROR_NOTREADY;
         goto err;
+    }
+    /* the output mailbox is not modified until RFOMx is set, nor is its
+     * copy until the next peek */
+    regs = r_CANx_RxMBOX(ctx->id, fifo);
+    copy = &can_peek_frames[ctx->id - 1][fifo];
+    copy->id    = regs->IxR;
+    copy->dlct  = regs->DTxR;
+    copy->datal = regs->DLxR;
+    copy->datah = regs->DHxR;
+    *frame = copy;
+err:
+    return errcode;
+}
+
+mbed_error_t can_receive_commit(const __in  can_context_t *ctx,
+                                const __in  can_fifo_t     fifo)
+{
+    volatile uint32_t *can_rfxr;
+    mbed_error_t errcode = MBED_ERROR_NONE;
 
+    /* sanitize */
+    if (!ctx) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
     }
-    /* about the header */
-    if (header->IDE == CAN_ID_STD) {
-        set_reg_value(can_tixr, header->id.std, CAN_TIxR_STID_Msk,  CAN_TIxR_STID_Pos);
-    } else if (header->IDE == CAN_ID_EXT) {
-        set_reg_value(can_tixr, header->id.ext, CAN_TIxR_EXID_Msk,  CAN_TIxR_EXID_Pos);
-    } else { /* invalid header format */
+    if (fifo != CAN_FIFO_0 && fifo != CAN_FIFO_1) {
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
-    /* Set data length */
-    set_reg_value(can_tdtxr, header->DLC, CAN_TDTxR_DLC_Msk, CAN_TDTxR_DLC_Pos);
-
-    if (header->TGT == true) {
-        /* global time transmission requested */
-        set_reg_bits(can_tdtxr, CAN_TDTxR_TGT_Msk);
-    } else {
-        clear_reg_bits(can_tdtxr, CAN_TDTxR_TGT_Msk);
+    if (ctx->state != CAN_STATE_STARTED) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
     }
-
-    /* about the body */
-    set_reg_value(can_tdlxr, data->data_fields.data0, CAN_TDLxR_DATA0_Msk, CAN_TDLxR_DATA0_Pos);
-    set_reg_value(can_tdlxr, data->data_fields.data1, CAN_TDLxR_DATA1_Msk, CAN_TDLxR_DATA1_Pos);
-    set_reg_value(can_tdlxr, data->data_fields.data2, CAN_TDLxR_DATA2_Msk, CAN_TDLxR_DATA2_Pos);
-    set_reg_value(can_tdlxr, data->data_fields.data3, CAN_TDLxR_DATA3_Msk, CAN_TDLxR_DATA3_Pos);
-    set_reg_value(can_tdhxr, data->data_fields.data4, CAN_TDHxR_DATA4_Msk, CAN_TDHxR_DATA4_Pos);
-    set_reg_value(can_tdhxr, data->data_fields.data5, CAN_TDHxR_DATA5_Msk, CAN_TDHxR_DATA5_Pos);
-    set_reg_value(can_tdhxr, data->data_fields.data6, CAN_TDHxR_DATA6_Msk, CAN_TDHxR_DATA6_Pos);
-    set_reg_value(can_tdhxr, data->data_fields.data7, CAN_TDHxR_DATA7_Msk, CAN_TDHxR_DATA7_Pos);
-
-    /* Clear RTR bit to ensure that a data frame is emitted */
-    clear_reg_bits(can_tixr, CAN_TIxR_RTR_Msk);
-
-    /* requesting transmission */
-    set_reg_bits(can_tixr, CAN_TIxR_TXRQ_Msk);
-
-    errcode = MBED_ERROR_NONE;
+#if CONFIG_USR_DRV_CAN_RX_RING
+    if (ctx->rxbuffered) {
+        /* the context is owned by the user task, only the consumer index
+         * is updated here */
+        can_rx_ring_t *ring = (can_rx_ring_t*)&ctx->rx_ring[fifo];
+        uint32_t tail = ring->tail;
+
+        if (tail == ring->head) {
+            errcode = MBED_ERROR_NOTREADY;
+            goto err;
+        }
+        can_barrier();
+        ring->tail = tail + 1;
+        can_rx_ring_release(ctx, fifo, ring);
+        can_profile_rx_received(ctx->id, fifo);
+        goto err;
+    }
+#endif
+    can_rfxr = (fifo == CAN_FIFO_0) ? r_CANx_RF0R(ctx->id) : r_CANx_RF1R(ctx->id);
+    if ((*can_rfxr & CAN_RFxR_FMPx_Msk) == 0U) {
+        errcode = MBED_ERROR_NOTREADY;
+        goto err;
+    }
+    write_reg_value(can_rfxr, CAN_RFxR_RFOMx_Msk);
+    can_stats_inc(ctx, rx_frames[fifo]);
+    can_profile_rx_received(ctx->id, fifo);
+    can_fifo_irq_restore(ctx, fifo);
 err:
     return errcode;
 }
 
 /*******************************************************************************
- *          RECEIVE CAN FRAME
+ *          RECEIVE CAN FRAMES BURST
  *
- * Get back data from one of the CAN Rx FIFO
+ * Get back up to max frames from one of the CAN Rx FIFO. In buffered mode,
+ * frames are read from the software ring without any device access (except
+ * reenabling the FIFO interrupts if the ring was stalled). Otherwise the
+ * hardware FIFO is read until empty or max frames are received.
  ******************************************************************************/
-mbed_error_t can_receive(const __in  can_context_t *ctx,
-                         const __in  can_fifo_t     fifo,
-                               __out can_header_t  *header,
-                               __out can_data_t    *data)
+mbed_error_t can_receive_burst(const __in  can_context_t *ctx,
+                               const __in  can_fifo_t     fifo,
+                                     __out can_frame_t    frames[],
+                               const __in  uint32_t       max,
+                                     __out uint32_t      *count)
 {
-    volatile uint32_t *can_rfxr;
-    volatile uint32_t *can_rixr;
-    volatile uint32_t *can_rdtxr;
-    volatile uint32_t *can_rdlxr;
-    volatile uint32_t *can_rdhxr;
     mbed_error_t errcode = MBED_ERROR_NONE;
+    uint32_t n = 0;
 
     /* sanitize */
-    if (!ctx || !data || !header) {
+    if (!ctx || !frames || !count) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    *count = 0;
+    if (fifo != CAN_FIFO_0 && fifo != CAN_FIFO_1) {
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
@@ -876,72 +3436,106 @@ mbed_error_t can_receive(const __in  can_context_t *ctx,
         errcode = MBED_ERROR_INVSTATE;
         goto err;
     }
-    switch (fifo) {
-        case CAN_FIFO_0:
-            can_rfxr  = r_CANx_RF0R(ctx->id);
-            can_rixr  = r_CANx_RI0R(ctx->id);
-            can_rdtxr = r_CANx_RDT0R(ctx->id);
-            can_rdlxr = r_CANx_RDL0R(ctx->id);
-            can_rdhxr = r_CANx_RDH0R(ctx->id);
-            break;
-        case CAN_FIFO_1:
-            can_rfxr  = r_CANx_RF1R(ctx->id);
-            can_rixr  = r_CANx_RI1R(ctx->id);
-            can_rdtxr = r_CANx_RDT1R(ctx->id);
-            can_rdlxr = r_CANx_RDL1R(ctx->id);
-            can_rdhxr = r_CANx_RDH1R(ctx->id);
-	          break;
-        default:
-            errcode = MBED_ERROR_INVPARAM;
-            goto err;
+#if CONFIG_USR_DRV_CAN_RX_RING
+    if (ctx->rxbuffered) {
+        /* the context is owned by the user task, only the consumer index
+         * is updated here */
+        can_rx_ring_t *ring = (can_rx_ring_t*)&ctx->rx_ring[fifo];
+        uint32_t tail = ring->tail;
+        uint32_t head = ring->head;
+
+        can_barrier();
+        while (n < max && tail != head) {
+            can_frame_unpack(&ring->slots[tail & CAN_RX_RING_MASK],
+                             &frames[n].header, &frames[n].data);
+            can_header_stamp(ctx, &frames[n].header);
+            tail++;
+            n++;
+        }
+        can_barrier();
+        ring->tail = tail;
+        can_rx_ring_release(ctx, fifo, ring);
+        if (n != 0) {
+            can_profile_rx_received(ctx->id, fifo);
+        }
+        goto end;
+    }
+#endif
+    while (n < max) {
+        if (can_receive(ctx, fifo, &frames[n].header, &frames[n].data) != MBED_ERROR_NONE) {
             break;
+        }
+        n++;
     }
-    /* is current fifo empty ? */
-    if ((*can_rfxr & CAN_RFxR_FMPx_Msk) == 0U) {
+#if CONFIG_USR_DRV_CAN_RX_RING
+end:
+#endif
+    *count = n;
+    if (n == 0) {
         errcode = MBED_ERROR_NOTREADY;
-        goto err;
     }
+err:
+    return errcode;
+}
 
-    /* let's read the message from mailbox 0 of current FIFO */
-    /* mask and pos are the same for all FIFOs  */
+#if CONFIG_USR_DRV_CAN_DISPATCH
+/*******************************************************************************
+ *          DISPATCH RECEIVED FRAMES
+ *
+ * Receive up to max frames and route each of them to the handler of the
+ * filter that matched it, with a single indexed lookup on the frame FMI.
+ ******************************************************************************/
+mbed_error_t can_receive_dispatch(const __in  can_context_t *ctx,
+                                  const __in  can_fifo_t     fifo,
+                                  const __in  uint32_t       max,
+                                        __out uint32_t      *count)
+{
+    const can_rx_handler_t *table;
+    can_packed_frame_t frame;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint32_t fmi, idx;
+    uint32_t n = 0;
 
-    /* get header */
-    header->IDE = get_reg_value(can_rixr, CAN_RIxR_IDE_Msk,  CAN_RIxR_IDE_Pos);
-    if (header->IDE == CAN_ID_STD) {  /* standard Identifier */
-        header->id.std = (uint16_t)get_reg_value(can_rixr, CAN_RIxR_STID_Msk, CAN_RIxR_STID_Pos);
-    } else { /* extended identifier */
-        header->id.ext = get_reg_value(can_rixr, CAN_RIxR_EXID_Msk, CAN_RIxR_EXID_Pos);
+    /* sanitize */
+    if (!ctx || !count) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
     }
-    header->RTR = get_reg_value(can_rixr, CAN_RIxR_RTR_Msk, CAN_RIxR_RTR_Pos);
-    header->DLC = (uint8_t)get_reg_value(can_rdtxr, CAN_RDTxR_DLC_Msk, CAN_RDTxR_DLC_Pos);
-    header->FMI = (uint8_t)get_reg_value(can_rdtxr, CAN_RDTxR_FMI_Msk, CAN_RDTxR_FMI_Pos);
-    header->gt  = (uint8_t)get_reg_value(can_rdtxr, CAN_RDTxR_TIME_Msk, CAN_RDTxR_TIME_Pos);
-
-    /* get data */
-    data->data_fields.data0 = (uint8_t)get_reg_value(can_rdlxr, CAN_RDLxR_DATA0_Msk, CAN_RDLxR_DATA0_Pos);
-    data->data_fields.data1 = (uint8_t)get_reg_value(can_rdlxr, CAN_RDLxR_DATA1_Msk, CAN_RDLxR_DATA1_Pos);
-    data->data_fields.data2 = (uint8_t)get_reg_value(can_rdlxr, CAN_RDLxR_DATA2_Msk, CAN_RDLxR_DATA2_Pos);
-    data->data_fields.data3 = (uint8_t)get_reg_value(can_rdlxr, CAN_RDLxR_DATA3_Msk, CAN_RDLxR_DATA3_Pos);
-    data->data_fields.data4 = (uint8_t)get_reg_value(can_rdhxr, CAN_RDHxR_DATA4_Msk, CAN_RDHxR_DATA4_Pos);
-    data->data_fields.data5 = (uint8_t)get_reg_value(can_rdhxr, CAN_RDHxR_DATA5_Msk, CAN_RDHxR_DATA5_Pos);
-    data->data_fields.data6 = (uint8_t)get_reg_value(can_rdhxr, CAN_RDHxR_DATA6_Msk, CAN_RDHxR_DATA6_Pos);
-    data->data_fields.data7 = (uint8_t)get_reg_value(can_rdhxr, CAN_RDHxR_DATA7_Msk, CAN_RDHxR_DATA7_Pos);
-
-    /* release head (mailbox #0) of current FIFO */
-    set_reg_bits(can_rfxr, CAN_RFxR_RFOMx_Msk);
-    /* restore interruptions on the FIFO to get another frame */
-    if (fifo == CAN_FIFO_0) {
-       set_reg_bits(r_CANx_IER(ctx->id), CAN_IER_FMPIE0_Msk
-                                       | CAN_IER_FFIE0_Msk
-                                       | CAN_IER_FOVIE0_Msk);
-    } else {
-       set_reg_bits(r_CANx_IER(ctx->id), CAN_IER_FMPIE1_Msk
-                                       | CAN_IER_FFIE1_Msk
-                                       | CAN_IER_FOVIE1_Msk);
+    *count = 0;
+    if (fifo != CAN_FIFO_0 && fifo != CAN_FIFO_1) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    table = (ctx->id == CAN_PORT_1) ? can1_rx_dispatch : can2_rx_dispatch;
+    if (table == NULL) {
+        /* no table defined by the application for this port */
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    while (n < max) {
+        errcode = can_receive_packed(ctx, fifo, &frame);
+        if (errcode != MBED_ERROR_NONE) {
+            break;
+        }
+        n++;
+        fmi = (frame.dlct & CAN_RDTxR_FMI_Msk) >> CAN_RDTxR_FMI_Pos;
+        idx = (fmi < CAN_FILTER_NUMBERS_MAX) ? ctx->fmi_map[fifo][fmi] : CAN_FILTER_DEFAULT;
+        if (idx >= ctx->filters_num || ctx->filters == NULL) {
+            /* default entry */
+            idx = (ctx->filters != NULL) ? ctx->filters_num : 0;
+        }
+        if (table[idx] != NULL) {
+            table[idx](ctx->id, &frame);
+        }
+    }
+    *count = n;
+    if (n != 0) {
+        errcode = MBED_ERROR_NONE;
     }
 err:
     return errcode;
 }
+#endif
 
 /*******************************************************************************
  *  TX MESSAGE PENDING
@@ -991,3 +3585,252 @@ mbed_error_t can_is_txmsg_pending(const __in  can_context_t *ctx,
 err:
     return errcode;
 }
+
+#if CONFIG_USR_DRV_CAN_TIMESTAMP
+/*******************************************************************************
+ *          64 BITS TIME STAMPS
+ *
+ * Received frame headers get their extended stamp from can_receive(). These
+ * functions give it for packed frames and for sent frames.
+ ******************************************************************************/
+mbed_error_t can_timestamp(const __in  can_context_t      *ctx,
+                           const __in  can_packed_frame_t *frame,
+                                 __out uint64_t           *timestamp)
+{
+    /* sanitize */
+    if (!ctx || !frame || !timestamp) {
+        return MBED_ERROR_INVPARAM;
+    }
+    if (!ctx->timetrigger || ctx->state != CAN_STATE_STARTED) {
+        return MBED_ERROR_INVSTATE;
+    }
+    *timestamp = can_time_extend(ctx,
+        (uint16_t)((frame->dlct & CAN_RDTxR_TIME_Msk) >> CAN_RDTxR_TIME_Pos));
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t can_tx_timestamp(const __in  can_context_t *ctx,
+                              const __in  can_mbox_t     mbox,
+                                    __out uint64_t      *timestamp)
+{
+    /* sanitize */
+    if (!ctx || !timestamp || mbox > CAN_MBOX_2) {
+        return MBED_ERROR_INVPARAM;
+    }
+    if (!ctx->timetrigger || ctx->access != CAN_ACCESS_IT) {
+        /* stamps are saved by the Tx ISR */
+        return MBED_ERROR_INVSTATE;
+    }
+    *timestamp = ctx->tx_time[mbox];
+    return MBED_ERROR_NONE;
+}
+#endif
+
+#if CONFIG_USR_DRV_CAN_STATS
+/*******************************************************************************
+ *          STATISTICS
+ *
+ * Counters are never cleared while the device is in use: a reset saves their
+ * current values, which are then subtracted at snapshot time. Neither call
+ * races with the ISR, which keeps on incrementing the running counters.
+ ******************************************************************************/
+
+/* all fields are 32 bits counters, except the last two error counters */
+#define CAN_STATS_COUNTERS ((sizeof(can_stats_t) / sizeof(uint32_t)) - 2)
+
+mbed_error_t can_stats_snapshot(const __in  can_context_t *ctx,
+                                      __out can_stats_t   *stats)
+{
+    const volatile uint32_t *cur;
+    const uint32_t *base;
+    uint32_t *out;
+    uint32_t esr;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!ctx || !stats) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    cur  = (const volatile uint32_t*)&ctx->stats;
+    base = (const uint32_t*)&ctx->stats_base;
+    out  = (uint32_t*)stats;
+    for (uint32_t i = 0; i < CAN_STATS_COUNTERS; ++i) {
+        out[i] = cur[i] - base[i];
+    }
+    if (ctx->state == CAN_STATE_SLEEP || ctx->state == CAN_STATE_RESET) {
+        /* device not initialized, or released */
+        stats->tec = 0;
+        stats->rec = 0;
+        goto err;
+    }
+    esr = *r_CANx_ESR(ctx->id);
+    stats->tec = (esr & CAN_ESR_TEC_Msk) >> CAN_ESR_TEC_Pos;
+    stats->rec = (esr & CAN_ESR_REC_Msk) >> CAN_ESR_REC_Pos;
+err:
+    return errcode;
+}
+
+mbed_error_t can_stats_reset(__inout can_context_t *ctx)
+{
+    const volatile uint32_t *cur;
+    uint32_t *base;
+
+    /* sanitize */
+    if (!ctx) {
+        return MBED_ERROR_INVPARAM;
+    }
+    cur  = (const volatile uint32_t*)&ctx->stats;
+    base = (uint32_t*)&ctx->stats_base;
+    for (uint32_t i = 0; i < CAN_STATS_COUNTERS; ++i) {
+        base[i] = cur[i];
+    }
+    return MBED_ERROR_NONE;
+}
+#endif
+
+#if CONFIG_USR_DRV_CAN_PROFILE
+/*******************************************************************************
+ *          PROFILING
+ ******************************************************************************/
+mbed_error_t can_profile_get(const __in  can_probe_t    probe,
+                                   __out can_profile_t *profile)
+{
+    /* sanitize */
+    if (probe >= CAN_PROBE_NUM || !profile) {
+        return MBED_ERROR_INVPARAM;
+    }
+    *profile = can_profile_table[probe];
+    return MBED_ERROR_NONE;
+}
+
+void can_profile_reset(void)
+{
+    memset((void*)can_profile_table, 0x0, sizeof(can_profile_table));
+    memset((void*)can_profile_rx_stamp, 0x0, sizeof(can_profile_rx_stamp));
+}
+#endif
+
+#if CONFIG_USR_DRV_CAN_CAPTURE
+/*******************************************************************************
+ *          CAPTURE
+ ******************************************************************************/
+mbed_error_t can_capture_read(__out can_capture_record_t *records,
+                              const __in uint32_t        max,
+                              __out uint32_t             *count,
+                              __out uint32_t             *lost)
+{
+    uint32_t head, tail, n, torn;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!records || !count || !lost) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    *lost = 0;
+    head = can_capture.head;
+    can_barrier();
+    tail = can_capture.tail;
+    if (head - tail > CONFIG_USR_DRV_CAN_CAPTURE_DEPTH) {
+        /* overwritten before being read */
+        *lost = head - tail - CONFIG_USR_DRV_CAN_CAPTURE_DEPTH;
+        tail = head - CONFIG_USR_DRV_CAN_CAPTURE_DEPTH;
+    }
+    n = (head - tail < max) ? head - tail : max;
+    for (uint32_t i = 0; i < n; ++i) {
+        records[i] = can_capture.slots[(tail + i) & CAN_CAPTURE_MASK];
+    }
+    can_barrier();
+    /* the record being written by the ISR overwrites the slot of the record
+     * head - DEPTH: records up to it may have been modified during the copy */
+    head = can_capture.head;
+    torn = 0;
+    if (head - tail >= CONFIG_USR_DRV_CAN_CAPTURE_DEPTH) {
+        torn = head - tail - CONFIG_USR_DRV_CAN_CAPTURE_DEPTH + 1;
+        torn = (torn > n) ? n : torn;
+        for (uint32_t i = torn; i < n; ++i) {
+            records[i - torn] = records[i];
+        }
+    }
+    *lost += torn;
+    *count = n - torn;
+    can_capture.tail = tail + n;
+err:
+    return errcode;
+}
+
+void can_capture_reset(void)
+{
+    can_capture.tail = can_capture.head;
+}
+
+uint32_t can_capture_format(const __in  can_capture_record_t *record,
+                                  __out char                 *buf,
+                            const __in  uint32_t              size)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char line[CAN_CAPTURE_LINE_MAX];
+    char digits[20];
+    uint64_t sec;
+    uint32_t usec, id, len = 0, n = 0;
+    uint8_t byte, dlc;
+
+    if (!record || !buf) {
+        return 0;
+    }
+    /* "(seconds.us) canN " */
+    sec = record->stamp / 1000000;
+    usec = (uint32_t)(record->stamp % 1000000);
+    line[len++] = '(';
+    do {
+        digits[n++] = (char)('0' + sec % 10);
+        sec /= 10;
+    } while (sec != 0);
+    while (n != 0) {
+        line[len++] = digits[--n];
+    }
+    line[len++] = '.';
+    for (uint32_t i = 0; i < 6; ++i) {
+        line[len + 5 - i] = (char)('0' + usec % 10);
+        usec /= 10;
+    }
+    len += 6;
+    memcpy(&line[len], ") can", 5);
+    len += 5;
+    line[len++] = (char)('0' + record->port - 1);
+    line[len++] = ' ';
+    /* identifier: 3 hex digits, 8 for the extended ones */
+    if (record->id & CAN_RIxR_IDE_Msk) {
+        id = (record->id & (CAN_RIxR_STID_Msk | CAN_RIxR_EXID_Msk)) >> CAN_RIxR_EXID_Pos;
+        n = 8;
+    } else {
+        id = (record->id & CAN_RIxR_STID_Msk) >> CAN_RIxR_STID_Pos;
+        n = 3;
+    }
+    while (n != 0) {
+        line[len++] = hex[(id >> (4 * --n)) & 0xf];
+    }
+    line[len++] = '#';
+    dlc = (record->dlc > 8) ? 8 : record->dlc;
+    if (record->id & CAN_RIxR_RTR_Msk) {
+        line[len++] = 'R';
+        if (dlc != 0) {
+            line[len++] = (char)('0' + dlc);
+        }
+    } else {
+        for (uint32_t i = 0; i < dlc; ++i) {
+            byte = (uint8_t)(((i < 4) ? record->datal : record->datah) >> (8 * (i % 4)));
+            line[len++] = hex[byte >> 4];
+            line[len++] = hex[byte & 0xf];
+        }
+    }
+    line[len++] = '\n';
+    if (len + 1 > size) {
+        return 0;
+    }
+    memcpy(buf, line, len);
+    buf[len] = '\0';
+    return len;
+}
+#endif
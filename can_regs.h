@@ -163,7 +163,9 @@
 #define CAN_ESR_LEC_Pos 4U
 #define CAN_ESR_LEC_Msk ((uint32_t)7 << CAN_ESR_LEC_Pos)
 #define CAN_ESR_TEC_Pos 16U
-#define CAN_ESR_TEC_Msk ((uint32_t)0xffff << CAN_ESR_TEC_Pos)
+#define CAN_ESR_TEC_Msk ((uint32_t)0xff << CAN_ESR_TEC_Pos)
+#define CAN_ESR_REC_Pos 24U
+#define CAN_ESR_REC_Msk ((uint32_t)0xff << CAN_ESR_REC_Pos)
 
 
 /* BTR Bit Timing Register */
@@ -365,6 +367,17 @@
 /* FA1R is a table of 28 bit-enable state for each of the
  * 28 filters (0=not active, 1=active) */
 
+/* Filter bank registers content, 32 bits scale: same layout as RIxR
+ * (STID[31:21], EXID[20:3], IDE, RTR). 16 bits scale: two halves of: */
+#define CAN_FxR16_EXID_Pos 0U /* EXID[17:15] */
+#define CAN_FxR16_EXID_Msk ((uint32_t)0x7 << CAN_FxR16_EXID_Pos)
+#define CAN_FxR16_IDE_Pos 3U
+#define CAN_FxR16_IDE_Msk ((uint32_t)0x1 << CAN_FxR16_IDE_Pos)
+#define CAN_FxR16_RTR_Pos 4U
+#define CAN_FxR16_RTR_Msk ((uint32_t)0x1 << CAN_FxR16_RTR_Pos)
+#define CAN_FxR16_STID_Pos 5U
+#define CAN_FxR16_STID_Msk ((uint32_t)0x7ff << CAN_FxR16_STID_Pos)
+
 /* can filtering registers (two per filters, 28 filters) */
 #define r_CAN_F0R1   REG_ADDR(CAN1_BASE + 0x240)
 #define r_CAN_F0R2   REG_ADDR(CAN1_BASE + 0x244)
@@ -443,4 +456,29 @@ CAN_GET_REGISTER(TDH2R)
 CAN_GET_FILTER(1)
 CAN_GET_FILTER(2)
 
+/*
+ * Each Tx mailbox and each Rx FIFO output mailbox is a block of four
+ * consecutive registers (identifier, data length control and time stamp,
+ * data low, data high). Tx mailboxes start at TI0R, Rx FIFOs at RI0R.
+ */
+typedef struct {
+    uint32_t IxR;
+    uint32_t DTxR;
+    uint32_t DLxR;
+    uint32_t DHxR;
+} can_mbox_regs_t;
+
+/* the mailboxes are indexed as an array of register blocks */
+_Static_assert(sizeof(can_mbox_regs_t) == 16, "a mailbox is 4 registers");
+
+/* return the register block of Tx mailbox mbox (0 to 2) of CANn */
+static inline volatile can_mbox_regs_t* r_CANx_TxMBOX(uint8_t n, uint8_t mbox){
+	return (volatile can_mbox_regs_t*)r_CANx_TI0R(n) + mbox;
+}
+
+/* return the output mailbox register block of Rx FIFO fifo (0 or 1) of CANn */
+static inline volatile can_mbox_regs_t* r_CANx_RxMBOX(uint8_t n, uint8_t fifo){
+	return (volatile can_mbox_regs_t*)r_CANx_RI0R(n) + fifo;
+}
+
 #endif/*!CAN_REGS_H_*/
@@ -0,0 +1,904 @@
+#include "api/libcan_canopen.h"
+#include "can_regs.h"
+#include "libc/syscall.h"
+#include "libc/string.h"
+#include "autoconf.h"
+
+#if CONFIG_USR_DRV_CAN_CANOPEN
+
+/* NMT commands */
+#define CO_NMT_START          0x01
+#define CO_NMT_STOP           0x02
+#define CO_NMT_PRE_OPERATIONAL 0x80
+#define CO_NMT_RESET_NODE     0x81
+#define CO_NMT_RESET_COMM     0x82
+
+/* SDO command specifiers, bits 7-5 of the first byte */
+#define CO_SDO_CCS_DOWN_SEGMENT  0
+#define CO_SDO_CCS_DOWN_INITIATE 1
+#define CO_SDO_CCS_UP_INITIATE   2
+#define CO_SDO_CCS_UP_SEGMENT    3
+#define CO_SDO_CS_ABORT          4
+#define CO_SDO_CCS_BLOCK_UP      5
+#define CO_SDO_CCS_BLOCK_DOWN    6
+
+/* block upload client subcommands (cs) */
+#define CO_SDO_BLOCK_UP_INITIATE 0
+#define CO_SDO_BLOCK_UP_END      1
+#define CO_SDO_BLOCK_UP_ACK      2
+#define CO_SDO_BLOCK_UP_START    3
+
+#define CO_SDO_SEGMENT  7     /* payload of a segment */
+#define CO_SDO_LAST     0x80  /* last segment of a block transfer */
+#define CO_BURST        3     /* a segments burst fills the three Tx mailboxes */
+
+static inline uint64_t co_now(void)
+{
+    uint64_t now = 0;
+
+    sys_get_systick(&now, PREC_MICRO);
+    return now;
+}
+
+static inline void co_notify(can_co_node_t *node, can_co_event_t event, uint32_t arg)
+{
+    if (can_co_event != NULL) {
+        can_co_event(node, event, arg);
+    }
+}
+
+/*******************************************************************************
+ *           FRAMES
+ *******************************************************************************/
+static void co_frame_build(can_packed_frame_t *frame,
+                           uint16_t            cob_id,
+                           const uint8_t      *bytes,
+                           uint8_t             dlc)
+{
+    uint8_t buf[8] = { 0 };
+
+    memcpy(buf, bytes, dlc);
+    frame->id    = ((uint32_t)cob_id << CAN_TIxR_STID_Pos) & CAN_TIxR_STID_Msk;
+    frame->dlct  = ((uint32_t)dlc << CAN_TDTxR_DLC_Pos) & CAN_TDTxR_DLC_Msk;
+    frame->datal = ((uint32_t)buf[0] << CAN_TDLxR_DATA0_Pos) |
+                   ((uint32_t)buf[1] << CAN_TDLxR_DATA1_Pos) |
+                   ((uint32_t)buf[2] << CAN_TDLxR_DATA2_Pos) |
+                   ((uint32_t)buf[3] << CAN_TDLxR_DATA3_Pos);
+    frame->datah = ((uint32_t)buf[4] << CAN_TDHxR_DATA4_Pos) |
+                   ((uint32_t)buf[5] << CAN_TDHxR_DATA5_Pos) |
+                   ((uint32_t)buf[6] << CAN_TDHxR_DATA6_Pos) |
+                   ((uint32_t)buf[7] << CAN_TDHxR_DATA7_Pos);
+}
+
+static inline void co_frame_bytes(const can_packed_frame_t *frame, uint8_t buf[8])
+{
+    for (uint8_t i = 0; i < 4; ++i) {
+        buf[i] = (uint8_t)(frame->datal >> (8 * i));
+        buf[i + 4] = (uint8_t)(frame->datah >> (8 * i));
+    }
+}
+
+static inline uint32_t co_le32(const uint8_t *b)
+{
+    return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) |
+           ((uint32_t)b[3] << 24);
+}
+
+static inline void co_set_le32(uint8_t *b, uint32_t v)
+{
+    b[0] = (uint8_t)v;
+    b[1] = (uint8_t)(v >> 8);
+    b[2] = (uint8_t)(v >> 16);
+    b[3] = (uint8_t)(v >> 24);
+}
+
+/*******************************************************************************
+ *           OBJECT DICTIONARY
+ *******************************************************************************/
+const can_co_od_entry_t *can_co_od_find(const can_co_node_t *node,
+                                        uint16_t             index,
+                                        uint8_t              subindex)
+{
+    uint32_t key = ((uint32_t)index << 8) | subindex;
+    uint32_t lo = 0;
+    uint32_t hi;
+    uint32_t mid, k;
+
+    if (!node || !node->od) {
+        return NULL;
+    }
+    /* binary search, the dictionary being sorted */
+    hi = node->od_num;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        k = ((uint32_t)node->od[mid].index << 8) | node->od[mid].subindex;
+        if (k == key) {
+            return &node->od[mid];
+        }
+        if (k < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ *           PDO
+ *
+ * Mappings are compiled once by can_co_init(): each entry is looked up in
+ * the dictionary and turned into a byte copy, merged with the previous one
+ * when the objects are contiguous in memory. Entries must be byte aligned.
+ *******************************************************************************/
+static mbed_error_t co_pdo_compile(const can_co_node_t *node,
+                                   const can_co_pdo_t  *pdo,
+                                   can_co_pdo_map_t    *map,
+                                   bool                 tx)
+{
+    const can_co_od_entry_t *entry;
+    can_co_pdo_copy_t *copy;
+    uint16_t index;
+    uint8_t bytes;
+    uint8_t off = 0;
+
+    memset(map, 0x0, sizeof(can_co_pdo_map_t));
+    if (pdo->cob_id > 0x7ff || (pdo->num != 0 && !pdo->mapping) || pdo->num > 8) {
+        return MBED_ERROR_INVPARAM;
+    }
+    for (uint8_t i = 0; i < pdo->num; ++i) {
+        index = (uint16_t)(pdo->mapping[i] >> 16);
+        bytes = (uint8_t)(pdo->mapping[i] & 0xff);
+        if ((bytes % 8) != 0 || off + bytes / 8 > 8) {
+            return MBED_ERROR_INVPARAM;
+        }
+        bytes /= 8;
+        if (!tx && index < 0x1000) {
+            /* dummy entry, skipped bytes */
+            off += bytes;
+            continue;
+        }
+        entry = can_co_od_find(node, index, (uint8_t)(pdo->mapping[i] >> 8));
+        if (entry == NULL || entry->size < bytes ||
+            !(entry->access & (tx ? CAN_CO_ACCESS_READ : CAN_CO_ACCESS_WRITE))) {
+            return MBED_ERROR_INVPARAM;
+        }
+        copy = (map->ncopies != 0) ? &map->copies[map->ncopies - 1] : NULL;
+        if (copy != NULL && copy->off + copy->len == off &&
+            copy->obj + copy->len == (uint8_t *)entry->data) {
+            copy->len += bytes;
+        } else {
+            copy = &map->copies[map->ncopies++];
+            copy->obj = (uint8_t *)entry->data;
+            copy->off = off;
+            copy->len = bytes;
+        }
+        off += bytes;
+    }
+    map->pdo = pdo;
+    map->dlc = off;
+    map->header.id.std = pdo->cob_id;
+    map->header.IDE = CAN_ID_STD;
+    map->header.DLC = off;
+    return MBED_ERROR_NONE;
+}
+
+static void co_tpdo_pack(const can_co_pdo_map_t *map, can_packed_frame_t *frame)
+{
+    can_data_t data = { 0 };
+
+    for (uint8_t i = 0; i < map->ncopies; ++i) {
+        memcpy(&data.data[map->copies[i].off], map->copies[i].obj, map->copies[i].len);
+    }
+    can_frame_pack(&map->header, &data, frame);
+}
+
+static void co_rpdo_unpack(can_co_node_t *node, uint8_t num)
+{
+    const can_co_pdo_map_t *map = &node->rpdo_map[num];
+
+    for (uint8_t i = 0; i < map->ncopies; ++i) {
+        memcpy(map->copies[i].obj, &map->data.data[map->copies[i].off], map->copies[i].len);
+    }
+    co_notify(node, CAN_CO_EVENT_RPDO, num);
+}
+
+/* send the pending TPDOs in a single pass on the Tx mailboxes, the ones
+ * not accepted being sent by can_co_poll() */
+static void co_tpdo_flush(can_co_node_t *node)
+{
+    can_packed_frame_t frames[CONFIG_USR_DRV_CAN_CANOPEN_PDO_MAX];
+    uint8_t nums[CONFIG_USR_DRV_CAN_CANOPEN_PDO_MAX];
+    uint32_t n = 0;
+    uint32_t accepted = 0;
+
+    if (node->tpdo_pending == 0) {
+        return;
+    }
+    for (uint8_t i = 0; i < node->tpdo_num; ++i) {
+        if (node->tpdo_pending & (0x1UL << i)) {
+            co_tpdo_pack(&node->tpdo_map[i], &frames[n]);
+            nums[n++] = i;
+        }
+    }
+    can_xmit_burst(node->ctx, frames, n, &accepted, NULL);
+    for (uint32_t i = 0; i < accepted; ++i) {
+        node->tpdo_pending &= ~(0x1UL << nums[i]);
+    }
+}
+
+static void co_sync(can_co_node_t *node)
+{
+    can_co_pdo_map_t *map;
+
+    if (node->nmt != CAN_CO_NMT_OPERATIONAL) {
+        return;
+    }
+    /* synchronous RPDOs received since the last SYNC are applied now */
+    for (uint8_t i = 0; i < node->rpdo_num; ++i) {
+        if (node->rpdo_map[i].armed) {
+            node->rpdo_map[i].armed = false;
+            co_rpdo_unpack(node, i);
+        }
+    }
+    for (uint8_t i = 0; i < node->tpdo_num; ++i) {
+        map = &node->tpdo_map[i];
+        if (map->pdo->type == CAN_CO_PDO_ACYCLIC) {
+            if (map->armed) {
+                map->armed = false;
+                node->tpdo_pending |= 0x1UL << i;
+            }
+        } else if (map->pdo->type <= CAN_CO_PDO_SYNC_MAX) {
+            if (++map->sync_count >= map->pdo->type) {
+                map->sync_count = 0;
+                node->tpdo_pending |= 0x1UL << i;
+            }
+        }
+    }
+    co_tpdo_flush(node);
+}
+
+static bool co_rpdo_rx(can_co_node_t *node, uint16_t cob_id, const can_packed_frame_t *frame)
+{
+    can_co_pdo_map_t *map;
+    uint8_t dlc = (uint8_t)((frame->dlct & CAN_RDTxR_DLC_Msk) >> CAN_RDTxR_DLC_Pos);
+
+    for (uint8_t i = 0; i < node->rpdo_num; ++i) {
+        map = &node->rpdo_map[i];
+        if (map->pdo->cob_id != cob_id) {
+            continue;
+        }
+        if (node->nmt != CAN_CO_NMT_OPERATIONAL || dlc < map->dlc) {
+            /* too short PDOs are ignored */
+            return true;
+        }
+        co_frame_bytes(frame, map->data.data);
+        if (map->pdo->type <= CAN_CO_PDO_SYNC_MAX) {
+            map->armed = true;
+        } else {
+            co_rpdo_unpack(node, i);
+        }
+        return true;
+    }
+    return false;
+}
+
+/*******************************************************************************
+ *           SDO SERVER
+ *******************************************************************************/
+static inline uint64_t co_sdo_timeout(const can_co_node_t *node)
+{
+    return 1000ULL * ((node->sdo_timeout_ms != 0) ? node->sdo_timeout_ms
+                                                  : CAN_CO_SDO_TIMEOUT);
+}
+
+/* CRC-16-CCITT (polynomial 0x1021, initial value 0) of block transfers */
+static uint16_t co_crc16(const uint8_t *data, uint32_t len)
+{
+    uint16_t crc = 0;
+
+    for (uint32_t i = 0; i < len; ++i) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (uint8_t b = 0; b < 8; ++b) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+/* send a SDO response, kept for can_co_poll() if no mailbox is free */
+static void co_sdo_send(can_co_node_t *node, const uint8_t buf[8])
+{
+    can_mbox_t mbox;
+
+    co_frame_build(&node->sdo_resp, CAN_CO_COB_SDO_TX + node->node_id, buf, 8);
+    node->sdo_resp_pending = can_xmit_packed(node->ctx, &node->sdo_resp, &mbox) != MBED_ERROR_NONE;
+}
+
+static void co_sdo_reply(can_co_node_t *node, uint8_t cmd, const uint8_t req[8], uint32_t value)
+{
+    uint8_t buf[8] = { cmd, req[1], req[2], req[3], 0, 0, 0, 0 };
+
+    co_set_le32(&buf[4], value);
+    co_sdo_send(node, buf);
+}
+
+static void co_sdo_abort(can_co_node_t *node, const uint8_t req[8], uint32_t code)
+{
+    uint8_t buf[8] = { CO_SDO_CS_ABORT << 5, 0, 0, 0, 0, 0, 0, 0 };
+
+    if (node->sdo_entry != NULL && node->sdo_state != CAN_CO_SDO_IDLE) {
+        buf[1] = (uint8_t)node->sdo_entry->index;
+        buf[2] = (uint8_t)(node->sdo_entry->index >> 8);
+        buf[3] = node->sdo_entry->subindex;
+    } else if (req != NULL) {
+        buf[1] = req[1];
+        buf[2] = req[2];
+        buf[3] = req[3];
+    }
+    co_set_le32(&buf[4], code);
+    co_sdo_send(node, buf);
+    node->sdo_state = CAN_CO_SDO_IDLE;
+    co_notify(node, CAN_CO_EVENT_SDO_ABORT, code);
+}
+
+static void co_sdo_written(can_co_node_t *node)
+{
+    node->sdo_state = CAN_CO_SDO_IDLE;
+    co_notify(node, CAN_CO_EVENT_SDO_WRITTEN,
+              ((uint32_t)node->sdo_entry->index << 8) | node->sdo_entry->subindex);
+}
+
+/*
+ * Block upload segments. As ISO-TP consecutive frames, they are pipelined in
+ * all the free Tx mailboxes (or the Tx queue) when the context sends them in
+ * chronological order, a single one being pending at a time otherwise.
+ */
+static void co_sdo_block_segments(can_co_node_t *node)
+{
+    can_packed_frame_t frames[CO_BURST];
+    can_mbox_t mboxes[CO_BURST];
+    uint8_t buf[8];
+    uint32_t accepted, n, off, len;
+    uint8_t seqno;
+    bool pending;
+    bool pipelined = node->ctx->txfifoprio;
+
+    do {
+        if (node->sdo_resp_pending) {
+            return;
+        }
+        if (!pipelined && node->sdo_inflight) {
+            if (can_is_txmsg_pending(node->ctx, node->sdo_mbox, &pending) == MBED_ERROR_NONE &&
+                pending) {
+                return;
+            }
+            node->sdo_inflight = false;
+        }
+        n = 0;
+        off = node->sdo_off;
+        seqno = node->sdo_seqno;
+        while (n < (pipelined ? CO_BURST : 1) && seqno < node->sdo_blksize &&
+               off < node->sdo_size) {
+            len = node->sdo_size - off;
+            len = (len > CO_SDO_SEGMENT) ? CO_SDO_SEGMENT : len;
+            memset(buf, 0x0, sizeof(buf));
+            buf[0] = ++seqno | ((off + len >= node->sdo_size) ? CO_SDO_LAST : 0);
+            memcpy(&buf[1], (const uint8_t *)node->sdo_entry->data + off, len);
+            co_frame_build(&frames[n++], CAN_CO_COB_SDO_TX + node->node_id, buf, 8);
+            off += len;
+        }
+        accepted = 0;
+        can_xmit_burst(node->ctx, frames, n, &accepted, mboxes);
+        if (accepted == 0) {
+            return;
+        }
+        node->sdo_seqno += (uint8_t)accepted;
+        node->sdo_off += accepted * CO_SDO_SEGMENT;
+        node->sdo_off = (node->sdo_off > node->sdo_size) ? node->sdo_size : node->sdo_off;
+        node->sdo_mbox = mboxes[accepted - 1];
+        node->sdo_inflight = node->sdo_mbox != CAN_MBOX_QUEUED;
+        if (node->sdo_seqno == node->sdo_blksize || node->sdo_off >= node->sdo_size) {
+            node->sdo_state = CAN_CO_SDO_UP_BLOCK_ACK;
+            return;
+        }
+    } while (pipelined && accepted == n);
+}
+
+/* block download segment, the first byte being the sequence number */
+static void co_sdo_block_down_segment(can_co_node_t *node, const uint8_t req[8])
+{
+    const can_co_od_entry_t *entry = node->sdo_entry;
+    uint8_t seqno = req[0] & ~CO_SDO_LAST;
+    bool last = (req[0] & CO_SDO_LAST) != 0;
+    uint8_t buf[8] = { (CO_SDO_CCS_BLOCK_UP << 5) | CO_SDO_BLOCK_UP_ACK, 0, 0, 0, 0, 0, 0, 0 };
+    uint32_t off, len;
+
+    if (seqno == node->sdo_seqno + 1) {
+        off = node->sdo_block_off + (uint32_t)(seqno - 1) * CO_SDO_SEGMENT;
+        if (off >= entry->size) {
+            co_sdo_abort(node, req, CAN_CO_SDO_ABORT_LENGTH);
+            return;
+        }
+        len = entry->size - off;
+        len = (len > CO_SDO_SEGMENT) ? CO_SDO_SEGMENT : len;
+        memcpy((uint8_t *)entry->data + off, &req[1], len);
+        node->sdo_seqno = seqno;
+    } else if (!last && seqno != node->sdo_blksize) {
+        /* lost segment, the ack tells the client where to resume */
+        return;
+    }
+    if (seqno != node->sdo_blksize && !last) {
+        return;
+    }
+    buf[1] = node->sdo_seqno;
+    buf[2] = node->sdo_blksize;
+    co_sdo_send(node, buf);
+    node->sdo_block_off += (uint32_t)node->sdo_seqno * CO_SDO_SEGMENT;
+    if (last && seqno == node->sdo_seqno) {
+        node->sdo_off = node->sdo_block_off;
+        node->sdo_state = CAN_CO_SDO_DOWN_BLOCK_END;
+    }
+    node->sdo_seqno = 0;
+}
+
+static void co_sdo_initiate(can_co_node_t *node, const uint8_t req[8])
+{
+    const can_co_od_entry_t *entry;
+    uint8_t ccs = req[0] >> 5;
+    uint8_t buf[8];
+    uint32_t len;
+    bool write = (ccs == CO_SDO_CCS_DOWN_INITIATE || ccs == CO_SDO_CCS_BLOCK_DOWN);
+
+    node->sdo_entry = NULL;
+    if (ccs != CO_SDO_CCS_DOWN_INITIATE && ccs != CO_SDO_CCS_UP_INITIATE &&
+        ccs != CO_SDO_CCS_BLOCK_UP && ccs != CO_SDO_CCS_BLOCK_DOWN) {
+        /* a segment out of any transfer, or an unknown specifier */
+        co_sdo_abort(node, req, CAN_CO_SDO_ABORT_COMMAND);
+        return;
+    }
+    entry = can_co_od_find(node, (uint16_t)(req[1] | (req[2] << 8)), req[3]);
+    if (entry == NULL) {
+        co_sdo_abort(node, req, CAN_CO_SDO_ABORT_NO_OBJECT);
+        return;
+    }
+    if (!(entry->access & (write ? CAN_CO_ACCESS_WRITE : CAN_CO_ACCESS_READ))) {
+        co_sdo_abort(node, req, write ? CAN_CO_SDO_ABORT_READONLY : CAN_CO_SDO_ABORT_WRITEONLY);
+        return;
+    }
+    node->sdo_entry = entry;
+    node->sdo_off = 0;
+    node->sdo_toggle = 0;
+    switch (ccs) {
+        case CO_SDO_CCS_DOWN_INITIATE:
+            if (req[0] & 0x2) {
+                /* expedited, the size indicated or else the object size,
+                 * the object written as a whole */
+                len = (req[0] & 0x1) ? 4U - ((req[0] >> 2) & 0x3U) : entry->size;
+                if (len != entry->size || len == 0 || len > 4) {
+                    co_sdo_abort(node, req, CAN_CO_SDO_ABORT_LENGTH);
+                    break;
+                }
+                memcpy(entry->data, &req[4], len);
+                co_sdo_reply(node, CO_SDO_CCS_UP_SEGMENT << 5, req, 0);
+                co_sdo_written(node);
+                break;
+            }
+            node->sdo_size = (req[0] & 0x1) ? co_le32(&req[4]) : entry->size;
+            if (node->sdo_size > entry->size) {
+                co_sdo_abort(node, req, CAN_CO_SDO_ABORT_LENGTH);
+                break;
+            }
+            node->sdo_state = CAN_CO_SDO_DOWN_SEGMENT;
+            co_sdo_reply(node, CO_SDO_CCS_UP_SEGMENT << 5, req, 0);
+            break;
+        case CO_SDO_CCS_UP_INITIATE:
+            if (entry->size == 0) {
+                co_sdo_abort(node, req, CAN_CO_SDO_ABORT_LENGTH);
+                break;
+            }
+            node->sdo_size = entry->size;
+            if (entry->size <= 4) {
+                memset(buf, 0x0, sizeof(buf));
+                buf[0] = (CO_SDO_CCS_UP_INITIATE << 5) | ((4 - entry->size) << 2) | 0x3;
+                buf[1] = req[1];
+                buf[2] = req[2];
+                buf[3] = req[3];
+                memcpy(&buf[4], entry->data, entry->size);
+                co_sdo_send(node, buf);
+                break;
+            }
+            node->sdo_state = CAN_CO_SDO_UP_SEGMENT;
+            co_sdo_reply(node, (CO_SDO_CCS_UP_INITIATE << 5) | 0x1, req, entry->size);
+            break;
+        case CO_SDO_CCS_BLOCK_UP:
+            if ((req[0] & 0x3) != CO_SDO_BLOCK_UP_INITIATE) {
+                co_sdo_abort(node, req, CAN_CO_SDO_ABORT_COMMAND);
+                break;
+            }
+            if (req[4] == 0 || req[4] > CAN_CO_SDO_BLKSIZE_MAX) {
+                co_sdo_abort(node, req, CAN_CO_SDO_ABORT_BLKSIZE);
+                break;
+            }
+            if (entry->size == 0) {
+                co_sdo_abort(node, req, CAN_CO_SDO_ABORT_LENGTH);
+                break;
+            }
+            node->sdo_blksize = req[4];
+            node->sdo_crc = (req[0] & 0x4) != 0;
+            node->sdo_size = entry->size;
+            node->sdo_state = CAN_CO_SDO_UP_BLOCK_START;
+            /* CRC supported, size indicated */
+            co_sdo_reply(node, (CO_SDO_CCS_BLOCK_DOWN << 5) | 0x4 | 0x2, req, entry->size);
+            break;
+        case CO_SDO_CCS_BLOCK_DOWN:
+            if (req[0] & 0x1) {
+                co_sdo_abort(node, req, CAN_CO_SDO_ABORT_COMMAND);
+                break;
+            }
+            node->sdo_size = (req[0] & 0x2) ? co_le32(&req[4]) : entry->size;
+            if (node->sdo_size > entry->size) {
+                co_sdo_abort(node, req, CAN_CO_SDO_ABORT_LENGTH);
+                break;
+            }
+            node->sdo_blksize = (node->block_size != 0 && node->block_size <= CAN_CO_SDO_BLKSIZE_MAX)
+                                ? node->block_size : CAN_CO_SDO_BLKSIZE_MAX;
+            node->sdo_crc = (req[0] & 0x4) != 0;
+            node->sdo_seqno = 0;
+            node->sdo_block_off = 0;
+            node->sdo_state = CAN_CO_SDO_DOWN_BLOCK;
+            co_sdo_reply(node, (CO_SDO_CCS_BLOCK_UP << 5) | 0x4, req, node->sdo_blksize);
+            break;
+        default:
+            break;
+    }
+}
+
+static void co_sdo_rx(can_co_node_t *node, const can_packed_frame_t *frame, uint64_t now)
+{
+    const can_co_od_entry_t *entry = node->sdo_entry;
+    uint8_t req[8];
+    uint8_t buf[8];
+    uint8_t ccs, t;
+    uint32_t len;
+
+    co_frame_bytes(frame, req);
+    node->sdo_deadline = now + co_sdo_timeout(node);
+    /* block download segments are numbered from 1, a client abort frame
+     * (0x80) reading as sequence number 0 */
+    if (node->sdo_state == CAN_CO_SDO_DOWN_BLOCK && (req[0] & ~CO_SDO_LAST) != 0) {
+        co_sdo_block_down_segment(node, req);
+        return;
+    }
+    ccs = req[0] >> 5;
+    if (ccs == CO_SDO_CS_ABORT) {
+        node->sdo_state = CAN_CO_SDO_IDLE;
+        co_notify(node, CAN_CO_EVENT_SDO_ABORT, co_le32(&req[4]));
+        return;
+    }
+    switch (node->sdo_state) {
+        case CAN_CO_SDO_DOWN_SEGMENT:
+            if (ccs != CO_SDO_CCS_DOWN_SEGMENT) {
+                break;
+            }
+            t = (req[0] >> 4) & 0x1;
+            if (t != node->sdo_toggle) {
+                co_sdo_abort(node, req, CAN_CO_SDO_ABORT_TOGGLE);
+                return;
+            }
+            len = CO_SDO_SEGMENT - ((req[0] >> 1) & 0x7);
+            /* no more than the size announced, and all of it on the last */
+            if (node->sdo_off + len > node->sdo_size ||
+                ((req[0] & 0x1) && node->sdo_off + len != node->sdo_size)) {
+                co_sdo_abort(node, req, CAN_CO_SDO_ABORT_LENGTH);
+                return;
+            }
+            memcpy((uint8_t *)entry->data + node->sdo_off, &req[1], len);
+            node->sdo_off += len;
+            node->sdo_toggle ^= 1;
+            memset(buf, 0x0, sizeof(buf));
+            buf[0] = (CO_SDO_CCS_DOWN_INITIATE << 5) | (t << 4);
+            co_sdo_send(node, buf);
+            if (req[0] & 0x1) {
+                co_sdo_written(node);
+            }
+            return;
+        case CAN_CO_SDO_UP_SEGMENT:
+            if (ccs != CO_SDO_CCS_UP_SEGMENT) {
+                break;
+            }
+            t = (req[0] >> 4) & 0x1;
+            if (t != node->sdo_toggle) {
+                co_sdo_abort(node, req, CAN_CO_SDO_ABORT_TOGGLE);
+                return;
+            }
+            len = node->sdo_size - node->sdo_off;
+            len = (len > CO_SDO_SEGMENT) ? CO_SDO_SEGMENT : len;
+            memset(buf, 0x0, sizeof(buf));
+            buf[0] = (uint8_t)((t << 4) | ((CO_SDO_SEGMENT - len) << 1) |
+                               ((node->sdo_off + len >= node->sdo_size) ? 0x1 : 0x0));
+            memcpy(&buf[1], (const uint8_t *)entry->data + node->sdo_off, len);
+            co_sdo_send(node, buf);
+            node->sdo_off += len;
+            node->sdo_toggle ^= 1;
+            if (node->sdo_off >= node->sdo_size) {
+                node->sdo_state = CAN_CO_SDO_IDLE;
+            }
+            return;
+        case CAN_CO_SDO_DOWN_BLOCK_END:
+            if (ccs != CO_SDO_CCS_BLOCK_DOWN || (req[0] & 0x1) == 0) {
+                break;
+            }
+            /* bytes of the last segment not holding data */
+            len = node->sdo_off - ((req[0] >> 2) & 0x7);
+            if (len > entry->size || len != node->sdo_size) {
+                co_sdo_abort(node, req, CAN_CO_SDO_ABORT_LENGTH);
+                return;
+            }
+            if (node->sdo_crc &&
+                co_crc16(entry->data, len) != (uint16_t)(req[1] | (req[2] << 8))) {
+                co_sdo_abort(node, req, CAN_CO_SDO_ABORT_CRC);
+                return;
+            }
+            memset(buf, 0x0, sizeof(buf));
+            buf[0] = (CO_SDO_CCS_BLOCK_UP << 5) | CO_SDO_BLOCK_UP_END;
+            co_sdo_send(node, buf);
+            co_sdo_written(node);
+            return;
+        case CAN_CO_SDO_UP_BLOCK_START:
+            if (req[0] != ((CO_SDO_CCS_BLOCK_UP << 5) | CO_SDO_BLOCK_UP_START)) {
+                break;
+            }
+            node->sdo_seqno = 0;
+            node->sdo_block_off = 0;
+            node->sdo_inflight = false;
+            node->sdo_state = CAN_CO_SDO_UP_BLOCK;
+            co_sdo_block_segments(node);
+            return;
+        case CAN_CO_SDO_UP_BLOCK:
+        case CAN_CO_SDO_UP_BLOCK_ACK:
+            if (req[0] != ((CO_SDO_CCS_BLOCK_UP << 5) | CO_SDO_BLOCK_UP_ACK)) {
+                break;
+            }
+            if (req[1] > node->sdo_seqno) {
+                co_sdo_abort(node, req, CAN_CO_SDO_ABORT_SEQNO);
+                return;
+            }
+            /* resume after the last segment acknowledged */
+            node->sdo_off = node->sdo_block_off + (uint32_t)req[1] * CO_SDO_SEGMENT;
+            node->sdo_off = (node->sdo_off > node->sdo_size) ? node->sdo_size : node->sdo_off;
+            node->sdo_block_off = node->sdo_off;
+            node->sdo_seqno = 0;
+            if (node->sdo_off >= node->sdo_size) {
+                memset(buf, 0x0, sizeof(buf));
+                len = node->sdo_size % CO_SDO_SEGMENT;
+                buf[0] = (uint8_t)((CO_SDO_CCS_BLOCK_DOWN << 5) |
+                                   (((len != 0) ? CO_SDO_SEGMENT - len : 0) << 2) | 0x1);
+                if (node->sdo_crc) {
+                    uint16_t crc = co_crc16(entry->data, node->sdo_size);
+
+                    buf[1] = (uint8_t)crc;
+                    buf[2] = (uint8_t)(crc >> 8);
+                }
+                co_sdo_send(node, buf);
+                node->sdo_state = CAN_CO_SDO_UP_BLOCK_END;
+                return;
+            }
+            if (req[2] == 0 || req[2] > CAN_CO_SDO_BLKSIZE_MAX) {
+                co_sdo_abort(node, req, CAN_CO_SDO_ABORT_BLKSIZE);
+                return;
+            }
+            node->sdo_blksize = req[2];
+            node->sdo_state = CAN_CO_SDO_UP_BLOCK;
+            co_sdo_block_segments(node);
+            return;
+        case CAN_CO_SDO_UP_BLOCK_END:
+            if (req[0] != ((CO_SDO_CCS_BLOCK_UP << 5) | CO_SDO_BLOCK_UP_END)) {
+                break;
+            }
+            node->sdo_state = CAN_CO_SDO_IDLE;
+            return;
+        default:
+            /* a new transfer */
+            co_sdo_initiate(node, req);
+            return;
+    }
+    co_sdo_abort(node, req, CAN_CO_SDO_ABORT_COMMAND);
+}
+
+/*******************************************************************************
+ *           NMT
+ *******************************************************************************/
+static void co_nmt_set(can_co_node_t *node, can_co_nmt_state_t state)
+{
+    if (node->nmt == state) {
+        return;
+    }
+    node->nmt = state;
+    if (state != CAN_CO_NMT_OPERATIONAL) {
+        node->tpdo_pending = 0;
+    }
+    co_notify(node, CAN_CO_EVENT_NMT, state);
+}
+
+static void co_bootup(can_co_node_t *node)
+{
+    can_packed_frame_t frame;
+    can_mbox_t mbox;
+    uint8_t state = CAN_CO_NMT_INITIALIZING;
+
+    co_frame_build(&frame, CAN_CO_COB_HEARTBEAT + node->node_id, &state, 1);
+    can_xmit_packed(node->ctx, &frame, &mbox);
+    node->sdo_state = CAN_CO_SDO_IDLE;
+    node->sdo_resp_pending = false;
+    node->tpdo_pending = 0;
+    for (uint8_t i = 0; i < node->tpdo_num; ++i) {
+        node->tpdo_map[i].sync_count = 0;
+        node->tpdo_map[i].armed = false;
+    }
+    for (uint8_t i = 0; i < node->rpdo_num; ++i) {
+        node->rpdo_map[i].armed = false;
+    }
+    co_nmt_set(node, CAN_CO_NMT_PRE_OPERATIONAL);
+}
+
+static void co_nmt_rx(can_co_node_t *node, const can_packed_frame_t *frame)
+{
+    uint8_t cmd[8];
+
+    co_frame_bytes(frame, cmd);
+    if (cmd[1] != 0 && cmd[1] != node->node_id) {
+        return;
+    }
+    switch (cmd[0]) {
+        case CO_NMT_START:
+            co_nmt_set(node, CAN_CO_NMT_OPERATIONAL);
+            break;
+        case CO_NMT_STOP:
+            co_nmt_set(node, CAN_CO_NMT_STOPPED);
+            break;
+        case CO_NMT_PRE_OPERATIONAL:
+            co_nmt_set(node, CAN_CO_NMT_PRE_OPERATIONAL);
+            break;
+        case CO_NMT_RESET_NODE:
+        case CO_NMT_RESET_COMM:
+            node->nmt = CAN_CO_NMT_INITIALIZING;
+            co_bootup(node);
+            break;
+        default:
+            break;
+    }
+}
+
+/*******************************************************************************
+ *           CANOPEN API
+ *******************************************************************************/
+mbed_error_t can_co_init(__inout can_co_node_t *node)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!node || !node->ctx || node->node_id == 0 || node->node_id > 127 ||
+        (node->od_num != 0 && !node->od) ||
+        (node->tpdo_num != 0 && !node->tpdo) || (node->rpdo_num != 0 && !node->rpdo)) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (node->tpdo_num > CONFIG_USR_DRV_CAN_CANOPEN_PDO_MAX ||
+        node->rpdo_num > CONFIG_USR_DRV_CAN_CANOPEN_PDO_MAX) {
+        errcode = MBED_ERROR_TOOBIG;
+        goto err;
+    }
+#if CONFIG_USR_DRV_CAN_TX_QUEUE
+    if (node->ctx->txqueued && !node->ctx->txfifoprio) {
+        /* queued SDO segments would be sent by mailbox number */
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+#endif
+    for (uint8_t i = 0; i < node->tpdo_num; ++i) {
+        errcode = co_pdo_compile(node, &node->tpdo[i], &node->tpdo_map[i], true);
+        if (errcode != MBED_ERROR_NONE) {
+            goto err;
+        }
+    }
+    for (uint8_t i = 0; i < node->rpdo_num; ++i) {
+        errcode = co_pdo_compile(node, &node->rpdo[i], &node->rpdo_map[i], false);
+        if (errcode != MBED_ERROR_NONE) {
+            goto err;
+        }
+    }
+    node->sdo_entry = NULL;
+    node->sdo_inflight = false;
+    node->nmt = CAN_CO_NMT_INITIALIZING;
+    co_bootup(node);
+err:
+    return errcode;
+}
+
+mbed_error_t can_co_tpdo_send(__inout can_co_node_t *node,
+                              const __in uint8_t     num)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!node || num >= node->tpdo_num) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (node->nmt != CAN_CO_NMT_OPERATIONAL) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    if (node->tpdo_map[num].pdo->type == CAN_CO_PDO_ACYCLIC) {
+        node->tpdo_map[num].armed = true;
+    } else if (node->tpdo_map[num].pdo->type > CAN_CO_PDO_SYNC_MAX) {
+        node->tpdo_pending |= 0x1UL << num;
+        co_tpdo_flush(node);
+    } else {
+        /* cyclic synchronous PDOs are only sent on SYNC */
+        errcode = MBED_ERROR_INVSTATE;
+    }
+err:
+    return errcode;
+}
+
+mbed_error_t can_co_rx_frame(__inout can_co_node_t      *node,
+                             const __in can_packed_frame_t *frame)
+{
+    uint16_t cob_id;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!node || !frame) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    /* standard data frames only */
+    if (frame->id & (CAN_RIxR_IDE_Msk | CAN_RIxR_RTR_Msk)) {
+        errcode = MBED_ERROR_NOTFOUND;
+        goto err;
+    }
+    cob_id = (uint16_t)((frame->id & CAN_TIxR_STID_Msk) >> CAN_TIxR_STID_Pos);
+    if (cob_id == CAN_CO_COB_NMT) {
+        co_nmt_rx(node, frame);
+    } else if (cob_id == CAN_CO_COB_SYNC) {
+        co_sync(node);
+    } else if (cob_id == CAN_CO_COB_SDO_RX + node->node_id) {
+        if (node->nmt != CAN_CO_NMT_STOPPED &&
+            ((frame->dlct & CAN_RDTxR_DLC_Msk) >> CAN_RDTxR_DLC_Pos) == 8) {
+            co_sdo_rx(node, frame, co_now());
+        }
+    } else if (!co_rpdo_rx(node, cob_id, frame)) {
+        errcode = MBED_ERROR_NOTFOUND;
+    }
+err:
+    return errcode;
+}
+
+mbed_error_t can_co_poll(__inout can_co_node_t *node)
+{
+    can_mbox_t mbox;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!node) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (node->sdo_resp_pending) {
+        node->sdo_resp_pending =
+            can_xmit_packed(node->ctx, &node->sdo_resp, &mbox) != MBED_ERROR_NONE;
+    }
+    co_tpdo_flush(node);
+    if (node->sdo_state == CAN_CO_SDO_UP_BLOCK) {
+        co_sdo_block_segments(node);
+    }
+    if (node->sdo_state != CAN_CO_SDO_IDLE && co_now() > node->sdo_deadline) {
+        co_sdo_abort(node, NULL, CAN_CO_SDO_ABORT_TIMEOUT);
+    }
+err:
+    return errcode;
+}
+
+#endif
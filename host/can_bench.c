@@ -0,0 +1,2698 @@
+/*
+ * Host-side CAN driver benchmark, running the driver on the bxCAN simulator.
+ *
+ * For each scenario, the cost of the measured driver calls is given per frame
+ * in nanoseconds and, when the Linux performance counters are available, in
+ * user space instructions. Frames per second are computed on the whole
+ * scenario, simulator included, and are only meaningful to compare two
+ * versions of the driver.
+ *
+ * The trace driven scenarios only depend on the trace and the driver, their
+ * results being computed on the trace time: "can_bench trace" runs them
+ * alone, for a deterministic output.
+ *
+ * Each scenario also checks its invariants (no frame lost, corrupted or out of
+ * order outside of the Rx FIFO overruns, counters consistent with the
+ * simulator...): the benchmark exits with a failure status if any of them is
+ * violated. The fault scenarios of the transport protocols check their error
+ * paths the same way, the simulator clock being moved to their timeouts.
+ *
+ * usage: can_bench [frames]
+ *        can_bench trace [frames] [log]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "can_sim.h"
+#include "can_trace.h"
+#include "can_regs.h"
+#include "api/libcan_isotp.h"
+#include "api/libcan_j1939.h"
+#include "api/libcan_canopen.h"
+
+#define BENCH_FRAMES_DEFAULT 100000
+#define BENCH_INAK_TIMEOUT   1000   /* us */
+#define BENCH_COALESCE_FRAMES 8
+#define BENCH_COALESCE_US    1000
+#define BENCH_BURST          4      /* frames per can_xmit_burst() call */
+#define BENCH_LIFETIME_US    100    /* can_xmit_deadline() frames lifetime */
+#define BENCH_URGENT_PERIOD  16     /* frame times between two urgent frames */
+#define BENCH_PREEMPT_PUSHES 2      /* low priority frames queued right after
+                                       an urgent one, before its Tx interrupt */
+#define BENCH_STAMP_PERIOD   200    /* us between two time stamped frames */
+#define BENCH_STAMP_FRAMES   1000   /* 200 ms, about 3 wraps at 1 Mbit/s */
+#define BENCH_ISOTP_SIZE     4095   /* largest message with a 12 bits length */
+#define BENCH_ISOTP_TASK     3      /* frame times between two task runs */
+#define BENCH_FRAME_BITS     111    /* 8 bytes standard frame and interframe
+                                       space, without stuffing */
+#define BENCH_EXT_FRAME_BITS 131    /* same, extended frame */
+#define BENCH_J1939_SENDERS  4      /* connection mode senders */
+#define BENCH_J1939_BAM_GAP  10     /* us, instead of 50 ms, to load the bus */
+#define BENCH_TRANSFER_FRAMES 5000  /* shorter runs may end before the first
+                                       transport message is complete */
+
+/*******************************************************************************
+ *          PROBES
+ ******************************************************************************/
+
+typedef struct {
+    const char *name;
+    uint64_t    calls;
+    uint64_t    ns;
+    uint64_t    instr;
+    /* current measure */
+    uint64_t    ns0;
+    uint64_t    instr0;
+} bench_probe_t;
+
+static int      bench_perf_fd = -1;
+static uint64_t bench_ns_overhead = 0;
+static uint64_t bench_instr_overhead = 0;
+
+static inline uint64_t bench_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t bench_instr(void)
+{
+    uint64_t v = 0;
+
+    if (bench_perf_fd >= 0 && read(bench_perf_fd, &v, sizeof(v)) != sizeof(v)) {
+        v = 0;
+    }
+    return v;
+}
+
+static void bench_perf_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0x0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    bench_perf_fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static inline void bench_begin(bench_probe_t *p)
+{
+    p->instr0 = bench_instr();
+    p->ns0 = bench_ns();
+}
+
+/* account the current measure, if the measured call is to be kept */
+static inline void bench_end(bench_probe_t *p, bool keep)
+{
+    uint64_t ns = bench_ns();
+    uint64_t instr = bench_instr();
+
+    if (!keep) {
+        return;
+    }
+    p->calls++;
+    p->ns += (ns - p->ns0 > bench_ns_overhead) ? ns - p->ns0 - bench_ns_overhead : 0;
+    p->instr += (instr - p->instr0 > bench_instr_overhead) ?
+                instr - p->instr0 - bench_instr_overhead : 0;
+}
+
+/* cost of an empty measure, removed from each measure */
+static void bench_calibrate(void)
+{
+    bench_probe_t p = { .name = "empty" };
+
+    for (uint32_t i = 0; i < 10000; ++i) {
+        bench_begin(&p);
+        bench_end(&p, true);
+    }
+    bench_ns_overhead = p.ns / p.calls;
+    bench_instr_overhead = p.instr / p.calls;
+}
+
+/* the ISR is measured through the simulator hooks */
+static bench_probe_t bench_irq = { .name = "can_IRQHandler" };
+
+static void bench_irq_enter(void)
+{
+    bench_begin(&bench_irq);
+}
+
+static void bench_irq_exit(void)
+{
+    bench_end(&bench_irq, true);
+}
+
+#if CONFIG_USR_DRV_CAN_PROFILE
+/* driver probes, timestamped in nanoseconds by the clock below */
+uint32_t can_profile_clock(void)
+{
+    return (uint32_t)bench_ns();
+}
+
+static void bench_report_profile(void)
+{
+    static const char *names[CAN_PROBE_NUM] = {
+        "IRQ", "xmit", "receive", "rx latency", "INAK wait"
+    };
+    can_profile_t prof;
+    uint32_t mode;
+
+    for (uint32_t i = 0; i < CAN_PROBE_NUM; ++i) {
+        if (can_profile_get((can_probe_t)i, &prof) != MBED_ERROR_NONE ||
+            prof.count == 0) {
+            continue;
+        }
+        /* most populated histogram bucket */
+        mode = 0;
+        for (uint32_t b = 1; b < CAN_PROFILE_BUCKETS; ++b) {
+            if (prof.histogram[b] > prof.histogram[mode]) {
+                mode = b;
+            }
+        }
+        printf("      probe %-12s %8u calls  min %6u  mean %8.1f  max %8u ns,"
+               " mostly %u-%u ns\n", names[i], prof.count, prof.min,
+               (double)prof.sum / prof.count, prof.max,
+               (mode == 0) ? 0 : (1u << mode), (2u << mode) - 1);
+    }
+}
+#endif
+
+/* invariant violations of all the scenarios, giving the exit status */
+static uint64_t bench_failures;
+
+static void bench_expect(uint64_t violations, const char *what)
+{
+    if (violations != 0) {
+        printf("    FAILED: %llu %s\n", (unsigned long long)violations, what);
+        bench_failures += violations;
+    }
+}
+
+static void bench_report(const char *scenario, uint64_t frames, uint64_t ns,
+                         bench_probe_t *probes[], uint32_t n)
+{
+    printf("%-28s %8llu frames %10.0f frames/s\n", scenario,
+           (unsigned long long)frames, (ns != 0) ? frames * 1e9 / ns : 0.0);
+    for (uint32_t i = 0; i < n; ++i) {
+        bench_probe_t *p = probes[i];
+
+        if (p->calls == 0) {
+            continue;
+        }
+        printf("    %-24s %8llu calls %8.1f ns/frame", p->name,
+               (unsigned long long)p->calls, (double)p->ns / frames);
+        if (bench_perf_fd >= 0) {
+            printf(" %8.1f instr/frame", (double)p->instr / frames);
+        }
+        printf("\n");
+    }
+#if CONFIG_USR_DRV_CAN_PROFILE
+    bench_report_profile();
+#endif
+}
+
+/* driver statistics of the context, checked against the simulator ones */
+static void bench_report_stats(const can_context_t *ctx)
+{
+    can_stats_t st;
+    uint32_t port = ctx->id - 1;
+
+    if (can_stats_snapshot(ctx, &st) != MBED_ERROR_NONE) {
+        return;
+    }
+    printf("    CAN%d stats: irq %u/%u/%u/%u, rx %u (sim %llu), overruns %u (sim %llu),"
+           " tx %u (sim %llu)\n", ctx->id,
+           st.irq_tx, st.irq_rx[0], st.irq_rx[1], st.irq_sce,
+           st.rx_frames[0] + st.rx_frames[1],
+           (unsigned long long)can_sim_stats.rx_frames[port],
+           st.rx_overruns[0] + st.rx_overruns[1],
+           (unsigned long long)can_sim_stats.rx_overruns[port],
+           st.tx_frames[0] + st.tx_frames[1] + st.tx_frames[2],
+           (unsigned long long)can_sim_stats.tx_frames[port]);
+    bench_expect(st.rx_frames[0] + st.rx_frames[1] != can_sim_stats.rx_frames[port],
+                 "driver Rx frames count different from the simulator one");
+    bench_expect(st.tx_frames[0] + st.tx_frames[1] + st.tx_frames[2] !=
+                 can_sim_stats.tx_frames[port],
+                 "driver Tx frames count different from the simulator one");
+}
+
+/*******************************************************************************
+ *          DRIVER SETUP
+ ******************************************************************************/
+
+static volatile uint32_t bench_rx_pending[2];
+static volatile uint32_t bench_transitions[2];
+static volatile uint32_t bench_timeouts[2];
+static volatile uint32_t bench_tx_done[2];
+static volatile uint32_t bench_tx_expired[2];
+static volatile uint32_t bench_rx_overruns[2];
+#if CONFIG_USR_DRV_CAN_TIMESTAMP
+static const can_context_t *bench_stamp_ctx;  /* sender of the stamped frames */
+static volatile uint64_t bench_tx_time;
+#endif
+
+mbed_error_t can_event(can_event_t event, can_port_t port, can_error_t errcode)
+{
+    switch (event) {
+        case CAN_EVENT_RX_FIFO0_MSG_PENDING:
+        case CAN_EVENT_RX_FIFO1_MSG_PENDING:
+            bench_rx_pending[port - 1]++;
+            break;
+        case CAN_EVENT_INIT_COMPLETE:
+        case CAN_EVENT_START_COMPLETE:
+        case CAN_EVENT_STOP_COMPLETE:
+            bench_transitions[port - 1]++;
+            if (errcode & CAN_ERROR_INAK_TIMEOUT) {
+                bench_timeouts[port - 1]++;
+            }
+            break;
+        case CAN_EVENT_TX_MBOX0_COMPLETE:
+        case CAN_EVENT_TX_MBOX1_COMPLETE:
+        case CAN_EVENT_TX_MBOX2_COMPLETE:
+            bench_tx_done[port - 1]++;
+#if CONFIG_USR_DRV_CAN_TIMESTAMP
+            if (bench_stamp_ctx != NULL && bench_stamp_ctx->id == port) {
+                uint64_t ts;
+
+                if (can_tx_timestamp(bench_stamp_ctx,
+                                     (can_mbox_t)(event - CAN_EVENT_TX_MBOX0_COMPLETE),
+                                     &ts) == MBED_ERROR_NONE) {
+                    bench_tx_time = ts;
+                }
+            }
+#endif
+            break;
+        case CAN_EVENT_TX_MBOX0_EXPIRED:
+        case CAN_EVENT_TX_MBOX1_EXPIRED:
+        case CAN_EVENT_TX_MBOX2_EXPIRED:
+            bench_tx_expired[port - 1]++;
+            break;
+        case CAN_EVENT_ERROR:
+            if (errcode & (CAN_ERROR_RX_FIFO0_OVERRRUN | CAN_ERROR_RX_FIFO1_OVERRRUN)) {
+                bench_rx_overruns[port - 1]++;
+            }
+            break;
+        default:
+            break;
+    }
+    return MBED_ERROR_NONE;
+}
+
+static void bench_ctx_init(can_context_t *ctx, can_port_t port, can_access_t access)
+{
+    memset(ctx, 0x0, sizeof(can_context_t));
+    ctx->id = port;
+    ctx->mode = CAN_MODE_NORMAL;
+    ctx->access = access;
+    ctx->autoretrans = true;
+    ctx->rxfifolocked = true;
+    ctx->bit_rate = CAN_SPEED_1MHZ;
+}
+
+static void bench_ctx_start(can_context_t *ctx)
+{
+    if (can_declare(ctx) != MBED_ERROR_NONE ||
+        can_initialize(ctx) != MBED_ERROR_NONE ||
+        can_start(ctx) != MBED_ERROR_NONE) {
+        fprintf(stderr, "unable to start CAN%d\n", ctx->id);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void bench_frame(can_packed_frame_t *frame, uint32_t i)
+{
+    can_header_t header = {
+        .id.std = (uint16_t)(0x100 + (i & 0xff)),
+        .IDE = CAN_ID_STD,
+        .RTR = 0,
+        .DLC = 8,
+    };
+    can_data_t data;
+
+    for (uint32_t b = 0; b < 8; ++b) {
+        data.data[b] = (uint8_t)(i + b);
+    }
+    can_frame_pack(&header, &data, frame);
+}
+
+static void bench_setup(void)
+{
+    can_sim_reset();
+    bench_rx_pending[0] = bench_rx_pending[1] = 0;
+    bench_transitions[0] = bench_transitions[1] = 0;
+    bench_timeouts[0] = bench_timeouts[1] = 0;
+    bench_tx_done[0] = bench_tx_done[1] = 0;
+    bench_tx_expired[0] = bench_tx_expired[1] = 0;
+    bench_rx_overruns[0] = bench_rx_overruns[1] = 0;
+    memset(&bench_irq, 0x0, sizeof(bench_irq));
+    bench_irq.name = "can_IRQHandler";
+#if CONFIG_USR_DRV_CAN_PROFILE
+    can_profile_reset();
+#endif
+}
+
+/*******************************************************************************
+ *          SCENARIOS
+ ******************************************************************************/
+
+/* polling transmission, the bus draining one frame per step */
+static void bench_xmit_poll(uint64_t frames)
+{
+    can_context_t ctx;
+    bench_probe_t xmit = { .name = "can_xmit" };
+    bench_probe_t *probes[] = { &xmit };
+    can_header_t header;
+    can_data_t data;
+    can_packed_frame_t frame;
+    can_mbox_t mbox;
+    uint64_t sent = 0, t0;
+    mbed_error_t err;
+
+    bench_setup();
+    bench_ctx_init(&ctx, CAN_PORT_1, CAN_ACCESS_POLL);
+    bench_ctx_start(&ctx);
+    t0 = bench_ns();
+    while (sent < frames) {
+        bench_frame(&frame, (uint32_t)sent);
+        can_frame_unpack(&frame, &header, &data);
+        bench_begin(&xmit);
+        err = can_xmit(&ctx, &header, &data, &mbox);
+        bench_end(&xmit, err == MBED_ERROR_NONE);
+        if (err == MBED_ERROR_NONE) {
+            sent++;
+        } else {
+            can_sim_step();
+        }
+    }
+    while (can_sim_step() != 0) {
+        /* drain the mailboxes */
+    }
+    bench_report("xmit, polling", sent, bench_ns() - t0, probes, 1);
+    bench_expect(sent != can_sim_stats.tx_frames[0], "frames accepted but not sent");
+}
+
+/* polling burst transmission, the remainder of each burst sent again after
+ * one bus step */
+static void bench_xmit_burst(uint64_t frames)
+{
+    can_context_t ctx;
+    bench_probe_t xmit = { .name = "can_xmit_burst" };
+    bench_probe_t *probes[] = { &xmit };
+    can_packed_frame_t burst[BENCH_BURST];
+    uint32_t n, i, accepted;
+    uint64_t sent = 0, t0;
+    mbed_error_t err;
+
+    bench_setup();
+    bench_ctx_init(&ctx, CAN_PORT_1, CAN_ACCESS_POLL);
+    bench_ctx_start(&ctx);
+    t0 = bench_ns();
+    while (sent < frames) {
+        n = (frames - sent < BENCH_BURST) ? (uint32_t)(frames - sent) : BENCH_BURST;
+        for (i = 0; i < n; i++) {
+            bench_frame(&burst[i], (uint32_t)(sent + i));
+        }
+        bench_begin(&xmit);
+        err = can_xmit_burst(&ctx, burst, n, &accepted, NULL);
+        bench_end(&xmit, err == MBED_ERROR_NONE);
+        sent += accepted;
+        can_sim_step();
+    }
+    while (can_sim_step() != 0) {
+        /* drain the mailboxes */
+    }
+    bench_report("xmit burst, polling", sent, bench_ns() - t0, probes, 1);
+    bench_expect(sent != can_sim_stats.tx_frames[0], "frames accepted but not sent");
+}
+
+/* polling reception, a remote node filling the Rx FIFO */
+static void bench_receive_poll(uint64_t frames)
+{
+    can_context_t ctx;
+    bench_probe_t recv = { .name = "can_receive" };
+    bench_probe_t *probes[] = { &recv };
+    can_header_t header;
+    can_data_t data;
+    can_packed_frame_t frame;
+    uint64_t received = 0, t0;
+    mbed_error_t err;
+
+    bench_setup();
+    bench_ctx_init(&ctx, CAN_PORT_1, CAN_ACCESS_POLL);
+    bench_ctx_start(&ctx);
+    t0 = bench_ns();
+    while (received < frames) {
+        for (uint32_t i = 0; i < 3; ++i) {
+            bench_frame(&frame, (uint32_t)(received + i));
+            can_sim_inject(CAN_PORT_1, &frame);
+        }
+        do {
+            bench_begin(&recv);
+            err = can_receive(&ctx, CAN_FIFO_0, &header, &data);
+            bench_end(&recv, err == MBED_ERROR_NONE);
+            received += (err == MBED_ERROR_NONE) ? 1 : 0;
+        } while (err == MBED_ERROR_NONE);
+    }
+    bench_report("receive, polling", received, bench_ns() - t0, probes, 1);
+    bench_expect(can_sim_stats.rx_overruns[0], "frames lost on a full Rx FIFO");
+}
+
+/*******************************************************************************
+ *          PER BYTE MAILBOX COPY
+ *
+ * The mailbox accesses of the driver before the packed frame format, kept
+ * here as the baseline of the word accesses: each header field and data byte
+ * is a read-modify-write of a mailbox register on transmission, and a masked
+ * read on reception. Standard data frames only, as the scenario sends.
+ ******************************************************************************/
+
+static mbed_error_t bench_bytes_xmit(const can_context_t *ctx,
+                                     const can_header_t  *header,
+                                     const can_data_t    *data)
+{
+    volatile uint32_t *can_tixr, *can_tdtxr, *can_tdlxr, *can_tdhxr;
+    uint32_t tme;
+
+    tme = get_reg_value(r_CANx_TSR(ctx->id), CAN_TSR_TME_Msk, CAN_TSR_TME_Pos);
+    if (tme == 0x0) {
+        return MBED_ERROR_BUSY;
+    }
+    /* first empty mailbox, the four registers of each being contiguous */
+    can_tixr  = r_CANx_TI0R(ctx->id) + 4 * __builtin_ctz(tme);
+    can_tdtxr = can_tixr + 1;
+    can_tdlxr = can_tixr + 2;
+    can_tdhxr = can_tixr + 3;
+
+    set_reg_value(can_tixr, header->id.std, CAN_TIxR_STID_Msk, CAN_TIxR_STID_Pos);
+    set_reg_value(can_tdtxr, header->DLC, CAN_TDTxR_DLC_Msk, CAN_TDTxR_DLC_Pos);
+    clear_reg_bits(can_tdtxr, CAN_TDTxR_TGT_Msk);
+    set_reg_value(can_tdlxr, data->data[0], CAN_TDLxR_DATA0_Msk, CAN_TDLxR_DATA0_Pos);
+    set_reg_value(can_tdlxr, data->data[1], CAN_TDLxR_DATA1_Msk, CAN_TDLxR_DATA1_Pos);
+    set_reg_value(can_tdlxr, data->data[2], CAN_TDLxR_DATA2_Msk, CAN_TDLxR_DATA2_Pos);
+    set_reg_value(can_tdlxr, data->data[3], CAN_TDLxR_DATA3_Msk, CAN_TDLxR_DATA3_Pos);
+    set_reg_value(can_tdhxr, data->data[4], CAN_TDHxR_DATA4_Msk, CAN_TDHxR_DATA4_Pos);
+    set_reg_value(can_tdhxr, data->data[5], CAN_TDHxR_DATA5_Msk, CAN_TDHxR_DATA5_Pos);
+    set_reg_value(can_tdhxr, data->data[6], CAN_TDHxR_DATA6_Msk, CAN_TDHxR_DATA6_Pos);
+    set_reg_value(can_tdhxr, data->data[7], CAN_TDHxR_DATA7_Msk, CAN_TDHxR_DATA7_Pos);
+    clear_reg_bits(can_tixr, CAN_TIxR_RTR_Msk);
+    set_reg_bits(can_tixr, CAN_TIxR_TXRQ_Msk);
+    return MBED_ERROR_NONE;
+}
+
+static mbed_error_t bench_bytes_receive(const can_context_t *ctx,
+                                        can_header_t        *header,
+                                        can_data_t          *data)
+{
+    volatile uint32_t *can_rfxr = r_CANx_RF0R(ctx->id);
+    volatile uint32_t *can_rixr = r_CANx_RI0R(ctx->id);
+    volatile uint32_t *can_rdtxr = r_CANx_RDT0R(ctx->id);
+    volatile uint32_t *can_rdlxr = r_CANx_RDL0R(ctx->id);
+    volatile uint32_t *can_rdhxr = r_CANx_RDH0R(ctx->id);
+
+    if (get_reg_value(can_rfxr, CAN_RFxR_FMPx_Msk, CAN_RFxR_FMPx_Pos) == 0) {
+        return MBED_ERROR_NOTREADY;
+    }
+    header->IDE = get_reg_value(can_rixr, CAN_RIxR_IDE_Msk, CAN_RIxR_IDE_Pos);
+    header->id.std = (uint16_t)get_reg_value(can_rixr, CAN_RIxR_STID_Msk, CAN_RIxR_STID_Pos);
+    header->RTR = get_reg_value(can_rixr, CAN_RIxR_RTR_Msk, CAN_RIxR_RTR_Pos);
+    header->DLC = (uint8_t)get_reg_value(can_rdtxr, CAN_RDTxR_DLC_Msk, CAN_RDTxR_DLC_Pos);
+    header->FMI = (uint8_t)get_reg_value(can_rdtxr, CAN_RDTxR_FMI_Msk, CAN_RDTxR_FMI_Pos);
+    header->gt  = (uint16_t)get_reg_value(can_rdtxr, CAN_RDTxR_TIME_Msk, CAN_RDTxR_TIME_Pos);
+    data->data[0] = (uint8_t)get_reg_value(can_rdlxr, CAN_RDLxR_DATA0_Msk, CAN_RDLxR_DATA0_Pos);
+    data->data[1] = (uint8_t)get_reg_value(can_rdlxr, CAN_RDLxR_DATA1_Msk, CAN_RDLxR_DATA1_Pos);
+    data->data[2] = (uint8_t)get_reg_value(can_rdlxr, CAN_RDLxR_DATA2_Msk, CAN_RDLxR_DATA2_Pos);
+    data->data[3] = (uint8_t)get_reg_value(can_rdlxr, CAN_RDLxR_DATA3_Msk, CAN_RDLxR_DATA3_Pos);
+    data->data[4] = (uint8_t)get_reg_value(can_rdhxr, CAN_RDHxR_DATA4_Msk, CAN_RDHxR_DATA4_Pos);
+    data->data[5] = (uint8_t)get_reg_value(can_rdhxr, CAN_RDHxR_DATA5_Msk, CAN_RDHxR_DATA5_Pos);
+    data->data[6] = (uint8_t)get_reg_value(can_rdhxr, CAN_RDHxR_DATA6_Msk, CAN_RDHxR_DATA6_Pos);
+    data->data[7] = (uint8_t)get_reg_value(can_rdhxr, CAN_RDHxR_DATA7_Msk, CAN_RDHxR_DATA7_Pos);
+    set_reg_bits(can_rfxr, CAN_RFxR_RFOMx_Msk);
+    return MBED_ERROR_NONE;
+}
+
+/* the same frames moved in polling mode by the per byte copy and by the
+ * driver word accesses, one frame of each per bus step */
+static void bench_mbox_copy(uint64_t frames)
+{
+    can_context_t ctx;
+    bench_probe_t bytes_xmit = { .name = "per byte xmit" };
+    bench_probe_t word_xmit = { .name = "can_xmit_packed" };
+    bench_probe_t bytes_recv = { .name = "per byte receive" };
+    bench_probe_t word_recv = { .name = "can_receive_packed" };
+    bench_probe_t *probes[] = { &bytes_xmit, &word_xmit, &bytes_recv, &word_recv };
+    can_header_t header;
+    can_data_t data;
+    can_packed_frame_t frame, rx;
+    can_mbox_t mbox;
+    uint64_t moved = 0, mismatch = 0, t0;
+    mbed_error_t err;
+
+    bench_setup();
+    bench_ctx_init(&ctx, CAN_PORT_1, CAN_ACCESS_POLL);
+    bench_ctx_start(&ctx);
+    t0 = bench_ns();
+    while (moved < frames) {
+        bench_frame(&frame, (uint32_t)moved);
+        can_frame_unpack(&frame, &header, &data);
+        bench_begin(&bytes_xmit);
+        err = bench_bytes_xmit(&ctx, &header, &data);
+        bench_end(&bytes_xmit, err == MBED_ERROR_NONE);
+        can_sim_step();
+        bench_begin(&word_xmit);
+        err = can_xmit_packed(&ctx, &frame, &mbox);
+        bench_end(&word_xmit, err == MBED_ERROR_NONE);
+        can_sim_step();
+
+        can_sim_inject(CAN_PORT_1, &frame);
+        can_sim_inject(CAN_PORT_1, &frame);
+        bench_begin(&bytes_recv);
+        err = bench_bytes_receive(&ctx, &header, &data);
+        bench_end(&bytes_recv, err == MBED_ERROR_NONE);
+        if (err != MBED_ERROR_NONE || header.id.std != 0x100 + (moved & 0xff) ||
+            data.data[7] != (uint8_t)(moved + 7)) {
+            mismatch++;
+        }
+        bench_begin(&word_recv);
+        err = can_receive_packed(&ctx, CAN_FIFO_0, &rx);
+        bench_end(&word_recv, err == MBED_ERROR_NONE);
+        if (err != MBED_ERROR_NONE || rx.id != frame.id || rx.datah != frame.datah) {
+            mismatch++;
+        }
+        moved++;
+    }
+    bench_report("mailbox copy, byte vs word", moved, bench_ns() - t0, probes, 4);
+    printf("    %llu Tx and %llu Rx frames each\n",
+           (unsigned long long)bytes_xmit.calls, (unsigned long long)bytes_recv.calls);
+    bench_expect(mismatch, "frames received different from the sent ones");
+    bench_expect(2 * moved - word_xmit.calls - bytes_xmit.calls, "frames not sent");
+}
+
+/*******************************************************************************
+ *          TRACE DRIVEN OVERRUNS
+ *
+ * A bus trace, a candump -L log or a synthetic one, is replayed at its own
+ * time stamps on the simulated registers, against can_IRQHandler and a user
+ * task calling can_receive(). The task is woken by the Rx pending events
+ * after a scheduling latency, then empties the Rx FIFOs, all the frames
+ * being in FIFO0, spread over both FIFOs, or urgent ones in FIFO1.
+ * Everything is computed on the trace time: the frames dropped on a full Rx
+ * FIFO, the overruns reported by the driver, and the latency from the end of
+ * each frame on the bus to its reception by the task.
+ ******************************************************************************/
+
+#define BENCH_TRACE_SEED      0x2545f491
+#define BENCH_TRACE_BURST_MIN 8      /* frames per burst */
+#define BENCH_TRACE_BURST_MAX 64
+#define BENCH_TRACE_GAP_MIN   200    /* us of idle bus between two bursts */
+#define BENCH_TRACE_GAP_MAX   3000
+#define BENCH_TRACE_EXT_PCT   40     /* extended frames, in percents */
+
+static uint32_t bench_rand_state;
+
+/* xorshift32, for traces and latencies reproducible on any host */
+static uint32_t bench_rand(uint32_t min, uint32_t max)
+{
+    uint32_t x = bench_rand_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    bench_rand_state = x;
+    return min + x % (max - min + 1);
+}
+
+/*
+ * Dense traffic at 1 Mbit/s: bursts of back to back frames separated by idle
+ * times, with random standard and extended identifiers and lengths.
+ */
+static can_trace_frame_t *bench_trace_synth(uint64_t frames)
+{
+    can_trace_frame_t *trace = calloc(frames, sizeof(can_trace_frame_t));
+    can_header_t header = { 0 };
+    can_data_t data;
+    uint64_t now = 0;
+    uint32_t burst = 0;
+
+    if (trace == NULL) {
+        perror("trace");
+        exit(EXIT_FAILURE);
+    }
+    bench_rand_state = BENCH_TRACE_SEED;
+    for (uint64_t i = 0; i < frames; ++i) {
+        if (burst == 0) {
+            burst = bench_rand(BENCH_TRACE_BURST_MIN, BENCH_TRACE_BURST_MAX);
+            now += bench_rand(BENCH_TRACE_GAP_MIN, BENCH_TRACE_GAP_MAX);
+        }
+        burst--;
+        if (bench_rand(1, 100) <= BENCH_TRACE_EXT_PCT) {
+            header.IDE = CAN_ID_EXT;
+            header.id.ext = bench_rand(0, 0x1fffffff);
+        } else {
+            header.IDE = CAN_ID_STD;
+            header.id.std = (uint16_t)bench_rand(0, 0x7ff);
+        }
+        header.DLC = (uint8_t)bench_rand(0, 8);
+        for (uint32_t b = 0; b < 8; ++b) {
+            data.data[b] = (uint8_t)bench_rand(0, 0xff);
+        }
+        can_frame_pack(&header, &data, &trace[i].frame);
+        trace[i].port = CAN_PORT_1;
+        now += can_trace_bits(&trace[i].frame);
+        trace[i].us = now;
+    }
+    return trace;
+}
+
+/* at most frames frames of can0 in a candump -L log, from time 0 */
+static can_trace_frame_t *bench_trace_load(const char *path, uint64_t *frames)
+{
+    can_trace_frame_t *trace = calloc(*frames, sizeof(can_trace_frame_t));
+    char line[CAN_TRACE_LINE_MAX];
+    FILE *log = fopen(path, "r");
+    uint64_t n = 0, t0 = 0;
+
+    if (trace == NULL || log == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    while (n < *frames && fgets(line, sizeof(line), log) != NULL) {
+        if (can_trace_parse(line, &trace[n]) && trace[n].port == CAN_PORT_1) {
+            t0 = (n == 0) ? trace[n].us : t0;
+            trace[n++].us -= t0;
+        }
+    }
+    fclose(log);
+    *frames = n;
+    return trace;
+}
+
+static int bench_cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+typedef enum {
+    BENCH_TRACE_FIFO0 = 0,      /* all frames in Rx FIFO0 */
+    BENCH_TRACE_BALANCED,       /* spread over both Rx FIFOs */
+    BENCH_TRACE_URGENT          /* Rx FIFO1 dedicated to urgent frames */
+} bench_trace_fifos_t;
+
+#if CONFIG_USR_DRV_CAN_RX_BALANCE
+/* standard identifiers 0x000-0x0ff are the urgent ones */
+static const can_filter_t bench_trace_filters[] = {
+    { .type = CAN_FILTER_MASK, .IDE = CAN_ID_STD, .id = 0x000, .mask = 0x700,
+      .prio = CAN_FILTER_PRIO_HIGH },
+    { .type = CAN_FILTER_MASK, .IDE = CAN_ID_STD, .id = 0x100, .mask = 0x700 },
+    { .type = CAN_FILTER_MASK, .IDE = CAN_ID_STD, .id = 0x200, .mask = 0x600 },
+    { .type = CAN_FILTER_MASK, .IDE = CAN_ID_STD, .id = 0x400, .mask = 0x400 },
+    { .type = CAN_FILTER_MASK, .IDE = CAN_ID_EXT, .id = 0x0, .mask = 0x0 },
+};
+#endif
+
+static uint32_t bench_percentile(const uint32_t *sorted, uint64_t n, uint32_t permille)
+{
+    return (n != 0) ? sorted[(n - 1) * permille / 1000] : 0;
+}
+
+/*
+ * Replay of the trace, the task running latency_us (+/- 50%) after the first
+ * Rx pending event following its previous run, and emptying Rx FIFO1 first.
+ */
+static void bench_trace(const can_trace_frame_t *trace, uint64_t frames,
+                        bool buffered, bench_trace_fifos_t fifos,
+                        uint32_t latency_us)
+{
+    static const char *modes[] = { "FIFO0", "2 FIFOs", "urgent" };
+    can_context_t ctx;
+    can_header_t header;
+    can_data_t data;
+    can_packed_frame_t frame;
+    /* per Rx FIFO, frames stored in order: arrival time and identifier, then
+     * latency of the received ones */
+    uint64_t *arrival[2];
+    uint32_t *ids[2];
+    uint32_t *latency[3];
+    uint64_t stored[2] = { 0, 0 }, received[3] = { 0, 0, 0 };
+    uint64_t misordered = 0, lost = 0, count[2];
+    uint64_t now, wake = UINT64_MAX;
+    char name[32];
+#if CONFIG_USR_DRV_CAN_STATS
+    can_stats_t st;
+#endif
+
+    for (uint32_t k = 0; k < 3; ++k) {
+        if (k < 2) {
+            arrival[k] = malloc(frames * sizeof(uint64_t));
+            ids[k] = malloc(frames * sizeof(uint32_t));
+        }
+        latency[k] = malloc(frames * sizeof(uint32_t));
+        if ((k < 2 && (arrival[k] == NULL || ids[k] == NULL)) || latency[k] == NULL) {
+            perror("trace");
+            exit(EXIT_FAILURE);
+        }
+    }
+    bench_setup();
+    bench_ctx_init(&ctx, CAN_PORT_1, CAN_ACCESS_IT);
+    ctx.rxbuffered = buffered;
+#if CONFIG_USR_DRV_CAN_RX_BALANCE
+    ctx.rxbalanced = (fifos != BENCH_TRACE_FIFO0);
+    if (fifos == BENCH_TRACE_URGENT) {
+        ctx.filters = bench_trace_filters;
+        ctx.filters_num = sizeof(bench_trace_filters) / sizeof(bench_trace_filters[0]);
+    }
+#endif
+    bench_ctx_start(&ctx);
+    bench_rand_state = BENCH_TRACE_SEED ^ latency_us;
+    for (uint64_t i = 0; i <= frames; ++i) {
+        now = (i < frames) ? trace[i].us : UINT64_MAX;
+        if (wake <= now) {
+            /* the task, emptying the FIFOs at once */
+            bench_rx_pending[0] = 0;
+            for (int32_t k = CAN_FIFO_1; k >= CAN_FIFO_0; --k) {
+                while (can_receive(&ctx, (can_fifo_t)k, &header, &data) == MBED_ERROR_NONE) {
+                    can_frame_pack(&header, &data, &frame);
+                    misordered += (frame.id != ids[k][received[k]]) ? 1 : 0;
+                    latency[k][received[k]] = (uint32_t)(wake - arrival[k][received[k]]);
+                    latency[2][received[2]++] = latency[k][received[k]++];
+                    can_sim_irq_poll();
+                }
+            }
+            bench_rx_pending[0] = 0;
+            wake = UINT64_MAX;
+        }
+        if (i == frames) {
+            break;
+        }
+        count[0] = can_sim_stats.rx_fifo_frames[0][CAN_FIFO_0];
+        count[1] = can_sim_stats.rx_fifo_frames[0][CAN_FIFO_1];
+        can_sim_inject(CAN_PORT_1, &trace[i].frame);
+        can_sim_irq_poll();
+        for (uint32_t k = 0; k < 2; ++k) {
+            if (can_sim_stats.rx_fifo_frames[0][k] != count[k]) {
+                arrival[k][stored[k]] = now;
+                ids[k][stored[k]++] = trace[i].frame.id;
+            }
+        }
+        if (bench_rx_pending[0] != 0 && wake == UINT64_MAX) {
+            wake = now + latency_us / 2 + bench_rand(0, latency_us);
+        }
+    }
+    for (uint32_t k = 0; k < 3; ++k) {
+        qsort(latency[k], received[k], sizeof(uint32_t), bench_cmp_u32);
+    }
+    snprintf(name, sizeof(name), "trace, %s, %s, %u us", buffered ? "ring" : "IT",
+             modes[fifos], latency_us);
+    printf("%-30s %8llu frames  dropped %6.2f%%  %6u overruns  latency"
+           " p50 %5u p99 %5u p99.9 %5u max %5u us\n", name,
+           (unsigned long long)received[2],
+           (frames != 0) ? 100.0 * (frames - received[2]) / frames : 0.0,
+           bench_rx_overruns[0],
+           bench_percentile(latency[2], received[2], 500),
+           bench_percentile(latency[2], received[2], 990),
+           bench_percentile(latency[2], received[2], 999),
+           bench_percentile(latency[2], received[2], 1000));
+    if (fifos != BENCH_TRACE_FIFO0) {
+#if CONFIG_USR_DRV_CAN_STATS
+        can_stats_snapshot(&ctx, &st);
+#endif
+        for (uint32_t k = 0; k < 2; ++k) {
+            printf("    FIFO%u %8llu frames  dropped %6llu  latency p99 %5u max %5u us",
+                   k, (unsigned long long)received[k],
+                   (unsigned long long)can_sim_stats.rx_fifo_overruns[0][k],
+                   bench_percentile(latency[k], received[k], 990),
+                   bench_percentile(latency[k], received[k], 1000));
+#if CONFIG_USR_DRV_CAN_STATS
+            printf("  level at Rx IRQs 0/1/2/3: %u/%u/%u/%u",
+                   st.rx_level[k][0], st.rx_level[k][1], st.rx_level[k][2],
+                   st.rx_level[k][3]);
+#endif
+            printf("\n");
+        }
+    }
+    lost = stored[0] + stored[1] - received[2];
+    bench_expect(misordered, "frames out of order");
+    bench_expect(lost, "frames stored in a Rx FIFO but not received");
+    bench_expect(frames - stored[0] - stored[1] - can_sim_stats.rx_overruns[0],
+                 "frames neither stored nor dropped on a full Rx FIFO");
+    bench_expect((can_sim_stats.rx_overruns[0] != 0) != (bench_rx_overruns[0] != 0),
+                 "scenario with frames dropped but no overrun reported, or the opposite");
+    for (uint32_t k = 0; k < 3; ++k) {
+        if (k < 2) {
+            free(arrival[k]);
+            free(ids[k]);
+        }
+        free(latency[k]);
+    }
+}
+
+static void bench_trace_suite(uint64_t frames, const char *path)
+{
+    static const uint32_t latencies[] = { 50, 200, 500, 1000, 2000, 5000 };
+    can_trace_frame_t *trace;
+    can_header_t header;
+    can_data_t data;
+    uint64_t bits = 0, ext = 0;
+
+    trace = (path != NULL) ? bench_trace_load(path, &frames) : bench_trace_synth(frames);
+    for (uint64_t i = 0; i < frames; ++i) {
+        can_frame_unpack(&trace[i].frame, &header, &data);
+        bits += can_trace_bits(&trace[i].frame);
+        ext += (header.IDE == CAN_ID_EXT) ? 1 : 0;
+    }
+    printf("trace %s: %llu frames in %.1f ms, %.0f%% extended, %.0f%% bus load"
+           " at 1 Mbit/s\n", (path != NULL) ? path : "synthetic",
+           (unsigned long long)frames,
+           (frames != 0) ? trace[frames - 1].us / 1000.0 : 0.0,
+           (frames != 0) ? 100.0 * ext / frames : 0.0,
+           (frames != 0 && trace[frames - 1].us != 0) ?
+           100.0 * bits / trace[frames - 1].us : 0.0);
+    for (uint32_t buffered = 0; buffered < 2; ++buffered) {
+        for (uint32_t fifos = BENCH_TRACE_FIFO0; fifos <= BENCH_TRACE_URGENT; ++fifos) {
+#if !CONFIG_USR_DRV_CAN_RX_BALANCE
+            if (fifos != BENCH_TRACE_FIFO0) {
+                break;
+            }
+#endif
+            for (uint32_t i = 0; i < sizeof(latencies) / sizeof(latencies[0]); ++i) {
+                bench_trace(trace, frames, buffered != 0, (bench_trace_fifos_t)fifos,
+                            latencies[i]);
+            }
+        }
+    }
+    free(trace);
+}
+
+/*
+ * Gateway: frames received by CAN1 in buffered mode are forwarded to CAN2,
+ * on another bus, either copied by can_receive_packed() or sent in place
+ * between can_receive_peek() and can_receive_commit().
+ */
+static void bench_forward(uint64_t frames, bool peek)
+{
+    can_context_t ctx[2];
+    bench_probe_t fwd = { .name = "receive + xmit" };
+    bench_probe_t *probes[] = { &fwd };
+    can_packed_frame_t frame;
+    const can_packed_frame_t *next;
+    can_mbox_t mbox;
+    uint64_t forwarded = 0, t0;
+    bool held = false;
+    mbed_error_t err;
+
+    bench_setup();
+    for (uint32_t p = 0; p < 2; ++p) {
+        bench_ctx_init(&ctx[p], (can_port_t)(CAN_PORT_1 + p), CAN_ACCESS_IT);
+        ctx[p].rxbuffered = (p == 0);
+        bench_ctx_start(&ctx[p]);
+    }
+    if (peek) {
+        fwd.name = "peek + xmit + commit";
+    }
+    t0 = bench_ns();
+    while (forwarded < frames) {
+        for (uint32_t i = 0; i < 3; ++i) {
+            bench_frame(&frame, (uint32_t)(forwarded + i));
+            can_sim_inject(CAN_PORT_1, &frame);
+        }
+        can_sim_irq_poll();
+        do {
+            bench_begin(&fwd);
+            if (peek) {
+                err = can_receive_peek(&ctx[0], CAN_FIFO_0, &next);
+                if (err == MBED_ERROR_NONE) {
+                    err = can_xmit_packed(&ctx[1], next, &mbox);
+                    if (err == MBED_ERROR_NONE) {
+                        err = can_receive_commit(&ctx[0], CAN_FIFO_0);
+                    }
+                }
+            } else {
+                /* a copied frame refused by CAN2 is held for the next step */
+                err = held ? MBED_ERROR_NONE :
+                      can_receive_packed(&ctx[0], CAN_FIFO_0, &frame);
+                if (err == MBED_ERROR_NONE) {
+                    err = can_xmit_packed(&ctx[1], &frame, &mbox);
+                    held = (err != MBED_ERROR_NONE);
+                }
+            }
+            bench_end(&fwd, err == MBED_ERROR_NONE);
+            forwarded += (err == MBED_ERROR_NONE) ? 1 : 0;
+        } while (err == MBED_ERROR_NONE);
+        can_sim_step();
+    }
+    while (can_sim_step() != 0) {
+        /* drain the CAN2 mailboxes */
+    }
+    bench_report(peek ? "forward, IT, ring, peek" : "forward, IT, ring, copy",
+                 forwarded, bench_ns() - t0, probes, 1);
+    bench_expect(forwarded - can_sim_stats.tx_frames[1], "frames forwarded but not sent");
+}
+
+/* interrupt driven reception, one frame per interrupt. In buffered mode, the
+ * ring is read once some frames are reported, coalesced or not */
+static void bench_receive_it(uint64_t frames, bool buffered, uint8_t coalesce)
+{
+    can_context_t ctx;
+    bench_probe_t recv = { .name = buffered ? "can_receive_burst" : "can_receive" };
+    bench_probe_t *probes[] = { &recv, &bench_irq };
+    can_frame_t burst[CONFIG_USR_DRV_CAN_RX_RING_DEPTH];
+    can_header_t header;
+    can_data_t data;
+    can_packed_frame_t frame;
+    uint64_t received = 0, events = 0, t0;
+    uint32_t count;
+    mbed_error_t err;
+
+    bench_setup();
+    bench_ctx_init(&ctx, CAN_PORT_1, CAN_ACCESS_IT);
+    ctx.rxbuffered = buffered;
+    ctx.rx_coalesce_frames = coalesce;
+    ctx.rx_coalesce_us = (coalesce != 0) ? BENCH_COALESCE_US : 0;
+    bench_ctx_start(&ctx);
+    can_sim_irq_enter = bench_irq_enter;
+    can_sim_irq_exit = bench_irq_exit;
+    t0 = bench_ns();
+    while (received < frames) {
+        /* a burst of frames, each one raising its interrupt */
+        for (uint32_t i = 0; i < CONFIG_USR_DRV_CAN_RX_RING_DEPTH; ++i) {
+            bench_frame(&frame, (uint32_t)(received + i));
+            can_sim_inject(CAN_PORT_1, &frame);
+            can_sim_irq_poll();
+            if (!buffered) {
+                bench_begin(&recv);
+                err = can_receive(&ctx, CAN_FIFO_0, &header, &data);
+                bench_end(&recv, err == MBED_ERROR_NONE);
+                received += (err == MBED_ERROR_NONE) ? 1 : 0;
+                can_sim_irq_poll();
+            }
+        }
+        if (buffered && bench_rx_pending[0] != 0) {
+            events += bench_rx_pending[0];
+            bench_rx_pending[0] = 0;
+            bench_begin(&recv);
+            err = can_receive_burst(&ctx, CAN_FIFO_0, burst,
+                                    CONFIG_USR_DRV_CAN_RX_RING_DEPTH, &count);
+            bench_end(&recv, err == MBED_ERROR_NONE);
+            received += (err == MBED_ERROR_NONE) ? count : 0;
+        }
+    }
+    can_sim_irq_enter = NULL;
+    can_sim_irq_exit = NULL;
+    bench_report(!buffered ? "receive, IT" :
+                 (coalesce != 0) ? "receive, IT, ring, coalesced" : "receive, IT, Rx ring",
+                 received, bench_ns() - t0, probes, 2);
+    printf("    %llu pending frames events\n",
+           (unsigned long long)(events + bench_rx_pending[0]));
+    bench_expect(can_sim_stats.rx_overruns[0], "frames lost on a full Rx FIFO");
+    bench_expect(can_sim_stats.rx_frames[0] - received, "frames stored but not received");
+}
+
+static uint64_t bench_rx_direct;
+static uint32_t bench_urgent_id;    /* packed identifier of the urgent frames */
+static uint64_t bench_urgent_step;  /* frame time of the last one received */
+static uint8_t *bench_seen;         /* receptions of each numbered frame */
+static uint64_t bench_seen_num;
+
+void can_rx_frame(can_port_t port, can_fifo_t fifo, const can_packed_frame_t *frame)
+{
+    (void)port;
+    (void)fifo;
+    if (frame->id == bench_urgent_id) {
+        bench_urgent_step = can_sim_stats.steps;
+    } else if (bench_seen != NULL && frame->datal < bench_seen_num &&
+               bench_seen[frame->datal] < 0xff) {
+        bench_seen[frame->datal]++;
+    }
+    bench_rx_direct++;
+}
+
+/* direct reception, the ISR handing each frame to can_rx_frame() */
+static void bench_receive_direct(uint64_t frames)
+{
+    can_context_t ctx;
+    bench_probe_t *probes[] = { &bench_irq };
+    can_packed_frame_t frame;
+    uint64_t t0;
+
+    bench_setup();
+    bench_rx_direct = 0;
+    bench_ctx_init(&ctx, CAN_PORT_1, CAN_ACCESS_IT);
+    ctx.rxdirect = true;
+    bench_ctx_start(&ctx);
+    can_sim_irq_enter = bench_irq_enter;
+    can_sim_irq_exit = bench_irq_exit;
+    t0 = bench_ns();
+    while (bench_rx_direct < frames) {
+        bench_frame(&frame, (uint32_t)bench_rx_direct);
+        can_sim_inject(CAN_PORT_1, &frame);
+        can_sim_irq_poll();
+    }
+    can_sim_irq_enter = NULL;
+    can_sim_irq_exit = NULL;
+    bench_report("receive, IT, direct", bench_rx_direct, bench_ns() - t0, probes, 1);
+    bench_expect(can_sim_stats.rx_overruns[0], "frames lost on a full Rx FIFO");
+}
+
+/* queued transmission, the Tx ISR refilling the mailboxes */
+static void bench_xmit_queued(uint64_t frames)
+{
+    can_context_t ctx;
+    bench_probe_t xmit = { .name = "can_xmit_packed" };
+    bench_probe_t *probes[] = { &xmit, &bench_irq };
+    can_packed_frame_t frame;
+    can_mbox_t mbox;
+    uint64_t queued = 0, t0;
+    mbed_error_t err;
+
+    bench_setup();
+    bench_ctx_init(&ctx, CAN_PORT_1, CAN_ACCESS_IT);
+    ctx.txqueued = true;
+    bench_ctx_start(&ctx);
+    can_sim_irq_enter = bench_irq_enter;
+    can_sim_irq_exit = bench_irq_exit;
+    t0 = bench_ns();
+    while (queued < frames) {
+        bench_frame(&frame, (uint32_t)queued);
+        bench_begin(&xmit);
+        err = can_xmit_packed(&ctx, &frame, &mbox);
+        bench_end(&xmit, err == MBED_ERROR_NONE);
+        if (err == MBED_ERROR_NONE) {
+            queued++;
+        } else {
+            can_sim_step();
+        }
+    }
+    while (can_sim_step() != 0) {
+        /* drain the queue */
+    }
+    can_sim_irq_enter = NULL;
+    can_sim_irq_exit = NULL;
+    bench_report("xmit, IT, Tx queue", can_sim_stats.tx_frames[0],
+                 bench_ns() - t0, probes, 2);
+    bench_expect(queued - can_sim_stats.tx_frames[0], "frames queued but not sent");
+    bench_expect(queued - bench_tx_done[0], "frames sent without completion event");
+}
+
+/*
+ * CAN2 flooding the bus with high priority frames half of the time, CAN1
+ * sending a new setpoint at each frame time with a deadline: the stale
+ * setpoints are aborted instead of holding the mailboxes.
+ */
+static void bench_xmit_deadline(uint64_t frames)
+{
+    can_context_t ctx[2];
+    bench_probe_t xmit = { .name = "can_xmit_deadline" };
+    bench_probe_t *probes[] = { &xmit, &bench_irq };
+    can_header_t header = {
+        .id.std = 0x010,
+        .IDE = CAN_ID_STD,
+        .RTR = 0,
+        .DLC = 8,
+    };
+    can_data_t data = { 0 };
+    can_packed_frame_t flood, frame;
+    can_mbox_t mbox;
+    uint64_t sent = 0, refused = 0, t0;
+    mbed_error_t err;
+#if CONFIG_USR_DRV_CAN_STATS
+    can_stats_t st;
+#endif
+
+    bench_setup();
+    can_sim_link(true);
+    for (uint32_t p = 0; p < 2; ++p) {
+        bench_ctx_init(&ctx[p], (can_port_t)(CAN_PORT_1 + p), CAN_ACCESS_IT);
+        bench_ctx_start(&ctx[p]);
+    }
+    ctx[1].txqueued = true;
+    can_frame_pack(&header, &data, &flood);
+    can_sim_irq_enter = bench_irq_enter;
+    can_sim_irq_exit = bench_irq_exit;
+    t0 = bench_ns();
+    while (sent < frames) {
+        if ((sent & 0x3f) < 0x20) {
+            while (can_xmit_packed(&ctx[1], &flood, &mbox) == MBED_ERROR_NONE) {
+                /* fill the CAN2 queue */
+            }
+        }
+        bench_frame(&frame, (uint32_t)sent);
+        bench_begin(&xmit);
+        err = can_xmit_deadline(&ctx[0], &frame, BENCH_LIFETIME_US, &mbox);
+        bench_end(&xmit, err == MBED_ERROR_NONE);
+        if (err != MBED_ERROR_NONE) {
+            refused++;
+        }
+        sent++;
+        can_sim_step();
+    }
+    while (can_sim_step() != 0) {
+        /* drain the mailboxes */
+    }
+    can_sim_irq_enter = NULL;
+    can_sim_irq_exit = NULL;
+    bench_report("xmit, IT, deadlines", sent, bench_ns() - t0, probes, 2);
+    printf("    setpoints: %u sent, %u expired, %llu refused\n",
+           bench_tx_done[0], bench_tx_expired[0], (unsigned long long)refused);
+#if CONFIG_USR_DRV_CAN_STATS
+    /* the driver counts the expired frames that were actually not sent */
+    can_stats_snapshot(&ctx[0], &st);
+    bench_expect(st.tx_expired[0] + st.tx_expired[1] + st.tx_expired[2] !=
+                 bench_tx_expired[0], "driver expired frames count different from the events");
+#endif
+    bench_expect(sent - refused - bench_tx_done[0] - bench_tx_expired[0],
+                 "setpoints neither sent nor expired");
+}
+
+/*
+ * CAN1 keeping its Tx queue full of low priority frames, with an urgent frame
+ * every BENCH_URGENT_PERIOD frame times, received by CAN2: latency of the
+ * urgent frames, in frame times, with or without mailbox preemption. More
+ * low priority frames are queued before the Tx interrupt of a preemption,
+ * each of them being numbered, and must all be received exactly once.
+ */
+static void bench_xmit_preempt(uint64_t frames, bool preempt)
+{
+    can_context_t ctx[2];
+    bench_probe_t xmit = { .name = "can_xmit_packed" };
+    bench_probe_t *probes[] = { &xmit, &bench_irq };
+    can_header_t header = {
+        .id.std = 0x010,
+        .IDE = CAN_ID_STD,
+        .RTR = 0,
+        .DLC = 8,
+    };
+    can_data_t data = { 0 };
+    can_packed_frame_t urgent, frame;
+    can_mbox_t mbox;
+    uint64_t queued = 0, submitted = 0, t0;
+    uint64_t urgents = 0, latency, latency_sum = 0, latency_max = 0;
+    uint64_t lost = 0, duplicated = 0;
+    uint32_t pushes;
+    mbed_error_t err;
+
+    bench_setup();
+    can_sim_link(true);
+    bench_ctx_init(&ctx[0], CAN_PORT_1, CAN_ACCESS_IT);
+    ctx[0].txqueued = true;
+#if CONFIG_USR_DRV_CAN_TX_PREEMPT
+    ctx[0].txpreempt = preempt;
+#else
+    if (preempt) {
+        return;
+    }
+#endif
+    bench_ctx_start(&ctx[0]);
+    bench_ctx_init(&ctx[1], CAN_PORT_2, CAN_ACCESS_IT);
+    ctx[1].rxdirect = true;
+    bench_ctx_start(&ctx[1]);
+    can_frame_pack(&header, &data, &urgent);
+    bench_urgent_id = urgent.id;
+    bench_urgent_step = 0;
+    bench_seen_num = frames + CONFIG_USR_DRV_CAN_TX_QUEUE_DEPTH + 3;
+    bench_seen = calloc(bench_seen_num, sizeof(uint8_t));
+    if (bench_seen == NULL) {
+        perror("preempt");
+        exit(EXIT_FAILURE);
+    }
+    can_sim_irq_enter = bench_irq_enter;
+    can_sim_irq_exit = bench_irq_exit;
+    t0 = bench_ns();
+    while (can_sim_stats.tx_frames[0] < frames) {
+        /* low priority frames, from 0x100, numbered in their first word,
+         * leaving room for the pushes following an urgent frame */
+        pushes = 0;
+        while (ctx[0].tx_queue.count <
+               CONFIG_USR_DRV_CAN_TX_QUEUE_DEPTH - BENCH_PREEMPT_PUSHES - 1) {
+            bench_frame(&frame, (uint32_t)queued);
+            frame.datal = (uint32_t)queued;
+            bench_begin(&xmit);
+            err = can_xmit_packed(&ctx[0], &frame, &mbox);
+            bench_end(&xmit, err == MBED_ERROR_NONE);
+            queued += (err == MBED_ERROR_NONE);
+        }
+        if (can_sim_stats.steps % BENCH_URGENT_PERIOD == 0) {
+            if (submitted != 0) {
+                /* the previous one is received by now */
+                latency = bench_urgent_step - submitted;
+                latency_sum += latency;
+                latency_max = (latency > latency_max) ? latency : latency_max;
+                urgents++;
+            }
+            submitted = can_sim_stats.steps;
+            bench_begin(&xmit);
+            err = can_xmit_packed(&ctx[0], &urgent, &mbox);
+            bench_end(&xmit, err == MBED_ERROR_NONE);
+            pushes = BENCH_PREEMPT_PUSHES;
+        }
+        /* before the Tx interrupt of the preemption, if any */
+        for (; pushes > 0; --pushes) {
+            bench_frame(&frame, (uint32_t)queued);
+            frame.datal = (uint32_t)queued;
+            bench_begin(&xmit);
+            err = can_xmit_packed(&ctx[0], &frame, &mbox);
+            bench_end(&xmit, err == MBED_ERROR_NONE);
+            queued += (err == MBED_ERROR_NONE);
+        }
+        /* the ISR thread, running before the end of the current frame */
+        can_sim_irq_poll();
+        can_sim_step();
+    }
+    while (ctx[0].tx_queue.count != 0 || can_sim_step() != 0) {
+        /* drain the queue and the mailboxes */
+        can_sim_step();
+    }
+    can_sim_irq_enter = NULL;
+    can_sim_irq_exit = NULL;
+    for (uint64_t i = 0; i < queued; ++i) {
+        lost += (bench_seen[i] == 0);
+        duplicated += (bench_seen[i] > 1);
+    }
+    free(bench_seen);
+    bench_seen = NULL;
+    bench_report(preempt ? "xmit, IT, queue, preemption" : "xmit, IT, queue, urgent",
+                 can_sim_stats.tx_frames[0], bench_ns() - t0, probes, 2);
+    printf("    %llu urgent frames, latency mean %.1f max %llu frame times\n",
+           (unsigned long long)urgents,
+           (urgents != 0) ? (double)latency_sum / urgents : 0.0,
+           (unsigned long long)latency_max);
+    printf("    %llu low priority frames\n", (unsigned long long)queued);
+    bench_expect(lost, "low priority frames lost");
+    bench_expect(duplicated, "low priority frames received more than once");
+}
+
+#if CONFIG_USR_DRV_CAN_TIMESTAMP
+/*
+ * Both controllers in time triggered mode on the same bus, CAN1 sending a
+ * frame every BENCH_STAMP_PERIOD us for several counter wraps: the extended
+ * Rx stamps must be monotonic, and equal to the Tx ones.
+ */
+static void bench_timestamps(void)
+{
+    can_context_t ctx[2];
+    bench_probe_t recv = { .name = "can_receive" };
+    bench_probe_t *probes[] = { &recv, &bench_irq };
+    can_packed_frame_t frame;
+    can_header_t header;
+    can_data_t data;
+    can_mbox_t mbox;
+    uint64_t first = 0, last = 0, skew, skew_max = 0, t0, next;
+    uint32_t received = 0, disorders = 0;
+    mbed_error_t err;
+
+    bench_setup();
+    can_sim_link(true);
+    for (uint32_t p = 0; p < 2; ++p) {
+        bench_ctx_init(&ctx[p], (can_port_t)(CAN_PORT_1 + p), CAN_ACCESS_IT);
+        ctx[p].timetrigger = true;
+        bench_ctx_start(&ctx[p]);
+    }
+    bench_stamp_ctx = &ctx[0];
+    can_sim_irq_enter = bench_irq_enter;
+    can_sim_irq_exit = bench_irq_exit;
+    t0 = bench_ns();
+    next = t0;
+    for (uint32_t i = 0; i < BENCH_STAMP_FRAMES; ++i) {
+        while (bench_ns() < next) {
+            /* idle bus */
+        }
+        next += BENCH_STAMP_PERIOD * 1000;
+        bench_frame(&frame, i);
+        if (can_xmit_packed(&ctx[0], &frame, &mbox) != MBED_ERROR_NONE) {
+            continue;
+        }
+        can_sim_step();
+        bench_begin(&recv);
+        err = can_receive(&ctx[1], CAN_FIFO_0, &header, &data);
+        bench_end(&recv, err == MBED_ERROR_NONE);
+        if (err != MBED_ERROR_NONE) {
+            continue;
+        }
+        if (received == 0) {
+            first = header.timestamp;
+        } else if (header.timestamp <= last) {
+            disorders++;
+        }
+        last = header.timestamp;
+        skew = (last > bench_tx_time) ? last - bench_tx_time : bench_tx_time - last;
+        skew_max = (skew > skew_max) ? skew : skew_max;
+        received++;
+    }
+    can_sim_irq_enter = NULL;
+    can_sim_irq_exit = NULL;
+    bench_stamp_ctx = NULL;
+    bench_report("time stamps, IT", received, bench_ns() - t0, probes, 2);
+    printf("    %llu bit times (%llu wraps), %u out of order, Rx/Tx skew max %llu\n",
+           (unsigned long long)(last - first),
+           (unsigned long long)((last >> 16) - (first >> 16)), disorders,
+           (unsigned long long)skew_max);
+    bench_expect(disorders, "Rx time stamps out of order");
+}
+#endif
+
+#if CONFIG_USR_DRV_CAN_CAPTURE
+#define BENCH_CAPTURE_READ   64     /* frame times between two capture reads */
+
+/* simulated time, in us at 1 Mbit/s, so that the logs are reproducible */
+uint64_t can_capture_clock(void)
+{
+    return can_sim_stats.steps * BENCH_FRAME_BITS;
+}
+
+/* read and format the pending capture records, returning how many */
+static uint32_t bench_capture_read(can_capture_record_t records[], uint64_t *tx,
+                                   uint64_t *lost, uint64_t *bytes, char sample[])
+{
+    char line[CAN_CAPTURE_LINE_MAX];
+    uint32_t count, n;
+
+    can_capture_read(records, CONFIG_USR_DRV_CAN_CAPTURE_DEPTH, &count, &n);
+    for (uint32_t i = 0; i < count; ++i) {
+        *bytes += can_capture_format(&records[i], line, sizeof(line));
+        *tx += (records[i].flags & CAN_CAPTURE_TX) ? 1 : 0;
+    }
+    *lost += n;
+    if (count != 0) {
+        memcpy(sample, line, sizeof(line));
+    }
+    return count;
+}
+
+/*
+ * Loopback traffic, each frame being recorded when sent and when received in
+ * the Rx ring, the task reading the capture ring every BENCH_CAPTURE_READ
+ * frame times and formatting the records as candump -L lines. Run with and
+ * without capture, for the ISR cost of the records.
+ */
+static void bench_capture(uint64_t frames, bool capture)
+{
+    static can_capture_record_t records[CONFIG_USR_DRV_CAN_CAPTURE_DEPTH];
+    can_context_t ctx;
+    bench_probe_t read = { .name = "capture read+format" };
+    bench_probe_t *probes[] = { &read, &bench_irq };
+    can_frame_t burst[CONFIG_USR_DRV_CAN_RX_RING_DEPTH];
+    can_packed_frame_t frame;
+    can_mbox_t mbox;
+    char sample[CAN_CAPTURE_LINE_MAX] = "";
+    uint64_t sent = 0, received = 0, rx = 0, tx = 0, lost = 0, bytes = 0, t0;
+    uint32_t count;
+
+    bench_setup();
+    bench_ctx_init(&ctx, CAN_PORT_1, CAN_ACCESS_IT);
+    ctx.mode = CAN_MODE_LOOPBACK;
+    ctx.rxbuffered = true;
+    ctx.capture = capture;
+    bench_ctx_start(&ctx);
+    can_capture_reset();
+    can_sim_irq_enter = bench_irq_enter;
+    can_sim_irq_exit = bench_irq_exit;
+    t0 = bench_ns();
+    while (sent < frames) {
+        bench_frame(&frame, (uint32_t)sent);
+        if (can_xmit_packed(&ctx, &frame, &mbox) == MBED_ERROR_NONE) {
+            sent++;
+        }
+        can_sim_step();
+        can_receive_burst(&ctx, CAN_FIFO_0, burst, CONFIG_USR_DRV_CAN_RX_RING_DEPTH, &count);
+        received += count;
+        if (!capture || (can_sim_stats.steps % BENCH_CAPTURE_READ) != 0) {
+            continue;
+        }
+        bench_begin(&read);
+        rx += bench_capture_read(records, &tx, &lost, &bytes, sample);
+        bench_end(&read, true);
+    }
+    /* the last frames in flight, and their records */
+    do {
+        can_receive_burst(&ctx, CAN_FIFO_0, burst, CONFIG_USR_DRV_CAN_RX_RING_DEPTH, &count);
+        received += count;
+    } while (can_sim_step() != 0 || count != 0);
+    if (capture) {
+        while ((count = bench_capture_read(records, &tx, &lost, &bytes, sample)) != 0) {
+            rx += count;
+        }
+    }
+    can_sim_irq_enter = NULL;
+    can_sim_irq_exit = NULL;
+    bench_report(capture ? "loopback, Rx ring, capture" : "loopback, Rx ring",
+                 sent, bench_ns() - t0, probes, 2);
+    if (capture) {
+        printf("    %llu records sent + %llu received, %llu lost, %.1f bytes/line\n",
+               (unsigned long long)tx, (unsigned long long)(rx - tx),
+               (unsigned long long)lost, (rx != 0) ? (double)bytes / rx : 0.0);
+        printf("    last: %s", sample);
+        bench_expect(lost, "capture records lost");
+        bench_expect(sent - tx, "frames sent without a Tx record");
+        bench_expect(sent - (rx - tx), "frames received without a Rx record");
+    }
+    bench_expect(sent - received, "frames sent but not received");
+}
+#endif
+
+#if CONFIG_USR_DRV_CAN_ISOTP
+static uint8_t  bench_isotp_tx[BENCH_ISOTP_SIZE];
+static uint8_t  bench_isotp_rx[BENCH_ISOTP_SIZE];
+static uint64_t bench_isotp_messages;
+static uint64_t bench_isotp_bytes;
+static uint64_t bench_isotp_corrupted;
+static uint64_t bench_isotp_errors;
+static can_isotp_error_t bench_isotp_error;  /* of the last error event */
+
+void can_isotp_event(can_isotp_link_t *link, can_isotp_event_t event,
+                     can_isotp_error_t error)
+{
+    switch (event) {
+        case CAN_ISOTP_EVENT_RX_DONE:
+            /* checked now, the next first frame may follow in the same run */
+            bench_isotp_messages++;
+            bench_isotp_bytes += link->rx_len;
+            bench_isotp_corrupted +=
+                (memcmp(link->rx_buf, bench_isotp_tx, link->rx_len) != 0);
+            break;
+        case CAN_ISOTP_EVENT_TX_ERROR:
+        case CAN_ISOTP_EVENT_RX_ERROR:
+            bench_isotp_errors++;
+            bench_isotp_error = error;
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * ISO-TP transfer between two links of a same controller in loopback mode,
+ * the task running every BENCH_ISOTP_TASK frame times: it hands the received
+ * frames to the links and lets them send the next consecutive frames. The
+ * payload rate is given per frame time and converted to a 1 Mbit/s bus.
+ */
+static void bench_isotp(uint64_t frames, bool pipelined, uint8_t block_size)
+{
+    can_context_t ctx;
+    can_isotp_link_t link[2];
+    bench_probe_t task = { .name = "ISO-TP task" };
+    bench_probe_t *probes[] = { &task, &bench_irq };
+    const can_packed_frame_t *frame;
+    uint64_t t0, steps;
+    char scenario[40];
+
+    bench_setup();
+    bench_isotp_messages = bench_isotp_bytes = 0;
+    bench_isotp_corrupted = bench_isotp_errors = 0;
+    bench_ctx_init(&ctx, CAN_PORT_1, CAN_ACCESS_IT);
+    ctx.mode = CAN_MODE_LOOPBACK;
+    ctx.rxbuffered = true;
+    ctx.txfifoprio = pipelined;
+    bench_ctx_start(&ctx);
+    for (uint32_t i = 0; i < 2; ++i) {
+        memset(&link[i], 0x0, sizeof(can_isotp_link_t));
+        link[i].ctx = &ctx;
+        link[i].IDE = CAN_ID_STD;
+        link[i].tx_id = (i == 0) ? 0x7e0 : 0x7e8;
+        link[i].rx_id = (i == 0) ? 0x7e8 : 0x7e0;
+        link[i].block_size = block_size;
+        link[i].rx_buf = bench_isotp_rx;
+        link[i].rx_size = sizeof(bench_isotp_rx);
+        if (can_isotp_init(&link[i]) != MBED_ERROR_NONE) {
+            fprintf(stderr, "unable to init the ISO-TP link %u\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (uint32_t b = 0; b < BENCH_ISOTP_SIZE; ++b) {
+        bench_isotp_tx[b] = (uint8_t)(b * 7 + 3);
+    }
+    can_sim_irq_enter = bench_irq_enter;
+    can_sim_irq_exit = bench_irq_exit;
+    t0 = bench_ns();
+    while (can_sim_stats.tx_frames[0] < frames) {
+        bench_begin(&task);
+        while (can_receive_peek(&ctx, CAN_FIFO_0, &frame) == MBED_ERROR_NONE) {
+            if (can_isotp_rx_frame(&link[1], frame) == MBED_ERROR_NOTFOUND) {
+                can_isotp_rx_frame(&link[0], frame);
+            }
+            can_receive_commit(&ctx, CAN_FIFO_0);
+        }
+        if (link[0].tx_state == CAN_ISOTP_IDLE) {
+            can_isotp_send(&link[0], bench_isotp_tx, BENCH_ISOTP_SIZE);
+        }
+        can_isotp_poll(&link[0]);
+        can_isotp_poll(&link[1]);
+        bench_end(&task, true);
+        for (uint32_t s = 0; s < BENCH_ISOTP_TASK; ++s) {
+            can_sim_step();
+        }
+    }
+    can_sim_irq_enter = NULL;
+    can_sim_irq_exit = NULL;
+    steps = can_sim_stats.steps;
+    snprintf(scenario, sizeof(scenario), "ISO-TP, loopback, %s BS %u",
+             pipelined ? "pipe" : "serial", block_size);
+    bench_report(scenario, can_sim_stats.tx_frames[0], bench_ns() - t0, probes, 2);
+    printf("    %llu messages, %.2f bytes/frame time (%.1f kB/s at 1 Mbit/s),"
+           " %llu corrupted, %llu errors\n",
+           (unsigned long long)bench_isotp_messages,
+           (steps != 0) ? (double)bench_isotp_bytes / steps : 0.0,
+           (steps != 0) ? (double)bench_isotp_bytes / steps * 1e6 / BENCH_FRAME_BITS / 1000
+                        : 0.0,
+           (unsigned long long)bench_isotp_corrupted,
+           (unsigned long long)bench_isotp_errors);
+    if (frames >= BENCH_TRANSFER_FRAMES) {
+        bench_expect(bench_isotp_messages == 0, "scenario without any message received");
+    }
+    bench_expect(bench_isotp_corrupted, "messages corrupted");
+    bench_expect(bench_isotp_errors, "transfer errors");
+}
+
+/* a frame sent by the peer of the link, padded to 8 bytes */
+static void bench_isotp_peer(can_isotp_link_t *link, const uint8_t *bytes, uint8_t len)
+{
+    can_header_t header = {
+        .id.std = (uint16_t)link->rx_id,
+        .IDE = CAN_ID_STD,
+        .RTR = 0,
+        .DLC = 8,
+    };
+    can_data_t data;
+    can_packed_frame_t frame;
+
+    memset(data.data, CAN_ISOTP_PADDING_BYTE, sizeof(data.data));
+    memcpy(data.data, bytes, len);
+    can_frame_pack(&header, &data, &frame);
+    can_isotp_rx_frame(link, &frame);
+}
+
+/* the case must have ended on a single error event, of the expected code.
+ * Returns 1 for a wrong outcome, and resets the link for the next case */
+static uint32_t bench_isotp_outcome(can_isotp_link_t *link, const char *what,
+                                    can_isotp_error_t expected)
+{
+    uint32_t wrong = (bench_isotp_errors != 1 || bench_isotp_error != expected);
+
+    if (wrong) {
+        printf("    %s: %llu errors, last %u instead of %u\n", what,
+               (unsigned long long)bench_isotp_errors, bench_isotp_error, expected);
+    }
+    while (can_sim_step() != 0) {
+        /* the frames sent by the case */
+    }
+    bench_isotp_errors = 0;
+    bench_isotp_error = CAN_ISOTP_ERROR_NONE;
+    can_isotp_init(link);
+    return wrong;
+}
+
+/*
+ * ISO-TP error paths: the frames of the peer are handed to the link by the
+ * task, the clock being moved forward for the N_Bs and N_Cr timeouts.
+ */
+static void bench_isotp_faults(void)
+{
+    const uint8_t ff[] = { 0x10, 20, 0, 1, 2, 3, 4, 5 };
+    const uint8_t ff_long[] = { 0x1f, 0xff, 0, 1, 2, 3, 4, 5 };
+    const uint8_t cf_sn2[] = { 0x22, 6, 7, 8, 9, 10, 11, 12 };
+    const uint8_t fc_cts[] = { 0x30, 0, 0 };
+    const uint8_t fc_wait[] = { 0x31, 0, 0 };
+    const uint8_t fc_ovflw[] = { 0x32, 0, 0 };
+    const uint64_t timeout = CAN_ISOTP_TIMEOUT_DEFAULT * 1000ULL;
+    static uint8_t rx_buf[64];
+    can_context_t ctx;
+    can_isotp_link_t link;
+    uint32_t cases = 0, wrong = 0;
+
+    bench_setup();
+    bench_isotp_errors = 0;
+    bench_isotp_error = CAN_ISOTP_ERROR_NONE;
+    bench_ctx_init(&ctx, CAN_PORT_1, CAN_ACCESS_IT);
+    ctx.mode = CAN_MODE_LOOPBACK;
+    ctx.rxbuffered = true;
+    bench_ctx_start(&ctx);
+    memset(&link, 0x0, sizeof(link));
+    link.ctx = &ctx;
+    link.IDE = CAN_ID_STD;
+    link.tx_id = 0x7e0;
+    link.rx_id = 0x7e8;
+    link.rx_buf = rx_buf;
+    link.rx_size = sizeof(rx_buf);
+    if (can_isotp_init(&link) != MBED_ERROR_NONE) {
+        fprintf(stderr, "unable to init the ISO-TP link\n");
+        exit(EXIT_FAILURE);
+    }
+
+    bench_isotp_peer(&link, ff, sizeof(ff));
+    bench_isotp_peer(&link, cf_sn2, sizeof(cf_sn2));
+    wrong += bench_isotp_outcome(&link, "consecutive frame out of sequence",
+                                 CAN_ISOTP_ERROR_WRONG_SN);
+    cases++;
+
+    bench_isotp_peer(&link, ff, sizeof(ff));
+    can_sim_advance(timeout + 1000);
+    can_isotp_poll(&link);
+    wrong += bench_isotp_outcome(&link, "no consecutive frame (N_Cr)",
+                                 CAN_ISOTP_ERROR_TIMEOUT_CR);
+    cases++;
+
+    bench_isotp_peer(&link, ff_long, sizeof(ff_long));
+    wrong += bench_isotp_outcome(&link, "message larger than the buffer",
+                                 CAN_ISOTP_ERROR_OVERFLOW);
+    cases++;
+
+    can_isotp_send(&link, bench_isotp_tx, 20);
+    can_sim_advance(timeout + 1000);
+    can_isotp_poll(&link);
+    wrong += bench_isotp_outcome(&link, "no flow control (N_Bs)",
+                                 CAN_ISOTP_ERROR_TIMEOUT_BS);
+    cases++;
+
+    /* each WAIT restarts N_Bs */
+    can_isotp_send(&link, bench_isotp_tx, 20);
+    can_sim_advance(timeout * 3 / 4);
+    bench_isotp_peer(&link, fc_wait, sizeof(fc_wait));
+    can_sim_advance(timeout * 3 / 4);
+    can_isotp_poll(&link);
+    wrong += (bench_isotp_errors != 0 || link.tx_state != CAN_ISOTP_TX_WAIT_FC);
+    can_sim_advance(timeout);
+    can_isotp_poll(&link);
+    wrong += bench_isotp_outcome(&link, "no flow control after a WAIT",
+                                 CAN_ISOTP_ERROR_TIMEOUT_BS);
+    cases++;
+
+    /* up to CAN_ISOTP_WFT_MAX WAIT, then CTS */
+    can_isotp_send(&link, bench_isotp_tx, 20);
+    for (uint32_t i = 0; i < CAN_ISOTP_WFT_MAX; ++i) {
+        bench_isotp_peer(&link, fc_wait, sizeof(fc_wait));
+    }
+    bench_isotp_peer(&link, fc_cts, sizeof(fc_cts));
+    wrong += (bench_isotp_errors != 0 || link.tx_state == CAN_ISOTP_TX_WAIT_FC);
+    while (link.tx_state != CAN_ISOTP_IDLE && can_sim_step() != 0) {
+        can_isotp_poll(&link);
+    }
+    wrong += (bench_isotp_errors != 0 || link.tx_state != CAN_ISOTP_IDLE);
+    can_isotp_init(&link);
+    cases++;
+
+    can_isotp_send(&link, bench_isotp_tx, 20);
+    for (uint32_t i = 0; i <= CAN_ISOTP_WFT_MAX; ++i) {
+        bench_isotp_peer(&link, fc_wait, sizeof(fc_wait));
+    }
+    wrong += bench_isotp_outcome(&link, "too many flow control WAIT",
+                                 CAN_ISOTP_ERROR_WFT_OVRN);
+    cases++;
+
+    can_isotp_send(&link, bench_isotp_tx, 20);
+    bench_isotp_peer(&link, fc_ovflw, sizeof(fc_ovflw));
+    wrong += bench_isotp_outcome(&link, "flow control overflow",
+                                 CAN_ISOTP_ERROR_OVERFLOW);
+    cases++;
+
+    printf("%-28s %8u cases\n", "ISO-TP, faults", cases);
+    bench_expect(wrong, "fault cases with a wrong outcome");
+}
+#endif
+
+#if CONFIG_USR_DRV_CAN_J1939
+/* node 0 receives, nodes 1 to BENCH_J1939_SENDERS send to it in connection
+ * mode, the last one broadcasts */
+#define BENCH_J1939_NODES    (BENCH_J1939_SENDERS + 2)
+#define BENCH_J1939_RECEIVER 0x30
+
+static uint8_t  bench_j1939_data[CAN_J1939_TP_MAX];
+static const can_j1939_node_t *bench_j1939_receiver;
+static uint64_t bench_j1939_messages[2];   /* connection mode, broadcast */
+static uint64_t bench_j1939_bytes;
+static uint64_t bench_j1939_corrupted;
+static uint64_t bench_j1939_aborts;
+static uint32_t bench_j1939_claimed;
+static uint32_t bench_j1939_round;
+static uint32_t bench_j1939_events;        /* all events, with the last one */
+static can_j1939_event_t bench_j1939_event;
+static can_j1939_abort_t bench_j1939_reason;
+
+void can_j1939_rx(can_j1939_node_t *node, const can_j1939_msg_t *msg)
+{
+    if (node != bench_j1939_receiver || msg->len <= 8) {
+        return;
+    }
+    bench_j1939_messages[(msg->da == CAN_J1939_ADDR_GLOBAL) ? 1 : 0]++;
+    bench_j1939_bytes += msg->len;
+    bench_j1939_corrupted += (memcmp(msg->data, bench_j1939_data, msg->len) != 0);
+}
+
+void can_j1939_event(can_j1939_node_t *node, can_j1939_event_t event,
+                     uint32_t pgn, can_j1939_abort_t reason)
+{
+    (void)node;
+    (void)pgn;
+    bench_j1939_events++;
+    bench_j1939_event = event;
+    bench_j1939_reason = reason;
+    switch (event) {
+        case CAN_J1939_EVENT_TX_ABORT:
+        case CAN_J1939_EVENT_RX_ABORT:
+            bench_j1939_aborts++;
+            break;
+        case CAN_J1939_EVENT_ADDR_CLAIMED:
+            bench_j1939_claimed++;
+            break;
+        default:
+            break;
+    }
+}
+
+/* the task: hand each received frame to every node, then poll them */
+static uint32_t bench_j1939_task(const can_context_t *ctx, can_j1939_node_t nodes[])
+{
+    const can_packed_frame_t *frame;
+    uint32_t sessions = 0;
+
+    while (can_receive_peek(ctx, CAN_FIFO_0, &frame) == MBED_ERROR_NONE) {
+        for (uint32_t i = 0; i < BENCH_J1939_NODES; ++i) {
+            can_j1939_rx_frame(&nodes[i], frame);
+        }
+        can_receive_commit(ctx, CAN_FIFO_0);
+    }
+    /* round robin, the first node polled getting the free mailboxes */
+    for (uint32_t i = 0; i < BENCH_J1939_NODES; ++i) {
+        can_j1939_poll(&nodes[(bench_j1939_round + i) % BENCH_J1939_NODES]);
+    }
+    bench_j1939_round++;
+    for (uint32_t i = 0; i < CONFIG_USR_DRV_CAN_J1939_SESSIONS; ++i) {
+        sessions += (nodes[0].sessions[i].type != CAN_J1939_SESSION_FREE);
+    }
+    return sessions;
+}
+
+/*
+ * J1939 nodes on a same controller in loopback mode. They first claim their
+ * address, the last two senders contending for the same one, then the
+ * senders transfer 1785 bytes messages to the receiver, in connection mode,
+ * while the last node broadcasts: the receiver reassembles them all
+ * concurrently. The task runs every BENCH_ISOTP_TASK frame times.
+ */
+static void bench_j1939(uint64_t frames, bool pipelined)
+{
+    static can_j1939_node_t nodes[BENCH_J1939_NODES];
+    can_context_t ctx;
+    bench_probe_t task = { .name = "J1939 task" };
+    bench_probe_t *probes[] = { &task, &bench_irq };
+    can_j1939_node_t *bam = &nodes[BENCH_J1939_NODES - 1];
+    uint32_t sessions, sessions_max = 0;
+    uint64_t t0, steps, sent;
+    char scenario[40];
+
+    bench_setup();
+    bench_j1939_messages[0] = bench_j1939_messages[1] = 0;
+    bench_j1939_bytes = bench_j1939_corrupted = bench_j1939_aborts = 0;
+    bench_j1939_claimed = 0;
+    bench_ctx_init(&ctx, CAN_PORT_1, CAN_ACCESS_IT);
+    ctx.mode = CAN_MODE_LOOPBACK;
+    ctx.rxbuffered = true;
+    ctx.txfifoprio = pipelined;
+    bench_ctx_start(&ctx);
+    for (uint32_t i = 0; i < BENCH_J1939_NODES; ++i) {
+        memset(&nodes[i], 0x0, sizeof(can_j1939_node_t));
+        nodes[i].ctx = &ctx;
+        nodes[i].name = CAN_J1939_NAME_AAC | (0x1000 + i);
+        nodes[i].address = (i == 0) ? BENCH_J1939_RECEIVER : (uint8_t)(0x10 + i);
+        nodes[i].bam_gap_us = BENCH_J1939_BAM_GAP;
+        if (can_j1939_init(&nodes[i]) != MBED_ERROR_NONE) {
+            fprintf(stderr, "unable to init the J1939 node %u\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* contention: the last sender has a higher NAME and moves */
+    nodes[BENCH_J1939_SENDERS].address = nodes[BENCH_J1939_SENDERS - 1].address;
+    bench_j1939_receiver = &nodes[0];
+    for (uint32_t b = 0; b < CAN_J1939_TP_MAX; ++b) {
+        bench_j1939_data[b] = (uint8_t)(b * 13 + 5);
+    }
+    for (uint32_t i = 0; i < BENCH_J1939_NODES; ++i) {
+        can_j1939_claim(&nodes[i]);
+    }
+    while (bench_j1939_claimed < BENCH_J1939_NODES) {
+        bench_j1939_task(&ctx, nodes);
+        can_sim_step();
+    }
+    can_sim_irq_enter = bench_irq_enter;
+    can_sim_irq_exit = bench_irq_exit;
+    steps = can_sim_stats.steps;
+    sent = can_sim_stats.tx_frames[0];
+    t0 = bench_ns();
+    while (can_sim_stats.tx_frames[0] - sent < frames) {
+        bench_begin(&task);
+        for (uint32_t i = 1; i <= BENCH_J1939_SENDERS; ++i) {
+            if (nodes[i].tx_state == CAN_J1939_TX_IDLE) {
+                can_j1939_send(&nodes[i], CAN_J1939_PRIO_DEFAULT, 0xef00, nodes[0].sa,
+                               bench_j1939_data, CAN_J1939_TP_MAX);
+            }
+        }
+        if (bam->tx_state == CAN_J1939_TX_IDLE) {
+            /* DM1, broadcast */
+            can_j1939_send(bam, CAN_J1939_PRIO_DEFAULT, 0xfeca, CAN_J1939_ADDR_GLOBAL,
+                           bench_j1939_data, CAN_J1939_TP_MAX);
+        }
+        sessions = bench_j1939_task(&ctx, nodes);
+        sessions_max = (sessions > sessions_max) ? sessions : sessions_max;
+        bench_end(&task, true);
+        for (uint32_t s = 0; s < BENCH_ISOTP_TASK; ++s) {
+            can_sim_step();
+        }
+    }
+    can_sim_irq_enter = NULL;
+    can_sim_irq_exit = NULL;
+    steps = can_sim_stats.steps - steps;
+    snprintf(scenario, sizeof(scenario), "J1939, loopback, %s",
+             pipelined ? "pipe" : "serial");
+    bench_report(scenario, can_sim_stats.tx_frames[0] - sent, bench_ns() - t0, probes, 2);
+    printf("    addresses");
+    for (uint32_t i = 0; i < BENCH_J1939_NODES; ++i) {
+        printf(" 0x%02x", nodes[i].sa);
+    }
+    printf(", %u sessions max\n", sessions_max);
+    printf("    %llu RTS/CTS + %llu BAM messages, %.2f bytes/frame time"
+           " (%.1f kB/s at 1 Mbit/s), %llu corrupted, %llu aborts\n",
+           (unsigned long long)bench_j1939_messages[0],
+           (unsigned long long)bench_j1939_messages[1],
+           (steps != 0) ? (double)bench_j1939_bytes / steps : 0.0,
+           (steps != 0) ? (double)bench_j1939_bytes / steps * 1e6 / BENCH_EXT_FRAME_BITS / 1000
+                        : 0.0,
+           (unsigned long long)bench_j1939_corrupted,
+           (unsigned long long)bench_j1939_aborts);
+    if (frames >= BENCH_TRANSFER_FRAMES) {
+        bench_expect(bench_j1939_messages[0] == 0, "scenario without any message received");
+    }
+    bench_expect(bench_j1939_corrupted, "messages corrupted");
+    bench_expect(bench_j1939_aborts, "transfers aborted");
+    bench_expect(nodes[BENCH_J1939_SENDERS].sa == nodes[BENCH_J1939_SENDERS - 1].sa,
+                 "address claimed twice");
+}
+
+#define BENCH_J1939_PEER     0x40
+
+/* a frame sent by the peer of the node, to it or to all for a claim */
+static void bench_j1939_peer(can_j1939_node_t *node, uint32_t pgn, uint8_t sa,
+                             const uint8_t bytes[8])
+{
+    can_header_t header = {
+        .id.ext = can_j1939_id(CAN_J1939_PRIO_TP, pgn,
+                               (pgn == CAN_J1939_PGN_ADDR_CLAIM) ? CAN_J1939_ADDR_GLOBAL
+                                                                 : node->sa, sa),
+        .IDE = CAN_ID_EXT,
+        .RTR = 0,
+        .DLC = 8,
+    };
+    can_data_t data;
+    can_packed_frame_t frame;
+
+    memcpy(data.data, bytes, 8);
+    can_frame_pack(&header, &data, &frame);
+    can_j1939_rx_frame(node, &frame);
+}
+
+/* init the node and claim its address without contention */
+static void bench_j1939_fault_node(can_j1939_node_t *node, uint64_t name)
+{
+    node->name = name;
+    node->address = BENCH_J1939_RECEIVER;
+    can_j1939_init(node);
+    can_j1939_claim(node);
+    can_sim_advance(1000ULL * CAN_J1939_CLAIM_DELAY + 1000);
+    can_j1939_poll(node);
+    bench_j1939_events = 0;
+}
+
+/* the case must have ended on a single event, of the expected kind and
+ * reason. Returns 1 for a wrong outcome */
+static uint32_t bench_j1939_outcome(const char *what, can_j1939_event_t event,
+                                    can_j1939_abort_t reason)
+{
+    uint32_t wrong = (bench_j1939_events != 1 || bench_j1939_event != event ||
+                      bench_j1939_reason != reason);
+
+    if (wrong) {
+        printf("    %s: %u events, last %u reason %u instead of %u reason %u\n", what,
+               bench_j1939_events, bench_j1939_event, bench_j1939_reason, event, reason);
+    }
+    while (can_sim_step() != 0) {
+        /* the frames sent by the case */
+    }
+    return wrong;
+}
+
+/*
+ * J1939 error paths: the frames of a peer are handed to the node by the task,
+ * the clock being moved forward for the claim delay and the T1 to T4
+ * timeouts. Each case starts from a node with its address claimed.
+ */
+static void bench_j1939_faults(void)
+{
+    const uint8_t rts[] = { 16, 20, 0, 3, 0xff, 0x00, 0xef, 0x00 };
+    const uint8_t cts_all[] = { 17, 3, 1, 0xff, 0xff, 0x00, 0xef, 0x00 };
+    const uint8_t cts_bad[] = { 17, 2, 9, 0xff, 0xff, 0x00, 0xef, 0x00 };
+    const uint8_t cts_hold[] = { 17, 0, 0xff, 0xff, 0xff, 0x00, 0xef, 0x00 };
+    const uint8_t dt1[] = { 1, 1, 2, 3, 4, 5, 6, 7 };
+    const uint8_t dt2[] = { 2, 8, 9, 10, 11, 12, 13, 14 };
+    const uint8_t lower[] = { 1, 0, 0, 0, 0, 0, 0, 0 };  /* peer NAME 1 */
+    const uint8_t higher[] = { 0, 0, 0, 0, 0, 0, 0, 0x7f };
+    static can_j1939_node_t node;
+    can_context_t ctx;
+    uint32_t cases = 0, wrong = 0;
+
+    bench_setup();
+    bench_ctx_init(&ctx, CAN_PORT_1, CAN_ACCESS_IT);
+    ctx.mode = CAN_MODE_LOOPBACK;
+    ctx.rxbuffered = true;
+    bench_ctx_start(&ctx);
+    memset(&node, 0x0, sizeof(node));
+    node.ctx = &ctx;
+
+    /* contention won: the node claims again and keeps its address */
+    node.name = 0x1000;
+    node.address = BENCH_J1939_RECEIVER;
+    can_j1939_init(&node);
+    can_j1939_claim(&node);
+    bench_j1939_events = 0;
+    bench_j1939_peer(&node, CAN_J1939_PGN_ADDR_CLAIM, BENCH_J1939_RECEIVER, higher);
+    can_sim_advance(1000ULL * CAN_J1939_CLAIM_DELAY + 1000);
+    can_j1939_poll(&node);
+    wrong += bench_j1939_outcome("address contention won", CAN_J1939_EVENT_ADDR_CLAIMED,
+                                 CAN_J1939_ABORT_NONE);
+    wrong += (node.sa != BENCH_J1939_RECEIVER);
+    cases++;
+
+    /* contention lost: an arbitrary address capable node moves */
+    bench_j1939_fault_node(&node, CAN_J1939_NAME_AAC | 0x1000);
+    bench_j1939_peer(&node, CAN_J1939_PGN_ADDR_CLAIM, BENCH_J1939_RECEIVER, lower);
+    can_sim_advance(1000ULL * CAN_J1939_CLAIM_DELAY + 1000);
+    can_j1939_poll(&node);
+    wrong += bench_j1939_outcome("address contention lost, moved",
+                                 CAN_J1939_EVENT_ADDR_CLAIMED, CAN_J1939_ABORT_NONE);
+    wrong += (node.sa != CAN_J1939_ADDR_ARBITRARY);
+    cases++;
+
+    /* contention lost: others cannot claim */
+    bench_j1939_fault_node(&node, 0x1000);
+    bench_j1939_peer(&node, CAN_J1939_PGN_ADDR_CLAIM, BENCH_J1939_RECEIVER, lower);
+    wrong += bench_j1939_outcome("address contention lost", CAN_J1939_EVENT_ADDR_LOST,
+                                 CAN_J1939_ABORT_NONE);
+    wrong += (node.sa != CAN_J1939_ADDR_NULL);
+    cases++;
+
+    /* sender: a CTS while the window is being sent, a single TP.DT being
+     * pending at a time */
+    bench_j1939_fault_node(&node, 0x1000);
+    can_j1939_send(&node, CAN_J1939_PRIO_DEFAULT, 0xef00, BENCH_J1939_PEER,
+                   bench_j1939_data, 20);
+    bench_j1939_peer(&node, CAN_J1939_PGN_TP_CM, BENCH_J1939_PEER, cts_all);
+    wrong += (node.tx_state != CAN_J1939_TX_DT);
+    bench_j1939_peer(&node, CAN_J1939_PGN_TP_CM, BENCH_J1939_PEER, cts_all);
+    wrong += bench_j1939_outcome("CTS during a data window", CAN_J1939_EVENT_TX_ABORT,
+                                 CAN_J1939_ABORT_CTS_IN_DT);
+    cases++;
+
+    bench_j1939_fault_node(&node, 0x1000);
+    can_j1939_send(&node, CAN_J1939_PRIO_DEFAULT, 0xef00, BENCH_J1939_PEER,
+                   bench_j1939_data, 20);
+    bench_j1939_peer(&node, CAN_J1939_PGN_TP_CM, BENCH_J1939_PEER, cts_bad);
+    wrong += bench_j1939_outcome("CTS of a packet out of the message",
+                                 CAN_J1939_EVENT_TX_ABORT, CAN_J1939_ABORT_BAD_SEQUENCE);
+    cases++;
+
+    bench_j1939_fault_node(&node, 0x1000);
+    can_j1939_send(&node, CAN_J1939_PRIO_DEFAULT, 0xef00, BENCH_J1939_PEER,
+                   bench_j1939_data, 20);
+    can_sim_advance(1000ULL * CAN_J1939_T3 + 1000);
+    can_j1939_poll(&node);
+    wrong += bench_j1939_outcome("no CTS (T3)", CAN_J1939_EVENT_TX_ABORT,
+                                 CAN_J1939_ABORT_TIMEOUT);
+    cases++;
+
+    /* a hold CTS shortens the wait to T4 */
+    bench_j1939_fault_node(&node, 0x1000);
+    can_j1939_send(&node, CAN_J1939_PRIO_DEFAULT, 0xef00, BENCH_J1939_PEER,
+                   bench_j1939_data, 20);
+    bench_j1939_peer(&node, CAN_J1939_PGN_TP_CM, BENCH_J1939_PEER, cts_hold);
+    can_sim_advance(1000ULL * CAN_J1939_T4 + 1000);
+    can_j1939_poll(&node);
+    wrong += bench_j1939_outcome("no CTS after a hold (T4)", CAN_J1939_EVENT_TX_ABORT,
+                                 CAN_J1939_ABORT_TIMEOUT);
+    cases++;
+
+    /* receiver */
+    bench_j1939_fault_node(&node, 0x1000);
+    bench_j1939_peer(&node, CAN_J1939_PGN_TP_CM, BENCH_J1939_PEER, rts);
+    bench_j1939_peer(&node, CAN_J1939_PGN_TP_DT, BENCH_J1939_PEER, dt2);
+    wrong += bench_j1939_outcome("TP.DT out of sequence", CAN_J1939_EVENT_RX_ABORT,
+                                 CAN_J1939_ABORT_BAD_SEQUENCE);
+    cases++;
+
+    bench_j1939_fault_node(&node, 0x1000);
+    bench_j1939_peer(&node, CAN_J1939_PGN_TP_CM, BENCH_J1939_PEER, rts);
+    can_sim_advance(1000ULL * CAN_J1939_T2 + 1000);
+    can_j1939_poll(&node);
+    wrong += bench_j1939_outcome("no TP.DT after a CTS (T2)", CAN_J1939_EVENT_RX_ABORT,
+                                 CAN_J1939_ABORT_TIMEOUT);
+    cases++;
+
+    bench_j1939_fault_node(&node, 0x1000);
+    bench_j1939_peer(&node, CAN_J1939_PGN_TP_CM, BENCH_J1939_PEER, rts);
+    bench_j1939_peer(&node, CAN_J1939_PGN_TP_DT, BENCH_J1939_PEER, dt1);
+    can_sim_advance(1000ULL * CAN_J1939_T1 + 1000);
+    can_j1939_poll(&node);
+    wrong += bench_j1939_outcome("no TP.DT after a TP.DT (T1)", CAN_J1939_EVENT_RX_ABORT,
+                                 CAN_J1939_ABORT_TIMEOUT);
+    cases++;
+
+    printf("%-28s %8u cases\n", "J1939, faults", cases);
+    bench_expect(wrong, "fault cases with a wrong outcome");
+}
+#endif
+
+#if CONFIG_USR_DRV_CAN_CANOPEN
+#define BENCH_CO_NODE        0x10
+#define BENCH_CO_TPDOS       4
+#define BENCH_CO_DOMAIN      4096   /* bytes uploaded per SDO transfer */
+#define BENCH_CO_SYNC_PERIOD 16     /* frame times between two SYNC */
+
+typedef enum {
+    BENCH_CO_SYNC = 0,              /* SYNC driven TPDOs */
+    BENCH_CO_SEGMENTED,             /* SDO segmented upload */
+    BENCH_CO_BLOCK                  /* SDO block upload */
+} bench_co_mode_t;
+
+/* client states, a transfer starting from BENCH_CO_CLIENT_IDLE */
+typedef enum {
+    BENCH_CO_CLIENT_IDLE = 0,
+    BENCH_CO_CLIENT_SEG_INIT,
+    BENCH_CO_CLIENT_SEG,
+    BENCH_CO_CLIENT_BLK_INIT,
+    BENCH_CO_CLIENT_BLK,
+    BENCH_CO_CLIENT_BLK_END
+} bench_co_client_state_t;
+
+static uint32_t bench_co_values[2 * BENCH_CO_TPDOS];
+static uint8_t  bench_co_domain[BENCH_CO_DOMAIN];
+static uint8_t  bench_co_upload[BENCH_CO_DOMAIN];
+static const uint32_t bench_co_mappings[BENCH_CO_TPDOS][2] = {
+    { CAN_CO_MAP(0x2000, 1, 32), CAN_CO_MAP(0x2000, 2, 32) },
+    { CAN_CO_MAP(0x2000, 3, 32), CAN_CO_MAP(0x2000, 4, 32) },
+    { CAN_CO_MAP(0x2000, 5, 32), CAN_CO_MAP(0x2000, 6, 32) },
+    { CAN_CO_MAP(0x2000, 7, 32), CAN_CO_MAP(0x2000, 8, 32) },
+};
+static const can_co_od_entry_t bench_co_od[] = {
+    { 0x2000, 1, CAN_CO_ACCESS_RW, 4, &bench_co_values[0] },
+    { 0x2000, 2, CAN_CO_ACCESS_RW, 4, &bench_co_values[1] },
+    { 0x2000, 3, CAN_CO_ACCESS_RW, 4, &bench_co_values[2] },
+    { 0x2000, 4, CAN_CO_ACCESS_RW, 4, &bench_co_values[3] },
+    { 0x2000, 5, CAN_CO_ACCESS_RW, 4, &bench_co_values[4] },
+    { 0x2000, 6, CAN_CO_ACCESS_RW, 4, &bench_co_values[5] },
+    { 0x2000, 7, CAN_CO_ACCESS_RW, 4, &bench_co_values[6] },
+    { 0x2000, 8, CAN_CO_ACCESS_RW, 4, &bench_co_values[7] },
+    { 0x2100, 0, CAN_CO_ACCESS_READ, BENCH_CO_DOMAIN, bench_co_domain },
+};
+
+static struct {
+    bench_co_client_state_t state;
+    uint8_t  toggle;
+    uint8_t  seqno;
+    uint32_t off;
+    uint32_t block_off;
+    bool     pending;               /* req to send again */
+    can_packed_frame_t req;
+} bench_co_client;
+static uint64_t bench_co_uploads;
+static uint64_t bench_co_bytes;
+static uint64_t bench_co_corrupted;
+static uint64_t bench_co_aborts;
+static uint32_t bench_co_abort_code;       /* of the last abort */
+static uint64_t bench_co_tpdos;
+static uint64_t bench_co_syncs;
+
+void can_co_event(can_co_node_t *node, can_co_event_t event, uint32_t arg)
+{
+    (void)node;
+    if (event == CAN_CO_EVENT_SDO_ABORT) {
+        bench_co_aborts++;
+        bench_co_abort_code = arg;
+    }
+}
+
+static void bench_co_xmit(uint16_t cob_id, const uint8_t *bytes, uint8_t dlc)
+{
+    can_header_t header = { 0 };
+    can_data_t data = { 0 };
+
+    header.id.std = cob_id;
+    header.IDE = CAN_ID_STD;
+    header.DLC = dlc;
+    if (dlc != 0) {
+        memcpy(data.data, bytes, dlc);
+    }
+    can_frame_pack(&header, &data, &bench_co_client.req);
+    bench_co_client.pending = true;
+}
+
+static void bench_co_client_send(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4)
+{
+    uint8_t req[8] = { b0, b1, b2, b3, b4, 0, 0, 0 };
+
+    bench_co_xmit(CAN_CO_COB_SDO_RX + BENCH_CO_NODE, req, 8);
+}
+
+/* minimal SDO client, uploading the domain object */
+static void bench_co_client_rx(const uint8_t resp[8])
+{
+    uint32_t len;
+    uint8_t seqno;
+
+    if (resp[0] == 0x80 && bench_co_client.state != BENCH_CO_CLIENT_BLK) {
+        /* aborted, counted by can_co_event() */
+        bench_co_client.state = BENCH_CO_CLIENT_IDLE;
+        return;
+    }
+    switch (bench_co_client.state) {
+        case BENCH_CO_CLIENT_SEG_INIT:
+            bench_co_client.state = BENCH_CO_CLIENT_SEG;
+            bench_co_client_send(0x60, 0, 0, 0, 0);
+            break;
+        case BENCH_CO_CLIENT_SEG:
+            len = 7 - ((resp[0] >> 1) & 0x7);
+            memcpy(&bench_co_upload[bench_co_client.off], &resp[1], len);
+            bench_co_client.off += len;
+            if (resp[0] & 0x1) {
+                bench_co_client.state = BENCH_CO_CLIENT_IDLE;
+                break;
+            }
+            bench_co_client.toggle ^= 1;
+            bench_co_client_send(0x60 | (bench_co_client.toggle << 4), 0, 0, 0, 0);
+            break;
+        case BENCH_CO_CLIENT_BLK_INIT:
+            bench_co_client.state = BENCH_CO_CLIENT_BLK;
+            bench_co_client_send(0xa3, 0, 0, 0, 0);
+            break;
+        case BENCH_CO_CLIENT_BLK:
+            seqno = resp[0] & 0x7f;
+            if (seqno == bench_co_client.seqno + 1) {
+                len = BENCH_CO_DOMAIN - bench_co_client.off;
+                len = (len > 7) ? 7 : len;
+                memcpy(&bench_co_upload[bench_co_client.off], &resp[1], len);
+                bench_co_client.off += 7;
+                bench_co_client.seqno = seqno;
+            }
+            if (seqno == CAN_CO_SDO_BLKSIZE_MAX || (resp[0] & 0x80)) {
+                bench_co_client_send(0xa2, bench_co_client.seqno,
+                                     CAN_CO_SDO_BLKSIZE_MAX, 0, 0);
+                bench_co_client.seqno = 0;
+                if (resp[0] & 0x80) {
+                    bench_co_client.state = BENCH_CO_CLIENT_BLK_END;
+                }
+            }
+            break;
+        case BENCH_CO_CLIENT_BLK_END:
+            bench_co_client.off -= (resp[0] >> 2) & 0x7;
+            bench_co_client.state = BENCH_CO_CLIENT_IDLE;
+            bench_co_client_send(0xa1, 0, 0, 0, 0);
+            break;
+        default:
+            return;
+    }
+    if (bench_co_client.state == BENCH_CO_CLIENT_IDLE) {
+        bench_co_uploads++;
+        bench_co_bytes += bench_co_client.off;
+        bench_co_corrupted += (bench_co_client.off != BENCH_CO_DOMAIN ||
+                               memcmp(bench_co_upload, bench_co_domain, BENCH_CO_DOMAIN) != 0);
+    }
+}
+
+/* the task: hand each received frame to the node or the client, then poll */
+static void bench_co_task(const can_context_t *ctx, can_co_node_t *node, bench_co_mode_t mode)
+{
+    const can_packed_frame_t *frame;
+    can_header_t header;
+    can_data_t data;
+    can_mbox_t mbox;
+
+    while (can_receive_peek(ctx, CAN_FIFO_0, &frame) == MBED_ERROR_NONE) {
+        if (can_co_rx_frame(node, frame) == MBED_ERROR_NOTFOUND) {
+            can_frame_unpack(frame, &header, &data);
+            if (header.id.std == CAN_CO_COB_SDO_TX + BENCH_CO_NODE) {
+                bench_co_client_rx(data.data);
+            } else if (header.id.std != CAN_CO_COB_SDO_RX + BENCH_CO_NODE) {
+                bench_co_tpdos++;
+            }
+        }
+        can_receive_commit(ctx, CAN_FIFO_0);
+    }
+    if (mode != BENCH_CO_SYNC && bench_co_client.state == BENCH_CO_CLIENT_IDLE &&
+        !bench_co_client.pending) {
+        /* upload the domain, block transfers with CRC */
+        bench_co_client.off = 0;
+        bench_co_client.toggle = 0;
+        bench_co_client.seqno = 0;
+        if (mode == BENCH_CO_BLOCK) {
+            bench_co_client.state = BENCH_CO_CLIENT_BLK_INIT;
+            bench_co_client_send(0xa4, 0x00, 0x21, 0, CAN_CO_SDO_BLKSIZE_MAX);
+        } else {
+            bench_co_client.state = BENCH_CO_CLIENT_SEG_INIT;
+            bench_co_client_send(0x40, 0x00, 0x21, 0, 0);
+        }
+    }
+    if (bench_co_client.pending) {
+        bench_co_client.pending =
+            can_xmit_packed(ctx, &bench_co_client.req, &mbox) != MBED_ERROR_NONE;
+    }
+    can_co_poll(node);
+}
+
+/*
+ * A CANopen node on a controller in loopback mode, the bench acting as the
+ * NMT master and SDO client on the same controller. Either a SYNC is sent
+ * every BENCH_CO_SYNC_PERIOD frame times, the node answering with its
+ * synchronous TPDOs in a single burst, or the bench uploads a 4 kB domain
+ * through segmented or block SDO transfers. The task runs every
+ * BENCH_ISOTP_TASK frame times.
+ */
+static void bench_canopen(uint64_t frames, bench_co_mode_t mode, bool pipelined)
+{
+    static can_co_node_t node;
+    can_co_pdo_t tpdo[BENCH_CO_TPDOS];
+    can_context_t ctx;
+    bench_probe_t task = { .name = "CANopen task" };
+    bench_probe_t *probes[] = { &task, &bench_irq };
+    uint8_t nmt[2] = { 0x01, BENCH_CO_NODE };
+    uint64_t t0, steps, sent, last_sync = 0;
+    char scenario[40];
+
+    bench_setup();
+    memset(&bench_co_client, 0x0, sizeof(bench_co_client));
+    bench_co_uploads = bench_co_bytes = bench_co_corrupted = bench_co_aborts = 0;
+    bench_co_tpdos = bench_co_syncs = 0;
+    bench_ctx_init(&ctx, CAN_PORT_1, CAN_ACCESS_IT);
+    ctx.mode = CAN_MODE_LOOPBACK;
+    ctx.rxbuffered = true;
+    ctx.txfifoprio = pipelined;
+    bench_ctx_start(&ctx);
+    for (uint32_t i = 0; i < BENCH_CO_TPDOS; ++i) {
+        tpdo[i].cob_id = (uint16_t)(0x180 + 0x100 * i + BENCH_CO_NODE);
+        tpdo[i].type = 1;
+        tpdo[i].num = 2;
+        tpdo[i].mapping = bench_co_mappings[i];
+    }
+    for (uint32_t b = 0; b < BENCH_CO_DOMAIN; ++b) {
+        bench_co_domain[b] = (uint8_t)(b * 11 + 1);
+    }
+    memset(&node, 0x0, sizeof(node));
+    node.ctx = &ctx;
+    node.node_id = BENCH_CO_NODE;
+    node.od = bench_co_od;
+    node.od_num = sizeof(bench_co_od) / sizeof(bench_co_od[0]);
+    node.tpdo = tpdo;
+    node.tpdo_num = BENCH_CO_TPDOS;
+    if (can_co_init(&node) != MBED_ERROR_NONE) {
+        fprintf(stderr, "unable to init the CANopen node\n");
+        exit(EXIT_FAILURE);
+    }
+    if (mode == BENCH_CO_SYNC) {
+        bench_co_xmit(CAN_CO_COB_NMT, nmt, 2);
+    }
+    can_sim_irq_enter = bench_irq_enter;
+    can_sim_irq_exit = bench_irq_exit;
+    steps = can_sim_stats.steps;
+    sent = can_sim_stats.tx_frames[0];
+    t0 = bench_ns();
+    while (can_sim_stats.tx_frames[0] - sent < frames) {
+        bench_begin(&task);
+        if (mode == BENCH_CO_SYNC && !bench_co_client.pending &&
+            can_sim_stats.steps - last_sync >= BENCH_CO_SYNC_PERIOD) {
+            last_sync = can_sim_stats.steps;
+            bench_co_values[bench_co_syncs % (2 * BENCH_CO_TPDOS)]++;
+            bench_co_syncs++;
+            bench_co_xmit(CAN_CO_COB_SYNC, NULL, 0);
+        }
+        bench_co_task(&ctx, &node, mode);
+        bench_end(&task, true);
+        for (uint32_t s = 0; s < BENCH_ISOTP_TASK; ++s) {
+            can_sim_step();
+        }
+    }
+    can_sim_irq_enter = NULL;
+    can_sim_irq_exit = NULL;
+    steps = can_sim_stats.steps - steps;
+    snprintf(scenario, sizeof(scenario), "CANopen, %s",
+             (mode == BENCH_CO_SYNC) ? "SYNC, 4 TPDOs" :
+             (mode == BENCH_CO_SEGMENTED) ? "SDO segmented" :
+             pipelined ? "SDO block pipe" : "SDO block serial");
+    bench_report(scenario, can_sim_stats.tx_frames[0] - sent, bench_ns() - t0, probes, 2);
+    if (mode == BENCH_CO_SYNC) {
+        printf("    %llu SYNC, %.2f TPDOs per SYNC\n", (unsigned long long)bench_co_syncs,
+               (bench_co_syncs != 0) ? (double)bench_co_tpdos / bench_co_syncs : 0.0);
+        /* the last SYNC may still be answered */
+        bench_expect(bench_co_syncs * BENCH_CO_TPDOS - bench_co_tpdos > BENCH_CO_TPDOS,
+                     "SYNC not answered by the TPDOs");
+        return;
+    }
+    printf("    %llu uploads, %.2f bytes/frame time (%.1f kB/s at 1 Mbit/s),"
+           " %llu corrupted, %llu aborts\n",
+           (unsigned long long)bench_co_uploads,
+           (steps != 0) ? (double)bench_co_bytes / steps : 0.0,
+           (steps != 0) ? (double)bench_co_bytes / steps * 1e6 / BENCH_FRAME_BITS / 1000
+                        : 0.0,
+           (unsigned long long)bench_co_corrupted,
+           (unsigned long long)bench_co_aborts);
+    if (frames >= BENCH_TRANSFER_FRAMES) {
+        bench_expect(bench_co_uploads == 0, "scenario without any upload completed");
+    }
+    bench_expect(bench_co_corrupted, "uploads corrupted");
+    bench_expect(bench_co_aborts, "transfers aborted");
+}
+
+/* a request of the SDO client, handed to the node */
+static void bench_co_fault_req(can_co_node_t *node, const uint8_t req[8])
+{
+    can_header_t header = {
+        .id.std = CAN_CO_COB_SDO_RX + BENCH_CO_NODE,
+        .IDE = CAN_ID_STD,
+        .RTR = 0,
+        .DLC = 8,
+    };
+    can_data_t data;
+    can_packed_frame_t frame;
+
+    memcpy(data.data, req, 8);
+    can_frame_pack(&header, &data, &frame);
+    can_co_rx_frame(node, &frame);
+}
+
+/* the case must have ended on a single abort, of the expected code, the
+ * server being back to idle. Returns 1 for a wrong outcome */
+static uint32_t bench_co_outcome(const can_co_node_t *node, const char *what, uint32_t code)
+{
+    uint32_t wrong = (bench_co_aborts != 1 || bench_co_abort_code != code ||
+                      node->sdo_state != CAN_CO_SDO_IDLE);
+
+    if (wrong) {
+        printf("    %s: %llu aborts, last 0x%08x instead of 0x%08x\n", what,
+               (unsigned long long)bench_co_aborts, bench_co_abort_code, code);
+    }
+    while (can_sim_step() != 0) {
+        /* the responses sent by the case */
+    }
+    bench_co_aborts = 0;
+    bench_co_abort_code = 0;
+    return wrong;
+}
+
+/*
+ * SDO server error paths: the client requests are handed to the node by the
+ * task, the clock being moved forward for the SDO timeout.
+ */
+static void bench_co_faults(void)
+{
+    /* segmented download of 14 bytes to 0x2100 */
+    const uint8_t seg_init[] = { 0x21, 0x00, 0x21, 0, 14, 0, 0, 0 };
+    const uint8_t seg_t0[] = { 0x00, 1, 2, 3, 4, 5, 6, 7 };
+    const uint8_t seg_t1[] = { 0x10, 1, 2, 3, 4, 5, 6, 7 };
+    const uint8_t seg_t1_short[] = { 0x10 | (4 << 1) | 0x1, 8, 9, 10, 0, 0, 0, 0 };
+    /* expedited download of 2 bytes to a 4 bytes object */
+    const uint8_t exp_short[] = { 0x2b, 0x00, 0x20, 1, 1, 2, 0, 0 };
+    /* block download of 14 bytes with CRC, two segments */
+    const uint8_t blk_init[] = { 0xc6, 0x00, 0x21, 0, 14, 0, 0, 0 };
+    const uint8_t blk_seg1[] = { 0x01, 1, 2, 3, 4, 5, 6, 7 };
+    const uint8_t blk_seg2[] = { 0x82, 8, 9, 10, 11, 12, 13, 14 };
+    const uint8_t blk_end[] = { 0xc1, 0x12, 0x34, 0, 0, 0, 0, 0 };
+    /* block upload of 0x2100, blocks of 4 segments with CRC */
+    const uint8_t up_init[] = { 0xa4, 0x00, 0x21, 0, 4, 0, 0, 0 };
+    const uint8_t up_start[] = { 0xa3, 0, 0, 0, 0, 0, 0, 0 };
+    const uint8_t up_ack_seqno[] = { 0xa2, 127, 4, 0, 0, 0, 0, 0 };
+    const uint8_t up_ack_blksize[] = { 0xa2, 0, 0, 0, 0, 0, 0, 0 };
+    static uint8_t domain[64];
+    static const can_co_od_entry_t od[] = {
+        { 0x2000, 1, CAN_CO_ACCESS_RW, 4, &bench_co_values[0] },
+        { 0x2100, 0, CAN_CO_ACCESS_RW, sizeof(domain), domain },
+    };
+    static can_co_node_t node;
+    can_context_t ctx;
+    uint32_t cases = 0, wrong = 0;
+
+    bench_setup();
+    bench_co_aborts = 0;
+    bench_co_abort_code = 0;
+    bench_ctx_init(&ctx, CAN_PORT_1, CAN_ACCESS_IT);
+    ctx.mode = CAN_MODE_LOOPBACK;
+    ctx.rxbuffered = true;
+    bench_ctx_start(&ctx);
+    memset(&node, 0x0, sizeof(node));
+    node.ctx = &ctx;
+    node.node_id = BENCH_CO_NODE;
+    node.od = od;
+    node.od_num = sizeof(od) / sizeof(od[0]);
+    if (can_co_init(&node) != MBED_ERROR_NONE) {
+        fprintf(stderr, "unable to init the CANopen node\n");
+        exit(EXIT_FAILURE);
+    }
+
+    bench_co_fault_req(&node, seg_init);
+    bench_co_fault_req(&node, seg_t1);
+    wrong += bench_co_outcome(&node, "segment toggle bit", CAN_CO_SDO_ABORT_TOGGLE);
+    cases++;
+
+    bench_co_fault_req(&node, seg_init);
+    bench_co_fault_req(&node, seg_t0);
+    bench_co_fault_req(&node, seg_t1_short);
+    wrong += bench_co_outcome(&node, "segmented download too short",
+                              CAN_CO_SDO_ABORT_LENGTH);
+    cases++;
+
+    bench_co_fault_req(&node, exp_short);
+    wrong += bench_co_outcome(&node, "expedited download size", CAN_CO_SDO_ABORT_LENGTH);
+    cases++;
+
+    bench_co_fault_req(&node, seg_t0);
+    wrong += bench_co_outcome(&node, "segment out of a transfer", CAN_CO_SDO_ABORT_COMMAND);
+    cases++;
+
+    bench_co_fault_req(&node, blk_init);
+    bench_co_fault_req(&node, blk_seg1);
+    bench_co_fault_req(&node, blk_seg2);
+    bench_co_fault_req(&node, blk_end);
+    wrong += bench_co_outcome(&node, "block download CRC", CAN_CO_SDO_ABORT_CRC);
+    cases++;
+
+    bench_co_fault_req(&node, up_init);
+    bench_co_fault_req(&node, up_start);
+    bench_co_fault_req(&node, up_ack_seqno);
+    wrong += bench_co_outcome(&node, "block acknowledge sequence number",
+                              CAN_CO_SDO_ABORT_SEQNO);
+    cases++;
+
+    bench_co_fault_req(&node, up_init);
+    bench_co_fault_req(&node, up_start);
+    bench_co_fault_req(&node, up_ack_blksize);
+    wrong += bench_co_outcome(&node, "block acknowledge block size",
+                              CAN_CO_SDO_ABORT_BLKSIZE);
+    cases++;
+
+    bench_co_fault_req(&node, seg_init);
+    can_sim_advance(1000ULL * CAN_CO_SDO_TIMEOUT + 1000);
+    can_co_poll(&node);
+    wrong += bench_co_outcome(&node, "client silent", CAN_CO_SDO_ABORT_TIMEOUT);
+    cases++;
+
+    printf("%-28s %8u cases\n", "CANopen, SDO faults", cases);
+    bench_expect(wrong, "fault cases with a wrong outcome");
+}
+#endif
+
+/* both controllers on the same bus, each one sending to the other */
+static void bench_dual(uint64_t frames)
+{
+    can_context_t ctx[2];
+    bench_probe_t xmit = { .name = "can_xmit_packed" };
+    bench_probe_t recv = { .name = "can_receive_burst" };
+    bench_probe_t *probes[] = { &xmit, &recv, &bench_irq };
+    can_frame_t burst[CONFIG_USR_DRV_CAN_RX_RING_DEPTH];
+    can_packed_frame_t frame;
+    can_mbox_t mbox;
+    uint64_t received[2] = { 0, 0 };
+    uint64_t queued[2] = { 0, 0 };
+    uint64_t t0;
+    uint32_t count;
+    mbed_error_t err;
+
+    bench_setup();
+    can_sim_link(true);
+    for (uint32_t p = 0; p < 2; ++p) {
+        bench_ctx_init(&ctx[p], (can_port_t)(CAN_PORT_1 + p), CAN_ACCESS_IT);
+        ctx[p].rxbuffered = true;
+        ctx[p].txqueued = true;
+        bench_ctx_start(&ctx[p]);
+    }
+    can_sim_irq_enter = bench_irq_enter;
+    can_sim_irq_exit = bench_irq_exit;
+    t0 = bench_ns();
+    while (received[0] + received[1] < 2 * frames) {
+        for (uint32_t p = 0; p < 2; ++p) {
+            while (queued[p] < frames) {
+                /* CAN1 sends even identifiers, CAN2 odd ones */
+                bench_frame(&frame, (uint32_t)(2 * queued[p] + p));
+                bench_begin(&xmit);
+                err = can_xmit_packed(&ctx[p], &frame, &mbox);
+                bench_end(&xmit, err == MBED_ERROR_NONE);
+                if (err != MBED_ERROR_NONE) {
+                    break;
+                }
+                queued[p]++;
+            }
+        }
+        can_sim_step();
+        for (uint32_t p = 0; p < 2; ++p) {
+            bench_begin(&recv);
+            err = can_receive_burst(&ctx[p], CAN_FIFO_0, burst,
+                                    CONFIG_USR_DRV_CAN_RX_RING_DEPTH, &count);
+            bench_end(&recv, err == MBED_ERROR_NONE);
+            received[p] += (err == MBED_ERROR_NONE) ? count : 0;
+        }
+    }
+    can_sim_irq_enter = NULL;
+    can_sim_irq_exit = NULL;
+    bench_report("dual port, IT, ring+queue", received[0] + received[1],
+                 bench_ns() - t0, probes, 3);
+    bench_report_stats(&ctx[0]);
+    bench_report_stats(&ctx[1]);
+    bench_expect(2 * frames - received[0] - received[1], "frames not received");
+}
+
+/* poll the pending transitions of both contexts until they are completed */
+static uint64_t bench_transitions_wait(can_context_t ctx[2], mbed_error_t ret[2])
+{
+    uint64_t polls = 0;
+
+    ret[0] = ret[1] = MBED_ERROR_BUSY;
+    while (ret[0] == MBED_ERROR_BUSY || ret[1] == MBED_ERROR_BUSY) {
+        for (uint32_t p = 0; p < 2; ++p) {
+            if (ret[p] == MBED_ERROR_BUSY) {
+                ret[p] = can_transition_poll(&ctx[p]);
+                polls++;
+            }
+        }
+    }
+    return polls;
+}
+
+/* both controllers initialized then started at once, asynchronously, the
+ * CAN2 bus being stuck: the CAN1 start completes, the CAN2 one times out */
+static void bench_async_start(void)
+{
+    can_context_t ctx[2];
+    mbed_error_t ret[2];
+    uint64_t polls, t0, ns;
+
+    bench_setup();
+    can_sim_stuck(CAN_PORT_2, true);
+    for (uint32_t p = 0; p < 2; ++p) {
+        bench_ctx_init(&ctx[p], (can_port_t)(CAN_PORT_1 + p), CAN_ACCESS_POLL);
+        if (can_declare(&ctx[p]) != MBED_ERROR_NONE) {
+            fprintf(stderr, "unable to declare CAN%d\n", ctx[p].id);
+            exit(EXIT_FAILURE);
+        }
+    }
+    t0 = bench_ns();
+    for (uint32_t p = 0; p < 2; ++p) {
+        can_initialize_async(&ctx[p], BENCH_INAK_TIMEOUT);
+    }
+    polls = bench_transitions_wait(ctx, ret);
+    for (uint32_t p = 0; p < 2; ++p) {
+        can_start_async(&ctx[p], BENCH_INAK_TIMEOUT);
+    }
+    polls += bench_transitions_wait(ctx, ret);
+    ns = bench_ns() - t0;
+    printf("%-28s %8.1f us, %llu polls, %u us timeout\n", "async init+start, CAN2 stuck",
+           ns / 1e3, (unsigned long long)polls, BENCH_INAK_TIMEOUT);
+    for (uint32_t p = 0; p < 2; ++p) {
+        printf("    CAN%d: %s, %u transitions reported, %u timed out\n", ctx[p].id,
+               (ret[p] == MBED_ERROR_NONE && ctx[p].state == CAN_STATE_STARTED) ?
+               "started" : "not started",
+               bench_transitions[p], bench_timeouts[p]);
+    }
+    bench_expect(ret[0] != MBED_ERROR_NONE || ctx[0].state != CAN_STATE_STARTED ||
+                 bench_timeouts[0] != 0, "CAN1 not started");
+    bench_expect(ret[1] == MBED_ERROR_NONE || bench_timeouts[1] != 1,
+                 "CAN2 timeout not reported");
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t frames = BENCH_FRAMES_DEFAULT;
+
+    if (argc > 1 && strcmp(argv[1], "trace") == 0) {
+        if (argc > 2) {
+            frames = strtoull(argv[2], NULL, 0);
+        }
+        bench_trace_suite(frames, (argc > 3) ? argv[3] : NULL);
+        return (bench_failures != 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (argc > 1) {
+        frames = strtoull(argv[1], NULL, 0);
+    }
+    bench_perf_open();
+    bench_calibrate();
+    printf("CAN driver host benchmark, %llu frames per scenario%s\n\n",
+           (unsigned long long)frames,
+           (bench_perf_fd < 0) ? " (no instruction counter)" : "");
+
+    bench_xmit_poll(frames);
+    bench_xmit_burst(frames);
+    bench_receive_poll(frames);
+    bench_mbox_copy(frames);
+    bench_receive_it(frames, false, 0);
+    bench_receive_it(frames, true, 0);
+    bench_receive_it(frames, true, BENCH_COALESCE_FRAMES);
+    bench_receive_direct(frames);
+    bench_trace_suite(frames, NULL);
+    bench_forward(frames, false);
+    bench_forward(frames, true);
+    bench_xmit_queued(frames);
+    bench_xmit_deadline(frames);
+    bench_xmit_preempt(frames, false);
+    bench_xmit_preempt(frames, true);
+#if CONFIG_USR_DRV_CAN_TIMESTAMP
+    bench_timestamps();
+#endif
+#if CONFIG_USR_DRV_CAN_CAPTURE
+    bench_capture(frames, false);
+    bench_capture(frames, true);
+#endif
+#if CONFIG_USR_DRV_CAN_ISOTP
+    bench_isotp(frames, false, 0);
+    bench_isotp(frames, true, 0);
+    bench_isotp(frames, true, 8);
+    bench_isotp_faults();
+#endif
+#if CONFIG_USR_DRV_CAN_J1939
+    bench_j1939(frames, false);
+    bench_j1939(frames, true);
+    bench_j1939_faults();
+#endif
+#if CONFIG_USR_DRV_CAN_CANOPEN
+    bench_canopen(frames, BENCH_CO_SYNC, false);
+    bench_canopen(frames, BENCH_CO_SEGMENTED, false);
+    bench_canopen(frames, BENCH_CO_BLOCK, false);
+    bench_canopen(frames, BENCH_CO_BLOCK, true);
+    bench_co_faults();
+#endif
+    bench_dual(frames);
+    bench_async_start();
+    if (bench_failures != 0) {
+        printf("\n%llu invariant violations\n", (unsigned long long)bench_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/*
+ * Host-side capture replayer, feeding a Linux candump -L log (as written by
+ * can_capture_format()) back into the driver through the bxCAN simulator.
+ *
+ * Each frame of interfaces can0 and can1 is injected on the bus of port 1 or
+ * 2, as sent by a remote node: it goes through the simulated filter banks,
+ * Rx FIFOs and interrupts, then the driver ISR, in buffered mode with the
+ * capture enabled. The user task runs every task_frames frames, and the
+ * frames the driver recorded are printed back in the same format, stamped
+ * with the log time: frames not printed were lost on the way, as reported
+ * on stderr.
+ *
+ * usage: can_replay [-t task_frames] [log]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "can_sim.h"
+#include "can_trace.h"
+
+/* log time of the frame being replayed, in us */
+static uint64_t replay_now;
+
+static struct {
+    uint64_t lines;
+    uint64_t skipped;           /* malformed, CAN FD or other interfaces */
+    uint64_t injected;
+    uint64_t received;          /* by the user task */
+    uint64_t printed;
+    uint64_t lost;              /* capture records overwritten */
+} replay_stats;
+
+uint64_t can_capture_clock(void)
+{
+    return replay_now;
+}
+
+mbed_error_t can_event(can_event_t event, can_port_t port, can_error_t errcode)
+{
+    (void)event;
+    (void)port;
+    (void)errcode;
+    return MBED_ERROR_NONE;
+}
+
+static void replay_ctx_start(can_context_t *ctx, can_port_t port)
+{
+    memset(ctx, 0x0, sizeof(can_context_t));
+    ctx->id = port;
+    ctx->mode = CAN_MODE_NORMAL;
+    ctx->access = CAN_ACCESS_IT;
+    ctx->autoretrans = true;
+    ctx->rxfifolocked = true;
+    ctx->bit_rate = CAN_SPEED_1MHZ;
+    ctx->rxbuffered = true;
+    ctx->capture = true;
+    if (can_declare(ctx) != MBED_ERROR_NONE ||
+        can_initialize(ctx) != MBED_ERROR_NONE ||
+        can_start(ctx) != MBED_ERROR_NONE) {
+        fprintf(stderr, "unable to start CAN%d\n", ctx->id);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* the task: empty the Rx rings, then print the records */
+static void replay_task(can_context_t ctx[2])
+{
+    static can_capture_record_t records[CONFIG_USR_DRV_CAN_CAPTURE_DEPTH];
+    can_frame_t burst[CONFIG_USR_DRV_CAN_RX_RING_DEPTH];
+    char line[CAN_CAPTURE_LINE_MAX];
+    uint32_t count, lost;
+
+    for (uint32_t p = 0; p < 2; ++p) {
+        for (can_fifo_t fifo = CAN_FIFO_0; fifo <= CAN_FIFO_1; ++fifo) {
+            while (can_receive_burst(&ctx[p], fifo, burst, CONFIG_USR_DRV_CAN_RX_RING_DEPTH,
+                                     &count) == MBED_ERROR_NONE && count != 0) {
+                replay_stats.received += count;
+            }
+        }
+    }
+    do {
+        can_capture_read(records, CONFIG_USR_DRV_CAN_CAPTURE_DEPTH, &count, &lost);
+        replay_stats.lost += lost;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (can_capture_format(&records[i], line, sizeof(line)) != 0) {
+                fputs(line, stdout);
+                replay_stats.printed++;
+            }
+        }
+    } while (count != 0);
+}
+
+int main(int argc, char *argv[])
+{
+    can_context_t ctx[2];
+    can_trace_frame_t tf;
+    char line[CAN_TRACE_LINE_MAX];
+    FILE *log = stdin;
+    unsigned long task_frames = 1;
+    uint64_t pending = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+            case 't':
+                task_frames = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-t task_frames] [log]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind < argc && (log = fopen(argv[optind], "r")) == NULL) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    task_frames = (task_frames != 0) ? task_frames : 1;
+    can_sim_reset();
+    replay_ctx_start(&ctx[0], CAN_PORT_1);
+    replay_ctx_start(&ctx[1], CAN_PORT_2);
+    can_capture_reset();
+    while (fgets(line, sizeof(line), log) != NULL) {
+        replay_stats.lines++;
+        if (!can_trace_parse(line, &tf)) {
+            replay_stats.skipped++;
+            continue;
+        }
+        replay_now = tf.us;
+        can_sim_inject(tf.port, &tf.frame);
+        can_sim_irq_poll();
+        replay_stats.injected++;
+        if (++pending >= task_frames) {
+            pending = 0;
+            replay_task(ctx);
+        }
+    }
+    replay_task(ctx);
+    fprintf(stderr, "%llu lines, %llu skipped, %llu frames injected, %llu filtered,"
+            " %llu FIFO overruns, %llu received by the task, %llu printed,"
+            " %llu records lost\n",
+            (unsigned long long)replay_stats.lines,
+            (unsigned long long)replay_stats.skipped,
+            (unsigned long long)replay_stats.injected,
+            (unsigned long long)(can_sim_stats.rx_filtered[0] + can_sim_stats.rx_filtered[1]),
+            (unsigned long long)(can_sim_stats.rx_overruns[0] + can_sim_stats.rx_overruns[1]),
+            (unsigned long long)replay_stats.received,
+            (unsigned long long)replay_stats.printed,
+            (unsigned long long)replay_stats.lost);
+    if (log != stdin) {
+        fclose(log);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,641 @@
+/*
+ * Host-side bxCAN simulator: register file, bus and EwoK syscalls stubs.
+ * See can_sim.h.
+ */
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include "can_sim.h"
+#include "can_regs.h"
+
+volatile uint32_t can_sim_regs[CAN_SIM_SIZE / 4];
+
+can_sim_stats_t can_sim_stats;
+
+void (*can_sim_irq_enter)(void) = NULL;
+void (*can_sim_irq_exit)(void) = NULL;
+
+#define CAN_SIM_PORTS      2
+#define CAN_SIM_FIFO_DEPTH 3
+/* guard against an ISR that neither clears nor masks its interrupt source */
+#define CAN_SIM_IRQ_MAX    64
+
+/* register offset in a controller block */
+#define CAN_SIM_OFF(port, off) ((((port) * 0x400) + (off)) / 4)
+#define CAN_SIM_REG(port, off) can_sim_regs[CAN_SIM_OFF(port, off)]
+
+/* TSR bits of mailbox mbox that are cleared by writing RQCPx */
+#define CAN_SIM_TSR_MBOX(mbox) (((uint32_t)0xf) << (8 * (mbox)))
+
+typedef struct {
+    /* hardware owned state, the registers being rebuilt from it */
+    uint32_t           tsr;      /* RQCPx, TXOKx, ALSTx, TERRx */
+    uint32_t           msr;      /* ERRI, WKUI, SLAKI */
+    can_packed_frame_t fifo[2][CAN_SIM_FIFO_DEPTH];
+    uint32_t           fifo_count[2];
+    bool               fifo_full[2];
+    bool               fifo_ovr[2];
+    uint32_t           tx_seq[3];/* request order, for TXFP */
+    /* declared device, as given to sys_init() */
+    bool               declared;
+    device_t           dev;
+    /* bus state, kept on controller reset */
+    bool               stuck;    /* held dominant, INAK never cleared */
+} can_sim_ctrl_t;
+
+static can_sim_ctrl_t can_sim_ctrl[CAN_SIM_PORTS];
+static bool           can_sim_linked = false;
+static uint32_t       can_sim_seq = 0;
+
+/*******************************************************************************
+ *          REGISTER FILE
+ ******************************************************************************/
+
+/*
+ * The mailboxes are written directly by the driver: new transmission requests
+ * are noticed here, each getting its request order, and clearing the RQCPx,
+ * TXOKx, ALSTx and TERRx bits of its mailbox (RM0090, chap 32.9.2).
+ */
+static void can_sim_tx_requests(uint32_t port)
+{
+    can_sim_ctrl_t *c = &can_sim_ctrl[port];
+
+    for (uint32_t mbox = 0; mbox < 3; ++mbox) {
+        if ((CAN_SIM_REG(port, CAN_TI0R + 0x10 * mbox) & CAN_TIxR_TXRQ_Msk) != 0 &&
+            c->tx_seq[mbox] == 0) {
+            c->tx_seq[mbox] = ++can_sim_seq;
+            c->tsr &= ~CAN_SIM_TSR_MBOX(mbox);
+        }
+    }
+}
+
+/* rebuild the hardware owned registers of the given controller */
+static void can_sim_sync(uint32_t port)
+{
+    can_sim_ctrl_t *c = &can_sim_ctrl[port];
+    uint32_t tsr;
+
+    can_sim_tx_requests(port);
+    tsr = c->tsr;
+
+    for (uint32_t mbox = 0; mbox < 3; ++mbox) {
+        if ((CAN_SIM_REG(port, CAN_TI0R + 0x10 * mbox) & CAN_TIxR_TXRQ_Msk) == 0) {
+            tsr |= (0x1UL << (CAN_TSR_TME_Pos + mbox));
+        }
+    }
+    CAN_SIM_REG(port, CAN_TSR) = tsr;
+    CAN_SIM_REG(port, CAN_MSR) = (CAN_SIM_REG(port, CAN_MSR)
+                                  & ~(CAN_MSR_ERRI_Msk | CAN_MSR_WKUI_Msk | CAN_MSR_SLAKI_Msk))
+                                 | c->msr;
+    for (uint32_t fifo = 0; fifo < 2; ++fifo) {
+        CAN_SIM_REG(port, CAN_RF0R + 4 * fifo) =
+            c->fifo_count[fifo]
+            | (c->fifo_full[fifo] ? CAN_RFxR_FULLx_Msk : 0)
+            | (c->fifo_ovr[fifo] ? CAN_RFxR_FOVRx_Msk : 0);
+        if (c->fifo_count[fifo] != 0) {
+            CAN_SIM_REG(port, CAN_RI0R + 0x10 * fifo)     = c->fifo[fifo][0].id;
+            CAN_SIM_REG(port, CAN_RI0R + 0x10 * fifo + 4) = c->fifo[fifo][0].dlct;
+            CAN_SIM_REG(port, CAN_RI0R + 0x10 * fifo + 8) = c->fifo[fifo][0].datal;
+            CAN_SIM_REG(port, CAN_RI0R + 0x10 * fifo + 12) = c->fifo[fifo][0].datah;
+        }
+    }
+}
+
+static void can_sim_ctrl_reset(uint32_t port)
+{
+    memset((void*)&can_sim_ctrl[port].tsr, 0x0,
+           offsetof(can_sim_ctrl_t, declared));
+    for (uint32_t off = 0; off < CAN_FMR; off += 4) {
+        CAN_SIM_REG(port, off) = 0;
+    }
+    CAN_SIM_REG(port, CAN_MCR) = 0x00010002;
+    CAN_SIM_REG(port, CAN_MSR) = 0x00000c02;
+    CAN_SIM_REG(port, CAN_BTR) = 0x01230000;
+    can_sim_sync(port);
+}
+
+/* MCR write: INRQ/INAK and SLEEP/SLAK handshakes, master reset */
+static void can_sim_write_mcr(uint32_t port, uint32_t value)
+{
+    uint32_t msr = CAN_SIM_REG(port, CAN_MSR) & ~(CAN_MSR_INAK_Msk | CAN_MSR_SLAK_Msk);
+
+    if (value & CAN_MCR_RESET_Msk) {
+        can_sim_ctrl_reset(port);
+        return;
+    }
+    if ((value & CAN_MCR_INRQ_Msk) ||
+        (can_sim_ctrl[port].stuck && (CAN_SIM_REG(port, CAN_MSR) & CAN_MSR_INAK_Msk))) {
+        /* no 11 recessive bits on a stuck bus to leave the init mode */
+        msr |= CAN_MSR_INAK_Msk;
+    } else if (value & CAN_MCR_SLEEP_Msk) {
+        msr |= CAN_MSR_SLAK_Msk;
+    }
+    CAN_SIM_REG(port, CAN_MSR) = msr;
+}
+
+/* TSR write: RQCPx are rc_w1, ABRQx abort the pending mailboxes */
+static void can_sim_write_tsr(uint32_t port, uint32_t value)
+{
+    can_sim_ctrl_t *c = &can_sim_ctrl[port];
+
+    for (uint32_t mbox = 0; mbox < 3; ++mbox) {
+        volatile uint32_t *tixr = &CAN_SIM_REG(port, CAN_TI0R + 0x10 * mbox);
+
+        if (value & (CAN_TSR_RQCP0_Msk << (8 * mbox))) {
+            c->tsr &= ~CAN_SIM_TSR_MBOX(mbox);
+        }
+        if ((value & (CAN_TSR_ABRQ0_Msk << (8 * mbox))) &&
+            (*tixr & CAN_TIxR_TXRQ_Msk)) {
+            *tixr &= ~CAN_TIxR_TXRQ_Msk;
+            c->tx_seq[mbox] = 0;
+            c->tsr |= (CAN_TSR_RQCP0_Msk << (8 * mbox));
+            can_sim_stats.tx_aborts[port]++;
+        }
+    }
+}
+
+/* RFxR write: RFOMx releases the output mailbox, FULLx and FOVRx are rc_w1 */
+static void can_sim_write_rfr(uint32_t port, uint32_t fifo, uint32_t value)
+{
+    can_sim_ctrl_t *c = &can_sim_ctrl[port];
+
+    if ((value & CAN_RFxR_RFOMx_Msk) && c->fifo_count[fifo] != 0) {
+        c->fifo_count[fifo]--;
+        for (uint32_t i = 0; i < c->fifo_count[fifo]; ++i) {
+            c->fifo[fifo][i] = c->fifo[fifo][i + 1];
+        }
+    }
+    if (value & CAN_RFxR_FULLx_Msk) {
+        c->fifo_full[fifo] = false;
+    }
+    if (value & CAN_RFxR_FOVRx_Msk) {
+        c->fifo_ovr[fifo] = false;
+    }
+}
+
+void can_sim_read(volatile const uint32_t *reg)
+{
+    uint32_t off = (uint32_t)((volatile const uint8_t*)reg - (volatile uint8_t*)can_sim_regs);
+
+    if (off < CAN_SIM_SIZE) {
+        can_sim_sync(off / 0x400);
+    }
+}
+
+void can_sim_write(volatile uint32_t *reg, uint32_t value)
+{
+    uint32_t off = (uint32_t)((volatile uint8_t*)reg - (volatile uint8_t*)can_sim_regs);
+    uint32_t port = off / 0x400;
+
+    if (off >= CAN_SIM_SIZE) {
+        return;
+    }
+    off &= 0x3ff;
+    switch (off) {
+        case CAN_MCR:
+            can_sim_write_mcr(port, value);
+            break;
+        case CAN_MSR:
+            can_sim_ctrl[port].msr &= ~(value & (CAN_MSR_ERRI_Msk | CAN_MSR_WKUI_Msk | CAN_MSR_SLAKI_Msk));
+            break;
+        case CAN_TSR:
+            can_sim_write_tsr(port, value);
+            break;
+        case CAN_RF0R:
+            can_sim_write_rfr(port, 0, value);
+            break;
+        case CAN_RF1R:
+            can_sim_write_rfr(port, 1, value);
+            break;
+        default:
+            break;
+    }
+    can_sim_sync(port);
+}
+
+/*******************************************************************************
+ *          FILTER BANKS
+ ******************************************************************************/
+
+/* 16 bits filter image of a packed identifier word */
+static inline uint32_t can_sim_id16(uint32_t id)
+{
+    return (((id & CAN_RIxR_STID_Msk) >> CAN_RIxR_STID_Pos) << CAN_FxR16_STID_Pos)
+         | (((id & CAN_RIxR_RTR_Msk) >> CAN_RIxR_RTR_Pos) << CAN_FxR16_RTR_Pos)
+         | (((id & CAN_RIxR_IDE_Msk) >> CAN_RIxR_IDE_Pos) << CAN_FxR16_IDE_Pos)
+         | ((id >> (CAN_RIxR_EXID_Pos + 15)) & CAN_FxR16_EXID_Msk);
+}
+
+/*
+ * Look for the filter accepting the frame, following the bxCAN priority
+ * rules: 32 bits before 16 bits, list before mask, then lowest filter
+ * number. Returns false if no filter of the controller accepts the frame.
+ */
+static bool can_sim_filter(uint32_t port, uint32_t id, uint32_t *fifo, uint32_t *fmi)
+{
+    volatile can_filters_table_t *banks = r_CAN1_FxRy();
+    uint32_t fmr = CAN_SIM_REG(0, CAN_FMR);
+    uint32_t fm1r = CAN_SIM_REG(0, CAN_FM1R);
+    uint32_t fs1r = CAN_SIM_REG(0, CAN_FS1R);
+    uint32_t ffa1r = CAN_SIM_REG(0, CAN_FFA1R);
+    uint32_t fa1r = CAN_SIM_REG(0, CAN_FA1R);
+    uint32_t can2sb = (fmr & CAN_FMR_CAN2SB_Msk) >> CAN_FMR_CAN2SB_Pos;
+    uint32_t first = (port == 0) ? 0 : can2sb;
+    uint32_t last = (port == 0) ? can2sb : CAN_MAX_FILTERS;
+    uint32_t num[2] = { 0, 0 };
+    uint32_t best = 0xffffffff; /* priority class << 8 | filter number */
+    uint32_t w = id & ~CAN_TIxR_TXRQ_Msk;
+    uint32_t h = can_sim_id16(id);
+
+    if (fmr & CAN_FMR_FINIT_Msk) {
+        /* no reception while the filters are being set */
+        return false;
+    }
+    for (uint32_t b = 0; b < CAN_MAX_FILTERS; ++b) {
+        uint32_t f = (ffa1r >> b) & 0x1;
+        bool list = (fm1r >> b) & 0x1;
+        bool s32 = (fs1r >> b) & 0x1;
+        uint32_t r1 = banks[b].FiR1;
+        uint32_t r2 = banks[b].fiR2;
+        uint32_t cls = (s32 ? 0 : 2) + (list ? 0 : 1);
+        int32_t hit = -1;
+
+        if (b >= first && b < last && ((fa1r >> b) & 0x1)) {
+            if (s32 && !list) {
+                hit = (((w ^ r1) & r2 & ~0x1UL) == 0) ? 0 : -1;
+            } else if (s32) {
+                hit = (((w ^ r1) & ~0x1UL) == 0) ? 0 :
+                      (((w ^ r2) & ~0x1UL) == 0) ? 1 : -1;
+            } else if (!list) {
+                hit = (((h ^ r1) & (r1 >> 16) & 0xffff) == 0) ? 0 :
+                      (((h ^ r2) & (r2 >> 16) & 0xffff) == 0) ? 1 : -1;
+            } else {
+                hit = (h == (r1 & 0xffff)) ? 0 : (h == (r1 >> 16)) ? 1 :
+                      (h == (r2 & 0xffff)) ? 2 : (h == (r2 >> 16)) ? 3 : -1;
+            }
+            if (hit >= 0 && ((cls << 8) | (num[f] + hit)) < best) {
+                best = (cls << 8) | (num[f] + hit);
+                *fifo = f;
+                *fmi = num[f] + hit;
+            }
+        }
+        num[f] += (s32 ? 1 : 2) * (list ? 2 : 1);
+    }
+    return best != 0xffffffff;
+}
+
+/*******************************************************************************
+ *          BUS
+ ******************************************************************************/
+
+static inline bool can_sim_started(uint32_t port)
+{
+    return (CAN_SIM_REG(port, CAN_MSR) & (CAN_MSR_INAK_Msk | CAN_MSR_SLAK_Msk)) == 0;
+}
+
+/* time triggered mode counter, incremented each bit time, 0 when TTCM is
+ * clear. It follows the wall clock, as the driver systick does */
+static uint32_t can_sim_time(uint32_t port)
+{
+    uint32_t btr = CAN_SIM_REG(port, CAN_BTR);
+    uint64_t us = 0;
+    uint64_t bitrate;
+
+    if ((CAN_SIM_REG(port, CAN_MCR) & CAN_MCR_TTCM_Msk) == 0) {
+        return 0;
+    }
+    bitrate = (CONFIG_CORE_FREQUENCY / CONFIG_APB1_DIVISOR)
+            / (((btr & CAN_BTR_BRP_Msk) >> CAN_BTR_BRP_Pos) + 1)
+            / (3 + ((btr & CAN_BTR_TS1_Msk) >> CAN_BTR_TS1_Pos)
+                 + ((btr & CAN_BTR_TS2_Msk) >> CAN_BTR_TS2_Pos));
+    sys_get_systick(&us, PREC_MICRO);
+    return (uint32_t)(us * bitrate / 1000000) & 0xffff;
+}
+
+/* a frame seen on the bus of the controller, stored in a Rx FIFO if accepted */
+static void can_sim_receive(uint32_t port, const can_packed_frame_t *frame)
+{
+    can_sim_ctrl_t *c = &can_sim_ctrl[port];
+    uint32_t fifo, fmi, slot;
+
+    if (!can_sim_started(port)) {
+        return;
+    }
+    if (!can_sim_filter(port, frame->id, &fifo, &fmi)) {
+        can_sim_stats.rx_filtered[port]++;
+        return;
+    }
+    if (c->fifo_count[fifo] == CAN_SIM_FIFO_DEPTH) {
+        c->fifo_ovr[fifo] = true;
+        can_sim_stats.rx_overruns[port]++;
+        can_sim_stats.rx_fifo_overruns[port][fifo]++;
+        if (CAN_SIM_REG(port, CAN_MCR) & CAN_MCR_RFLM_Msk) {
+            /* locked: the new frame is lost */
+            can_sim_sync(port);
+            return;
+        }
+        /* not locked: the last frame is overwritten */
+        slot = CAN_SIM_FIFO_DEPTH - 1;
+    } else {
+        slot = c->fifo_count[fifo]++;
+    }
+    c->fifo[fifo][slot].id = frame->id & ~CAN_TIxR_TXRQ_Msk;
+    c->fifo[fifo][slot].dlct = (frame->dlct & CAN_RDTxR_DLC_Msk)
+                             | (fmi << CAN_RDTxR_FMI_Pos)
+                             | (can_sim_time(port) << CAN_RDTxR_TIME_Pos);
+    c->fifo[fifo][slot].datal = frame->datal;
+    c->fifo[fifo][slot].datah = frame->datah;
+    if (c->fifo_count[fifo] == CAN_SIM_FIFO_DEPTH) {
+        c->fifo_full[fifo] = true;
+    }
+    can_sim_stats.rx_frames[port]++;
+    can_sim_stats.rx_fifo_frames[port][fifo]++;
+    can_sim_sync(port);
+}
+
+/* the pending mailbox the controller would send first, -1 if none */
+static int32_t can_sim_tx_candidate(uint32_t port)
+{
+    can_sim_ctrl_t *c = &can_sim_ctrl[port];
+    bool txfp = (CAN_SIM_REG(port, CAN_MCR) & CAN_MCR_TXFP_Msk) != 0;
+    int32_t best = -1;
+    uint32_t id;
+
+    if (!can_sim_started(port)) {
+        return -1;
+    }
+    can_sim_tx_requests(port);
+    for (uint32_t mbox = 0; mbox < 3; ++mbox) {
+        id = CAN_SIM_REG(port, CAN_TI0R + 0x10 * mbox);
+        if ((id & CAN_TIxR_TXRQ_Msk) == 0) {
+            continue;
+        }
+        if (best < 0) {
+            best = (int32_t)mbox;
+        } else if (txfp) {
+            best = (c->tx_seq[mbox] < c->tx_seq[best]) ? (int32_t)mbox : best;
+        } else if ((id >> 1) < (CAN_SIM_REG(port, CAN_TI0R + 0x10 * best) >> 1)) {
+            best = (int32_t)mbox;
+        }
+    }
+    return best;
+}
+
+/* send the given mailbox and deliver the frame to the controllers */
+static void can_sim_transmit(uint32_t port, uint32_t mbox)
+{
+    can_sim_ctrl_t *c = &can_sim_ctrl[port];
+    uint32_t base = CAN_TI0R + 0x10 * mbox;
+    uint32_t btr = CAN_SIM_REG(port, CAN_BTR);
+    can_packed_frame_t frame;
+
+    frame.id = CAN_SIM_REG(port, base) & ~CAN_TIxR_TXRQ_Msk;
+    frame.dlct = CAN_SIM_REG(port, base + 4);
+    frame.datal = CAN_SIM_REG(port, base + 8);
+    frame.datah = CAN_SIM_REG(port, base + 12);
+
+    frame.dlct = (frame.dlct & ~CAN_TDTxR_TIME_Msk)
+               | (can_sim_time(port) << CAN_TDTxR_TIME_Pos);
+    CAN_SIM_REG(port, base + 4) = frame.dlct;
+    CAN_SIM_REG(port, base) = frame.id;
+    c->tx_seq[mbox] = 0;
+    c->tsr |= (CAN_TSR_RQCP0_Msk | CAN_TSR_TXOK0_Msk) << (8 * mbox);
+    can_sim_stats.tx_frames[port]++;
+    can_sim_sync(port);
+
+    if (btr & CAN_BTR_LBKM_Msk) {
+        can_sim_receive(port, &frame);
+    }
+    if (can_sim_linked && !(btr & CAN_BTR_SILM_Msk)) {
+        can_sim_receive(1 - port, &frame);
+    }
+}
+
+uint32_t can_sim_step(void)
+{
+    int32_t cand[CAN_SIM_PORTS];
+    uint32_t sent = 0;
+
+    for (uint32_t port = 0; port < CAN_SIM_PORTS; ++port) {
+        cand[port] = can_sim_tx_candidate(port);
+    }
+    if (can_sim_linked && cand[0] >= 0 && cand[1] >= 0) {
+        /* bus arbitration between the two controllers */
+        uint32_t id0 = CAN_SIM_REG(0, CAN_TI0R + 0x10 * cand[0]) >> 1;
+        uint32_t id1 = CAN_SIM_REG(1, CAN_TI0R + 0x10 * cand[1]) >> 1;
+
+        cand[(id0 <= id1) ? 1 : 0] = -1;
+    }
+    for (uint32_t port = 0; port < CAN_SIM_PORTS; ++port) {
+        if (cand[port] >= 0) {
+            can_sim_transmit(port, (uint32_t)cand[port]);
+            sent++;
+        }
+    }
+    can_sim_stats.steps++;
+    can_sim_irq_poll();
+    return sent;
+}
+
+void can_sim_inject(can_port_t port, const can_packed_frame_t *frame)
+{
+    can_sim_receive(port - 1, frame);
+}
+
+void can_sim_link(bool linked)
+{
+    can_sim_linked = linked;
+}
+
+void can_sim_stuck(can_port_t port, bool stuck)
+{
+    can_sim_ctrl[port - 1].stuck = stuck;
+}
+
+/*******************************************************************************
+ *          INTERRUPTS
+ ******************************************************************************/
+
+/* is the given interrupt line (0: Tx, 1: Rx0, 2: Rx1, 3: SCE) asserted ? */
+static bool can_sim_irq_line(uint32_t port, uint32_t line)
+{
+    can_sim_ctrl_t *c = &can_sim_ctrl[port];
+    uint32_t ier = CAN_SIM_REG(port, CAN_IER);
+
+    switch (line) {
+        case 0:
+            can_sim_tx_requests(port);
+            return (ier & CAN_IER_TMEIE_Msk) &&
+                   (c->tsr & (CAN_TSR_RQCP0_Msk | CAN_TSR_RQCP1_Msk | CAN_TSR_RQCP2_Msk));
+        case 1:
+        case 2: {
+            uint32_t fifo = line - 1;
+            uint32_t shift = 3 * fifo;
+
+            return ((ier & (CAN_IER_FMPIE0_Msk << shift)) && c->fifo_count[fifo] != 0) ||
+                   ((ier & (CAN_IER_FFIE0_Msk << shift)) && c->fifo_full[fifo]) ||
+                   ((ier & (CAN_IER_FOVIE0_Msk << shift)) && c->fifo_ovr[fifo]);
+        }
+        default:
+            return ((ier & CAN_IER_ERRIE_Msk) && (c->msr & CAN_MSR_ERRI_Msk)) ||
+                   ((ier & CAN_IER_WKUIE_Msk) && (c->msr & CAN_MSR_WKUI_Msk)) ||
+                   ((ier & CAN_IER_SLKIE_Msk) && (c->msr & CAN_MSR_SLAKI_Msk));
+    }
+}
+
+/* kernel side of an interrupt: posthook, then user ISR */
+static void can_sim_irq_exec(uint32_t port, const dev_irq_info_t *irq)
+{
+    const dev_irq_ph_t *ph = &irq->posthook;
+    uint32_t status = 0, data = 0;
+    volatile uint32_t *reg;
+
+    for (uint32_t i = 0; i < MAX_POSTHOOK_INSTR; ++i) {
+        const dev_irq_ph_action_t *a = &ph->action[i];
+
+        if (a->instr == IRQ_PH_READ) {
+            reg = &CAN_SIM_REG(port, a->read.offset);
+            if (a->read.offset == ph->status) {
+                status = *reg;
+            }
+            if (a->read.offset == ph->data) {
+                data = *reg;
+            }
+        } else if (a->instr == IRQ_PH_WRITE) {
+            reg = &CAN_SIM_REG(port, a->write.offset);
+            *reg = (*reg & ~a->write.mask) | (a->write.value & a->write.mask);
+            can_sim_write(reg, *reg);
+        }
+    }
+    can_sim_stats.irqs++;
+    if (can_sim_irq_enter != NULL) {
+        can_sim_irq_enter();
+    }
+    irq->handler((uint8_t)(irq->irq - 0x10), status, data);
+    if (can_sim_irq_exit != NULL) {
+        can_sim_irq_exit();
+    }
+}
+
+uint32_t can_sim_irq_poll(void)
+{
+    uint32_t count = 0;
+    bool again = true;
+
+    while (again && count < CAN_SIM_IRQ_MAX) {
+        again = false;
+        for (uint32_t port = 0; port < CAN_SIM_PORTS; ++port) {
+            can_sim_ctrl_t *c = &can_sim_ctrl[port];
+
+            if (!c->declared || c->dev.irq_num != 4) {
+                continue;
+            }
+            for (uint32_t line = 0; line < 4; ++line) {
+                if (can_sim_irq_line(port, line)) {
+                    can_sim_irq_exec(port, &c->dev.irqs[line]);
+                    count++;
+                    again = true;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+/*******************************************************************************
+ *          RESET
+ ******************************************************************************/
+
+void can_sim_reset(void)
+{
+    memset((void*)can_sim_regs, 0x0, sizeof(can_sim_regs));
+    memset((void*)can_sim_ctrl, 0x0, sizeof(can_sim_ctrl));
+    memset((void*)&can_sim_stats, 0x0, sizeof(can_sim_stats));
+    for (uint32_t port = 0; port < CAN_SIM_PORTS; ++port) {
+        can_sim_ctrl_reset(port);
+    }
+    CAN_SIM_REG(0, CAN_FMR) = 0x2a1c0e01;
+    can_sim_linked = false;
+    can_sim_seq = 0;
+}
+
+/*******************************************************************************
+ *          EWOK SYSCALLS
+ ******************************************************************************/
+
+e_syscall_ret sys_init(uint8_t type, ...)
+{
+    va_list args;
+    device_t *dev;
+    int *handle;
+    uint32_t port;
+
+    if (type != INIT_DEVACCESS) {
+        return SYS_E_INVAL;
+    }
+    va_start(args, type);
+    dev = va_arg(args, device_t*);
+    handle = va_arg(args, int*);
+    va_end(args);
+
+    if (dev->address < CAN_SIM_BASE || dev->address >= CAN_SIM_BASE + CAN_SIM_SIZE) {
+        return SYS_E_INVAL;
+    }
+    port = (dev->address - CAN_SIM_BASE) / 0x400;
+    if (can_sim_ctrl[port].declared) {
+        return SYS_E_BUSY;
+    }
+    can_sim_ctrl[port].declared = true;
+    can_sim_ctrl[port].dev = *dev;
+    *handle = (int)port;
+    return SYS_E_DONE;
+}
+
+e_syscall_ret sys_cfg(uint8_t type, ...)
+{
+    va_list args;
+    uint32_t handle;
+
+    if (type != CFG_DEV_RELEASE) {
+        return SYS_E_INVAL;
+    }
+    va_start(args, type);
+    handle = va_arg(args, uint32_t);
+    va_end(args);
+    if (handle >= CAN_SIM_PORTS || !can_sim_ctrl[handle].declared) {
+        return SYS_E_INVAL;
+    }
+    can_sim_ctrl[handle].declared = false;
+    return SYS_E_DONE;
+}
+
+/* time skipped by can_sim_advance(), in ns. Never reset, so that the clock
+ * stays monotonic */
+static uint64_t can_sim_skipped;
+
+void can_sim_advance(uint64_t us)
+{
+    can_sim_skipped += us * 1000;
+}
+
+e_syscall_ret sys_get_systick(uint64_t *val, uint8_t precision)
+{
+    struct timespec ts;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec + can_sim_skipped;
+    switch (precision) {
+        case PREC_MILLI:
+            *val = ns / 1000000;
+            break;
+        case PREC_MICRO:
+            *val = ns / 1000;
+            break;
+        default:
+            /* core cycles at CONFIG_CORE_FREQUENCY */
+            *val = ns * (CONFIG_CORE_FREQUENCY / 1000000) / 1000;
+            break;
+    }
+    return SYS_E_DONE;
+}
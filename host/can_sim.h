@@ -0,0 +1,63 @@
+/*
+ * Host-side bxCAN simulator.
+ *
+ * The driver is built against a simulated register file (see
+ * host/include/libc/regutils.h) modeling both controllers of the STM32F4:
+ * the INRQ/INAK and SLEEP/SLAK handshakes, the three Tx mailboxes, the two
+ * 3 deep Rx FIFOs, the shared filter banks, the time triggered mode counter,
+ * and the interrupt lines with their kernel posthooks. The EwoK syscalls used
+ * by the driver are stubbed here.
+ *
+ * Nothing happens on the bus by itself: each call to can_sim_step() is one
+ * frame time on each bus, and interrupts are only delivered by
+ * can_sim_step() and can_sim_irq_poll(), never in the middle of a driver
+ * call.
+ */
+#ifndef CAN_SIM_H_
+#define CAN_SIM_H_
+
+#include "api/libcan.h"
+
+typedef struct {
+    uint64_t steps;             /* frame times elapsed */
+    uint64_t irqs;              /* interrupts delivered */
+    uint64_t tx_frames[2];      /* frames sent, per port */
+    uint64_t tx_aborts[2];      /* transmissions aborted, per port */
+    uint64_t rx_frames[2];      /* frames stored in a Rx FIFO, per port */
+    uint64_t rx_filtered[2];    /* frames rejected by the filter banks */
+    uint64_t rx_overruns[2];    /* frames lost on a full Rx FIFO */
+    uint64_t rx_fifo_frames[2][2];   /* rx_frames, per port and Rx FIFO */
+    uint64_t rx_fifo_overruns[2][2]; /* rx_overruns, per port and Rx FIFO */
+} can_sim_stats_t;
+
+extern can_sim_stats_t can_sim_stats;
+
+/* called around each ISR execution (posthook excluded), may be NULL */
+extern void (*can_sim_irq_enter)(void);
+extern void (*can_sim_irq_exit)(void);
+
+/* back to the reset state, no device declared, separated buses */
+void can_sim_reset(void);
+
+/* put CAN1 and CAN2 on the same bus, or on two separated buses */
+void can_sim_link(bool linked);
+
+/* hold the bus of the given port at the dominant level: its controller
+ * cannot leave the initialization mode anymore */
+void can_sim_stuck(can_port_t port, bool stuck);
+
+/* move the clock read by the driver (sys_get_systick()) forward, to reach
+ * the protocol timeouts without waiting for them */
+void can_sim_advance(uint64_t us);
+
+/* frame sent by a remote node on the bus of the given port */
+void can_sim_inject(can_port_t port, const can_packed_frame_t *frame);
+
+/* one frame time: each bus sends its most prioritary pending mailbox, then
+ * the pending interrupts are delivered. Returns the number of frames sent */
+uint32_t can_sim_step(void);
+
+/* deliver the pending interrupts. Returns the number of ISR executed */
+uint32_t can_sim_irq_poll(void);
+
+#endif /*!CAN_SIM_H_*/
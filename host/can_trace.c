@@ -0,0 +1,82 @@
+/*
+ * Host-side bus traces (see host/can_trace.h).
+ */
+#include <stdio.h>
+#include "can_trace.h"
+
+static int can_trace_hex(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+bool can_trace_parse(const char *line, can_trace_frame_t *tf)
+{
+    unsigned long long sec, usec;
+    unsigned int iface;
+    char text[CAN_TRACE_LINE_MAX];
+    can_header_t header = { 0 };
+    can_data_t data = { 0 };
+    const char *p;
+    uint32_t id = 0, digits = 0;
+    int h, l;
+
+    if (sscanf(line, "(%llu.%llu) can%u %255s", &sec, &usec, &iface, text) != 4 ||
+        iface > 1) {
+        return false;
+    }
+    for (p = text; *p != '#' && *p != '\0'; ++p, ++digits) {
+        if ((h = can_trace_hex(*p)) < 0) {
+            return false;
+        }
+        id = (id << 4) | (uint32_t)h;
+    }
+    if (*p++ != '#' || (digits != 3 && digits != 8)) {
+        return false;
+    }
+    header.IDE = (digits == 8) ? CAN_ID_EXT : CAN_ID_STD;
+    if (header.IDE == CAN_ID_EXT) {
+        header.id.ext = id & 0x1fffffff;
+    } else if (id <= 0x7ff) {
+        header.id.std = (uint16_t)id;
+    } else {
+        return false;
+    }
+    if (*p == 'R') {
+        header.RTR = 1;
+        header.DLC = (p[1] >= '0' && p[1] <= '8') ? (uint8_t)(p[1] - '0') : 0;
+    } else {
+        while (*p != '\0') {
+            if (header.DLC == 8 || (h = can_trace_hex(p[0])) < 0 ||
+                (l = can_trace_hex(p[1])) < 0) {
+                return false;
+            }
+            data.data[header.DLC++] = (uint8_t)((h << 4) | l);
+            p += 2;
+        }
+    }
+    can_frame_pack(&header, &data, &tf->frame);
+    tf->port = (iface == 0) ? CAN_PORT_1 : CAN_PORT_2;
+    tf->us = sec * 1000000ULL + usec;
+    return true;
+}
+
+uint32_t can_trace_bits(const can_packed_frame_t *frame)
+{
+    can_header_t header;
+    can_data_t data;
+
+    can_frame_unpack(frame, &header, &data);
+    /* SOF, arbitration, control, CRC, ACK, EOF and interframe space: 47 bits
+     * for a standard frame, 20 more for the extended identifier */
+    return ((header.IDE == CAN_ID_EXT) ? 67U : 47U) +
+           ((header.RTR != 0) ? 0U : 8U * header.DLC);
+}
@@ -0,0 +1,31 @@
+/*
+ * Host-side bus traces, shared by the capture replayer and the benchmark.
+ *
+ * Traces are Linux candump -L logs, as written by can_capture_format(): one
+ * "(seconds.us) canN id#data" line per frame, time stamped at the end of
+ * its reception.
+ */
+#ifndef CAN_TRACE_H_
+#define CAN_TRACE_H_
+
+#include "api/libcan.h"
+
+#define CAN_TRACE_LINE_MAX 256
+
+typedef struct {
+    uint64_t           us;      /* log time */
+    can_port_t         port;    /* can0 on port 1, can1 on port 2 */
+    can_packed_frame_t frame;
+} can_trace_frame_t;
+
+/* parse a log line. Identifiers of 8 hex digits are extended ones, remote
+ * frames are "id#R" with an optional length digit. Returns false on
+ * anything else, CAN FD frames and interfaces other than can0 and can1
+ * included */
+bool can_trace_parse(const char *line, can_trace_frame_t *tf);
+
+/* length of the frame on the bus, interframe space included and stuff bits
+ * excluded, in bit times */
+uint32_t can_trace_bits(const can_packed_frame_t *frame);
+
+#endif /*!CAN_TRACE_H_*/
@@ -0,0 +1,41 @@
+/*
+ * Host build configuration: every driver option is compiled in, the
+ * benchmark selecting the features to exercise through the context fields.
+ */
+#ifndef HOST_AUTOCONF_H_
+#define HOST_AUTOCONF_H_
+
+#define CONFIG_CORE_FREQUENCY 168000000
+#define CONFIG_APB1_DIVISOR 4
+#define CONFIG_USR_DRV_CAN 1
+#define CONFIG_CAN_TARGET_VEHICLES 1
+#define CONFIG_CAN_TARGET_AUTOMATONS 1
+#define CONFIG_USR_DRV_CAN_CAN2SB 14
+#define CONFIG_USR_DRV_CAN_INAK_TIMEOUT 50000
+#define CONFIG_USR_DRV_CAN_RX_RING 1
+#define CONFIG_USR_DRV_CAN_RX_RING_DEPTH 16
+#define CONFIG_USR_DRV_CAN_RX_COALESCE 1
+#define CONFIG_USR_DRV_CAN_RX_DIRECT 1
+#define CONFIG_USR_DRV_CAN_TX_QUEUE 1
+#define CONFIG_USR_DRV_CAN_TX_QUEUE_DEPTH 16
+#define CONFIG_USR_DRV_CAN_TX_PREEMPT 1
+#define CONFIG_USR_DRV_CAN_TIMESTAMP 1
+#define CONFIG_USR_DRV_CAN_TX_DEADLINE 1
+#define CONFIG_USR_DRV_CAN_SW_FILTER 1
+#define CONFIG_USR_DRV_CAN_SW_FILTER_EXT_SLOTS 64
+#define CONFIG_USR_DRV_CAN_SW_FILTER_EXT_MASKS 4
+#define CONFIG_USR_DRV_CAN_RX_BALANCE 1
+#define CONFIG_USR_DRV_CAN_DISPATCH 1
+#define CONFIG_USR_DRV_CAN_ISOTP 1
+#define CONFIG_USR_DRV_CAN_J1939 1
+#define CONFIG_USR_DRV_CAN_J1939_SESSIONS 8
+#define CONFIG_USR_DRV_CAN_CANOPEN 1
+#define CONFIG_USR_DRV_CAN_CANOPEN_PDO_MAX 4
+#define CONFIG_USR_DRV_CAN_STATS 1
+#define CONFIG_USR_DRV_CAN_CAPTURE 1
+#define CONFIG_USR_DRV_CAN_CAPTURE_DEPTH 256
+#ifndef CONFIG_USR_DRV_CAN_PROFILE
+# define CONFIG_USR_DRV_CAN_PROFILE 0  /* see HOST_PROFILE in the Makefile */
+#endif
+
+#endif /*!HOST_AUTOCONF_H_*/
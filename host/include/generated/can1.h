@@ -0,0 +1,27 @@
+/*
+ * Host build: CAN1 device informations, as generated from the device tree.
+ */
+#ifndef HOST_GENERATED_CAN1_H_
+#define HOST_GENERATED_CAN1_H_
+
+#include "libc/types.h"
+
+enum {
+    CAN1_TD = 0,
+    CAN1_RD = 1
+};
+
+static const struct {
+    uint32_t address;
+    uint32_t size;
+    struct {
+        uint8_t port;
+        uint8_t pin;
+    } gpios[2];
+} can1_dev_infos = {
+    .address = 0x40006400,
+    .size    = 0x400,
+    .gpios   = { { 3, 1 }, { 3, 0 } }
+};
+
+#endif /*!HOST_GENERATED_CAN1_H_*/
@@ -0,0 +1,27 @@
+/*
+ * Host build: CAN2 device informations, as generated from the device tree.
+ */
+#ifndef HOST_GENERATED_CAN2_H_
+#define HOST_GENERATED_CAN2_H_
+
+#include "libc/types.h"
+
+enum {
+    CAN2_TD = 0,
+    CAN2_RD = 1
+};
+
+static const struct {
+    uint32_t address;
+    uint32_t size;
+    struct {
+        uint8_t port;
+        uint8_t pin;
+    } gpios[2];
+} can2_dev_infos = {
+    .address = 0x40006800,
+    .size    = 0x400,
+    .gpios   = { { 3, 13 }, { 3, 12 } }
+};
+
+#endif /*!HOST_GENERATED_CAN2_H_*/
@@ -0,0 +1,6 @@
+#ifndef HOST_LIBC_ARPA_INET_H_
+#define HOST_LIBC_ARPA_INET_H_
+
+#include <arpa/inet.h>
+
+#endif /*!HOST_LIBC_ARPA_INET_H_*/
@@ -0,0 +1,4 @@
+#ifndef HOST_LIBC_NOSTD_H_
+#define HOST_LIBC_NOSTD_H_
+
+#endif /*!HOST_LIBC_NOSTD_H_*/
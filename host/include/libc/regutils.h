@@ -0,0 +1,57 @@
+/*
+ * Host build: register accessors. Device addresses are mapped into the
+ * simulated register file of the bxCAN simulator, and each access made through
+ * these accessors is notified to the simulator, so that it can model the
+ * side effects of the writes (INAK handshake, FIFO release, rc_w1 bits...)
+ * and of the direct mailbox writes on the status registers (TSR:TMEx).
+ */
+#ifndef HOST_LIBC_REGUTILS_H_
+#define HOST_LIBC_REGUTILS_H_
+
+#include "libc/types.h"
+
+/* the simulated register file covers CAN1 and CAN2 (0x400 bytes each) */
+#define CAN_SIM_BASE 0x40006400
+#define CAN_SIM_SIZE 0x800
+
+extern volatile uint32_t can_sim_regs[CAN_SIM_SIZE / 4];
+
+void can_sim_read(volatile const uint32_t *reg);
+void can_sim_write(volatile uint32_t *reg, uint32_t value);
+
+#define REG_ADDR(addr) \
+    ((volatile uint32_t *)((volatile uint8_t *)can_sim_regs + ((addr) - CAN_SIM_BASE)))
+
+#define set_reg(REG, VALUE, FIELD) set_reg_value(REG, VALUE, FIELD##_Msk, FIELD##_Pos)
+#define get_reg(REG, FIELD) get_reg_value(REG, FIELD##_Msk, FIELD##_Pos)
+
+static inline uint32_t get_reg_value(volatile const uint32_t *reg,
+                                     uint32_t mask, uint8_t pos)
+{
+    can_sim_read(reg);
+    return (*reg & mask) >> pos;
+}
+
+static inline void write_reg_value(volatile uint32_t *reg, uint32_t value)
+{
+    *reg = value;
+    can_sim_write(reg, value);
+}
+
+static inline void set_reg_value(volatile uint32_t *reg, uint32_t value,
+                                 uint32_t mask, uint8_t pos)
+{
+    write_reg_value(reg, (*reg & ~mask) | ((value << pos) & mask));
+}
+
+static inline void set_reg_bits(volatile uint32_t *reg, uint32_t value)
+{
+    write_reg_value(reg, *reg | value);
+}
+
+static inline void clear_reg_bits(volatile uint32_t *reg, uint32_t value)
+{
+    write_reg_value(reg, *reg & ~value);
+}
+
+#endif /*!HOST_LIBC_REGUTILS_H_*/
@@ -0,0 +1,6 @@
+#ifndef HOST_LIBC_STDIO_H_
+#define HOST_LIBC_STDIO_H_
+
+#include <stdio.h>
+
+#endif /*!HOST_LIBC_STDIO_H_*/
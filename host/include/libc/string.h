@@ -0,0 +1,6 @@
+#ifndef HOST_LIBC_STRING_H_
+#define HOST_LIBC_STRING_H_
+
+#include <string.h>
+
+#endif /*!HOST_LIBC_STRING_H_*/
@@ -0,0 +1,116 @@
+/*
+ * Host build: EwoK syscalls and device declaration types used by the driver.
+ * The syscalls are implemented by the bxCAN simulator (host/can_sim.c).
+ */
+#ifndef HOST_LIBC_SYSCALL_H_
+#define HOST_LIBC_SYSCALL_H_
+
+#include "libc/types.h"
+
+typedef enum {
+    SYS_E_DONE = 0,
+    SYS_E_INVAL,
+    SYS_E_DENIED,
+    SYS_E_BUSY,
+    SYS_E_MAX
+} e_syscall_ret;
+
+/* sys_init() and sys_cfg() types */
+#define INIT_DEVACCESS  0
+#define CFG_DEV_RELEASE 0
+
+/* sys_get_systick() precision */
+#define PREC_MILLI 0
+#define PREC_MICRO 1
+#define PREC_CYCLE 2
+
+/* STM32F4 CAN IRQ numbers, seen from the core (exceptions included) */
+#define CAN1_TX_IRQ  0x23
+#define CAN1_RX0_IRQ 0x24
+#define CAN1_RX1_IRQ 0x25
+#define CAN1_SCE_IRQ 0x26
+#define CAN2_TX_IRQ  0x4F
+#define CAN2_RX0_IRQ 0x50
+#define CAN2_RX1_IRQ 0x51
+#define CAN2_SCE_IRQ 0x52
+
+/* posthooks */
+#define IRQ_PH_NIL   0
+#define IRQ_PH_READ  1
+#define IRQ_PH_WRITE 2
+#define MAX_POSTHOOK_INSTR 10
+
+#define IRQ_ISR_STANDARD 0
+
+typedef struct {
+    uint8_t  instr;
+    struct {
+        uint16_t offset;
+    } read;
+    struct {
+        uint16_t offset;
+        uint32_t value;
+        uint32_t mask;
+    } write;
+} dev_irq_ph_action_t;
+
+typedef struct {
+    dev_irq_ph_action_t action[MAX_POSTHOOK_INSTR];
+    uint16_t status;
+    uint16_t data;
+} dev_irq_ph_t;
+
+typedef void (*user_handler_t)(uint8_t irq, uint32_t status, uint32_t data);
+
+typedef struct {
+    user_handler_t handler;
+    uint8_t        irq;
+    uint8_t        mode;
+    dev_irq_ph_t   posthook;
+} dev_irq_info_t;
+
+/* GPIO configuration */
+#define GPIO_MASK_SET_MODE  (0x1 << 0)
+#define GPIO_MASK_SET_TYPE  (0x1 << 1)
+#define GPIO_MASK_SET_SPEED (0x1 << 2)
+#define GPIO_MASK_SET_PUPD  (0x1 << 3)
+#define GPIO_MASK_SET_AFR   (0x1 << 4)
+
+#define GPIO_PIN_ALTERNATE_MODE  2
+#define GPIO_PIN_VERY_HIGH_SPEED 3
+#define GPIO_PIN_OTYPER_PP       0
+#define GPIO_NOPULL              0
+#define GPIO_AF_AF9              9
+
+typedef struct {
+    struct {
+        uint8_t port;
+        uint8_t pin;
+    } kref;
+    uint32_t mask;
+    uint8_t  mode;
+    uint8_t  pupd;
+    uint8_t  type;
+    uint8_t  speed;
+    uint32_t afr;
+} dev_gpio_info_t;
+
+#define MAX_IRQS  4
+#define MAX_GPIOS 16
+
+typedef struct {
+    char            name[16];
+    uint32_t        address;
+    uint32_t        size;
+    uint8_t         irq_num;
+    uint8_t         gpio_num;
+    uint8_t         map_mode;
+    dev_irq_info_t  irqs[MAX_IRQS];
+    dev_gpio_info_t gpios[MAX_GPIOS];
+} device_t;
+
+e_syscall_ret sys_init(uint8_t type, ...);
+e_syscall_ret sys_cfg(uint8_t type, ...);
+e_syscall_ret sys_get_systick(uint64_t *val, uint8_t precision);
+
+#endif /*!HOST_LIBC_SYSCALL_H_*/
@@ -0,0 +1,597 @@
+#include "api/libcan_isotp.h"
+#include "can_regs.h"
+#include "libc/syscall.h"
+#include "libc/string.h"
+#include "autoconf.h"
+
+#if CONFIG_USR_DRV_CAN_ISOTP
+
+/* protocol control information, high nibble of the first data byte */
+#define ISOTP_PCI_SF    0x0   /* single frame, low nibble is the length */
+#define ISOTP_PCI_FF    0x1   /* first frame, 12 bits length */
+#define ISOTP_PCI_CF    0x2   /* consecutive frame, low nibble is the SN */
+#define ISOTP_PCI_FC    0x3   /* flow control, low nibble is the status */
+
+/* flow control status */
+#define ISOTP_FS_CTS    0x0   /* continue to send */
+#define ISOTP_FS_WAIT   0x1
+#define ISOTP_FS_OVFLW  0x2
+
+#define ISOTP_SF_MAX    7     /* single frame payload */
+#define ISOTP_FF_DL_MAX 0xfff /* beyond, the first frame uses the 32 bits
+                                 length escape */
+#define ISOTP_CF_MAX    7     /* consecutive frame payload */
+
+/* a burst of consecutive frames fills the three Tx mailboxes */
+#define ISOTP_BURST     3
+
+static inline uint64_t isotp_now(void)
+{
+    uint64_t now = 0;
+
+    sys_get_systick(&now, PREC_MICRO);
+    return now;
+}
+
+static inline uint64_t isotp_timeout(const can_isotp_link_t *link)
+{
+    return 1000ULL * ((link->timeout_ms != 0) ? link->timeout_ms
+                                              : CAN_ISOTP_TIMEOUT_DEFAULT);
+}
+
+/* STmin coding: 0 to 127 ms, or 100 to 900 us. Reserved values are handled
+ * as the longest gap */
+static uint32_t isotp_st_min_us(uint8_t st_min)
+{
+    if (st_min <= 0x7f) {
+        return 1000UL * st_min;
+    }
+    if (st_min >= 0xf1 && st_min <= 0xf9) {
+        return 100UL * (st_min - 0xf0);
+    }
+    return 127000UL;
+}
+
+static inline void isotp_notify(can_isotp_link_t *link,
+                                can_isotp_event_t event,
+                                can_isotp_error_t error)
+{
+    if (can_isotp_event != NULL) {
+        can_isotp_event(link, event, error);
+    }
+}
+
+/*******************************************************************************
+ *           FRAMES PACKING
+ *
+ * The frames are built and parsed in the packed format, bytes 0 to 3 in the
+ * datal word and 4 to 7 in the datah word.
+ *******************************************************************************/
+static void isotp_frame_build(const can_isotp_link_t *link,
+                              can_packed_frame_t     *frame,
+                              const uint8_t          *bytes,
+                              uint8_t                 len)
+{
+    uint8_t buf[8];
+    uint8_t dlc = link->padding ? 8 : len;
+
+    memset(buf, CAN_ISOTP_PADDING_BYTE, sizeof(buf));
+    memcpy(buf, bytes, len);
+    frame->id    = link->tx_pid;
+    frame->dlct  = ((uint32_t)dlc << CAN_TDTxR_DLC_Pos) & CAN_TDTxR_DLC_Msk;
+    frame->datal = ((uint32_t)buf[0] << CAN_TDLxR_DATA0_Pos) |
+                   ((uint32_t)buf[1] << CAN_TDLxR_DATA1_Pos) |
+                   ((uint32_t)buf[2] << CAN_TDLxR_DATA2_Pos) |
+                   ((uint32_t)buf[3] << CAN_TDLxR_DATA3_Pos);
+    frame->datah = ((uint32_t)buf[4] << CAN_TDHxR_DATA4_Pos) |
+                   ((uint32_t)buf[5] << CAN_TDHxR_DATA5_Pos) |
+                   ((uint32_t)buf[6] << CAN_TDHxR_DATA6_Pos) |
+                   ((uint32_t)buf[7] << CAN_TDHxR_DATA7_Pos);
+}
+
+static inline uint8_t isotp_frame_byte(const can_packed_frame_t *frame,
+                                       uint8_t                   i)
+{
+    return (uint8_t)((i < 4) ? (frame->datal >> (8 * i))
+                             : (frame->datah >> (8 * (i - 4))));
+}
+
+static void isotp_cf_build(can_isotp_link_t   *link,
+                           can_packed_frame_t *frame,
+                           uint32_t            off)
+{
+    uint8_t buf[8];
+    uint32_t len = link->tx_len - off;
+
+    if (len > ISOTP_CF_MAX) {
+        len = ISOTP_CF_MAX;
+    }
+    buf[0] = (ISOTP_PCI_CF << 4) | (link->tx_sn & 0xf);
+    memcpy(&buf[1], &link->tx_data[off], len);
+    isotp_frame_build(link, frame, buf, (uint8_t)(len + 1));
+}
+
+/*******************************************************************************
+ *           TRANSMISSION
+ *******************************************************************************/
+static void isotp_tx_end(can_isotp_link_t *link,
+                         can_isotp_event_t event,
+                         can_isotp_error_t error)
+{
+    link->tx_state = CAN_ISOTP_IDLE;
+    link->tx_data = NULL;
+    isotp_notify(link, event, error);
+}
+
+/* send the single frame or the first frame. Left in CAN_ISOTP_TX_FIRST, to
+ * be retried by can_isotp_poll(), if no mailbox is free */
+static void isotp_tx_first(can_isotp_link_t *link, uint64_t now)
+{
+    can_packed_frame_t frame;
+    can_mbox_t mbox;
+    uint8_t buf[8];
+    uint8_t hdr;
+
+    if (link->tx_len <= ISOTP_SF_MAX) {
+        buf[0] = (ISOTP_PCI_SF << 4) | (uint8_t)link->tx_len;
+        hdr = 1;
+    } else if (link->tx_len <= ISOTP_FF_DL_MAX) {
+        buf[0] = (ISOTP_PCI_FF << 4) | (uint8_t)(link->tx_len >> 8);
+        buf[1] = (uint8_t)link->tx_len;
+        hdr = 2;
+    } else {
+        buf[0] = ISOTP_PCI_FF << 4;
+        buf[1] = 0;
+        buf[2] = (uint8_t)(link->tx_len >> 24);
+        buf[3] = (uint8_t)(link->tx_len >> 16);
+        buf[4] = (uint8_t)(link->tx_len >> 8);
+        buf[5] = (uint8_t)link->tx_len;
+        hdr = 6;
+    }
+    if (link->tx_len <= ISOTP_SF_MAX) {
+        memcpy(&buf[hdr], link->tx_data, link->tx_len);
+        isotp_frame_build(link, &frame, buf, (uint8_t)(hdr + link->tx_len));
+    } else {
+        memcpy(&buf[hdr], link->tx_data, 8 - hdr);
+        isotp_frame_build(link, &frame, buf, 8);
+    }
+    if (can_xmit_packed(link->ctx, &frame, &mbox) != MBED_ERROR_NONE) {
+        return;
+    }
+    if (link->tx_len <= ISOTP_SF_MAX) {
+        isotp_tx_end(link, CAN_ISOTP_EVENT_TX_DONE, CAN_ISOTP_ERROR_NONE);
+        return;
+    }
+    link->tx_off = 8 - hdr;
+    link->tx_sn = 1;
+    link->tx_wft = 0;
+    link->tx_inflight = false;
+    link->tx_deadline = now + isotp_timeout(link);
+    link->tx_state = CAN_ISOTP_TX_WAIT_FC;
+}
+
+/*
+ * Send the consecutive frames allowed by the last flow control. With a zero
+ * STmin and the Tx mailboxes sent in chronological order, the frames are
+ * pipelined: each call fills all the free mailboxes (or the Tx queue) in a
+ * single can_xmit_burst(). Otherwise, as the controller would send the frames
+ * of a same identifier by mailbox number, a frame is only sent once the
+ * previous one has left its mailbox, and STmin after it was sent.
+ */
+static void isotp_tx_consecutive(can_isotp_link_t *link, uint64_t now)
+{
+    can_packed_frame_t frames[ISOTP_BURST];
+    can_mbox_t mboxes[ISOTP_BURST];
+    uint32_t accepted;
+    uint32_t n;
+    uint32_t off;
+    bool pending;
+    bool pipelined = link->ctx->txfifoprio && link->tx_st_us == 0;
+
+    do {
+        if (link->tx_st_us != 0 && now < link->tx_next) {
+            return;
+        }
+        if (!pipelined && link->tx_inflight) {
+            if (can_is_txmsg_pending(link->ctx, link->tx_mbox, &pending) == MBED_ERROR_NONE &&
+                pending) {
+                return;
+            }
+            link->tx_inflight = false;
+        }
+        /* build the frames of the burst, within the remaining block */
+        n = 0;
+        off = link->tx_off;
+        while (n < (pipelined ? ISOTP_BURST : 1) && off < link->tx_len &&
+               (link->tx_bs == 0 || n < link->tx_bs_left)) {
+            isotp_cf_build(link, &frames[n], off);
+            link->tx_sn++;
+            off += ISOTP_CF_MAX;
+            n++;
+        }
+        accepted = 0;
+        can_xmit_burst(link->ctx, frames, n, &accepted, mboxes);
+        /* take back the sequence numbers of the refused frames */
+        link->tx_sn -= (uint8_t)(n - accepted);
+        if (accepted == 0) {
+            return;
+        }
+        link->tx_off += accepted * ISOTP_CF_MAX;
+        if (link->tx_bs != 0) {
+            link->tx_bs_left -= (uint8_t)accepted;
+        }
+        link->tx_mbox = mboxes[accepted - 1];
+        link->tx_inflight = link->tx_mbox != CAN_MBOX_QUEUED;
+        link->tx_next = now + link->tx_st_us;
+        if (link->tx_off >= link->tx_len) {
+            isotp_tx_end(link, CAN_ISOTP_EVENT_TX_DONE, CAN_ISOTP_ERROR_NONE);
+            return;
+        }
+        if (link->tx_bs != 0 && link->tx_bs_left == 0) {
+            link->tx_wft = 0;
+            link->tx_deadline = now + isotp_timeout(link);
+            link->tx_state = CAN_ISOTP_TX_WAIT_FC;
+            return;
+        }
+    } while (pipelined && accepted == n);
+}
+
+static void isotp_tx_progress(can_isotp_link_t *link, uint64_t now)
+{
+    switch (link->tx_state) {
+        case CAN_ISOTP_TX_FIRST:
+            isotp_tx_first(link, now);
+            break;
+        case CAN_ISOTP_TX_WAIT_FC:
+            if (now > link->tx_deadline) {
+                isotp_tx_end(link, CAN_ISOTP_EVENT_TX_ERROR, CAN_ISOTP_ERROR_TIMEOUT_BS);
+            }
+            break;
+        case CAN_ISOTP_TX_SENDING:
+            isotp_tx_consecutive(link, now);
+            break;
+        default:
+            break;
+    }
+}
+
+static void isotp_rx_fc(can_isotp_link_t         *link,
+                        const can_packed_frame_t *frame,
+                        uint8_t                   dlc,
+                        uint64_t                  now)
+{
+    if (link->tx_state != CAN_ISOTP_TX_WAIT_FC || dlc < 3) {
+        return;
+    }
+    switch (isotp_frame_byte(frame, 0) & 0xf) {
+        case ISOTP_FS_CTS:
+            link->tx_bs = isotp_frame_byte(frame, 1);
+            link->tx_bs_left = link->tx_bs;
+            link->tx_st_us = isotp_st_min_us(isotp_frame_byte(frame, 2));
+            /* STmin applies between consecutive frames only */
+            link->tx_next = now;
+            link->tx_state = CAN_ISOTP_TX_SENDING;
+            isotp_tx_consecutive(link, now);
+            break;
+        case ISOTP_FS_WAIT:
+            if (++link->tx_wft > CAN_ISOTP_WFT_MAX) {
+                isotp_tx_end(link, CAN_ISOTP_EVENT_TX_ERROR, CAN_ISOTP_ERROR_WFT_OVRN);
+                break;
+            }
+            link->tx_deadline = now + isotp_timeout(link);
+            break;
+        case ISOTP_FS_OVFLW:
+            isotp_tx_end(link, CAN_ISOTP_EVENT_TX_ERROR, CAN_ISOTP_ERROR_OVERFLOW);
+            break;
+        default:
+            isotp_tx_end(link, CAN_ISOTP_EVENT_TX_ERROR, CAN_ISOTP_ERROR_INVALID_FS);
+            break;
+    }
+}
+
+/*******************************************************************************
+ *           RECEPTION
+ *******************************************************************************/
+
+/* send our flow control frame, or keep it for can_isotp_poll() if no
+ * mailbox is free */
+static void isotp_fc_send(can_isotp_link_t *link, uint8_t status)
+{
+    can_packed_frame_t frame;
+    can_mbox_t mbox;
+    uint8_t buf[3];
+
+    buf[0] = (ISOTP_PCI_FC << 4) | status;
+    buf[1] = link->block_size;
+    buf[2] = link->st_min;
+    isotp_frame_build(link, &frame, buf, sizeof(buf));
+    link->rx_fc_pending = can_xmit_packed(link->ctx, &frame, &mbox) != MBED_ERROR_NONE;
+    link->rx_fc_status = status;
+}
+
+static void isotp_rx_end(can_isotp_link_t *link,
+                         can_isotp_event_t event,
+                         can_isotp_error_t error)
+{
+    link->rx_state = CAN_ISOTP_IDLE;
+    if (event == CAN_ISOTP_EVENT_RX_DONE) {
+        link->rx_done = true;
+    }
+    isotp_notify(link, event, error);
+}
+
+static void isotp_rx_sf(can_isotp_link_t         *link,
+                        const can_packed_frame_t *frame,
+                        uint8_t                   dlc)
+{
+    uint8_t len = isotp_frame_byte(frame, 0) & 0xf;
+
+    if (len == 0 || len > dlc - 1) {
+        return;
+    }
+    if (link->rx_state == CAN_ISOTP_RX_RECEIVING) {
+        isotp_rx_end(link, CAN_ISOTP_EVENT_RX_ERROR, CAN_ISOTP_ERROR_UNEXP_PDU);
+    }
+    if (len > link->rx_size) {
+        isotp_rx_end(link, CAN_ISOTP_EVENT_RX_ERROR, CAN_ISOTP_ERROR_OVERFLOW);
+        return;
+    }
+    for (uint8_t i = 0; i < len; ++i) {
+        link->rx_buf[i] = isotp_frame_byte(frame, i + 1);
+    }
+    link->rx_len = len;
+    isotp_rx_end(link, CAN_ISOTP_EVENT_RX_DONE, CAN_ISOTP_ERROR_NONE);
+}
+
+static void isotp_rx_ff(can_isotp_link_t         *link,
+                        const can_packed_frame_t *frame,
+                        uint8_t                   dlc,
+                        uint64_t                  now)
+{
+    uint32_t len;
+    uint8_t hdr = 2;
+
+    if (dlc != 8) {
+        return;
+    }
+    len = ((uint32_t)(isotp_frame_byte(frame, 0) & 0xf) << 8) | isotp_frame_byte(frame, 1);
+    if (len == 0) {
+        len = ((uint32_t)isotp_frame_byte(frame, 2) << 24) |
+              ((uint32_t)isotp_frame_byte(frame, 3) << 16) |
+              ((uint32_t)isotp_frame_byte(frame, 4) << 8)  |
+              isotp_frame_byte(frame, 5);
+        hdr = 6;
+        if (len <= ISOTP_FF_DL_MAX) {
+            return;
+        }
+    } else if (len <= ISOTP_SF_MAX) {
+        return;
+    }
+    if (link->rx_state == CAN_ISOTP_RX_RECEIVING) {
+        isotp_rx_end(link, CAN_ISOTP_EVENT_RX_ERROR, CAN_ISOTP_ERROR_UNEXP_PDU);
+    }
+    if (len > link->rx_size) {
+        isotp_fc_send(link, ISOTP_FS_OVFLW);
+        isotp_rx_end(link, CAN_ISOTP_EVENT_RX_ERROR, CAN_ISOTP_ERROR_OVERFLOW);
+        return;
+    }
+    for (uint8_t i = hdr; i < 8; ++i) {
+        link->rx_buf[i - hdr] = isotp_frame_byte(frame, i);
+    }
+    link->rx_len = len;
+    link->rx_off = 8 - hdr;
+    link->rx_sn = 1;
+    link->rx_bs_left = link->block_size;
+    link->rx_done = false;
+    link->rx_deadline = now + isotp_timeout(link);
+    link->rx_state = CAN_ISOTP_RX_RECEIVING;
+    isotp_fc_send(link, ISOTP_FS_CTS);
+}
+
+static void isotp_rx_cf(can_isotp_link_t         *link,
+                        const can_packed_frame_t *frame,
+                        uint8_t                   dlc,
+                        uint64_t                  now)
+{
+    uint32_t len;
+
+    if (link->rx_state != CAN_ISOTP_RX_RECEIVING) {
+        return;
+    }
+    if ((isotp_frame_byte(frame, 0) & 0xf) != link->rx_sn) {
+        isotp_rx_end(link, CAN_ISOTP_EVENT_RX_ERROR, CAN_ISOTP_ERROR_WRONG_SN);
+        return;
+    }
+    len = link->rx_len - link->rx_off;
+    if (len > (uint32_t)(dlc - 1)) {
+        len = dlc - 1;
+    }
+    for (uint8_t i = 0; i < len; ++i) {
+        link->rx_buf[link->rx_off + i] = isotp_frame_byte(frame, i + 1);
+    }
+    link->rx_off += len;
+    link->rx_sn = (link->rx_sn + 1) & 0xf;
+    if (link->rx_off >= link->rx_len) {
+        isotp_rx_end(link, CAN_ISOTP_EVENT_RX_DONE, CAN_ISOTP_ERROR_NONE);
+        return;
+    }
+    link->rx_deadline = now + isotp_timeout(link);
+    if (link->block_size != 0 && --link->rx_bs_left == 0) {
+        link->rx_bs_left = link->block_size;
+        isotp_fc_send(link, ISOTP_FS_CTS);
+    }
+}
+
+/*******************************************************************************
+ *           ISO-TP API
+ *******************************************************************************/
+mbed_error_t can_isotp_init(__inout can_isotp_link_t *link)
+{
+    can_header_t header = { 0 };
+    can_data_t data = { 0 };
+    can_packed_frame_t frame;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!link || !link->ctx || (link->rx_size != 0 && !link->rx_buf)) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (link->tx_id == link->rx_id ||
+        (link->IDE == CAN_ID_STD && (link->tx_id > 0x7ff || link->rx_id > 0x7ff)) ||
+        (link->IDE == CAN_ID_EXT && (link->tx_id > 0x1fffffff || link->rx_id > 0x1fffffff))) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+#if CONFIG_USR_DRV_CAN_TX_QUEUE
+    if (link->ctx->txqueued && !link->ctx->txfifoprio) {
+        /* queued frames of a same identifier are sent by mailbox number,
+         * and their completion cannot be awaited one by one */
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+#endif
+    /* identifier words, computed once */
+    header.IDE = link->IDE;
+    if (link->IDE == CAN_ID_STD) {
+        header.id.std = (uint16_t)link->tx_id;
+    } else {
+        header.id.ext = link->tx_id;
+    }
+    can_frame_pack(&header, &data, &frame);
+    link->tx_pid = frame.id;
+    if (link->IDE == CAN_ID_STD) {
+        header.id.std = (uint16_t)link->rx_id;
+    } else {
+        header.id.ext = link->rx_id;
+    }
+    can_frame_pack(&header, &data, &frame);
+    link->rx_pid = frame.id;
+
+    link->tx_state = CAN_ISOTP_IDLE;
+    link->tx_data = NULL;
+    link->tx_inflight = false;
+    link->rx_state = CAN_ISOTP_IDLE;
+    link->rx_done = false;
+    link->rx_fc_pending = false;
+err:
+    return errcode;
+}
+
+mbed_error_t can_isotp_send(__inout can_isotp_link_t *link,
+                            const __in uint8_t       *data,
+                            const __in uint32_t       len)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!link || !data || len == 0) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (link->tx_state != CAN_ISOTP_IDLE) {
+        errcode = MBED_ERROR_BUSY;
+        goto err;
+    }
+    link->tx_data = data;
+    link->tx_len = len;
+    link->tx_off = 0;
+    link->tx_state = CAN_ISOTP_TX_FIRST;
+    isotp_tx_first(link, isotp_now());
+err:
+    return errcode;
+}
+
+mbed_error_t can_isotp_rx_frame(__inout can_isotp_link_t   *link,
+                                const __in can_packed_frame_t *frame)
+{
+    uint8_t dlc;
+    uint64_t now;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!link || !frame) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    /* remote frames do not match, their RTR bit being set */
+    if ((frame->id & ~CAN_TIxR_TXRQ_Msk) != link->rx_pid) {
+        errcode = MBED_ERROR_NOTFOUND;
+        goto err;
+    }
+    dlc = (uint8_t)((frame->dlct & CAN_RDTxR_DLC_Msk) >> CAN_RDTxR_DLC_Pos);
+    if (dlc == 0) {
+        goto err;
+    }
+    if (dlc > 8) {
+        dlc = 8;
+    }
+    now = isotp_now();
+    switch (isotp_frame_byte(frame, 0) >> 4) {
+        case ISOTP_PCI_SF:
+            if (link->rx_size != 0) {
+                isotp_rx_sf(link, frame, dlc);
+            }
+            break;
+        case ISOTP_PCI_FF:
+            if (link->rx_size != 0) {
+                isotp_rx_ff(link, frame, dlc, now);
+            }
+            break;
+        case ISOTP_PCI_CF:
+            isotp_rx_cf(link, frame, dlc, now);
+            break;
+        case ISOTP_PCI_FC:
+            isotp_rx_fc(link, frame, dlc, now);
+            break;
+        default:
+            /* unknown PCI, ignored */
+            break;
+    }
+err:
+    return errcode;
+}
+
+mbed_error_t can_isotp_poll(__inout can_isotp_link_t *link)
+{
+    uint64_t now;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!link) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    now = isotp_now();
+    if (link->rx_fc_pending) {
+        isotp_fc_send(link, link->rx_fc_status);
+    }
+    if (link->rx_state == CAN_ISOTP_RX_RECEIVING && now > link->rx_deadline) {
+        isotp_rx_end(link, CAN_ISOTP_EVENT_RX_ERROR, CAN_ISOTP_ERROR_TIMEOUT_CR);
+    }
+    isotp_tx_progress(link, now);
+err:
+    return errcode;
+}
+
+mbed_error_t can_isotp_receive(__inout can_isotp_link_t *link,
+                                     __out uint32_t     *len)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!link || !len) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (!link->rx_done) {
+        errcode = MBED_ERROR_NOTREADY;
+        goto err;
+    }
+    *len = link->rx_len;
+    link->rx_done = false;
+err:
+    return errcode;
+}
+
+#endif
@@ -0,0 +1,870 @@
+#include "api/libcan_j1939.h"
+#include "can_regs.h"
+#include "libc/syscall.h"
+#include "libc/string.h"
+#include "autoconf.h"
+
+#if CONFIG_USR_DRV_CAN_J1939
+
+/* TP.CM control bytes */
+#define J1939_CM_RTS    16
+#define J1939_CM_CTS    17
+#define J1939_CM_EOMA   19
+#define J1939_CM_BAM    32
+#define J1939_CM_ABORT  255
+
+/* PDU format from which the PGN is broadcast (PDU2), PS being an extension
+ * of the PGN instead of the destination address */
+#define J1939_PDU2_PF   240
+
+#define J1939_PACKET    7     /* TP.DT payload */
+#define J1939_NO_LIMIT  0xff  /* RTS maximum packets per CTS */
+#define J1939_BURST     3     /* a TP.DT burst fills the three Tx mailboxes */
+
+static inline uint64_t j1939_now(void)
+{
+    uint64_t now = 0;
+
+    sys_get_systick(&now, PREC_MICRO);
+    return now;
+}
+
+static inline void j1939_notify(can_j1939_node_t *node,
+                                can_j1939_event_t event,
+                                uint32_t          pgn,
+                                can_j1939_abort_t reason)
+{
+    if (can_j1939_event != NULL) {
+        can_j1939_event(node, event, pgn, reason);
+    }
+}
+
+static inline bool j1939_addr_is_used(const can_j1939_node_t *node, uint8_t addr)
+{
+    return (node->addr_used[addr / 32] >> (addr % 32)) & 0x1;
+}
+
+static inline void j1939_addr_set_used(can_j1939_node_t *node, uint8_t addr)
+{
+    node->addr_used[addr / 32] |= 0x1UL << (addr % 32);
+}
+
+/*******************************************************************************
+ *           IDENTIFIERS AND FRAMES
+ *
+ * Frames are built and parsed in the packed format, the 29 bits identifier
+ * being the EXID field of the identifier word.
+ *******************************************************************************/
+uint32_t can_j1939_id(uint8_t  priority,
+                      uint32_t pgn,
+                      uint8_t  da,
+                      uint8_t  sa)
+{
+    pgn &= 0x3ffff;
+    if (((pgn >> 8) & 0xff) < J1939_PDU2_PF) {
+        /* PDU1: PS is the destination address */
+        pgn = (pgn & 0x3ff00) | da;
+    }
+    return ((uint32_t)(priority & 0x7) << 26) | (pgn << 8) | sa;
+}
+
+void can_j1939_id_parse(uint32_t  id,
+                        uint8_t  *priority,
+                        uint32_t *pgn,
+                        uint8_t  *da,
+                        uint8_t  *sa)
+{
+    uint32_t p = (id >> 8) & 0x3ffff;
+
+    if (((p >> 8) & 0xff) < J1939_PDU2_PF) {
+        *da = (uint8_t)p;
+        p &= 0x3ff00;
+    } else {
+        *da = CAN_J1939_ADDR_GLOBAL;
+    }
+    *priority = (uint8_t)((id >> 26) & 0x7);
+    *pgn = p;
+    *sa = (uint8_t)id;
+}
+
+static inline uint32_t j1939_pid(uint8_t priority, uint32_t pgn, uint8_t da, uint8_t sa)
+{
+    return (can_j1939_id(priority, pgn, da, sa) << CAN_TIxR_EXID_Pos) | CAN_TIxR_IDE_Msk;
+}
+
+/* build a frame of dlc bytes, the bytes beyond len being 0xff */
+static void j1939_frame_build(can_packed_frame_t *frame,
+                              uint32_t            pid,
+                              const uint8_t      *bytes,
+                              uint8_t             len,
+                              uint8_t             dlc)
+{
+    uint8_t buf[8];
+
+    memset(buf, 0xff, sizeof(buf));
+    memcpy(buf, bytes, len);
+    frame->id    = pid;
+    frame->dlct  = ((uint32_t)dlc << CAN_TDTxR_DLC_Pos) & CAN_TDTxR_DLC_Msk;
+    frame->datal = ((uint32_t)buf[0] << CAN_TDLxR_DATA0_Pos) |
+                   ((uint32_t)buf[1] << CAN_TDLxR_DATA1_Pos) |
+                   ((uint32_t)buf[2] << CAN_TDLxR_DATA2_Pos) |
+                   ((uint32_t)buf[3] << CAN_TDLxR_DATA3_Pos);
+    frame->datah = ((uint32_t)buf[4] << CAN_TDHxR_DATA4_Pos) |
+                   ((uint32_t)buf[5] << CAN_TDHxR_DATA5_Pos) |
+                   ((uint32_t)buf[6] << CAN_TDHxR_DATA6_Pos) |
+                   ((uint32_t)buf[7] << CAN_TDHxR_DATA7_Pos);
+}
+
+static inline uint8_t j1939_frame_byte(const can_packed_frame_t *frame,
+                                       uint8_t                   i)
+{
+    return (uint8_t)((i < 4) ? (frame->datal >> (8 * i))
+                             : (frame->datah >> (8 * (i - 4))));
+}
+
+/*
+ * Control frames (TP.CM, address claim) are sent at once if possible, or kept
+ * in a small queue flushed by can_j1939_poll(). When this queue is full, the
+ * frame is dropped and the peer timeout recovers.
+ */
+static void j1939_ctrl_xmit(can_j1939_node_t *node, const can_packed_frame_t *frame)
+{
+    can_mbox_t mbox;
+
+    if (node->cm_count == 0 &&
+        can_xmit_packed(node->ctx, frame, &mbox) == MBED_ERROR_NONE) {
+        node->cm_mbox = mbox;
+        return;
+    }
+    if (node->cm_count < CAN_J1939_CM_QUEUE) {
+        node->cm_queue[node->cm_count++] = *frame;
+    }
+}
+
+static void j1939_ctrl_flush(can_j1939_node_t *node)
+{
+    can_mbox_t mbox;
+    uint8_t sent = 0;
+
+    while (sent < node->cm_count &&
+           can_xmit_packed(node->ctx, &node->cm_queue[sent], &mbox) == MBED_ERROR_NONE) {
+        node->cm_mbox = mbox;
+        sent++;
+    }
+    if (sent != 0) {
+        memmove(&node->cm_queue[0], &node->cm_queue[sent],
+                (node->cm_count - sent) * sizeof(can_packed_frame_t));
+        node->cm_count -= sent;
+    }
+}
+
+static void j1939_cm_send(can_j1939_node_t *node,
+                          uint8_t           da,
+                          uint8_t           control,
+                          uint16_t          word,
+                          uint8_t           b3,
+                          uint8_t           b4,
+                          uint32_t          pgn)
+{
+    can_packed_frame_t frame;
+    uint8_t cm[8] = {
+        control, (uint8_t)word, (uint8_t)(word >> 8), b3, b4,
+        (uint8_t)pgn, (uint8_t)(pgn >> 8), (uint8_t)(pgn >> 16)
+    };
+
+    j1939_frame_build(&frame, j1939_pid(CAN_J1939_PRIO_TP, CAN_J1939_PGN_TP_CM, da, node->sa),
+                      cm, sizeof(cm), sizeof(cm));
+    j1939_ctrl_xmit(node, &frame);
+}
+
+static inline void j1939_abort_send(can_j1939_node_t *node,
+                                    uint8_t           da,
+                                    can_j1939_abort_t reason,
+                                    uint32_t          pgn)
+{
+    j1939_cm_send(node, da, J1939_CM_ABORT, 0xff00 | reason, 0xff, 0xff, pgn);
+}
+
+/*******************************************************************************
+ *           ADDRESS CLAIM
+ *
+ * The node sends its NAME from its preferred address, and owns it if no other
+ * node claims it with a lower (more prioritary) NAME within
+ * CAN_J1939_CLAIM_DELAY ms. An arbitrary address capable node losing the
+ * contention claims the next address of the 128-247 range not claimed by
+ * another node, others send a cannot claim message from the null address.
+ *******************************************************************************/
+static void j1939_claim_send(can_j1939_node_t *node)
+{
+    can_packed_frame_t frame;
+    uint8_t name[8];
+
+    for (uint8_t i = 0; i < 8; ++i) {
+        name[i] = (uint8_t)(node->name >> (8 * i));
+    }
+    j1939_frame_build(&frame, j1939_pid(CAN_J1939_PRIO_DEFAULT, CAN_J1939_PGN_ADDR_CLAIM,
+                                        CAN_J1939_ADDR_GLOBAL, node->sa),
+                      name, sizeof(name), sizeof(name));
+    j1939_ctrl_xmit(node, &frame);
+}
+
+static void j1939_tx_end(can_j1939_node_t *node,
+                         can_j1939_event_t event,
+                         can_j1939_abort_t reason)
+{
+    node->tx_state = CAN_J1939_TX_IDLE;
+    node->tx_data = NULL;
+    j1939_notify(node, event, node->tx_pgn, reason);
+}
+
+/* the transfers in progress are tied to the address being left */
+static void j1939_transfers_reset(can_j1939_node_t *node)
+{
+    if (node->tx_state != CAN_J1939_TX_IDLE) {
+        j1939_tx_end(node, CAN_J1939_EVENT_TX_ABORT, CAN_J1939_ABORT_NONE);
+    }
+    for (uint8_t i = 0; i < CONFIG_USR_DRV_CAN_J1939_SESSIONS; ++i) {
+        node->sessions[i].type = CAN_J1939_SESSION_FREE;
+    }
+}
+
+static void j1939_claim_start(can_j1939_node_t *node, uint8_t addr, uint64_t now)
+{
+    j1939_transfers_reset(node);
+    node->sa = addr;
+    node->claim = CAN_J1939_CLAIM_PENDING;
+    node->claim_deadline = now + 1000ULL * CAN_J1939_CLAIM_DELAY;
+    j1939_claim_send(node);
+}
+
+static void j1939_rx_claim(can_j1939_node_t         *node,
+                           const can_packed_frame_t *frame,
+                           uint8_t                   sa,
+                           uint64_t                  now)
+{
+    uint64_t other = 0;
+
+    for (uint8_t i = 0; i < 8; ++i) {
+        other |= (uint64_t)j1939_frame_byte(frame, i) << (8 * i);
+    }
+    if (sa == CAN_J1939_ADDR_NULL || other == node->name) {
+        /* cannot claim message, or our own claim */
+        return;
+    }
+    j1939_addr_set_used(node, sa);
+    if (sa != node->sa ||
+        (node->claim != CAN_J1939_CLAIM_PENDING && node->claim != CAN_J1939_CLAIM_DONE)) {
+        return;
+    }
+    if (node->name < other) {
+        /* contention won, claim again */
+        j1939_claim_send(node);
+        return;
+    }
+    if (node->name & CAN_J1939_NAME_AAC) {
+        for (uint16_t addr = CAN_J1939_ADDR_ARBITRARY; addr <= CAN_J1939_ADDR_ARBITRARY_LAST; ++addr) {
+            if (!j1939_addr_is_used(node, (uint8_t)addr)) {
+                j1939_claim_start(node, (uint8_t)addr, now);
+                return;
+            }
+        }
+    }
+    j1939_transfers_reset(node);
+    node->sa = CAN_J1939_ADDR_NULL;
+    node->claim = CAN_J1939_CLAIM_LOST;
+    j1939_claim_send(node);
+    j1939_notify(node, CAN_J1939_EVENT_ADDR_LOST, CAN_J1939_PGN_ADDR_CLAIM, CAN_J1939_ABORT_NONE);
+}
+
+/*******************************************************************************
+ *           TRANSPORT PROTOCOL TRANSMISSION
+ *******************************************************************************/
+static void j1939_dt_build(const can_j1939_node_t *node,
+                           can_packed_frame_t     *frame,
+                           uint16_t                seq)
+{
+    uint8_t buf[8];
+    uint32_t off = (uint32_t)(seq - 1) * J1939_PACKET;
+    uint32_t len = node->tx_len - off;
+
+    if (len > J1939_PACKET) {
+        len = J1939_PACKET;
+    }
+    buf[0] = (uint8_t)seq;
+    memcpy(&buf[1], &node->tx_data[off], len);
+    j1939_frame_build(frame, j1939_pid(CAN_J1939_PRIO_TP, CAN_J1939_PGN_TP_DT, node->tx_da, node->sa),
+                      buf, (uint8_t)(len + 1), 8);
+}
+
+/*
+ * Send the TP.DT of the current connection mode window. As ISO-TP
+ * consecutive frames, they are pipelined in all the free Tx mailboxes when
+ * the context sends them in chronological order, a single one being pending
+ * at a time otherwise.
+ */
+static void j1939_tx_window(can_j1939_node_t *node, uint64_t now)
+{
+    can_packed_frame_t frames[J1939_BURST];
+    can_mbox_t mboxes[J1939_BURST];
+    uint32_t accepted;
+    uint32_t n;
+    bool pending;
+    bool pipelined = node->ctx->txfifoprio;
+
+    do {
+        if (!pipelined && node->tx_inflight) {
+            if (can_is_txmsg_pending(node->ctx, node->tx_mbox, &pending) == MBED_ERROR_NONE &&
+                pending) {
+                return;
+            }
+            node->tx_inflight = false;
+        }
+        n = 0;
+        while (n < (pipelined ? J1939_BURST : 1) && node->tx_next + n <= node->tx_window_end) {
+            j1939_dt_build(node, &frames[n], (uint16_t)(node->tx_next + n));
+            n++;
+        }
+        accepted = 0;
+        can_xmit_burst(node->ctx, frames, n, &accepted, mboxes);
+        if (accepted == 0) {
+            return;
+        }
+        node->tx_next += accepted;
+        node->tx_mbox = mboxes[accepted - 1];
+        node->tx_inflight = node->tx_mbox != CAN_MBOX_QUEUED;
+        if (node->tx_next > node->tx_window_end) {
+            /* wait for the next CTS, or the EOMA */
+            node->tx_deadline = now + 1000ULL * CAN_J1939_T3;
+            node->tx_state = CAN_J1939_TX_WAIT_CTS;
+            return;
+        }
+    } while (pipelined && accepted == n);
+}
+
+static inline bool j1939_mbox_pending(const can_j1939_node_t *node, can_mbox_t mbox)
+{
+    bool pending = false;
+
+    if (mbox != CAN_MBOX_QUEUED) {
+        can_is_txmsg_pending(node->ctx, mbox, &pending);
+    }
+    return pending;
+}
+
+/*
+ * Broadcast TP.DT are spaced by the BAM gap. In identifier priority mode, a
+ * TP.DT is only sent once the previous one, or the BAM itself (the last
+ * control frame sent), has left its mailbox.
+ */
+static void j1939_tx_bam(can_j1939_node_t *node, uint64_t now)
+{
+    can_packed_frame_t frame;
+    can_mbox_t mbox;
+
+    if (now < node->tx_time || node->cm_count != 0) {
+        return;
+    }
+    if (!node->ctx->txfifoprio &&
+        j1939_mbox_pending(node, (node->tx_next == 1) ? node->cm_mbox : node->tx_mbox)) {
+        return;
+    }
+    j1939_dt_build(node, &frame, node->tx_next);
+    if (can_xmit_packed(node->ctx, &frame, &mbox) != MBED_ERROR_NONE) {
+        return;
+    }
+    node->tx_mbox = mbox;
+    node->tx_next++;
+    node->tx_time = now + ((node->bam_gap_us != 0) ? node->bam_gap_us
+                                                   : 1000UL * CAN_J1939_BAM_GAP);
+    if (node->tx_next > node->tx_packets) {
+        j1939_tx_end(node, CAN_J1939_EVENT_TX_DONE, CAN_J1939_ABORT_NONE);
+    }
+}
+
+static void j1939_rx_cts(can_j1939_node_t *node,
+                         uint8_t           sa,
+                         uint8_t           packets,
+                         uint8_t           next,
+                         uint32_t          pgn,
+                         uint64_t          now)
+{
+    if ((node->tx_state != CAN_J1939_TX_WAIT_CTS && node->tx_state != CAN_J1939_TX_DT) ||
+        node->tx_da != sa || node->tx_pgn != pgn) {
+        return;
+    }
+    if (node->tx_state == CAN_J1939_TX_DT) {
+        j1939_abort_send(node, sa, CAN_J1939_ABORT_CTS_IN_DT, pgn);
+        j1939_tx_end(node, CAN_J1939_EVENT_TX_ABORT, CAN_J1939_ABORT_CTS_IN_DT);
+        return;
+    }
+    if (packets == 0) {
+        /* hold the connection open */
+        node->tx_deadline = now + 1000ULL * CAN_J1939_T4;
+        return;
+    }
+    if (next == 0 || next > node->tx_packets) {
+        j1939_abort_send(node, sa, CAN_J1939_ABORT_BAD_SEQUENCE, pgn);
+        j1939_tx_end(node, CAN_J1939_EVENT_TX_ABORT, CAN_J1939_ABORT_BAD_SEQUENCE);
+        return;
+    }
+    /* next may go back, for retransmissions */
+    node->tx_next = next;
+    node->tx_window_end = (uint8_t)((next + packets - 1 > node->tx_packets) ? node->tx_packets
+                                                                            : next + packets - 1);
+    node->tx_state = CAN_J1939_TX_DT;
+    j1939_tx_window(node, now);
+}
+
+/*******************************************************************************
+ *           TRANSPORT PROTOCOL RECEPTION
+ *******************************************************************************/
+static can_j1939_session_t *j1939_session_find(can_j1939_node_t        *node,
+                                               can_j1939_session_type_t type,
+                                               uint8_t                  sa)
+{
+    for (uint8_t i = 0; i < CONFIG_USR_DRV_CAN_J1939_SESSIONS; ++i) {
+        if (node->sessions[i].type == type && node->sessions[i].sa == sa) {
+            return &node->sessions[i];
+        }
+    }
+    return NULL;
+}
+
+/* session of the given source, restarted, or a free one */
+static can_j1939_session_t *j1939_session_alloc(can_j1939_node_t        *node,
+                                                can_j1939_session_type_t type,
+                                                uint8_t                  sa)
+{
+    can_j1939_session_t *s = j1939_session_find(node, type, sa);
+
+    for (uint8_t i = 0; s == NULL && i < CONFIG_USR_DRV_CAN_J1939_SESSIONS; ++i) {
+        if (node->sessions[i].type == CAN_J1939_SESSION_FREE) {
+            s = &node->sessions[i];
+        }
+    }
+    return s;
+}
+
+static void j1939_session_end(can_j1939_node_t    *node,
+                              can_j1939_session_t *s,
+                              can_j1939_abort_t    reason)
+{
+    s->type = CAN_J1939_SESSION_FREE;
+    j1939_notify(node, CAN_J1939_EVENT_RX_ABORT, s->pgn, reason);
+}
+
+/* grant the next window of a connection */
+static void j1939_cts_send(can_j1939_node_t    *node,
+                           can_j1939_session_t *s,
+                           uint64_t             now)
+{
+    uint16_t n = s->packets - s->next + 1;
+
+    if (s->window_max != 0 && n > s->window_max) {
+        n = s->window_max;
+    }
+    if (node->cts_packets != 0 && n > node->cts_packets) {
+        n = node->cts_packets;
+    }
+    s->window_end = (uint8_t)(s->next + n - 1);
+    s->deadline = now + 1000ULL * CAN_J1939_T2;
+    j1939_cm_send(node, s->sa, J1939_CM_CTS, (uint16_t)((s->next << 8) | n), 0xff, 0xff, s->pgn);
+}
+
+/* size and number of packets announced by a RTS or BAM */
+static inline bool j1939_tp_size_valid(uint16_t len, uint8_t packets)
+{
+    return len > 8 && len <= CAN_J1939_TP_MAX &&
+           packets == (len + J1939_PACKET - 1) / J1939_PACKET;
+}
+
+static void j1939_rx_announce(can_j1939_node_t         *node,
+                              const can_packed_frame_t *frame,
+                              can_j1939_session_type_t  type,
+                              uint8_t                   sa,
+                              uint32_t                  pgn,
+                              uint64_t                  now)
+{
+    can_j1939_session_t *s;
+    uint16_t len = (uint16_t)(j1939_frame_byte(frame, 1) | (j1939_frame_byte(frame, 2) << 8));
+    uint8_t packets = j1939_frame_byte(frame, 3);
+
+    if (!j1939_tp_size_valid(len, packets)) {
+        if (type == CAN_J1939_SESSION_CMDT) {
+            j1939_abort_send(node, sa, CAN_J1939_ABORT_SIZE, pgn);
+        }
+        return;
+    }
+    s = j1939_session_alloc(node, type, sa);
+    if (s == NULL) {
+        /* broadcasts are dropped silently */
+        if (type == CAN_J1939_SESSION_CMDT) {
+            j1939_abort_send(node, sa, CAN_J1939_ABORT_RESOURCES, pgn);
+        }
+        return;
+    }
+    s->type = type;
+    s->sa = sa;
+    s->pgn = pgn;
+    s->len = len;
+    s->packets = packets;
+    s->next = 1;
+    if (type == CAN_J1939_SESSION_CMDT) {
+        s->window_max = j1939_frame_byte(frame, 4);
+        s->window_max = (s->window_max == J1939_NO_LIMIT) ? 0 : s->window_max;
+        j1939_cts_send(node, s, now);
+    } else {
+        s->window_end = packets;
+        s->deadline = now + 1000ULL * CAN_J1939_T1;
+    }
+}
+
+static void j1939_rx_dt(can_j1939_node_t         *node,
+                        const can_packed_frame_t *frame,
+                        uint8_t                   priority,
+                        uint8_t                   sa,
+                        uint8_t                   da,
+                        uint64_t                  now)
+{
+    can_j1939_session_t *s;
+    can_j1939_msg_t msg;
+    can_j1939_session_type_t type = (da == CAN_J1939_ADDR_GLOBAL) ? CAN_J1939_SESSION_BAM
+                                                                  : CAN_J1939_SESSION_CMDT;
+    uint8_t seq = j1939_frame_byte(frame, 0);
+    uint32_t off;
+    uint32_t len;
+
+    s = j1939_session_find(node, type, sa);
+    if (s == NULL) {
+        return;
+    }
+    if (seq != s->next || seq > s->window_end) {
+        if (type == CAN_J1939_SESSION_CMDT) {
+            j1939_abort_send(node, sa, CAN_J1939_ABORT_BAD_SEQUENCE, s->pgn);
+        }
+        j1939_session_end(node, s, CAN_J1939_ABORT_BAD_SEQUENCE);
+        return;
+    }
+    off = (uint32_t)(seq - 1) * J1939_PACKET;
+    len = s->len - off;
+    if (len > J1939_PACKET) {
+        len = J1939_PACKET;
+    }
+    for (uint8_t i = 0; i < len; ++i) {
+        s->buf[off + i] = j1939_frame_byte(frame, i + 1);
+    }
+    s->next++;
+    if (seq == s->packets) {
+        if (type == CAN_J1939_SESSION_CMDT) {
+            j1939_cm_send(node, sa, J1939_CM_EOMA, s->len, s->packets, 0xff, s->pgn);
+        }
+        msg.pgn = s->pgn;
+        msg.priority = priority;
+        msg.sa = sa;
+        msg.da = da;
+        msg.len = s->len;
+        msg.data = s->buf;
+        if (can_j1939_rx != NULL) {
+            can_j1939_rx(node, &msg);
+        }
+        s->type = CAN_J1939_SESSION_FREE;
+        return;
+    }
+    if (type == CAN_J1939_SESSION_CMDT && seq == s->window_end) {
+        j1939_cts_send(node, s, now);
+    } else {
+        s->deadline = now + 1000ULL * CAN_J1939_T1;
+    }
+}
+
+static void j1939_rx_cm(can_j1939_node_t         *node,
+                        const can_packed_frame_t *frame,
+                        uint8_t                   sa,
+                        uint8_t                   da,
+                        uint64_t                  now)
+{
+    can_j1939_session_t *s;
+    uint32_t pgn = j1939_frame_byte(frame, 5) |
+                   ((uint32_t)j1939_frame_byte(frame, 6) << 8) |
+                   ((uint32_t)j1939_frame_byte(frame, 7) << 16);
+    bool global = (da == CAN_J1939_ADDR_GLOBAL);
+
+    switch (j1939_frame_byte(frame, 0)) {
+        case J1939_CM_RTS:
+            if (!global) {
+                j1939_rx_announce(node, frame, CAN_J1939_SESSION_CMDT, sa, pgn, now);
+            }
+            break;
+        case J1939_CM_BAM:
+            if (global) {
+                j1939_rx_announce(node, frame, CAN_J1939_SESSION_BAM, sa, pgn, now);
+            }
+            break;
+        case J1939_CM_CTS:
+            if (!global) {
+                j1939_rx_cts(node, sa, j1939_frame_byte(frame, 1),
+                             j1939_frame_byte(frame, 2), pgn, now);
+            }
+            break;
+        case J1939_CM_EOMA:
+            if (!global && node->tx_state == CAN_J1939_TX_WAIT_CTS && node->tx_da == sa &&
+                node->tx_pgn == pgn && node->tx_next > node->tx_packets) {
+                j1939_tx_end(node, CAN_J1939_EVENT_TX_DONE, CAN_J1939_ABORT_NONE);
+            }
+            break;
+        case J1939_CM_ABORT:
+            if (global) {
+                break;
+            }
+            if (node->tx_state != CAN_J1939_TX_IDLE && node->tx_state != CAN_J1939_TX_BAM &&
+                node->tx_da == sa && node->tx_pgn == pgn) {
+                j1939_tx_end(node, CAN_J1939_EVENT_TX_ABORT,
+                             (can_j1939_abort_t)j1939_frame_byte(frame, 1));
+            }
+            s = j1939_session_find(node, CAN_J1939_SESSION_CMDT, sa);
+            if (s != NULL && s->pgn == pgn) {
+                j1939_session_end(node, s, (can_j1939_abort_t)j1939_frame_byte(frame, 1));
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/*******************************************************************************
+ *           J1939 API
+ *******************************************************************************/
+mbed_error_t can_j1939_init(__inout can_j1939_node_t *node)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!node || !node->ctx) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+#if CONFIG_USR_DRV_CAN_TX_QUEUE
+    if (node->ctx->txqueued && !node->ctx->txfifoprio) {
+        /* queued TP.DT would be sent by mailbox number */
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+#endif
+    node->sa = CAN_J1939_ADDR_NULL;
+    node->claim = CAN_J1939_CLAIM_NONE;
+    memset(node->addr_used, 0x0, sizeof(node->addr_used));
+    node->tx_state = CAN_J1939_TX_IDLE;
+    node->tx_data = NULL;
+    node->tx_inflight = false;
+    node->cm_count = 0;
+    node->cm_mbox = CAN_MBOX_QUEUED;
+    for (uint8_t i = 0; i < CONFIG_USR_DRV_CAN_J1939_SESSIONS; ++i) {
+        node->sessions[i].type = CAN_J1939_SESSION_FREE;
+    }
+err:
+    return errcode;
+}
+
+mbed_error_t can_j1939_claim(__inout can_j1939_node_t *node)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!node || !node->ctx) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (node->address >= CAN_J1939_ADDR_NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    j1939_claim_start(node, node->address, j1939_now());
+err:
+    return errcode;
+}
+
+mbed_error_t can_j1939_send(__inout can_j1939_node_t *node,
+                            const __in uint8_t        priority,
+                            const __in uint32_t       pgn,
+                            const __in uint8_t        da,
+                            const __in uint8_t       *data,
+                            const __in uint16_t       len)
+{
+    can_packed_frame_t frame;
+    can_mbox_t mbox;
+    uint64_t now;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!node || (!data && len != 0)) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (len > CAN_J1939_TP_MAX) {
+        errcode = MBED_ERROR_TOOBIG;
+        goto err;
+    }
+    if (node->claim != CAN_J1939_CLAIM_DONE) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    if (len <= 8) {
+        j1939_frame_build(&frame, j1939_pid(priority, pgn, da, node->sa),
+                          data, (uint8_t)len, (uint8_t)len);
+        errcode = can_xmit_packed(node->ctx, &frame, &mbox);
+        goto err;
+    }
+    if (node->tx_state != CAN_J1939_TX_IDLE) {
+        errcode = MBED_ERROR_BUSY;
+        goto err;
+    }
+    now = j1939_now();
+    node->tx_data = data;
+    node->tx_len = len;
+    node->tx_pgn = pgn & 0x3ffff;
+    node->tx_da = da;
+    node->tx_packets = (uint8_t)((len + J1939_PACKET - 1) / J1939_PACKET);
+    node->tx_next = 1;
+    node->tx_inflight = false;
+    if (da == CAN_J1939_ADDR_GLOBAL) {
+        j1939_cm_send(node, da, J1939_CM_BAM, len, node->tx_packets, 0xff, node->tx_pgn);
+        node->tx_time = now + ((node->bam_gap_us != 0) ? node->bam_gap_us
+                                                       : 1000UL * CAN_J1939_BAM_GAP);
+        node->tx_state = CAN_J1939_TX_BAM;
+    } else {
+        j1939_cm_send(node, da, J1939_CM_RTS, len, node->tx_packets, J1939_NO_LIMIT, node->tx_pgn);
+        node->tx_window_end = 0;
+        node->tx_deadline = now + 1000ULL * CAN_J1939_T3;
+        node->tx_state = CAN_J1939_TX_WAIT_CTS;
+    }
+err:
+    return errcode;
+}
+
+mbed_error_t can_j1939_rx_frame(__inout can_j1939_node_t   *node,
+                                const __in can_packed_frame_t *frame)
+{
+    can_j1939_msg_t msg;
+    uint8_t data[8];
+    uint8_t priority, da, sa, dlc;
+    uint32_t pgn;
+    uint64_t now;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!node || !frame) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    /* extended data frames only */
+    if ((frame->id & (CAN_RIxR_IDE_Msk | CAN_RIxR_RTR_Msk)) != CAN_RIxR_IDE_Msk) {
+        errcode = MBED_ERROR_NOTFOUND;
+        goto err;
+    }
+    can_j1939_id_parse(frame->id >> CAN_RIxR_EXID_Pos, &priority, &pgn, &da, &sa);
+    dlc = (uint8_t)((frame->dlct & CAN_RDTxR_DLC_Msk) >> CAN_RDTxR_DLC_Pos);
+    dlc = (dlc > 8) ? 8 : dlc;
+    now = j1939_now();
+    if (pgn == CAN_J1939_PGN_ADDR_CLAIM) {
+        if (dlc == 8) {
+            j1939_rx_claim(node, frame, sa, now);
+        }
+        goto err;
+    }
+    if ((da != CAN_J1939_ADDR_GLOBAL && da != node->sa) || sa == node->sa) {
+        /* for another node, or ours (loopback) */
+        errcode = MBED_ERROR_NOTFOUND;
+        goto err;
+    }
+    switch (pgn) {
+        case CAN_J1939_PGN_TP_CM:
+            if (dlc == 8) {
+                j1939_rx_cm(node, frame, sa, da, now);
+            }
+            goto err;
+        case CAN_J1939_PGN_TP_DT:
+            if (dlc == 8) {
+                j1939_rx_dt(node, frame, priority, sa, da, now);
+            }
+            goto err;
+        case CAN_J1939_PGN_REQUEST:
+            if (dlc >= 3 && j1939_frame_byte(frame, 0) == (CAN_J1939_PGN_ADDR_CLAIM & 0xff) &&
+                j1939_frame_byte(frame, 1) == ((CAN_J1939_PGN_ADDR_CLAIM >> 8) & 0xff) &&
+                j1939_frame_byte(frame, 2) == 0) {
+                /* request for address claimed, answered by the stack */
+                if (node->claim == CAN_J1939_CLAIM_PENDING || node->claim == CAN_J1939_CLAIM_DONE ||
+                    node->claim == CAN_J1939_CLAIM_LOST) {
+                    j1939_claim_send(node);
+                }
+                goto err;
+            }
+            break;
+        default:
+            break;
+    }
+    /* single frame parameter group */
+    for (uint8_t i = 0; i < dlc; ++i) {
+        data[i] = j1939_frame_byte(frame, i);
+    }
+    msg.pgn = pgn;
+    msg.priority = priority;
+    msg.sa = sa;
+    msg.da = da;
+    msg.len = dlc;
+    msg.data = data;
+    if (can_j1939_rx != NULL) {
+        can_j1939_rx(node, &msg);
+    }
+err:
+    return errcode;
+}
+
+mbed_error_t can_j1939_poll(__inout can_j1939_node_t *node)
+{
+    can_j1939_session_t *s;
+    uint64_t now;
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (!node) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    now = j1939_now();
+    j1939_ctrl_flush(node);
+    if (node->claim == CAN_J1939_CLAIM_PENDING && now >= node->claim_deadline) {
+        node->claim = CAN_J1939_CLAIM_DONE;
+        j1939_notify(node, CAN_J1939_EVENT_ADDR_CLAIMED, CAN_J1939_PGN_ADDR_CLAIM,
+                     CAN_J1939_ABORT_NONE);
+    }
+    switch (node->tx_state) {
+        case CAN_J1939_TX_BAM:
+            j1939_tx_bam(node, now);
+            break;
+        case CAN_J1939_TX_DT:
+            j1939_tx_window(node, now);
+            break;
+        case CAN_J1939_TX_WAIT_CTS:
+            if (now > node->tx_deadline) {
+                j1939_abort_send(node, node->tx_da, CAN_J1939_ABORT_TIMEOUT, node->tx_pgn);
+                j1939_tx_end(node, CAN_J1939_EVENT_TX_ABORT, CAN_J1939_ABORT_TIMEOUT);
+            }
+            break;
+        default:
+            break;
+    }
+    for (uint8_t i = 0; i < CONFIG_USR_DRV_CAN_J1939_SESSIONS; ++i) {
+        s = &node->sessions[i];
+        if (s->type == CAN_J1939_SESSION_FREE || now <= s->deadline) {
+            continue;
+        }
+        if (s->type == CAN_J1939_SESSION_CMDT) {
+            j1939_abort_send(node, s->sa, CAN_J1939_ABORT_TIMEOUT, s->pgn);
+        }
+        j1939_session_end(node, s, CAN_J1939_ABORT_TIMEOUT);
+    }
+err:
+    return errcode;
+}
+
+#endif